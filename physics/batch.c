@@ -0,0 +1,325 @@
+// Batch projectile functions
+// Please use a tab size of 4 when reading this file.
+//
+// step_projectile_batch does for a whole batch what next_object_state does
+// for one projectile, with the same forces as net_force_projectile, but
+// without stopping at the ground.  It only finds out which projectiles
+// ended the step below the ground (or passed through it on the way), and
+// leaves those where they started, so that next_object_state can find
+// exactly where they hit.
+//
+// A step with propellant running out part way through is done by
+// next_object_state in two parts.  Here every projectile is stepped in two
+// parts, one propelled and one not, and the part that doesn't apply to a
+// projectile is given no time, so there are no branches in the loops.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <matrix.h>
+#include "batch.h"
+
+// Number of float arrays in a batch, and in its scratch space (the new
+// position and velocity, and the height of the ground under it)
+#define BATCH_ARRAYS 11
+#define SCRATCH_ARRAYS 7
+
+// The helpers of the stepping loop have to be inlined for the loop to be
+// vectorised
+#ifdef __GNUC__
+#define BATCH_INLINE static __inline__ __attribute__((always_inline))
+#else
+#define BATCH_INLINE static
+#endif
+
+// The stepping loop reads and writes a lot of arrays, more than the compiler
+// will check for overlaps, so it is told that they don't
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#define RESTRICT restrict
+#elif defined(__GNUC__)
+#define RESTRICT __restrict__
+#else
+#define RESTRICT
+#endif
+
+// Velocities slower than this feel no air resistance (see
+// air_resistance_force in physics.c)
+#define MIN_AIR_VELOCITY 0.000001F
+
+// Function prototypes
+BATCH_INLINE float batch_exp(float x);
+BATCH_INLINE void step_axis(float *x, float *v, float force, float mass, float c, float wind, float t, int air);
+BATCH_INLINE void integrate(const struct Physics_World *w,
+                            const float *RESTRICT x, const float *RESTRICT y, const float *RESTRICT z,
+                            const float *RESTRICT vx, const float *RESTRICT vy, const float *RESTRICT vz,
+                            const float *RESTRICT mass, const float *RESTRICT fx,
+                            const float *RESTRICT fy, const float *RESTRICT fz,
+                            const float *RESTRICT propelling_time,
+                            float *RESTRICT nx, float *RESTRICT ny, float *RESTRICT nz,
+                            float *RESTRICT nvx, float *RESTRICT nvy, float *RESTRICT nvz,
+                            int n, float t, int air);
+
+// init_projectile_batch sets up an empty batch with room for capacity
+// projectiles.  Returns 1 on success, or 0 if it runs out of memory.
+int init_projectile_batch(struct Projectile_Batch *b, int capacity) {
+    float *arrays[BATCH_ARRAYS];
+    int i;
+
+    if(capacity < 1) capacity = 1;
+    for(i = 0; i < BATCH_ARRAYS; i++) {
+        arrays[i] = malloc(capacity * sizeof(float));
+    }
+    b->scratch = malloc(SCRATCH_ARRAYS * capacity * sizeof(float));
+    b->x = arrays[0];
+    b->y = arrays[1];
+    b->z = arrays[2];
+    b->vx = arrays[3];
+    b->vy = arrays[4];
+    b->vz = arrays[5];
+    b->mass = arrays[6];
+    b->fx = arrays[7];
+    b->fy = arrays[8];
+    b->fz = arrays[9];
+    b->propelling_time = arrays[10];
+    b->count = 0;
+    b->capacity = capacity;
+
+    for(i = 0; i < BATCH_ARRAYS; i++) {
+        if(arrays[i] == NULL) break;
+    }
+    if(i < BATCH_ARRAYS || b->scratch == NULL) {
+        free_projectile_batch(b);
+        return 0;
+    }
+    return 1;
+}
+
+// free_projectile_batch frees the memory held by a batch.
+void free_projectile_batch(struct Projectile_Batch *b) {
+    free(b->x);
+    free(b->y);
+    free(b->z);
+    free(b->vx);
+    free(b->vy);
+    free(b->vz);
+    free(b->mass);
+    free(b->fx);
+    free(b->fy);
+    free(b->fz);
+    free(b->propelling_time);
+    free(b->scratch);
+    memset(b, 0, sizeof(struct Projectile_Batch));
+}
+
+// add_batch_object adds the object o to the end of a batch, making more
+// room if need be.  Returns the index of the object in the batch, or -1 if
+// it runs out of memory.
+int add_batch_object(struct Projectile_Batch *b, const struct Object *o) {
+    struct Projectile_Batch bigger;
+    int i = b->count;
+
+    if(b->count == b->capacity) {
+        if(!init_projectile_batch(&bigger, 2*b->capacity)) return -1;
+        memcpy(bigger.x, b->x, b->count * sizeof(float));
+        memcpy(bigger.y, b->y, b->count * sizeof(float));
+        memcpy(bigger.z, b->z, b->count * sizeof(float));
+        memcpy(bigger.vx, b->vx, b->count * sizeof(float));
+        memcpy(bigger.vy, b->vy, b->count * sizeof(float));
+        memcpy(bigger.vz, b->vz, b->count * sizeof(float));
+        memcpy(bigger.mass, b->mass, b->count * sizeof(float));
+        memcpy(bigger.fx, b->fx, b->count * sizeof(float));
+        memcpy(bigger.fy, b->fy, b->count * sizeof(float));
+        memcpy(bigger.fz, b->fz, b->count * sizeof(float));
+        memcpy(bigger.propelling_time, b->propelling_time, b->count * sizeof(float));
+        bigger.count = b->count;
+        free_projectile_batch(b);
+        *b = bigger;
+    }
+
+    b->x[i] = o->props.position[0];
+    b->y[i] = o->props.position[1];
+    b->z[i] = o->props.position[2];
+    b->vx[i] = o->props.velocity[0];
+    b->vy[i] = o->props.velocity[1];
+    b->vz[i] = o->props.velocity[2];
+    b->mass[i] = o->props.mass;
+    b->fx[i] = o->propelling_force[0];
+    b->fy[i] = o->propelling_force[1];
+    b->fz[i] = o->propelling_force[2];
+    b->propelling_time[i] = o->propelling_time;
+    b->count++;
+    return i;
+}
+
+// get_batch_object copies the position, velocity and propellant of
+// projectile i of a batch back into the object o.
+void get_batch_object(const struct Projectile_Batch *b, int i, struct Object *o) {
+    o->props.position[0] = b->x[i];
+    o->props.position[1] = b->y[i];
+    o->props.position[2] = b->z[i];
+    o->props.velocity[0] = b->vx[i];
+    o->props.velocity[1] = b->vy[i];
+    o->props.velocity[2] = b->vz[i];
+    o->propelling_time = b->propelling_time[i];
+}
+
+// batch_exp returns e^x to within a couple of units in the last place.
+// Unlike exp, it is simple enough to be vectorised.  (Cephes' expf.)
+BATCH_INLINE float batch_exp(float x) {
+    float n, r, p, scale;
+    int bits;
+
+    x = (x > 88.0F) ? 88.0F : x;
+    x = (x < -87.0F) ? -87.0F : x;
+
+    // e^x = 2^n * e^r, with |r| <= ln(2)/2
+    n = (float)(int)(x*1.44269504088896341F + ((x >= 0.0F) ? 0.5F : -0.5F));
+    r = x - n*0.693359375F + n*2.12194440e-4F;
+
+    p = 1.9875691500e-4F;
+    p = p*r + 1.3981999507e-3F;
+    p = p*r + 8.3334519073e-3F;
+    p = p*r + 4.1665795894e-2F;
+    p = p*r + 1.6666665459e-1F;
+    p = p*r + 5.0000001201e-1F;
+    p = p*r*r + r + 1.0F;
+
+    bits = ((int)n + 127) << 23;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p*scale;
+}
+
+// step_axis moves one coordinate of a projectile for time t, the same way
+// next_object_state does.  force is the gravity and propulsion along this
+// axis, c is the air resistance coefficient (-viscosity*density) and wind
+// is the wind along this axis.  The air resistance is only worked out if
+// air is set.
+BATCH_INLINE void step_axis(float *x, float *v, float force, float mass, float c, float wind, float t, int air) {
+    float v0, k, drag = 0.0F, at;
+
+    if(air) {
+        v0 = *v - wind;
+        k = force / ((fabsf(v0) < MIN_AIR_VELOCITY) ? 1.0F : v0);
+        k = (k + c) / mass;
+        drag = batch_exp(k*t) * v0 * c;
+        drag = (fabsf(v0) < MIN_AIR_VELOCITY) ? 0.0F : drag;
+    }
+
+    at = (force + drag) / mass * t;            // a*t
+    *x = (0.5F*at + *v)*t + *x;                // x0 + v0*t + 0.5*a*t^2
+    *v = *v + at;                              // v0 + a*t
+}
+
+// integrate steps n projectiles for time t, putting the new positions and
+// velocities in nx and so on.  The air resistance is only worked out if air
+// is set.
+BATCH_INLINE void integrate(const struct Physics_World *w,
+                            const float *RESTRICT x, const float *RESTRICT y, const float *RESTRICT z,
+                            const float *RESTRICT vx, const float *RESTRICT vy, const float *RESTRICT vz,
+                            const float *RESTRICT mass, const float *RESTRICT fx,
+                            const float *RESTRICT fy, const float *RESTRICT fz,
+                            const float *RESTRICT propelling_time,
+                            float *RESTRICT nx, float *RESTRICT ny, float *RESTRICT nz,
+                            float *RESTRICT nvx, float *RESTRICT nvy, float *RESTRICT nvz,
+                            int n, float t, int air) {
+    const float gravity = w->data.gravity;
+    const float c = -(w->data.air_viscosity*w->data.air_density);
+    const float wind_x = w->data.wind_x, wind_z = w->data.wind_z;
+    float px, py, pz, pvx, pvy, pvz, m, t0, t1, g;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        px = x[i];
+        py = y[i];
+        pz = z[i];
+        pvx = vx[i];
+        pvy = vy[i];
+        pvz = vz[i];
+        m = mass[i];
+        g = gravity * m;
+
+        // the propelled part, then the rest
+        t0 = (propelling_time[i] < t) ? propelling_time[i] : t;
+        t0 = (propelling_time[i] > 0.0F) ? t0 : 0.0F;
+        t1 = t - t0;
+
+        step_axis(&px, &pvx, fx[i], m, c, wind_x, t0, air);
+        step_axis(&py, &pvy, g + fy[i], m, c, 0.0F, t0, air);
+        step_axis(&pz, &pvz, fz[i], m, c, wind_z, t0, air);
+        step_axis(&px, &pvx, 0.0F, m, c, wind_x, t1, air);
+        step_axis(&py, &pvy, g, m, c, 0.0F, t1, air);
+        step_axis(&pz, &pvz, 0.0F, m, c, wind_z, t1, air);
+
+        nx[i] = px;
+        ny[i] = py;
+        nz[i] = pz;
+        nvx[i] = pvx;
+        nvy[i] = pvy;
+        nvz[i] = pvz;
+    }
+}
+
+// step_projectile_batch moves every projectile of a batch for time t.
+// The indices of the projectiles that would have hit the ground during the
+// step are stored in crossed, which must have room for the whole batch,
+// and their number is returned.  Those projectiles are left as they were;
+// the rest are moved.
+int step_projectile_batch(const struct Physics_World *w, struct Projectile_Batch *b, float t, int *crossed) {
+    int n = b->capacity;
+    float *nx = b->scratch, *ny = nx + n, *nz = ny + n;
+    float *nvx = nz + n, *nvy = nvx + n, *nvz = nvy + n;
+    float *ground = nvz + n;
+    float start[3], dir[3], hit, t0;
+    int i, num_crossed = 0;
+
+    // the loop is much simpler without air, and there usually isn't any
+    if(w->data.air_viscosity*w->data.air_density != 0.0F) {
+        integrate(w, b->x, b->y, b->z, b->vx, b->vy, b->vz, b->mass, b->fx, b->fy, b->fz,
+                  b->propelling_time, nx, ny, nz, nvx, nvy, nvz, b->count, t, 1);
+    } else {
+        integrate(w, b->x, b->y, b->z, b->vx, b->vy, b->vz, b->mass, b->fx, b->fy, b->fz,
+                  b->propelling_time, nx, ny, nz, nvx, nvy, nvz, b->count, t, 0);
+    }
+
+    if(w->terrain_heights != NULL) {
+        (*w->terrain_heights)(nx, nz, ground, b->count);
+    } else {
+        for(i = 0; i < b->count; i++) {
+            ground[i] = (*w->terrain_height)(nx[i], nz[i]);
+        }
+    }
+
+    // the ground is also looked for along the straight line between the
+    // ends of the step, which the path never strays far from in one step
+    for(i = 0; i < b->count; i++) {
+        if(ny[i] < ground[i]) {
+            crossed[num_crossed++] = i;
+            continue;
+        }
+        if(w->terrain_raycast == NULL) continue;
+        start[0] = b->x[i];
+        start[1] = b->y[i];
+        start[2] = b->z[i];
+        dir[0] = nx[i] - start[0];
+        dir[1] = ny[i] - start[1];
+        dir[2] = nz[i] - start[2];
+        if((*w->terrain_raycast)(start, dir, 1.0, &hit)) {
+            crossed[num_crossed++] = i;
+            ground[i] = HUGE_VAL;
+        }
+    }
+
+    for(i = 0; i < b->count; i++) {
+        if(ny[i] < ground[i]) continue;
+        b->x[i] = nx[i];
+        b->y[i] = ny[i];
+        b->z[i] = nz[i];
+        b->vx[i] = nvx[i];
+        b->vy[i] = nvy[i];
+        b->vz[i] = nvz[i];
+        t0 = b->propelling_time[i];
+        b->propelling_time[i] = (t0 > 0.0F && t > t0) ? 0.0F : t0 - t;
+    }
+
+    return num_crossed;
+}
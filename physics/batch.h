@@ -0,0 +1,35 @@
+/*
+** batch.h
+**
+**   Moves many projectiles at once.  The state that changes in flight is
+**   kept in separate arrays (one for each coordinate) so that a whole
+**   batch can be stepped by loops the compiler vectorises.
+**
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "physics.h"
+
+// A batch of projectiles.  Only the position, velocity, mass and
+// propellant are kept; projectiles in a batch don't spin, and
+// everything else about them stays in their Objects.
+struct Projectile_Batch {
+    int            count;
+    int            capacity;
+    float         *x, *y, *z;                          // position
+    float         *vx, *vy, *vz;                       // velocity
+    float         *mass;
+    float         *fx, *fy, *fz;                       // propelling force
+    float         *propelling_time;
+    float         *scratch;                            // for stepping
+};
+
+int init_projectile_batch(struct Projectile_Batch *b, int capacity);
+void free_projectile_batch(struct Projectile_Batch *b);
+int add_batch_object(struct Projectile_Batch *b, const struct Object *o);
+void get_batch_object(const struct Projectile_Batch *b, int i, struct Object *o);
+int step_projectile_batch(const struct Physics_World *w, struct Projectile_Batch *b, float t, int *crossed);
+
+#endif
@@ -0,0 +1,43 @@
+// Collision functions
+// Please use a tab size of 4 when reading this file.
+
+#include <math.h>
+#include <matrix.h>
+#include "collide.h"
+
+// sweep_spheres finds when a sphere that moves in a straight line from a0
+// to a1 during a step, while its radius goes from ra0 to ra1, first
+// touches a sphere of radius rb that stays at b.  Either sphere can be a
+// point (radius 0), and a growing explosion is a sphere that doesn't move.
+// Return value is how far through the step they first touch (0 if they
+// already touch at the start), or -1 if they don't touch during it.
+float sweep_spheres(const pVector a0, const pVector a1, float ra0, float ra1, const pVector b, float rb) {
+    double d0[3], dd[3], r0, dr, A, B, C, disc, denom, s;
+    int i;
+
+    // They touch at s when |d0 + s*dd| = r0 + s*dr, which is the quadratic
+    // A*s^2 + 2*B*s + C = 0
+    for(i = 0; i < 3; i++) {
+        d0[i] = a0[i] - b[i];
+        dd[i] = a1[i] - a0[i];
+    }
+    r0 = ra0 + rb;
+    dr = ra1 - ra0;
+    A = dd[0]*dd[0] + dd[1]*dd[1] + dd[2]*dd[2] - dr*dr;
+    B = d0[0]*dd[0] + d0[1]*dd[1] + d0[2]*dd[2] - r0*dr;
+    C = d0[0]*d0[0] + d0[1]*d0[1] + d0[2]*d0[2] - r0*r0;
+
+    if(C <= 0.0) return 0.0;
+
+    // The first time they touch is the smaller root when they close in
+    // (A > 0) and the only positive one when the radius grows faster than
+    // they move apart (A < 0).  Both are C/(-B + sqrt(B^2 - A*C)), which
+    // doesn't lose precision when A is small and also covers A == 0.
+    disc = B*B - A*C;
+    if(disc < 0.0) return -1.0;
+    denom = sqrt(disc) - B;
+    if(denom <= 0.0) return -1.0;
+    s = C / denom;
+    if(s > 1.0) return -1.0;
+    return (float)s;
+}
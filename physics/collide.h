@@ -0,0 +1,16 @@
+/*
+** collide.h
+**
+**   Collisions between spheres over a whole step, so that nothing fast
+**   or small can pass through something between the ends of a step.
+**
+*/
+
+#ifndef COLLIDE_H
+#define COLLIDE_H
+
+#include <matrix.h>
+
+float sweep_spheres(const pVector a0, const pVector a1, float ra0, float ra1, const pVector b, float rb);
+
+#endif
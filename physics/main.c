@@ -1,8 +1,189 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include "physics.h"
+#include "zeroin.h"
+#include "collide.h"
+
+// Number of shots in the impact solver check, and the length of each step
+#define NUM_SHOTS 2000
+#define SHOT_STEP 0.1
+
+// Number of random sweeps in the swept sphere check, and how finely each
+// is sampled to check it
+#define NUM_SWEEPS 20000
+#define SWEEP_SAMPLES 4000
+
+// The hills the shots are fired over, and how often they are looked at
+static long terrain_samples = 0;
+
+static float hill_height(float x, float z) {
+    terrain_samples++;
+    return 20.0*sin(x*0.01) + 10.0*cos(z*0.013) + 2.0*sin((x + z)*0.07);
+}
+
+// The old way of finding an impact: the whole step is re-run from the
+// start by next_object_state for every point zeroin looks at.
+struct Old_Search {
+    const struct Physics_World *w;
+    struct Object base;
+};
+
+static float old_terrain_delta(float t, void *data) {
+    const struct Old_Search *search = data;
+    struct Object o;
+    memcpy(&o, &search->base, sizeof(struct Object));
+    next_object_state(search->w, &o, t);
+    return o.props.position[1] - hill_height(o.props.position[0], o.props.position[2]);
+}
+
+// old_impact_time finds when the object o hits the ground during a step of
+// length t the way next_object_state used to, or returns -1 if it doesn't.
+static float old_impact_time(const struct Physics_World *w, const struct Object *o, float t) {
+    struct Old_Search search;
+    struct Object end;
+
+    search.w = w;
+    memcpy(&search.base, o, sizeof(struct Object));
+    search.base.state = STATE_PROJECTILE_FINAL;
+    memcpy(&end, &search.base, sizeof(struct Object));
+    next_object_state(w, &end, t);
+    if(end.props.position[1] >= hill_height(end.props.position[0], end.props.position[2]))
+        return -1.0;
+    return zeroin(0.0, t, old_terrain_delta, &search, 0.0);
+}
+
+// fire_shot sets up shot number i of the impact solver check.
+static void fire_shot(struct Object *o, int i) {
+    memset(o, 0, sizeof(struct Object));
+    o->props.mass = 1.0 + i%5;
+    o->props.radius = 1.0;
+    o->props.position[0] = (i*37)%500;
+    o->props.position[1] = 40.0;
+    o->props.position[2] = (i*91)%500;
+    o->props.velocity[0] = (i*13)%60 - 30.0;
+    o->props.velocity[1] = (i*7)%50;
+    o->props.velocity[2] = (i*29)%60 - 30.0;
+    o->props.moment_coefficient = 1.0;
+    if(i%3 == 0) {
+        o->propelling_force[1] = 15.0;
+        o->propelling_time = (i%20)*0.02;
+    }
+    o->state = STATE_PROJECTILE;
+}
+
+// check_impacts fires NUM_SHOTS shots over the hills and finds where each
+// lands with both the old and the new impact solvers, then prints how far
+// apart they were and how much work each did.
+static void check_impacts(struct Physics_World *w) {
+    struct Object o, before;
+    float t, old_t, diff, max_diff = 0.0;
+    long new_samples = 0, old_samples = 0, samples, new_step_samples, old_step_samples;
+    clock_t new_clock = 0, old_clock = 0, start, new_step_clock, old_step_clock;
+    int i, steps, impacts = 0, mismatches = 0;
+
+    w->terrain_height = hill_height;
+    w->terrain_min = -32.0;
+    w->terrain_max = 32.0;
+
+    // only the steps that end in an impact are counted, since the rest
+    // just look at the ground under the end of the step either way
+    for(i = 0; i < NUM_SHOTS; i++) {
+        fire_shot(&o, i);
+        for(steps = 0; o.state != STATE_IMPACTED && steps < 1000; steps++) {
+            memcpy(&before, &o, sizeof(struct Object));
+
+            samples = terrain_samples;
+            start = clock();
+            t = next_object_state(w, &o, SHOT_STEP);
+            new_step_clock = clock() - start;
+            new_step_samples = terrain_samples - samples;
+
+            samples = terrain_samples;
+            start = clock();
+            old_t = old_impact_time(w, &before, SHOT_STEP);
+            old_step_clock = clock() - start;
+            old_step_samples = terrain_samples - samples;
+
+            if((o.state == STATE_IMPACTED) != (old_t >= 0.0)) {
+                mismatches++;
+            } else if(o.state == STATE_IMPACTED) {
+                impacts++;
+                diff = fabs(t - old_t);
+                if(diff > max_diff) max_diff = diff;
+                new_clock += new_step_clock;
+                new_samples += new_step_samples;
+                old_clock += old_step_clock;
+                old_samples += old_step_samples;
+            }
+        }
+    }
+
+    printf("%d impacts, %d missed by one solver or the other\n", impacts, mismatches);
+    printf("largest difference in impact time: %g s\n", max_diff);
+    if(impacts == 0) return;
+    printf("old solver: %.1f terrain samples and %.2f us per impact\n",
+        (double)old_samples / impacts, 1e6 * old_clock / CLOCKS_PER_SEC / impacts);
+    printf("new solver: %.1f terrain samples and %.2f us per impact\n",
+        (double)new_samples / impacts, 1e6 * new_clock / CLOCKS_PER_SEC / impacts);
+}
+
+static float random_range(float low, float high) {
+    return low + (high - low) * rand() / RAND_MAX;
+}
+
+// check_sweeps compares sweep_spheres with sampling each sweep finely, and
+// counts how many of the hits only looking at the end of the step (as the
+// game used to) would have missed.
+static void check_sweeps(void) {
+    Vector a0, a1, b, a;
+    float ra0, ra1, rb, r, s, sampled, diff, max_diff = 0.0;
+    int i, j, k, hits = 0, mismatches = 0, tunnelled = 0;
+
+    srand(1);
+    for(i = 0; i < NUM_SWEEPS; i++) {
+        for(k = 0; k < 3; k++) {
+            a0[k] = random_range(-10.0, 10.0);
+            a1[k] = a0[k] + random_range(-20.0, 20.0);
+            b[k] = random_range(-10.0, 10.0);
+        }
+        ra0 = random_range(0.0, 2.0);
+        ra1 = (i % 2) ? random_range(0.0, 4.0) : ra0;
+        rb = random_range(0.0, 2.0);
+
+        // the first sample at which they touch
+        sampled = -1.0;
+        for(j = 0; j <= SWEEP_SAMPLES && sampled < 0.0; j++) {
+            s = (float)j / SWEEP_SAMPLES;
+            for(k = 0; k < 3; k++) a[k] = a0[k] + s * (a1[k] - a0[k]) - b[k];
+            r = ra0 + s * (ra1 - ra0) + rb;
+            if(a[0]*a[0] + a[1]*a[1] + a[2]*a[2] <= r*r) sampled = s;
+        }
+
+        s = sweep_spheres(a0, a1, ra0, ra1, b, rb);
+        if((s >= 0.0) != (sampled >= 0.0)) {
+            // a graze between two samples
+            mismatches++;
+        } else if(s >= 0.0) {
+            hits++;
+            diff = fabs(s - sampled);
+            if(diff > max_diff) max_diff = diff;
+            for(k = 0; k < 3; k++) a[k] = a1[k] - b[k];
+            r = ra1 + rb;
+            if(a[0]*a[0] + a[1]*a[1] + a[2]*a[2] > r*r) tunnelled++;
+        }
+    }
+
+    printf("%d hits, %d grazes missed by the sampling or the sweep\n", hits, mismatches);
+    printf("largest difference in time of contact: %g of a step (samples are %g apart)\n",
+        max_diff, 1.0 / SWEEP_SAMPLES);
+    printf("%d of the hits are missed at the end of the step\n", tunnelled);
+}
 
 int main() {
+    struct Physics_World w;
     struct Object o;
     Vector position = {384, 2.69478703, 384, 0};
     Vector velocity = {0, 0, 1000, 0};
@@ -10,11 +191,12 @@ int main() {
     double t;
 
     // Initialize data to simulate freshman physics
-    world_data.gravity = -9.8;
-    world_data.air_density = 0.0;
-    world_data.air_viscosity = 0.0;
-    world_data.wind_x = 0.0;
-    world_data.wind_z = 0.0;
+    init_physics_world(&w);
+    w.data.gravity = -9.8;
+    w.data.air_density = 0.0;
+    w.data.air_viscosity = 0.0;
+    w.data.wind_x = 0.0;
+    w.data.wind_z = 0.0;
 
     // Initialize the object -- more freshman physics values
     o.props.mass = 1.0;
@@ -39,7 +221,7 @@ int main() {
         printf("t = %.3f   x = [ %7.3f %7.3f %7.3f ]   v = [ %7.3f %7.3f %7.3f ]\n", t,
             o.props.position[0], o.props.position[1], o.props.position[2],
             o.props.velocity[0], o.props.velocity[1], o.props.velocity[2]);
-        t += next_object_state(&o, 0.1);
+        t += next_object_state(&w, &o, 0.1);
         counter++;
         if(counter == 20) {
             printf("Press Enter for next screen...");
@@ -51,5 +233,19 @@ int main() {
         o.props.position[0], o.props.position[1], o.props.position[2],
         o.props.velocity[0], o.props.velocity[1], o.props.velocity[2]);
 
+    // now check the impact solver against the old one, in still air and
+    // then in wind
+    printf("\nImpacts in still air:\n");
+    check_impacts(&w);
+    w.data.air_density = 1.2;
+    w.data.air_viscosity = 0.02;
+    w.data.wind_x = 3.0;
+    w.data.wind_z = -2.0;
+    printf("\nImpacts in wind:\n");
+    check_impacts(&w);
+
+    printf("\nSwept spheres:\n");
+    check_sweeps();
+
     return 0;
 }
@@ -1,3 +1,19 @@
+#include <math.h>
+#include <string.h>
 #include "pglobal.h"
 
-struct World_Data world_data;
+// zero_terrain_height returns 0 for all points (uniform terrain).
+static float zero_terrain_height(float x, float z) {
+    return 0.0;
+}
+
+// init_physics_world sets up a world with no gravity, no air and flat
+// terrain at height 0.
+void init_physics_world(struct Physics_World *w) {
+    memset(&w->data, 0, sizeof(w->data));
+    w->terrain_height = zero_terrain_height;
+    w->terrain_heights = NULL;
+    w->terrain_raycast = NULL;
+    w->terrain_min = -HUGE_VAL;
+    w->terrain_max = HUGE_VAL;
+}
@@ -1,7 +1,7 @@
 #ifndef PGLOBAL_H
 #define PGLOBAL_H
 
-/* Global data for "physics-land" */
+/* Data shared by everything in "physics-land" */
 
 struct World_Data {
     float gravity;
@@ -11,6 +11,38 @@ struct World_Data {
     float wind_z;
 };
 
-extern struct World_Data world_data;
+/*
+** A Physics_World is everything the physics functions need to know about
+** the world an object moves in: the world data and the terrain.  The
+** physics functions only read it, so any number of simulations may share
+** one world and run at the same time, as long as the terrain functions
+** may be called from more than one thread.
+**
+** terrain_height returns the height of the terrain at point x,z.
+**
+** terrain_heights fills in the heights of the terrain at count points at
+** once.  It may be NULL, in which case terrain_height is called for each.
+**
+** terrain_raycast finds where a straight line meets the terrain.  It takes
+** a ray origin, a direction and a maximum t; if origin + t*dir meets the
+** ground for some t between 0 and the maximum, it stores the first such t
+** and returns 1, otherwise it returns 0.  It may be NULL, in which case
+** impacts are only looked for at the end of each step.
+**
+** No point of the terrain is lower than terrain_min or higher than
+** terrain_max.  The closer they are, the fewer times the terrain has to be
+** looked at to find where a projectile hits it.
+*/
+struct Physics_World {
+    struct World_Data data;
+    float (*terrain_height)(float x, float z);
+    void (*terrain_heights)(const float *x, const float *z, float *heights,
+                            int count);
+    int (*terrain_raycast)(const float *origin, const float *dir,
+                           float max_t, float *t);
+    float terrain_min, terrain_max;
+};
+
+void init_physics_world(struct Physics_World *w);
 
 #endif
@@ -4,55 +4,50 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
 #include <matrix.h>
 #include "physics.h"
-#include "zeroin.h"
 
 #ifndef M_PI
 #define M_PI 3.141592653579323843383
 #endif
 
-// Function prototypes
-static void net_force_projectile(pVector f, const struct Object* o, float t);
-static void frictional_force(pVector f, float c1, float c2, const pVector n);
-static void gravitational_force(pVector f, const struct Object* o);
-static void propulsion_force(pVector f, const struct Object *o, float t);
-static void air_resistance_force(pVector f, const pVector F0, const struct Object* o, float t);
-static float zero_terrain_height(float x, float z);
-
-// Globals
-static float(*terrain_height)(float,float) = zero_terrain_height;
+// The path of a projectile is checked for impacts along straight chords.
+// It is split into enough chords that it never sags more than
+// IMPACT_SAG_TOLERANCE meters below them, up to MAX_IMPACT_CHORDS.
+#define IMPACT_SAG_TOLERANCE 0.01
+#define MAX_IMPACT_CHORDS 32
 
-// set_terrain_height_func sets the function used to calculate the height of
-// the terrain.  set_terrain_height_func takes a function pointer as an
-// argument and returns nothing.
-void set_terrain_height_func(float(*f)(float,float)) {
-    terrain_height = f;
-}
+// Impacts are found to within IMPACT_TIME_TOLERANCE times the time of the
+// impact, in at most MAX_IMPACT_ITERATIONS looks at the terrain.  Before
+// that, the search is narrowed down by up to MAX_BRACKET_STEPS halvings
+// that only look at the height of the path.
+#define IMPACT_TIME_TOLERANCE (4.0*FLT_EPSILON)
+#define MAX_IMPACT_ITERATIONS 50
+#define MAX_BRACKET_STEPS 24
 
-// a terrain_height_func returns the height of the terrain at point x,z.
-// zero_terrain_height returns 0 for all points (uniform terrain).
-static float zero_terrain_height(float x, float z) {
-    return 0.0;
-}
+// The path of an object over one step, in closed form, so that any point on
+// it can be found without re-running next_object_state.  Like
+// next_object_state, a step that outlasts the propellant has a propelled
+// part and an unpropelled part, which starts at time split.
+struct Impact_Path {
+    const struct Physics_World *w;
+    float mass, split;
+    Vector position[2], velocity[2], force[2];
+};
 
-// terrain_delta calculates the distance between the location of
-// an object at time t and the height of the terrain at the object's
-// x,z coordinates.  Uses Brent's zeroin function in combination with
-// this function to determine at what time (and thus at what
-// coordinates) a projectile impacted with the ground.
-// Before calling this function, initialize an Object struct named
-// base_object, which represents the object at time 0, at some
-// location before the impact.
-// THIS FUNCTION IS NOT THREAD-SAFE.
-struct Object base_object;
-float terrain_delta(float t) {
-    struct Object o;
-    memcpy(&o, &base_object, sizeof(struct Object));
-    next_object_state(&o, t);
-    return o.props.position[1] - (*terrain_height)(o.props.position[0],
-        o.props.position[2]);
-}
+// Function prototypes
+static void net_force_projectile(pVector f, const struct Physics_World *w, const struct Object* o, float t);
+static void frictional_force(pVector f, float c1, float c2, const pVector n);
+static void gravitational_force(pVector f, const struct Physics_World *w, const struct Object* o);
+static void propulsion_force(pVector f, const struct Object *o, float t);
+static void air_resistance_force(pVector f, const struct Physics_World *w, const pVector F0, const struct Object* o, float t);
+static float path_axis(float x, float *v, float force, float wind, float mass, float c, float t);
+static void init_impact_path(struct Impact_Path *path, const struct Physics_World *w, const struct Object *o);
+static void path_position(const struct Impact_Path *path, pVector position, pVector velocity, float t);
+static float impact_delta(const struct Impact_Path *path, float t);
+static float solve_impact(const struct Impact_Path *path, float a, float b, float fb);
+static int find_impact(const struct Physics_World *w, const struct Object *o, const pVector end, float t, float *impact_t);
 
 // next_object_state calculates the next point that an object will be at.
 // o is a pointer to the object.  o->props is updated to reflect the
@@ -62,12 +57,13 @@ float terrain_delta(float t) {
 // differences between points), and larger values mean less CPU
 // usage.  It should be possible for the driver to vary this
 // depending on how fast the computer is that the program is running
-// on.
+// on.  w is the world the object moves in; it is only read, so any number
+// of objects may be moved in the same world at once.
 // Return value is the actual amount of time elapsed.
-float next_object_state(struct Object* o, float t) {
+float next_object_state(const struct Physics_World *w, struct Object* o, float t) {
     Vector tmp, position, velocity;
     struct Physical_Properties *p = &o->props;
-    float non_propelled_time;
+    float non_propelled_time, impact_t;
 
     switch(o->state) {
     case STATE_PROJECTILE:
@@ -86,7 +82,7 @@ float next_object_state(struct Object* o, float t) {
         }
 
         // start by calculating the force on the projectile
-        net_force_projectile(tmp, o, t);       // tmp = F
+        net_force_projectile(tmp, w, o, t);    // tmp = F
         vc_div(tmp, p->mass);                  // tmp = F/m = a
 
         // find the new position -- this could be combined with the velocity
@@ -102,17 +98,13 @@ float next_object_state(struct Object* o, float t) {
 
         // check for impact with the ground
         // if we know we've hit, then don't do this twice!
-        if(position[1] < (*terrain_height)(position[0], position[2]) &&
-            o->state == STATE_PROJECTILE) {
-            
-            // we've impacted, now find the point of impact
-            // our search space is time=0 to time=t
-            o->state = STATE_PROJECTILE_FINAL;
-            memcpy(&base_object, o, sizeof(struct Object));
-            t = zeroin(0.0, t, terrain_delta, 0.0);
+        if(o->state == STATE_PROJECTILE &&
+            find_impact(w, o, position, t, &impact_t)) {
 
-            // and recalculate the final position based on the new time
-            t = next_object_state(o, t);
+            // we've impacted, so recalculate the final position based on
+            // the time of impact
+            o->state = STATE_PROJECTILE_FINAL;
+            t = next_object_state(w, o, impact_t);
             o->state = STATE_IMPACTED;
             return t;
         }
@@ -136,7 +128,7 @@ float next_object_state(struct Object* o, float t) {
         // session, then we must execute in two parts; this is the second part.
         if(non_propelled_time != 0.0) {
             o->propelling_time = 0.0;
-            t += next_object_state(o, non_propelled_time);
+            t += next_object_state(w, o, non_propelled_time);
         } else {
             o->propelling_time -= t;
         }
@@ -149,21 +141,222 @@ float next_object_state(struct Object* o, float t) {
     return t;
 }
 
+// path_axis moves one coordinate of an object for time t the same way
+// next_object_state does, with the same air resistance as
+// air_resistance_force.  x and v are the position and velocity, force is
+// the force along this axis without the air resistance, wind is the wind
+// along it and c is -(viscosity*density).  v is updated, and the new
+// position is returned.
+static float path_axis(float x, float *v, float force, float wind, float mass, float c, float t) {
+    float v0 = *v - wind, drag = 0.0, at;
+
+    if(c != 0.0 && fabs(v0) >= 0.000001) {
+        drag = exp((force/v0 + c)/mass * t) * v0 * c;
+    }
+
+    at = (force + drag) / mass * t;            // a*t
+    x = (0.5*at + *v)*t + x;                   // x0 + v0*t + 0.5*a*t^2
+    *v += at;                                  // v0 + a*t
+    return x;
+}
+
+// init_impact_path works out the path that the object o takes from where
+// it is now, in the world w.
+static void init_impact_path(struct Impact_Path *path, const struct Physics_World *w, const struct Object *o) {
+    Vector wind = {w->data.wind_x, 0.0, w->data.wind_z, 0.0};
+    float c = -(w->data.air_viscosity*w->data.air_density);
+    int i;
+
+    path->w = w;
+    path->mass = o->props.mass;
+    vv_cpy(path->position[0], o->props.position);
+    vv_cpy(path->velocity[0], o->props.velocity);
+    gravitational_force(path->force[1], w, o);
+    propulsion_force(path->force[0], o, 0.0);
+    vv_add(path->force[0], path->force[1]);
+
+    // the unpropelled part starts where the propellant runs out
+    if(o->propelling_time > 0.0) {
+        path->split = o->propelling_time;
+        vv_cpy(path->velocity[1], path->velocity[0]);
+        for(i = 0; i < 3; i++) {
+            path->position[1][i] = path_axis(path->position[0][i], &path->velocity[1][i],
+                path->force[0][i], wind[i], path->mass, c, path->split);
+        }
+    } else {
+        path->split = HUGE_VAL;
+    }
+}
+
+// path_position finds the position on the path at time t, and the
+// velocity there if velocity isn't NULL.
+static void path_position(const struct Impact_Path *path, pVector position, pVector velocity, float t) {
+    const struct World_Data *data = &path->w->data;
+    float wind[3] = {data->wind_x, 0.0, data->wind_z};
+    float c = -(data->air_viscosity*data->air_density);
+    float v;
+    int i, part = 0;
+
+    if(t > path->split) {
+        t -= path->split;
+        part = 1;
+    }
+    for(i = 0; i < 3; i++) {
+        v = path->velocity[part][i];
+        position[i] = path_axis(path->position[part][i], &v, path->force[part][i],
+            wind[i], path->mass, c, t);
+        if(velocity != NULL) velocity[i] = v;
+    }
+}
+
+// impact_delta calculates the distance between the point on the path at
+// time t and the height of the terrain under it.
+static float impact_delta(const struct Impact_Path *path, float t) {
+    Vector position;
+
+    path_position(path, position, NULL, t);
+    return position[1] - (*path->w->terrain_height)(position[0], position[2]);
+}
+
+// solve_impact finds the time at which the path meets the ground between
+// times a and b, where it is above the ground at a and fb below it at b.
+// Parts of the path above the highest point of the terrain or below the
+// lowest can't be where it meets the ground, so the search is first
+// narrowed down by looking at the path alone.  Then Newton's method is
+// used on the distance to the ground, with the vertical speed of the path
+// worked out exactly and the slope of the terrain under it from the last
+// two looks at the terrain.  A step that would leave [a,b] halves it
+// instead.
+static float solve_impact(const struct Impact_Path *path, float a, float b, float fb) {
+    const struct Physics_World *w = path->w;
+    Vector position, velocity;
+    float m, fm, h, next, slope = 0.0, last_t, last_h;
+    int i, have_last = 1;
+
+    for(i = 0; i < MAX_BRACKET_STEPS; i++) {
+        m = 0.5*(a + b);
+        path_position(path, position, NULL, m);
+        if(position[1] > w->terrain_max) {
+            a = m;
+        } else if(position[1] < w->terrain_min) {
+            b = m;
+            have_last = 0;
+        } else {
+            break;
+        }
+    }
+
+    // The first slope of the terrain comes from the end below the ground,
+    // if that end hasn't moved; otherwise the terrain is taken to be flat
+    // to start with.
+    path_position(path, position, velocity, b);
+    last_t = b;
+    last_h = position[1] - fb;
+    if(!have_last) fb = position[1] - w->terrain_min;
+    m = b - fb/velocity[1];
+
+    for(i = 0; i < MAX_IMPACT_ITERATIONS; i++) {
+        if(!(m > a && m < b)) m = 0.5*(a + b);
+        path_position(path, position, velocity, m);
+        h = (*w->terrain_height)(position[0], position[2]);
+        fm = position[1] - h;
+        if(fm == 0.0) return m;
+        if(fm > 0.0) {
+            a = m;
+        } else {
+            b = m;
+        }
+
+        if(have_last && m != last_t) slope = (h - last_h)/(m - last_t);
+        next = m - fm/(velocity[1] - slope);
+        if(fabs(next - m) <= IMPACT_TIME_TOLERANCE*fabs(m) ||
+           b - a <= IMPACT_TIME_TOLERANCE*fabs(b)) {
+            return (next > a && next < b) ? next : m;
+        }
+
+        last_t = m;
+        last_h = h;
+        have_last = 1;
+        m = next;
+    }
+
+    return m;
+}
+
+// find_impact looks for the ground along the path that the object o takes
+// over the next t seconds, which ends at position end.  If the path hits the
+// ground, find_impact stores the time of the impact in impact_t and returns
+// 1; otherwise it returns 0.
+// With a terrain_raycast function, the path is cast against the terrain as
+// a series of chords, so the projectile can't pass through a ridge between
+// the start and end of a step.  Without one, only the end of the step is
+// checked, and solve_impact searches the whole step for the impact.
+static int find_impact(const struct Physics_World *w, const struct Object *o, const pVector end, float t, float *impact_t) {
+    struct Impact_Path path;
+    Vector start, next, dir;
+    float t0, t1, hit, f0, f1;
+    int i, n;
+
+    if(w->terrain_raycast == NULL) {
+        f1 = end[1] - (*w->terrain_height)(end[0], end[2]);
+        if(f1 >= 0.0) return 0;
+        // the step starts above the ground, where the last one ended
+        init_impact_path(&path, w, o);
+        *impact_t = solve_impact(&path, 0.0, t, f1);
+        return 1;
+    }
+
+    // a path curving with acceleration g sags g*dt^2/8 below a chord
+    // dt seconds long
+    n = (int)ceil(sqrt(fabs(w->data.gravity)*t*t/8.0 / IMPACT_SAG_TOLERANCE));
+    if(n < 1) n = 1;
+    if(n > MAX_IMPACT_CHORDS) n = MAX_IMPACT_CHORDS;
+
+    init_impact_path(&path, w, o);
+    vv_cpy(start, o->props.position);
+    for(i = 1; i <= n; i++) {
+        t0 = t*(i-1)/n;
+        t1 = t*i/n;
+        if(i == n) {
+            vv_cpy(next, end);
+        } else {
+            path_position(&path, next, NULL, t1);
+        }
+        vv_cpy(dir, next);
+        vv_sub(dir, start);
+
+        if((*w->terrain_raycast)(start, dir, 1.0, &hit)) {
+            // the path lies below the chord, so it may reach the ground a
+            // little before the chord does
+            hit = t0 + hit*(t1 - t0);
+            f1 = impact_delta(&path, hit);
+            if(f1 < 0.0) {
+                f0 = impact_delta(&path, t0);
+                if(f0 > 0.0) hit = solve_impact(&path, t0, hit, f1);
+            }
+            *impact_t = hit;
+            return 1;
+        }
+        vv_cpy(start, next);
+    }
+    return 0;
+}
+
 // net_force calculates the net force on an object.  This includes gravitational
 // force, frictional force, force due to wind resistance, internal acceleratory
 // force, and other miscellaneous force.  The exact forces used is determined by
 // the type of object.  f is a pointer to a 3D vector that represents the return
 // value for the force.  o is a pointer to the object.
-static void net_force_projectile(pVector f, const struct Object* o, float t) {
+static void net_force_projectile(pVector f, const struct Physics_World *w, const struct Object* o, float t) {
     Vector total;
     Vector temp;
     
-    gravitational_force(total, o);             // total = g
+    gravitational_force(total, w, o);          // total = g
 
     propulsion_force(temp, o, t);              // temp = P
     vv_add(total, temp);                       // total = total + P
 
-    air_resistance_force(temp, total, o, t);   // temp = air resistance
+    air_resistance_force(temp, w, total, o, t); // temp = air resistance
     vv_add(total, temp);                       // total += air resistance
 
     vv_cpy(f, total);                          // f = total
@@ -182,10 +375,10 @@ static void frictional_force(pVector f, float c1, float c2, const pVector n) {
 // wind_force calculates the force on an object due to wind resistance.  f is
 // a pointer to a 3D vector that represents the return value for the force, and
 // F0 is the amount of force currently being exerted on the object.
-static void air_resistance_force(pVector f, const pVector F0, const struct Object* o, float t) {
+static void air_resistance_force(pVector f, const struct Physics_World *w, const pVector F0, const struct Object* o, float t) {
     Vector tmp;
-    float c = -(world_data.air_viscosity*world_data.air_density);
-    Vector v0 = {-world_data.wind_x, 0, -world_data.wind_z, 0};
+    float c = -(w->data.air_viscosity*w->data.air_density);
+    Vector v0 = {-w->data.wind_x, 0, -w->data.wind_z, 0};
 
     vv_add(v0, o->props.velocity);             // v0 = velocity - wind_velocity
     
@@ -211,8 +404,8 @@ static void air_resistance_force(pVector f, const pVector F0, const struct Objec
 
 // gravitational_force returns the force on an object due to gravity.  f is a
 // pointer to a 3D vector that represents the return value for the force.
-static void gravitational_force(pVector f, const struct Object *o) {
-    Vector g = {0.0, world_data.gravity * o->props.mass, 0.0, 0.0};
+static void gravitational_force(pVector f, const struct Physics_World *w, const struct Object *o) {
+    Vector g = {0.0, w->data.gravity * o->props.mass, 0.0, 0.0};
     vv_cpy(f, g);
 }
 
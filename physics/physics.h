@@ -43,7 +43,6 @@ struct Object {
     enum Object_State          state;
 };
 
-float next_object_state(struct Object* o, float t);
-void set_terrain_height_func(float(*f)(float,float));
+float next_object_state(const struct Physics_World *w, struct Object* o, float t);
 
 #endif
@@ -4,11 +4,13 @@
  * function ZEROIN - obtain a function zero within the given range
  *
  * Input
- *	float zeroin(ax,bx,f,tol)
+ *	float zeroin(ax,bx,f,data,tol)
  *	float ax; 			Root will be seeked for within
  *	float bx;  			a range [ax,bx]
- *	float (*f)(float x);		Name of the function whose zero
+ *	float (*f)(float x, void *data);
+ *					Name of the function whose zero
  *					will be seeked for
+ *	void *data;			Passed on to f untouched
  *	float tol;			Acceptable tolerance for the root
  *					value.
  *					May be specified as 0.0 to cause
@@ -52,10 +54,11 @@
 /* NOTE: This value must be greater than the smallest value for a float */
 #define EPSILON (float)ldexp(1, -16)
 
-float zeroin(ax,bx,f,tol)		/* An estimate to the root	*/
+float zeroin(ax,bx,f,data,tol)		/* An estimate to the root	*/
 float ax;					/* Left border | of the range	*/
 float bx;  				/* Right border| the root is seeked*/
-float (*f)(float x);			/* Function under investigation	*/
+float (*f)(float x, void *data);	/* Function under investigation	*/
+void *data;				/* User data for f		*/
 float tol;				/* Acceptable tolerance		*/
 {
   float a,b,c;				/* Abscissae, descr. see above	*/
@@ -64,7 +67,7 @@ float tol;				/* Acceptable tolerance		*/
   float fc;				/* f(c)				*/
 
   a = (float)ax;  b = (float)bx;
-  fa = (*f)(a);  fb = (*f)(b);
+  fa = (*f)(a, data);  fb = (*f)(b, data);
   c = a;   fc = fa;
 
   for(;;)		/* Main iteration loop	*/
@@ -129,7 +132,7 @@ float tol;				/* Acceptable tolerance		*/
     }
 
     a = b;  fa = fb;			/* Save the previous approx.	*/
-    b += new_step;  fb = (*f)(b);	/* Do step to a new approxim.	*/
+    b += new_step;  fb = (*f)(b, data);	/* Do step to a new approxim.	*/
     if( (fb > 0 && fc > 0) || (fb < 0 && fc < 0) )
     {                 			/* Adjust c for it to have a sign*/
       c = a;  fc = fa;                  /* opposite to that of b	*/
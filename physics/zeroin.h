@@ -1,6 +1,6 @@
 #ifndef ZEROIN_H
 #define ZEROIN_H
 
-float zeroin(float, float, float(*f)(float), float);
+float zeroin(float, float, float(*f)(float, void*), void*, float);
 
 #endif
@@ -0,0 +1,130 @@
+// File: height_bench.c
+// Author: Marc Bryant
+//
+// Times the batch terrain height sampling, scalar against SSE, on a made up
+// heightfield, and checks that the two give the same answers.
+//
+// Usage: height_bench [map size] [points] [passes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_pages.h"
+#include "sx3_terrain_sample.h"
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// make_heights
+//
+// Fills the terrain globals with a size x size field of rolling hills.
+static int make_heights(int size)
+{
+    int x, y;
+
+    if (sx3_alloc_terrain_pages(size, size, NULL) != SX3_ERROR_SUCCESS)
+        return 0;
+
+    g_terrain_height_scale = 0.01F;
+    g_terrain_height_offset = 0.0F;
+    for (y=0; y<size; y++)
+        for (x=0; x<size; x++)
+            TERRAIN_RAW_HEIGHT(x, y) = (short)(
+                8000.0*sin(x*0.031)*cos(y*0.017) +
+                1500.0*sin((x + y)*0.29) + (rand() % 64));
+    return 1;
+}  // make_heights
+
+
+// time_sampler
+//
+// Runs sample over the points passes times, and returns nanoseconds per
+// point.
+static double time_sampler(
+    void (*sample)(const float*, const float*, float*, struct Point*, int),
+    const float *x,
+    const float *z,
+    float *heights,
+    struct Point *normals,
+    int count,
+    int passes)
+{
+    clock_t start;
+    int i;
+
+    start = clock();
+    for (i=0; i<passes; i++)
+        sample(x, z, heights, normals, count);
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / count / passes;
+}  // time_sampler
+
+
+int main(int argc, char **argv)
+{
+    int size = argc > 1 ? atoi(argv[1]) : 1025;
+    int count = argc > 2 ? atoi(argv[2]) : 1 << 16;
+    int passes = argc > 3 ? atoi(argv[3]) : 100;
+    float *x, *z, *h_scalar, *h_simd;
+    struct Point *n_scalar, *n_simd;
+    int i, mismatches = 0;
+
+    if (size < 2 || count < 1 || passes < 1)
+    {
+        fprintf(stderr, "Usage: %s [map size] [points] [passes]\n", argv[0]);
+        return 1;
+    }
+
+    x = malloc(sizeof(float) * count);
+    z = malloc(sizeof(float) * count);
+    h_scalar = malloc(sizeof(float) * count);
+    h_simd = malloc(sizeof(float) * count);
+    n_scalar = malloc(sizeof(struct Point) * count);
+    n_simd = malloc(sizeof(struct Point) * count);
+    if (!x || !z || !h_scalar || !h_simd || !n_scalar || !n_simd ||
+        !make_heights(size))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Scatter the points over the map, and a little way off it, so that the
+    // wrapping gets exercised too
+    for (i=0; i<count; i++)
+    {
+        x[i] = ((float)rand() / RAND_MAX * 1.2F - 0.1F) * size * METERS_PER_MAP_GRID;
+        z[i] = ((float)rand() / RAND_MAX * 1.2F - 0.1F) * size * METERS_PER_MAP_GRID;
+    }
+
+    printf("%d x %d map, %d points, %d passes\n", size, size, count, passes);
+    printf("heights:           scalar %6.2f ns/point   batch %6.2f ns/point\n",
+           time_sampler(sx3_sample_terrain_heights_scalar,
+                        x, z, h_scalar, NULL, count, passes),
+           time_sampler(sx3_sample_terrain_heights,
+                        x, z, h_simd, NULL, count, passes));
+    printf("heights + normals: scalar %6.2f ns/point   batch %6.2f ns/point\n",
+           time_sampler(sx3_sample_terrain_heights_scalar,
+                        x, z, h_scalar, n_scalar, count, passes),
+           time_sampler(sx3_sample_terrain_heights,
+                        x, z, h_simd, n_simd, count, passes));
+
+    for (i=0; i<count; i++)
+        if (h_scalar[i] != h_simd[i] ||
+            n_scalar[i].x != n_simd[i].x ||
+            n_scalar[i].y != n_simd[i].y ||
+            n_scalar[i].z != n_simd[i].z)
+            mismatches++;
+    printf("%d of %d points differ between the two paths\n", mismatches, count);
+
+    sx3_free_terrain_pages();
+    free(x);
+    free(z);
+    free(h_scalar);
+    free(h_simd);
+    free(n_scalar);
+    free(n_simd);
+    return mismatches != 0;
+}
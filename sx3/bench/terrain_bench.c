@@ -0,0 +1,568 @@
+// File: terrain_bench.c
+// Author: Marc Bryant
+//
+// Flies a camera along a path over a terrain and draws each frame with
+// sx3_draw_terrain into an offscreen OSMesa buffer, once for each detail
+// algorithm (terrain.detail.alg) with and without horizon culling.  For
+// each mode it prints one CSV line with the CPU time per frame (p50, p95
+// and p99), the strips and vertices sent and the share of chunks left by
+// each stage of culling.  It exits with 3 if the chunk counts of any frame
+// don't add up: each stage of culling may only drop chunks, and horizon
+// culling may only drop chunks that the same frame without it kept.
+//
+// Usage: terrain_bench [options] [terrain] [path]
+//
+//   terrain   a terrain file (.ter or .ter2), or a number to generate a
+//             map of that size from seed 1.  Defaults to
+//             SX3_DEFAULT_TERRAIN.
+//   path      a camera path file.  Each line is
+//                 map_x map_y height yaw pitch
+//             with the height in meters above the ground, and the yaw and
+//             pitch in degrees (yaw 0 looks along +map x, pitch < 0 looks
+//             down).  Lines starting with # are skipped.  Defaults to a
+//             circle around the middle of the map.
+//
+//   -s WxH         size of the offscreen buffer (default 640x480)
+//   -n frames      frames in the default path (default 600)
+//   -o file        write the CSV to file instead of stdout
+//   -f file        also write every frame of every mode to file as CSV
+//   -b file        compare against the output of an earlier run and exit
+//                  with 2 if a mode got slower or sends more vertices.
+//                  Modes whose times in the file are 0 are only compared
+//                  by their vertices.
+//   -t percent     how much worse than the baseline is allowed (default 15)
+//   -c             write the times as 0, for a baseline that can be used
+//                  on any machine (like bench/terrain_baseline.csv)
+//   name=value     set a registry variable (terrain.detail.levels=8, ...)
+//
+// Run it from the sx3 directory, so that the data files are found.
+
+#include <GL/osmesa.h>
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sx3_registry.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_cull.h"
+#include "sx3_files.h"
+#include "sx3_global.h"
+#include "sx3_graphics.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// Frames at the start of each mode that are drawn but not counted, so that
+// the chunk cache is warm
+#define WARMUP_FRAMES       16
+#define MAX_MODES           (Num_Terrain_Detail_Algs*2)
+#define MAX_LINE            256
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+struct Camera {
+    struct Point                pos;
+    struct Point                dir;
+};
+
+struct Frame {
+    double                      cpu_ms;
+    struct Terrain_Stats        stats;
+};
+
+struct Summary {
+    char                        name[32];
+    double                      p50, p95, p99;
+    double                      strips, vertices;
+    double                      frustum_ratio, horizon_ratio, drawn;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// sx3_draw_terrain needs these; they normally live in sx3_game.c
+float                           g_fov = (float)M_PI/4;
+
+static const char              *alg_names[Num_Terrain_Detail_Algs] = {
+    "rings", "geomipmap", "cdlod"
+};
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// make_camera
+//
+// Works out the GL camera for a point on the path.
+static struct Camera make_camera(
+    float map_x,
+    float map_y,
+    float height,
+    float yaw,
+    float pitch)
+{
+    struct Camera c;
+
+    yaw *= (float)M_PI / 180.0F;
+    pitch *= (float)M_PI / 180.0F;
+
+    c.pos.x = MAP_Y_TO_GL_X(map_y);
+    c.pos.z = MAP_X_TO_GL_Z(map_x);
+    c.pos.y = sx3_find_terrain_height(c.pos.x, c.pos.z) + height;
+
+    // +map x is +GL z, +map y is -GL x
+    c.dir.x = -sin(yaw) * cos(pitch);
+    c.dir.y = sin(pitch);
+    c.dir.z = cos(yaw) * cos(pitch);
+    return c;
+}  // make_camera
+
+
+// load_path
+//
+// Reads a camera path file.  Returns the number of cameras, or 0 if the
+// file can't be read.
+static int load_path(const char *name, struct Camera **cameras)
+{
+    char line[MAX_LINE];
+    float map_x, map_y, height, yaw, pitch;
+    int n = 0, max = 0;
+    struct Camera *c;
+    FILE *f;
+
+    if (!(f = fopen(name, "r")))
+        return 0;
+
+    *cameras = NULL;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (line[0] == '#' ||
+            sscanf(line, "%f %f %f %f %f",
+                   &map_x, &map_y, &height, &yaw, &pitch) != 5)
+            continue;
+
+        if (n == max)
+        {
+            max = max ? 2*max : 256;
+            if (!(c = realloc(*cameras, max * sizeof(struct Camera))))
+                break;
+            *cameras = c;
+        }
+        (*cameras)[n++] = make_camera(map_x, map_y, height, yaw, pitch);
+    }
+
+    fclose(f);
+    return n;
+}  // load_path
+
+
+// make_path
+//
+// Makes the default path: a circle around the middle of the map, looking
+// ahead and a little down, rising and falling between skimming the ground
+// and looking out over it.
+static int make_path(int frames, struct Camera **cameras)
+{
+    float r = 0.3F * ((g_terrain_size.x < g_terrain_size.y) ?
+                      g_terrain_size.x : g_terrain_size.y);
+    float a;
+    int i;
+
+    if (!(*cameras = malloc(frames * sizeof(struct Camera))))
+        return 0;
+
+    for (i=0; i<frames; i++)
+    {
+        a = 2.0F * (float)M_PI * i / frames;
+        (*cameras)[i] = make_camera(
+            0.5F*g_terrain_size.x + r*cos(a),
+            0.5F*g_terrain_size.y + r*sin(a),
+            32.0F - 28.0F*cos(3.0F*a),
+            a * 180.0F / (float)M_PI + 90.0F,
+            -10.0F);
+    }
+    return frames;
+}  // make_path
+
+
+// compare_doubles
+static int compare_doubles(const void *a, const void *b)
+{
+    double d = *(const double*)a - *(const double*)b;
+
+    return (d > 0.0) - (d < 0.0);
+}  // compare_doubles
+
+
+// percentile
+//
+// Returns the q'th quantile of n sorted values.
+static double percentile(const double *sorted, int n, double q)
+{
+    return sorted[(int)(q*(n - 1) + 0.5)];
+}  // percentile
+
+
+// run_mode
+//
+// Draws every camera of the path with the current settings, filling in
+// one Frame for each.
+static void run_mode(const struct Camera *cameras, int n, struct Frame *frames)
+{
+    struct Point up = { 0.0F, 1.0F, 0.0F };
+    const struct Camera *c;
+    clock_t start;
+    int i;
+
+    for (i=-WARMUP_FRAMES; i<n; i++)
+    {
+        c = &cameras[((i % n) + n) % n];
+
+        glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+        glLoadIdentity();
+        gluLookAt(c->pos.x, c->pos.y, c->pos.z,
+                  c->pos.x + c->dir.x, c->pos.y + c->dir.y, c->pos.z + c->dir.z,
+                  up.x, up.y, up.z);
+        sx3_draw_terrain_lights();
+        glEnable(GL_LIGHTING);
+
+        // OSMesa draws as the calls are made, so glFinish is where the
+        // frame is done
+        start = clock();
+        sx3_draw_terrain(c->pos, c->dir, up);
+        glFinish();
+        if (i < 0)
+            continue;
+
+        frames[i].cpu_ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+        frames[i].stats = g_terrain_stats;
+    }
+}  // run_mode
+
+
+// summarize
+//
+// Works out the summary of a mode from its frames.
+static void summarize(const struct Frame *frames, int n, struct Summary *s)
+{
+    double *cpu = malloc(n * sizeof(double));
+    double in_range = 0.0, in_frustum = 0.0, over_horizon = 0.0;
+    int i;
+
+    s->strips = s->vertices = s->drawn = 0.0;
+    for (i=0; i<n; i++)
+    {
+        if (cpu)
+            cpu[i] = frames[i].cpu_ms;
+        s->strips += frames[i].stats.strips;
+        s->vertices += frames[i].stats.vertices;
+        s->drawn += frames[i].stats.chunks_drawn;
+        in_range += frames[i].stats.chunks_in_range;
+        in_frustum += frames[i].stats.chunks_in_frustum;
+        over_horizon += frames[i].stats.chunks_over_horizon;
+    }
+    s->strips /= n;
+    s->vertices /= n;
+    s->drawn /= n;
+    s->frustum_ratio = in_range > 0.0 ? in_frustum / in_range : 0.0;
+    s->horizon_ratio = in_frustum > 0.0 ? over_horizon / in_frustum : 0.0;
+
+    s->p50 = s->p95 = s->p99 = 0.0;
+    if (cpu)
+    {
+        qsort(cpu, n, sizeof(double), compare_doubles);
+        s->p50 = percentile(cpu, n, 0.50);
+        s->p95 = percentile(cpu, n, 0.95);
+        s->p99 = percentile(cpu, n, 0.99);
+        free(cpu);
+    }
+}  // summarize
+
+
+// check_frames
+//
+// Counts the frames whose chunk counts don't add up, printing the first few.
+// unculled holds the same frames drawn without horizon culling, or is NULL
+// if these are them.
+static int check_frames(
+    const char *name,
+    const struct Frame *frames,
+    const struct Frame *unculled,
+    int n)
+{
+    const struct Terrain_Stats *s, *u;
+    int i, bad = 0;
+
+    for (i=0; i<n; i++)
+    {
+        s = &frames[i].stats;
+        u = unculled ? &unculled[i].stats : s;
+        if (s->chunks_in_frustum > s->chunks_in_range ||
+            s->chunks_over_horizon > s->chunks_in_frustum ||
+            s->chunks_drawn > s->chunks_over_horizon ||
+            s->strips > s->chunks_drawn ||
+            u->chunks_in_frustum != s->chunks_in_frustum ||
+            u->chunks_over_horizon != u->chunks_in_frustum ||
+            s->chunks_over_horizon > u->chunks_over_horizon)
+        {
+            if (bad++ < 5)
+                fprintf(stderr, "%s frame %d: %d in range, %d in the frustum "
+                        "(%d without horizon culling), %d over the horizon, "
+                        "%d drawn, %d strips\n", name, i, s->chunks_in_range,
+                        s->chunks_in_frustum, u->chunks_in_frustum,
+                        s->chunks_over_horizon, s->chunks_drawn, s->strips);
+        }
+    }
+    return bad;
+}  // check_frames
+
+
+// print_summary
+static void print_summary(FILE *f, const struct Summary *s)
+{
+    fprintf(f, "%s,%.3f,%.3f,%.3f,%.1f,%.1f,%.4f,%.4f,%.1f\n",
+            s->name, s->p50, s->p95, s->p99, s->strips, s->vertices,
+            s->frustum_ratio, s->horizon_ratio, s->drawn);
+}  // print_summary
+
+
+// check_baseline
+//
+// Compares the summaries against an earlier run's output, and returns the
+// number of modes that got worse by more than tolerance percent.  Modes
+// that are missing from either run are skipped, and so are the times of
+// modes that the earlier run left untimed.
+static int check_baseline(
+    const char *name,
+    const struct Summary *summaries,
+    int num_modes,
+    float tolerance)
+{
+    char line[MAX_LINE];
+    struct Summary b;
+    double limit = 1.0 + tolerance / 100.0;
+    int i, regressions = 0;
+    FILE *f;
+
+    if (!(f = fopen(name, "r")))
+    {
+        fprintf(stderr, "Unable to open baseline file: %s\n", name);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%31[^,],%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+                   b.name, &b.p50, &b.p95, &b.p99, &b.strips, &b.vertices,
+                   &b.frustum_ratio, &b.horizon_ratio, &b.drawn) != 9)
+            continue;
+
+        for (i=0; i<num_modes; i++)
+        {
+            if (strcmp(summaries[i].name, b.name))
+                continue;
+            if (b.p95 > 0.0 && summaries[i].p95 > b.p95 * limit)
+            {
+                fprintf(stderr, "REGRESSION %s: p95 %.3f ms, was %.3f ms\n",
+                        b.name, summaries[i].p95, b.p95);
+                regressions++;
+            }
+            if (summaries[i].vertices > b.vertices * limit)
+            {
+                fprintf(stderr, "REGRESSION %s: %.1f vertices, was %.1f\n",
+                        b.name, summaries[i].vertices, b.vertices);
+                regressions++;
+            }
+        }
+    }
+
+    fclose(f);
+    return regressions;
+}  // check_baseline
+
+
+int main(int argc, char **argv)
+{
+    const char *terrain = SX3_DEFAULT_TERRAIN, *path = NULL;
+    const char *frames_name = NULL, *baseline = NULL, *out_name = NULL;
+    int width = 640, height = 480, path_frames = 600;
+    float tolerance = 15.0F;
+    struct Summary summaries[MAX_MODES];
+    struct Camera *cameras;
+    struct Frame *frames, *unculled;
+    FILE *out = stdout, *frames_file = NULL;
+    OSMesaContext ctx;
+    void *buffer;
+    char *eq;
+    int i, k, n, alg, horizon, num_modes = 0, positional = 0, bad = 0;
+    int untimed = 0;
+    SX3_ERROR_CODE retcode;
+
+    sx3_terrain_register_vars();
+
+    for (i=1; i<argc; i++)
+    {
+        if (!strcmp(argv[i], "-s") && i+1 < argc)
+            sscanf(argv[++i], "%dx%d", &width, &height);
+        else if (!strcmp(argv[i], "-n") && i+1 < argc)
+            path_frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i+1 < argc)
+            out_name = argv[++i];
+        else if (!strcmp(argv[i], "-f") && i+1 < argc)
+            frames_name = argv[++i];
+        else if (!strcmp(argv[i], "-b") && i+1 < argc)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "-t") && i+1 < argc)
+            tolerance = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-c"))
+            untimed = 1;
+        else if ((eq = strchr(argv[i], '=')) != NULL)
+        {
+            *eq = '\0';
+            if (sx3_set_global_value(argv[i], eq + 1) != GV_SUCCESS)
+                fprintf(stderr, "Unable to set %s\n", argv[i]);
+        }
+        else if (positional++ == 0)
+            terrain = argv[i];
+        else
+            path = argv[i];
+    }
+
+    if (width < 1 || height < 1 || path_frames < 1)
+    {
+        fprintf(stderr, "Usage: %s [-s WxH] [-n frames] [-o file] [-f file] "
+                "[-b file] [-t percent] [-c] [name=value ...] [terrain] [path]\n",
+                argv[0]);
+        return 1;
+    }
+
+    // The GL context has to exist before the terrain is loaded
+    buffer = malloc(width * height * 4);
+    ctx = OSMesaCreateContextExt(OSMESA_RGBA, 24, 0, 0, NULL);
+    if (!buffer || !ctx ||
+        !OSMesaMakeCurrent(ctx, buffer, GL_UNSIGNED_BYTE, width, height))
+    {
+        fprintf(stderr, "Unable to create an OSMesa context\n");
+        return 1;
+    }
+
+    g_window_size.x = width;
+    g_window_size.y = height;
+    glViewport(0, 0, width, height);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(g_fov/M_PI*180.0, (double)width/height, SX3_Z_NEAR, SX3_Z_FAR);
+    glMatrixMode(GL_MODELVIEW);
+    glEnable(GL_DEPTH_TEST);
+    glShadeModel(GL_SMOOTH);
+    glCullFace(GL_BACK);
+    glEnable(GL_CULL_FACE);
+
+    if (atoi(terrain) > 0)
+        retcode = sx3_generate_terrain(atoi(terrain), atoi(terrain), 1);
+    else
+        retcode = sx3_load_terrain((char*)terrain);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "Unable to load terrain: %s\n", terrain);
+        return 1;
+    }
+
+    n = path ? load_path(path, &cameras) : make_path(path_frames, &cameras);
+    if (n == 0)
+    {
+        fprintf(stderr, "Unable to read camera path: %s\n", path);
+        return 1;
+    }
+    frames = malloc(n * sizeof(struct Frame));
+    unculled = malloc(n * sizeof(struct Frame));
+    if (!frames || !unculled)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    if (out_name && !(out = fopen(out_name, "w")))
+    {
+        fprintf(stderr, "Unable to open output file: %s\n", out_name);
+        return 1;
+    }
+    if (frames_name)
+    {
+        if (!(frames_file = fopen(frames_name, "w")))
+        {
+            fprintf(stderr, "Unable to open frames file: %s\n", frames_name);
+            return 1;
+        }
+        fprintf(frames_file, "mode,frame,cpu_ms,strips,vertices,"
+                "in_range,in_frustum,over_horizon,drawn\n");
+    }
+
+    fprintf(out, "mode,p50_ms,p95_ms,p99_ms,strips,vertices,"
+            "frustum_ratio,horizon_ratio,chunks_drawn\n");
+    for (alg=0; alg<Num_Terrain_Detail_Algs; alg++)
+    {
+        for (horizon=0; horizon<2; horizon++)
+        {
+            sx3_set_global_int("terrain.detail.alg", alg);
+            sx3_set_global_bool("terrain.horizon", horizon);
+            run_mode(cameras, n, frames);
+
+            sprintf(summaries[num_modes].name, "%s%s", alg_names[alg],
+                    horizon ? "+horizon" : "");
+            summarize(frames, n, &summaries[num_modes]);
+            if (untimed)
+                summaries[num_modes].p50 = summaries[num_modes].p95 =
+                    summaries[num_modes].p99 = 0.0;
+            print_summary(out, &summaries[num_modes]);
+            fflush(out);
+
+            bad += check_frames(summaries[num_modes].name, frames,
+                                horizon ? unculled : NULL, n);
+            if (!horizon)
+                memcpy(unculled, frames, n * sizeof(struct Frame));
+
+            for (k=0; frames_file && k<n; k++)
+                fprintf(frames_file, "%s,%d,%.3f,%d,%ld,%d,%d,%d,%d\n",
+                        summaries[num_modes].name, k, frames[k].cpu_ms,
+                        frames[k].stats.strips, frames[k].stats.vertices,
+                        frames[k].stats.chunks_in_range,
+                        frames[k].stats.chunks_in_frustum,
+                        frames[k].stats.chunks_over_horizon,
+                        frames[k].stats.chunks_drawn);
+            num_modes++;
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+    if (frames_file)
+        fclose(frames_file);
+    sx3_unload_terrain();
+    OSMesaDestroyContext(ctx);
+    free(buffer);
+    free(cameras);
+    free(frames);
+    free(unculled);
+
+    if (bad)
+    {
+        fprintf(stderr, "%d frames with chunk counts that don't add up\n", bad);
+        return 3;
+    }
+    if (baseline &&
+        check_baseline(baseline, summaries, num_modes, tolerance) > 0)
+        return 2;
+    return 0;
+}
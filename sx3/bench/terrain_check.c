@@ -0,0 +1,592 @@
+// File: terrain_check.c
+// Author: Marc Bryant
+//
+// Checks the terrain's shortcuts against doing things the slow way.
+// Every vertex of every chunk that sx3_cull_terrain_horizon drops must be
+// hidden from the eye by the ground, going by a ray cast to it.  After a
+// handful of craters, the normals, tiles and chunks brought up to date by
+// sx3_flush_terrain_deformations must match those worked out again for the
+// whole map, byte for byte.  Last, the map is written out to a .ter2 file
+// and walked across with a small terrain.pages, and the pages in use must
+// stay within it without losing the heights of the pages handed back, or
+// of the craters blown along the way.
+//
+// Usage: terrain_check [terrain]
+//
+//   terrain   a terrain file (.ter or .ter2), or a number to generate a
+//             map of that size from seed 1.  Defaults to
+//             SX3_DEFAULT_TERRAIN.
+//
+// Run it from the sx3 directory, so that the data files are found.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_mesh.h"
+#include "sx3_terrain_cull.h"
+#include "sx3_terrain_normals.h"
+#include "sx3_terrain_pages.h"
+#include "sx3_terrain_raycast.h"
+#include "sx3_terrain_tiles.h"
+#include "sx3_terrain_file.h"
+#include "sx3_files.h"
+#include "sx3_global.h"
+#include "sx3_graphics.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// The views the horizon culling is checked from: a grid of places over the
+// map, looking each of HORIZON_YAWS ways, EYE_HEIGHT meters up
+#define HORIZON_PLACES              4
+#define HORIZON_YAWS                4
+#define EYE_HEIGHT                  2.0F
+
+// How far short of a vertex (meters) the ground has to be hit for the
+// vertex to count as hidden
+#define HIDDEN_MARGIN               0.1F
+
+// The .ter2 file the paging is checked on, the terrain.pages (kilobytes)
+// it is walked across with, and how many craters are blown on the way
+#define PAGES_FILE                  "terrain_check.ter2"
+#define PAGES_BUDGET                (12*TERRAIN_PAGE_BYTES/1024)
+#define PAGES_CRATERS               4
+
+// The size of the square of heights kept around each crater
+#define CRATER_WINDOW               16
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// A copy of everything a crater changes, to compare against
+struct Terrain_Copy {
+    unsigned int               *normals;
+    unsigned char              *tiles;
+    struct Terrain_Chunk       *chunks;
+    struct Terrain_Vertex     **vertices;
+    struct Terrain_Morph      **morph;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+float                           g_fov = (float)M_PI/4;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// num_chunks
+//
+// Returns the number of chunks the map is split into.
+static int num_chunks(void)
+{
+    return g_terrain_num_chunks.x * g_terrain_num_chunks.y;
+}  // num_chunks
+
+
+// morph_bytes
+//
+// Returns the size of a chunk's morph array.
+static size_t morph_bytes(const struct Terrain_Chunk *chunk)
+{
+    return (chunk->cells.x+1) * (chunk->cells.y+1) * sizeof(struct Terrain_Morph);
+}  // morph_bytes
+
+
+// copy_rows
+//
+// Copies every row of one of the per vertex arrays into values, which
+// holds size bytes a vertex.
+static void copy_rows(enum Terrain_Page_Array array, void *values, int size)
+{
+    int y;
+
+    for (y=0; y<g_terrain_size.y; y++)
+        sx3_get_terrain_row(array, y, 0, g_terrain_size.x,
+                            (char*)values + y*g_terrain_size.x*size);
+}  // copy_rows
+
+
+// copy_terrain
+//
+// Copies the normals, tiles and chunks into c.  Every chunk must be in the
+// cache.  Returns 0 if it runs out of memory.
+static int copy_terrain(struct Terrain_Copy *c)
+{
+    struct Terrain_Chunk *chunk;
+    int i, n = g_terrain_size.x * g_terrain_size.y;
+
+    c->normals = malloc(n * sizeof(unsigned int));
+    c->tiles = malloc(n);
+    c->chunks = malloc(num_chunks() * sizeof(struct Terrain_Chunk));
+    c->vertices = calloc(num_chunks(), sizeof(struct Terrain_Vertex*));
+    c->morph = calloc(num_chunks(), sizeof(struct Terrain_Morph*));
+    if (!c->normals || !c->tiles || !c->chunks || !c->vertices || !c->morph)
+        return 0;
+
+    copy_rows(Terrain_Normals, c->normals, sizeof(unsigned int));
+    copy_rows(Terrain_Tiles, c->tiles, 1);
+    memcpy(c->chunks, g_terrain_chunks,
+           num_chunks() * sizeof(struct Terrain_Chunk));
+    for (i=0; i<num_chunks(); i++)
+    {
+        chunk = &g_terrain_chunks[i];
+        c->vertices[i] = malloc(chunk->num_vertices * sizeof(struct Terrain_Vertex));
+        c->morph[i] = malloc(morph_bytes(chunk));
+        if (!c->vertices[i] || !c->morph[i])
+            return 0;
+        memcpy(c->vertices[i], chunk->vertices,
+               chunk->num_vertices * sizeof(struct Terrain_Vertex));
+        memcpy(c->morph[i], chunk->morph, morph_bytes(chunk));
+    }
+    return 1;
+}  // copy_terrain
+
+
+// free_terrain_copy
+//
+// Frees a copy made by copy_terrain.
+static void free_terrain_copy(struct Terrain_Copy *c)
+{
+    int i;
+
+    for (i=0; c->vertices && c->morph && i<num_chunks(); i++)
+    {
+        free(c->vertices[i]);
+        free(c->morph[i]);
+    }
+    free(c->normals);
+    free(c->tiles);
+    free(c->chunks);
+    free(c->vertices);
+    free(c->morph);
+    memset(c, 0, sizeof(struct Terrain_Copy));
+}  // free_terrain_copy
+
+
+// compare_terrain
+//
+// Returns the number of chunks (plus one each for the normals and tiles)
+// that differ from the copy, or -1 if it runs out of memory.
+static int compare_terrain(const struct Terrain_Copy *c)
+{
+    const struct Terrain_Chunk *a, *b;
+    unsigned int *normals;
+    unsigned char *tiles;
+    int i, n = g_terrain_size.x * g_terrain_size.y, differences = 0;
+
+    normals = malloc(n * sizeof(unsigned int));
+    tiles = malloc(n);
+    if (!normals || !tiles)
+    {
+        free(normals);
+        free(tiles);
+        return -1;
+    }
+    copy_rows(Terrain_Normals, normals, sizeof(unsigned int));
+    copy_rows(Terrain_Tiles, tiles, 1);
+
+    if (memcmp(c->normals, normals, n * sizeof(unsigned int)))
+    {
+        printf("craters: the normals differ\n");
+        differences++;
+    }
+    if (memcmp(c->tiles, tiles, n))
+    {
+        printf("craters: the tiles differ\n");
+        differences++;
+    }
+    free(normals);
+    free(tiles);
+
+    for (i=0; i<num_chunks(); i++)
+    {
+        a = &c->chunks[i];
+        b = &g_terrain_chunks[i];
+        if (a->min_height != b->min_height || a->max_height != b->max_height ||
+            memcmp(a->error, b->error, sizeof(a->error)) ||
+            memcmp(&a->center, &b->center, sizeof(a->center)) ||
+            a->radius != b->radius ||
+            memcmp(c->vertices[i], b->vertices,
+                   b->num_vertices * sizeof(struct Terrain_Vertex)) ||
+            memcmp(c->morph[i], b->morph, morph_bytes(b)))
+        {
+            printf("craters: chunk (%d,%d) differs\n",
+                   b->origin.x / TERRAIN_CHUNK_SIZE,
+                   b->origin.y / TERRAIN_CHUNK_SIZE);
+            differences++;
+        }
+    }
+    return differences;
+}  // compare_terrain
+
+
+// is_vertex_hidden
+//
+// Returns whether map vertex (map_x, map_y), which may be in any copy of
+// the map, is hidden from the GL point eye by the ground.
+static int is_vertex_hidden(const float *eye, int map_x, int map_y)
+{
+    float dir[3], t, length;
+    int mx, my;
+
+    mx = (map_x % g_terrain_size.x + g_terrain_size.x) % g_terrain_size.x;
+    my = (map_y % g_terrain_size.y + g_terrain_size.y) % g_terrain_size.y;
+    dir[0] = (g_terrain_size.y - map_y) * METERS_PER_MAP_GRID - eye[0];
+    dir[1] = TERRAIN_HEIGHT(mx, my) - eye[1];
+    dir[2] = map_x * METERS_PER_MAP_GRID - eye[2];
+    length = sqrt(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+
+    return sx3_terrain_raycast(eye, dir, 1.0F, &t) &&
+           (1.0F - t) * length > HIDDEN_MARGIN;
+}  // is_vertex_hidden
+
+
+// check_horizon_view
+//
+// Culls the terrain as sx3_draw_terrain would for a viewer at map point
+// (map_x, map_y) looking yaw radians round from the map's x axis, and ray
+// casts to every vertex of the chunks that the horizon hides.  Adds the
+// number of chunks in the frustum and over the horizon to *in_frustum and
+// *shown, and returns the number of hidden chunks with a vertex in sight.
+static int check_horizon_view(
+    float map_x,
+    float map_y,
+    float yaw,
+    float view_radius,
+    int *in_frustum,
+    int *shown)
+{
+    static struct Terrain_Visible *before = NULL;
+    static int max_before = 0;
+    const struct Terrain_Visible *visible, *v;
+    struct Terrain_Visible *bigger;
+    struct Terrain_Frustum frustum;
+    struct Point eye, dir, up = {0.0F, 1.0F, 0.0F};
+    float eye_gl[3];
+    int i, j, k, n, num_shown, seen, mistakes = 0;
+
+    eye.x = (g_terrain_size.y - map_y) * METERS_PER_MAP_GRID;
+    eye.z = map_x * METERS_PER_MAP_GRID;
+    eye.y = sx3_find_terrain_height(eye.x, eye.z) + EYE_HEIGHT;
+    dir.x = -sin(yaw);
+    dir.y = 0.0F;
+    dir.z = cos(yaw);
+    eye_gl[0] = eye.x;
+    eye_gl[1] = eye.y;
+    eye_gl[2] = eye.z;
+
+    sx3_build_terrain_frustum(&frustum, eye, dir, up, g_fov, 4.0F/3.0F,
+                              SX3_Z_NEAR, SX3_Z_FAR);
+    n = sx3_find_visible_terrain_chunks(&frustum, map_x, map_y, view_radius,
+                                        &visible);
+
+    // The horizon culling reuses the list, so keep a copy of it
+    if (n > max_before)
+    {
+        if (!(bigger = realloc(before, n * sizeof(struct Terrain_Visible))))
+            return 1;
+        before = bigger;
+        max_before = n;
+    }
+    memcpy(before, visible, n * sizeof(struct Terrain_Visible));
+    num_shown = sx3_cull_terrain_horizon(map_x, map_y, eye.y);
+    *in_frustum += n;
+    *shown += num_shown;
+
+    for (i=0; i<n; i++)
+    {
+        v = &before[i];
+        for (k=0; k<num_shown; k++)
+            if (visible[k].chunk == v->chunk &&
+                visible[k].kx == v->kx && visible[k].ky == v->ky)
+                break;
+        if (k < num_shown)
+            continue;
+
+        seen = 0;
+        for (j=0; j<=v->chunk->cells.y && !seen; j++)
+            for (k=0; k<=v->chunk->cells.x && !seen; k++)
+                seen = !is_vertex_hidden(eye_gl,
+                    v->kx*g_terrain_size.x + v->chunk->origin.x + k,
+                    v->ky*g_terrain_size.y + v->chunk->origin.y + j);
+        if (seen)
+        {
+            printf("horizon: chunk (%d,%d) is in sight from (%g,%g) but was "
+                   "culled\n", v->chunk->origin.x / TERRAIN_CHUNK_SIZE,
+                   v->chunk->origin.y / TERRAIN_CHUNK_SIZE, map_x, map_y);
+            mistakes++;
+        }
+    }
+    return mistakes;
+}  // check_horizon_view
+
+
+// check_horizon
+//
+// Checks the horizon culling from a grid of places over the map, looking
+// several ways from each.  Returns the number of chunks culled that
+// shouldn't have been.
+static int check_horizon(float view_radius)
+{
+    int x, y, yaw, in_frustum = 0, shown = 0, mistakes = 0;
+
+    for (y=0; y<HORIZON_PLACES; y++)
+        for (x=0; x<HORIZON_PLACES; x++)
+            for (yaw=0; yaw<HORIZON_YAWS; yaw++)
+                mistakes += check_horizon_view(
+                    (x + 0.5F) * g_terrain_size.x / HORIZON_PLACES,
+                    (y + 0.3F) * g_terrain_size.y / HORIZON_PLACES,
+                    (yaw + 0.1F) * 2.0F * (float)M_PI / HORIZON_YAWS,
+                    view_radius, &in_frustum, &shown);
+
+    printf("horizon: %d views out to %g, %d of %d chunks in the frustum "
+           "culled, %d of them in sight\n",
+           HORIZON_PLACES*HORIZON_PLACES*HORIZON_YAWS, view_radius,
+           in_frustum - shown, in_frustum, mistakes);
+    return mistakes;
+}  // check_horizon
+
+
+// crater
+//
+// Blows a crater of radius r at map point (map_x, map_y), with its centre
+// depth meters below the ground.
+static void crater(float map_x, float map_y, float depth, float r)
+{
+    float x = (g_terrain_size.y - map_y) * METERS_PER_MAP_GRID;
+    float z = map_x * METERS_PER_MAP_GRID;
+
+    deform_terrain(x, sx3_find_terrain_height(x, z) - depth, z, r);
+}  // crater
+
+
+// check_craters
+//
+// Blows craters in the middle of the map, on top of each other, across
+// the corner and the edges where the map wraps, next to the edges, and
+// under the ground, and
+// compares what sx3_flush_terrain_deformations makes of them with working
+// the normals, tiles and every chunk out again from the heights.  Returns
+// the number of differences.
+static int check_craters(void)
+{
+    struct Terrain_Copy flushed;
+    float mid_x = g_terrain_size.x * 0.5F, mid_y = g_terrain_size.y * 0.5F;
+    int i, differences;
+
+    // Every chunk has to be in the cache to be compared
+    g_terrain_cache_size = 1 << 30;
+    for (i=0; i<num_chunks(); i++)
+        if (sx3_page_in_terrain_chunk(&g_terrain_chunks[i]) != SX3_ERROR_SUCCESS)
+            return 1;
+
+    crater(mid_x, mid_y, 0.0F, 20.0F);
+    crater(mid_x + 4.0F, mid_y + 2.0F, 2.0F, 15.0F);
+    crater(0.5F, 0.5F, 0.0F, 25.0F);
+    crater(g_terrain_size.x - 1.0F, mid_y, 0.0F, 12.0F);
+    crater(mid_x * 0.5F, 0.0F, 0.0F, 12.0F);
+    crater(mid_x * 1.5F, mid_y * 0.5F, 30.0F, 20.0F);
+
+    // Craters whose normals reach the first row or column, which the last
+    // chunks share
+    crater(1.0F + 24.0F / METERS_PER_MAP_GRID, mid_y * 1.5F, 0.0F, 25.0F);
+    crater(mid_x * 1.5F, 1.0F + 24.0F / METERS_PER_MAP_GRID, 0.0F, 25.0F);
+    if (sx3_flush_terrain_deformations() != SX3_ERROR_SUCCESS)
+        return 1;
+
+    memset(&flushed, 0, sizeof(flushed));
+    if (!copy_terrain(&flushed))
+    {
+        fprintf(stderr, "Out of memory\n");
+        free_terrain_copy(&flushed);
+        return 1;
+    }
+
+    // Start again from the heights.  A mapped map is rebuilt in place, so
+    // none of it may be handed back.
+    sx3_pin_terrain_pages(0, 0, g_terrain_size.x, g_terrain_size.y);
+    sx3_compute_terrain_normals(0, 0, g_terrain_size.x, g_terrain_size.y);
+    sx3_classify_terrain_tiles(0, 0, g_terrain_size.x, g_terrain_size.y);
+    for (i=0; i<num_chunks(); i++)
+        sx3_rebuild_terrain_chunk(&g_terrain_chunks[i]);
+
+    differences = compare_terrain(&flushed);
+    if (differences < 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free_terrain_copy(&flushed);
+        return 1;
+    }
+    printf("craters: %d of %d chunks, normals and tiles differ from a full "
+           "rebuild\n", differences, num_chunks());
+
+    free_terrain_copy(&flushed);
+    return differences;
+}  // check_craters
+
+
+// walk_pages
+//
+// Walks diagonally across the map from map point (x,y) (and round it, as
+// it wraps), prefetching as a projectile would every chunk's width.
+// Returns the most the pages in use took up on the way, in bytes.
+static long walk_pages(int x, int y)
+{
+    long bytes, most = 0;
+    int step, steps;
+
+    steps = 2 * (g_terrain_size.x > g_terrain_size.y ?
+                 g_terrain_size.x : g_terrain_size.y) / TERRAIN_CHUNK_SIZE;
+    for (step=0; step<steps; step++)
+    {
+        sx3_prefetch_terrain_chunks((float)(x + step*TERRAIN_CHUNK_SIZE),
+                                    (float)(y + step*TERRAIN_CHUNK_SIZE),
+                                    (float)TERRAIN_CHUNK_SIZE, 0);
+        bytes = sx3_terrain_page_bytes();
+        if (bytes > most)
+            most = bytes;
+    }
+    return most;
+}  // walk_pages
+
+
+// crater_window
+//
+// Copies the CRATER_WINDOW x CRATER_WINDOW heights around map point (x,y)
+// into heights.
+static void crater_window(int x, int y, short *heights)
+{
+    int i, j, mx, my;
+
+    for (j=0; j<CRATER_WINDOW; j++)
+        for (i=0; i<CRATER_WINDOW; i++)
+        {
+            mx = (x - CRATER_WINDOW/2 + i + g_terrain_size.x) % g_terrain_size.x;
+            my = (y - CRATER_WINDOW/2 + j + g_terrain_size.y) % g_terrain_size.y;
+            heights[i + j*CRATER_WINDOW] = TERRAIN_RAW_HEIGHT(mx, my);
+        }
+}  // crater_window
+
+
+// check_pages
+//
+// Writes the map out to PAGES_FILE and loads it back, then walks across it
+// with terrain.pages set to PAGES_BUDGET.  The pages in use must stay
+// within the budget, and the heights must read back the same after their
+// pages have been handed back.  Then craters are blown along the way, and
+// must still be there after the walk has gone round the map again.
+// Returns the number of mistakes.
+static int check_pages(void)
+{
+    short *before, *after, windows[PAGES_CRATERS][CRATER_WINDOW*CRATER_WINDOW];
+    short window[CRATER_WINDOW*CRATER_WINDOW];
+    int i, x, y, n, mistakes = 0;
+    long most;
+
+    n = g_terrain_size.x * g_terrain_size.y;
+    before = malloc(n * sizeof(short));
+    after = malloc(n * sizeof(short));
+    if (!before || !after)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(before);
+        free(after);
+        return 1;
+    }
+    copy_rows(Terrain_Heights, before, sizeof(short));
+
+    if (sx3_write_terrain_file(PAGES_FILE) != SX3_ERROR_SUCCESS ||
+        sx3_load_terrain((char*)PAGES_FILE) != SX3_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "Unable to write and load %s\n", PAGES_FILE);
+        remove(PAGES_FILE);
+        free(before);
+        free(after);
+        return 1;
+    }
+    g_terrain_page_budget = PAGES_BUDGET;
+
+    most = walk_pages(0, 0);
+    if (most > PAGES_BUDGET * 1024L)
+        mistakes++;
+    copy_rows(Terrain_Heights, after, sizeof(short));
+    if (memcmp(before, after, n * sizeof(short)))
+    {
+        printf("pages: the heights differ after being read in again\n");
+        mistakes++;
+    }
+    printf("pages: the pages in use took up at most %ldK of %dK, out of %ldK "
+           "for the whole map\n", most / 1024, PAGES_BUDGET,
+           (long)g_terrain_num_pages.x * g_terrain_num_pages.y *
+           TERRAIN_PAGE_BYTES / 1024);
+
+    for (i=0; i<PAGES_CRATERS; i++)
+    {
+        x = (i + 1) * g_terrain_size.x / (PAGES_CRATERS + 1);
+        y = (i + 1) * g_terrain_size.y / (PAGES_CRATERS + 1);
+        walk_pages(x, y);
+        crater((float)x, (float)y, 0.0F, 10.0F);
+        crater_window(x, y, windows[i]);
+    }
+    if (sx3_flush_terrain_deformations() != SX3_ERROR_SUCCESS)
+        mistakes++;
+    walk_pages(0, 0);
+
+    for (i=0; i<PAGES_CRATERS; i++)
+    {
+        x = (i + 1) * g_terrain_size.x / (PAGES_CRATERS + 1);
+        y = (i + 1) * g_terrain_size.y / (PAGES_CRATERS + 1);
+        crater_window(x, y, window);
+        if (memcmp(window, windows[i], sizeof(window)))
+        {
+            printf("pages: the crater at (%d,%d) was lost\n", x, y);
+            mistakes++;
+        }
+    }
+    printf("pages: %d craters blown, %ldK in use after walking on\n",
+           PAGES_CRATERS, sx3_terrain_page_bytes() / 1024);
+
+    remove(PAGES_FILE);
+    free(before);
+    free(after);
+    return mistakes;
+}  // check_pages
+
+
+int main(int argc, char **argv)
+{
+    const char *terrain = argc > 1 ? argv[1] : SX3_DEFAULT_TERRAIN;
+    SX3_ERROR_CODE retcode;
+    int mistakes;
+
+    sx3_terrain_register_vars();
+
+    if (atoi(terrain) > 0)
+        retcode = sx3_generate_terrain(atoi(terrain), atoi(terrain), 1);
+    else
+        retcode = sx3_load_terrain((char*)terrain);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "Unable to load terrain: %s\n", terrain);
+        return 1;
+    }
+
+    mistakes = check_horizon(256.0F);
+    mistakes += check_horizon(512.0F);
+    mistakes += check_craters();
+    mistakes += check_pages();
+
+    sx3_unload_terrain();
+    return mistakes != 0;
+}
@@ -0,0 +1,349 @@
+// File: weapon_check.c
+// Author: Marc Bryant
+//
+// Checks the tank grid against testing every tank, on a field of made up
+// tanks far more crowded than any game, and checks that the projectile and
+// explosion handles keep naming the right thing however the pools churn.
+//
+// Usage: weapon_check [tanks] [searches] [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <collide.h>
+#include "sx3_global.h"
+#include "sx3_terrain.h"
+#include "sx3_tanks.h"
+#include "sx3_tank_grid.h"
+#include "sx3_weapons.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+#define MAP_SIZE                    1024
+
+// Live weapons of either kind that there can be
+#define MAX_LIVE_HANDLES            (MAX_PROJECTILES > MAX_EXPLOSIONS ? \
+                                     MAX_PROJECTILES : MAX_EXPLOSIONS)
+
+// Handles of destroyed weapons that are kept to check that they stay dead
+#define MAX_DEAD_HANDLES            4096
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// The handles of one kind of weapon that the check has made, and the tag
+// that it put in each live one's elapsed_time
+struct Weapon_Handles {
+    Weapon_Handle               live[MAX_LIVE_HANDLES];
+    float                       tag[MAX_LIVE_HANDLES];
+    int                         num_live;
+    Weapon_Handle               dead[MAX_DEAD_HANDLES];
+    int                         num_dead;
+};
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// random_range
+//
+// Returns a random number between low and high.
+static float random_range(float low, float high)
+{
+    return low + (high - low) * rand() / RAND_MAX;
+}  // random_range
+
+
+// make_tanks
+//
+// Fills g_tanks with count tanks of random sizes scattered over the map.
+static int make_tanks(int count)
+{
+    struct Tank *t;
+    int i;
+
+    g_tanks = calloc(count, sizeof(struct Tank));
+    if (!g_tanks)
+        return 0;
+    g_num_tanks = count;
+
+    g_terrain_size.x = MAP_SIZE;
+    g_terrain_size.y = MAP_SIZE;
+    for (i=0; i<count; i++)
+    {
+        t = &g_tanks[i];
+        t->o.props.position[0] = random_range(0.0F, MAP_SIZE * METERS_PER_MAP_GRID);
+        t->o.props.position[1] = random_range(0.0F, 100.0F);
+        t->o.props.position[2] = random_range(0.0F, MAP_SIZE * METERS_PER_MAP_GRID);
+        t->o.props.radius = random_range(5.0F, 30.0F);
+    }
+    return 1;
+}  // make_tanks
+
+
+// check_tank_grid
+//
+// Sweeps spheres of random sizes over random short paths, and counts the
+// tanks that they hit but that sx3_find_nearby_tanks leaves out (or gives
+// more than once).  Returns the number of such mistakes.
+static int check_tank_grid(int searches)
+{
+    const int *tanks;
+    char *found;
+    float p0[3], p1[3], radius;
+    int i, j, k, count, checked = 0, everything = 0, mistakes = 0;
+
+    found = malloc(g_num_tanks);
+    if (!found || sx3_build_tank_grid() != SX3_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(found);
+        return 1;
+    }
+
+    for (i=0; i<searches; i++)
+    {
+        for (k=0; k<3; k++)
+        {
+            p0[k] = random_range(0.0F, MAP_SIZE * METERS_PER_MAP_GRID);
+            p1[k] = p0[k] + random_range(-60.0F, 60.0F);
+        }
+        radius = random_range(0.0F, 40.0F);
+
+        count = sx3_find_nearby_tanks(p0, p1, radius, &tanks);
+        if (!tanks)
+            everything++;
+        checked += count;
+
+        memset(found, 0, g_num_tanks);
+        for (j=0; j<count; j++)
+        {
+            k = tanks ? tanks[j] : j;
+            if (found[k])
+                mistakes++;
+            found[k] = 1;
+        }
+
+        for (j=0; j<g_num_tanks; j++)
+            if (!found[j] &&
+                sweep_spheres(p0, p1, radius, radius,
+                              g_tanks[j].o.props.position,
+                              g_tanks[j].o.props.radius) >= 0.0F)
+                mistakes++;
+    }
+
+    printf("tank grid: %d searches, %.2f of %d tanks checked on average, "
+           "%d gave every tank\n", searches, (double)checked / searches,
+           g_num_tanks, everything);
+    printf("tank grid: %d hits missed or tanks given twice\n", mistakes);
+
+    sx3_free_tank_grid();
+    free(found);
+    return mistakes;
+}  // check_tank_grid
+
+
+// new_weapon
+//
+// Makes a projectile (if explosion is 0) or an explosion out of p.
+static Weapon_Handle new_weapon(int explosion, struct Projectile *p)
+{
+    Vector up = {0.0F, 1.0F, 0.0F, 0.0F};
+
+    if (explosion)
+        return new_explosion(p);
+    return new_projectile(up, 1.0F, p->o.props.position, Missile_I);
+}  // new_weapon
+
+
+// delete_weapon
+//
+// Deletes a projectile or an explosion.
+static void delete_weapon(int explosion, Weapon_Handle h)
+{
+    if (explosion)
+        delete_explosion(h);
+    else
+        delete_projectile(h);
+}  // delete_weapon
+
+
+// find_weapon_tag
+//
+// Returns the elapsed_time of the projectile or explosion that h names, or
+// NULL if there isn't one.  *handle is set to the handle it thinks it has.
+static float *find_weapon_tag(int explosion, Weapon_Handle h,
+                              Weapon_Handle *handle)
+{
+    struct Projectile *p;
+    struct Explosion *e;
+
+    if (explosion)
+    {
+        if (!(e = sx3_get_explosion(h)))
+            return NULL;
+        *handle = e->handle;
+        return &e->elapsed_time;
+    }
+    if (!(p = sx3_get_projectile(h)))
+        return NULL;
+    *handle = p->handle;
+    return &p->elapsed_time;
+}  // find_weapon_tag
+
+
+// churn_weapons
+//
+// Makes and deletes a random number of projectiles or explosions, as a
+// tick would.  A few more are made than deleted on average, so that the
+// pools fill up after a while.  Returns the number of handles that named the wrong thing.
+static int churn_weapons(int explosion, struct Weapon_Handles *w,
+                         struct Projectile *source, float *next_tag)
+{
+    Weapon_Handle h, handle;
+    float *tag;
+    int i, k, made, mistakes = 0;
+    int max = explosion ? MAX_EXPLOSIONS : MAX_PROJECTILES;
+    int *num = explosion ? &g_num_explosions : &g_num_projectiles;
+
+    made = rand() % 21;
+    for (k=0; k<made; k++)
+    {
+        h = new_weapon(explosion, source);
+        if (h == NO_WEAPON_HANDLE)
+        {
+            // Only a full pool may turn one down
+            if (*num != max)
+                mistakes++;
+            continue;
+        }
+        tag = find_weapon_tag(explosion, h, &handle);
+        if (!tag || handle != h)
+        {
+            mistakes++;
+            continue;
+        }
+        *tag = w->tag[w->num_live] = (*next_tag)++;
+        w->live[w->num_live++] = h;
+    }
+
+    // Deleting twice does nothing more, and deleted weapons stay until the
+    // end of the tick
+    for (k=rand()%20; k>0 && w->num_live>0; k--)
+    {
+        i = rand() % w->num_live;
+        delete_weapon(explosion, w->live[i]);
+        delete_weapon(explosion, w->live[i]);
+        if (!find_weapon_tag(explosion, w->live[i], &handle))
+            mistakes++;
+
+        w->dead[w->num_dead++ % MAX_DEAD_HANDLES] = w->live[i];
+        w->num_live--;
+        w->live[i] = w->live[w->num_live];
+        w->tag[i] = w->tag[w->num_live];
+    }
+    return mistakes;
+}  // churn_weapons
+
+
+// check_handles
+//
+// Counts the live handles that don't name the weapon they were given to,
+// and the dead ones that name anything at all.
+static int check_handles(int explosion, const struct Weapon_Handles *w)
+{
+    Weapon_Handle handle;
+    float *tag;
+    int i, mistakes = 0;
+    int num = explosion ? g_num_explosions : g_num_projectiles;
+    int num_dead = (w->num_dead < MAX_DEAD_HANDLES) ?
+                   w->num_dead : MAX_DEAD_HANDLES;
+
+    if (num != w->num_live)
+        mistakes++;
+    for (i=0; i<w->num_live; i++)
+    {
+        tag = find_weapon_tag(explosion, w->live[i], &handle);
+        if (!tag || handle != w->live[i] || *tag != w->tag[i])
+            mistakes++;
+    }
+    for (i=0; i<num_dead; i++)
+        if (find_weapon_tag(explosion, w->dead[i], &handle))
+            mistakes++;
+    return mistakes;
+}  // check_handles
+
+
+// check_weapon_pools
+//
+// Makes and deletes projectiles and explosions at random for a number of
+// ticks, and checks after each one that every handle still names the
+// weapon it was given to, and that handles of deleted weapons name
+// nothing, even once their slots have been used again.  Returns the number
+// of mistakes.
+static int check_weapon_pools(int rounds)
+{
+    static struct Weapon_Handles projectiles, explosions;
+    struct Projectile source;
+    float next_tag = 1.0F;
+    int i, mistakes = 0;
+
+    if (sx3_init_weapons() != SX3_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    memset(&source, 0, sizeof(source));
+    source.type = Missile_I;
+    for (i=0; i<rounds; i++)
+    {
+        mistakes += churn_weapons(0, &projectiles, &source, &next_tag);
+        mistakes += churn_weapons(1, &explosions, &source, &next_tag);
+        sx3_destroy_deleted_weapons();
+        mistakes += check_handles(0, &projectiles);
+        mistakes += check_handles(1, &explosions);
+    }
+
+    printf("weapon pools: %d ticks, %d projectiles and %d explosions left, "
+           "%d destroyed\n", rounds, projectiles.num_live,
+           explosions.num_live, projectiles.num_dead + explosions.num_dead);
+    printf("weapon pools: %d handles named the wrong thing\n", mistakes);
+
+    sx3_close_weapons();
+    return mistakes;
+}  // check_weapon_pools
+
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    int searches = argc > 2 ? atoi(argv[2]) : 20000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5000;
+    int mistakes;
+
+    if (count < 1 || searches < 1 || rounds < 1)
+    {
+        fprintf(stderr, "Usage: %s [tanks] [searches] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    srand(1);
+    if (!make_tanks(count))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    mistakes = check_tank_grid(searches);
+    mistakes += check_weapon_pools(rounds);
+
+    free(g_tanks);
+    return mistakes != 0;
+}
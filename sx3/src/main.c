@@ -20,6 +20,7 @@
 #include <ini.h>
 #include <sx3_console.h>
 #include "sx3_terrain.h"
+#include "sx3_terrain_file.h"
 #include "sx3_misc.h"
 #include "sx3_global.h"
 #include <sx3_registry.h>
@@ -153,6 +154,13 @@ int main(int argc, char *argv[])
     int i;
     int fullscreen = 0;
 
+    // Convert a terrain file to a .ter2 file and quit.  No window is
+    // needed for this, so it is done before SDL is started.
+    if(argc == 4 && !strcmp("-convert", argv[1]))
+    {
+        return sx3_convert_terrain_file(argv[2], argv[3]);
+    }
+
     // Initialize SDL
     if(SDL_Init(SDL_INIT_VIDEO) < 0)
     {
@@ -204,6 +212,7 @@ int main(int argc, char *argv[])
         {
             fprintf(stderr,"Unrecognized argument: %s\n",argv[i]);
             fprintf(stderr,"SYNTAX:  %s [-huge] [--var=value] [--var=value] ...\n", argv[0]);
+            fprintf(stderr,"         %s -convert in.ter out.ter2\n", argv[0]);
             exit(1);
         }
     }
@@ -27,6 +27,20 @@ extern "C" {
 #define SX3_MINOR_VERSION 1
 #define SX3_BUILD_VERSION 23
 
+// Atomic exchange and compare-and-swap of an int shared between threads.
+// Both are full memory barriers.  (Win32 needs <windows.h>.)
+#if defined(WIN32)
+#define SX3_ATOMIC_EXCHANGE(p,v) \
+    ((int)InterlockedExchange((volatile LONG*)(p), (LONG)(v)))
+#define SX3_ATOMIC_CAS(p,old,v) \
+    (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(v), (LONG)(old)) == (LONG)(old))
+#else
+#define SX3_ATOMIC_EXCHANGE(p,v) \
+    (__sync_synchronize(), __sync_lock_test_and_set((p), (v)))
+#define SX3_ATOMIC_CAS(p,old,v) \
+    __sync_bool_compare_and_swap((p), (old), (v))
+#endif
+
 
 // ===========================================================================
 // Global structures
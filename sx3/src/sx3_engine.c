@@ -10,9 +10,44 @@
 #include "sx3_global.h"
 #include "sx3_weapons.h"
 #include "sx3_tanks.h"
+#include "sx3_terrain.h"
+#include "sx3_tank_grid.h"
 #include "sx3_audio.h"
 #include "sx3_files.h"
 #include "sx3_math.h"
+#include <batch.h>
+#include <collide.h>
+
+// FIX ME!! Hits should not do constant damage.
+#define PROJECTILE_DAMAGE 40.0
+#define EXPLOSION_DAMAGE 20.0
+
+// A tank being hit by a projectile or an explosion, time seconds into a
+// tick.  The hits found during a tick are logged, and the damage is done
+// at the end of the tick in the order they happened (order breaks ties).
+struct Damage_Event {
+    float time;
+    float damage;
+    int tank;
+    int source;                 // index of the projectile or explosion
+    int explosion;              // T/F
+    int order;
+};
+
+// The missiles in flight are stepped together as one batch.  batch_slot
+// holds the place of each projectile in the batch (or -1 if it isn't in
+// it), and batch_projectile the projectile in each place.
+static struct Projectile_Batch batch;
+static int *batch_slot = NULL;
+static int *batch_projectile = NULL;
+static int *batch_crossed = NULL;
+static int batch_size = 0;
+
+// The damage log of the tick being run.  It is emptied every tick, so it
+// only grows to the most hits there have been in one tick.
+static struct Damage_Event *damage_log = NULL;
+static int num_events = 0;
+static int max_events = 0;
 
 // update_projectile updates a single projectile object
 float update_projectile(struct Projectile *p, float dt)
@@ -23,7 +58,7 @@ float update_projectile(struct Projectile *p, float dt)
         case Missile_II:
         case Missile_III:
         case Missile_IV:
-            return next_object_state(&p->o, dt);
+            return next_object_state(&g_physics_world, &p->o, dt);
         default:
             // No other projectile types defined yet 
             assert(0);
@@ -46,7 +81,7 @@ float update_explosion(struct Explosion *e, float dt) {
             e->props.radius -= (e->props.radius - explosion_radii[e->type]);
         } else if(e->props.radius <= 0.0) {
             // The explosion has completed -- now delete it
-            delete_explosion(e);
+            delete_explosion(e->handle);
         }
         break;
     default:
@@ -57,111 +92,306 @@ float update_explosion(struct Explosion *e, float dt) {
     return dt;
 }
 
+// explosion_peak finds the largest radius explosion e reaches in the next
+// dt seconds, the same way update_explosion grows it, and stores how long
+// it takes to get there in when.
+static float explosion_peak(const struct Explosion *e, float dt, float *when)
+{
+    float radius = e->props.radius;
+    float max_radius = explosion_radii[e->type];
+
+    if(e->props.growth_direction <= 0)
+    {
+        // Shrinking explosions are at their largest now
+        *when = 0.0;
+        return radius;
+    }
+    if(radius + dt > max_radius)
+    {
+        *when = max_radius - radius;
+        return max_radius;
+    }
+    *when = dt;
+    return radius + dt;
+}
+
+// log_damage records that tank was hit time seconds into the tick.  If
+// there isn't enough memory to keep it, the hit is lost.
+static void log_damage(float time, float damage, int tank, int source,
+                       int explosion)
+{
+    struct Damage_Event *d;
+
+    if(num_events == max_events)
+    {
+        d = realloc(damage_log, (max_events + 16) * sizeof(struct Damage_Event));
+        if(!d) return;
+        damage_log = d;
+        max_events += 16;
+    }
+    d = &damage_log[num_events];
+    d->time = time;
+    d->damage = damage;
+    d->tank = tank;
+    d->source = source;
+    d->explosion = explosion;
+    d->order = num_events++;
+}
+
+// sweep_projectile finds the tanks that projectile j passes through on the
+// way from last_position to where it is now, which took it time t, and
+// logs when it first touches each one it hasn't hit before.  It doesn't
+// matter how far it went, so fast shells can't skip over a tank between
+// ticks.
+static void sweep_projectile(int j, float t)
+{
+    struct Projectile *p = &g_projectiles[j];
+    struct Tank *tank;
+    const int *nearby;
+    float s;
+    int i, k, n;
+
+    n = sx3_find_nearby_tanks(p->last_position, p->o.props.position,
+                              p->o.props.radius, &nearby);
+    for(k = 0; k < n; k++)
+    {
+        i = nearby ? nearby[k] : k;
+        if(TANK_SET_HAS(p->hit, i)) continue;
+
+        tank = &g_tanks[i];
+        s = sweep_spheres(p->last_position, p->o.props.position,
+                          p->o.props.radius, p->o.props.radius,
+                          tank->o.props.position, tank->o.props.radius);
+        if(s >= 0.0)
+        {
+            TANK_SET_ADD(p->hit, i);
+            log_damage(s * t, PROJECTILE_DAMAGE, i, j, 0);
+        }
+    }
+}
+
+// sweep_explosion finds the tanks that explosion j (e) reaches while it
+// grows from radius r0 at time t0 into the tick to radius r1 at time t1,
+// and logs when it first touches each one it hasn't hit before.
+static void sweep_explosion(struct Explosion *e, int j, float r0, float r1,
+                            float t0, float t1)
+{
+    struct Tank *tank;
+    const int *nearby;
+    float s;
+    int i, k, n;
+
+    n = sx3_find_nearby_tanks(e->props.position, e->props.position, r1,
+                              &nearby);
+    for(k = 0; k < n; k++)
+    {
+        i = nearby ? nearby[k] : k;
+        if(TANK_SET_HAS(e->hit, i)) continue;
+
+        tank = &g_tanks[i];
+        s = sweep_spheres(e->props.position, e->props.position, r0, r1,
+                          tank->o.props.position, tank->o.props.radius);
+        if(s >= 0.0)
+        {
+            TANK_SET_ADD(e->hit, i);
+            log_damage(t0 + s * (t1 - t0), EXPLOSION_DAMAGE, i, j, 1);
+        }
+    }
+}
+
+// compare_events puts damage events in the order they happened.
+static int compare_events(const void *a, const void *b)
+{
+    const struct Damage_Event *d1 = a, *d2 = b;
+
+    if(d1->time < d2->time) return -1;
+    if(d1->time > d2->time) return 1;
+    return d1->order - d2->order;
+}
+
+// apply_damage damages the tanks hit during the tick, in the order they
+// were hit, and empties the damage log.
+static void apply_damage(void)
+{
+    struct Damage_Event *d;
+    struct Tank *tank;
+    int i;
+
+    qsort(damage_log, num_events, sizeof(struct Damage_Event), compare_events);
+    for(i = 0; i < num_events; i++)
+    {
+        d = &damage_log[i];
+        tank = &g_tanks[d->tank];
+
+        // A tank has been hit!
+        sx3_play_sound(SX3_AUDIO_HIT);
+        printf("Tank %d hit by %s %d\n", d->tank,
+            d->explosion ? "explosion" : "projectile", d->source);
+        tank->s.temp_damage += d->damage;
+        if(tank->s.energy > 0.0 && tank->s.energy - d->damage <= 0.0)
+        {
+            // FIX ME!! We should now remove the tank from the scene
+            sx3_play_sound(SX3_AUDIO_BYEBYE);
+            printf("Tank %d has been eliminated.\n", d->tank);
+        }
+        tank->s.energy -= d->damage;
+    }
+    num_events = 0;
+}
+
+// step_missiles moves all the missiles in flight for time dt as one batch.
+// The missiles that would hit the ground during the step are left where
+// they were, for update_projectile to find exactly where they land; the
+// rest are marked in batch_slot as already moved.
+// Return: 1 if the batch was stepped, or 0 if there was no memory for it.
+static int step_missiles(float dt)
+{
+    struct Projectile *p;
+    int i, j, num_crossed;
+    int *slot, *projectile, *crossed;
+
+    // Make room for every projectile
+    if(batch_size < g_num_projectiles)
+    {
+        slot = realloc(batch_slot, g_num_projectiles * sizeof(int));
+        if(slot) batch_slot = slot;
+        projectile = realloc(batch_projectile, g_num_projectiles * sizeof(int));
+        if(projectile) batch_projectile = projectile;
+        crossed = realloc(batch_crossed, g_num_projectiles * sizeof(int));
+        if(crossed) batch_crossed = crossed;
+        if(!slot || !projectile || !crossed) return 0;
+        batch_size = g_num_projectiles;
+    }
+    if(batch.capacity == 0 && !init_projectile_batch(&batch, g_num_projectiles))
+        return 0;
+
+    batch.count = 0;
+    for(j = 0; j < g_num_projectiles; j++)
+    {
+        p = &g_projectiles[j];
+        batch_slot[j] = -1;
+        if(p->o.state != STATE_PROJECTILE) continue;
+        if(p->type < Missile_I || p->type > Missile_IV) continue;
+        if(p->o.props.angular_velocity[0] != 0.0 ||
+           p->o.props.angular_velocity[1] != 0.0 ||
+           p->o.props.angular_velocity[2] != 0.0) continue;
+        i = add_batch_object(&batch, &p->o);
+        if(i < 0) return 0;
+        batch_slot[j] = i;
+        batch_projectile[i] = j;
+    }
+    if(batch.count == 0) return 1;
+
+    num_crossed = step_projectile_batch(&g_physics_world, &batch, dt,
+                                        batch_crossed);
+    for(i = 0; i < num_crossed; i++)
+        batch_slot[batch_projectile[batch_crossed[i]]] = -1;
+
+    for(j = 0; j < g_num_projectiles; j++)
+    {
+        if(batch_slot[j] >= 0)
+            get_batch_object(&batch, batch_slot[j], &g_projectiles[j].o);
+    }
+    return 1;
+}
+
 // modify_scene modifies the global variables g_projectiles and g_explosions
 // during the course of an attack sequence.  It takes a parameter dt which
-// represents the amount of time between frames.
+// represents the amount of time between ticks.  Nothing is removed from
+// them until the end, so their indices hold for the whole tick.
 // Return: the number of items left to animate.
 int modify_scene(float dt)
 {
-    int i, j, num_impacted;
-    float t;
+    int j, batched;
+    float t, peak, when;
     struct Projectile *p;
     struct Explosion *e;
-    struct Tank *tank;
-    Vector v;
-    float d;
+
+    // Remember where everything was, to draw the frames between this tick
+    // and the next
+    for(j = 0; j < g_num_projectiles; j++)
+        vv_cpy(g_projectiles[j].last_position, g_projectiles[j].o.props.position);
+    for(j = 0; j < g_num_explosions; j++)
+        g_explosions[j].last_radius = g_explosions[j].props.radius;
+
+    // Only the tanks near a projectile or an explosion are checked for hits.
+    // If there isn't enough memory for the grid, they all are.
+    sx3_build_tank_grid();
 
     // Go through all the explosions and update them according to the
-    // amount of time passed.
+    // amount of time passed, looking for the tanks they reach on the way.
     for(j = 0; j < g_num_explosions; j++)
     {
         e = &g_explosions[j];
-        t = update_explosion(e, dt);
+        peak = explosion_peak(e, dt, &when);
+        sweep_explosion(e, j, e->props.radius, peak, 0.0, when);
+        update_explosion(e, dt);
     }
 
+    // The craters may have lowered the ground since the last tick
+    g_physics_world.terrain_min = g_terrain_min_height;
+    g_physics_world.terrain_max = g_terrain_max_height;
+
+    // Move the missiles that aren't about to land all at once
+    batched = step_missiles(dt);
+
     // Go through all the projectiles and handle the ones that have not yet
     // been impacted.
-    for(j = 0, num_impacted = 0; j < g_num_projectiles; j++)
+    for(j = 0; j < g_num_projectiles; j++)
     {
         p = &g_projectiles[j];
-        if(p->o.state != STATE_IMPACTED)
-        {
-            t = update_projectile(p, dt);
-            if(p->o.state == STATE_IMPACTED)
-            {
-                printf("Projectile %d has impacted.\n", j);
-                // If the projectile has impacted, an explosion needs to be
-                // created which is appropriate to the projectile which has
-                // impacted, and which takes on properties of the former
-                // projectile.
-                e = new_explosion(p);
-
-                // Now, using the remaining time that did not get used on the
-                // projectile, update the new explosion.
-                t = update_explosion(e, dt - t);
-
-                // And play a sound to match
-                sx3_play_sound(SX3_AUDIO_EXPLOSION);
-            }
-        }
-        if(p->o.state == STATE_IMPACTED) num_impacted++;
-    }
+        if(p->o.state == STATE_IMPACTED) continue;
 
-    // FIX ME!! These two checks don't work properly if we have a low
-    // framerate.
-    for(j = 0; j < g_num_explosions; j++)
-    {
-        e = &g_explosions[j];
-        for(i = 0; i < g_num_tanks; i++)
+        if(batched && batch_slot[j] >= 0)
+            t = dt;
+        else
+            t = update_projectile(p, dt);
+        sweep_projectile(j, t);
+        if(p->o.state == STATE_IMPACTED)
         {
-            tank = &g_tanks[i];
-            // Don't check this tank if it's already been hit
-            // FIX ME!! This should be on a per-projectile/explosion basis
-            if(tank->s.temp_damage != 0.0) continue;
-
-            // Find the distance between the tank and the explosion, and test
-            vv_cpy(v, tank->o.props.position);
-            vv_sub(v, e->props.position);
-            d = v_mag(v);
-
-            if(d < tank->o.props.radius + e->props.radius)
-            {
-                // A tank has been hit!
-                sx3_play_sound(SX3_AUDIO_HIT);
-                printf("Tank %d hit by explosion %d\n", i, j);
-                // FIX ME!! This should not be constant damage.
-                tank->s.temp_damage = 20.0;
-            }
-        }
-    }
+            printf("Projectile %d has impacted.\n", j);
+            // If the projectile has impacted, an explosion needs to be
+            // created which is appropriate to the projectile which has
+            // impacted, and which takes on properties of the former
+            // projectile.  If there are too many explosions already, it
+            // fizzles.
+            e = sx3_get_explosion(new_explosion(p));
+            delete_projectile(p->handle);
+            if(!e) continue;
 
-    for(j = 0; j < g_num_projectiles; j++)
-    {
-        p = &g_projectiles[j];
-        if(p->o.state == STATE_IMPACTED) continue;
-        for(i = 0; i < g_num_tanks; i++)
+            // Blow a crater in the ground where it landed
+            deform_terrain(e->props.position[0], e->props.position[1],
+                           e->props.position[2], explosion_radii[e->type]);
+
+            // Now, using the remaining time that did not get used on the
+            // projectile, update the new explosion.
+            peak = explosion_peak(e, dt - t, &when);
+            sweep_explosion(e, g_num_explosions - 1, e->props.radius,
+                            peak, t, t + when);
+            update_explosion(e, dt - t);
+
+            // And play a sound to match
+            sx3_play_sound(SX3_AUDIO_EXPLOSION);
+        }
+        else
         {
-            tank = &g_tanks[i];
-            // Don't check this tank if it's already been hit
-            // FIX ME!! This should be on a per-projectile/explosion basis
-            if(tank->s.temp_damage != 0.0) continue;
-
-            // Find the distance between the tank and the projectiles, and test
-            vv_cpy(v, tank->o.props.position);
-            vv_sub(v, p->o.props.position);
-            d = v_mag(v);
-
-            if(d < tank->o.props.radius + p->o.props.radius)
-            {
-                // A tank has been hit!
-                sx3_play_sound(SX3_AUDIO_HIT);
-                printf("Tank %d hit by projectile %d\n", i, j);
-                // FIX ME!! This should not be constant damage.
-                tank->s.temp_damage = 40.0;
-            }
+            // Get the ground under the rest of its flight read in
+            // before it gets there
+            sx3_prefetch_terrain(p->o.props.position[0],
+                                 p->o.props.position[2],
+                                 p->o.props.velocity[0],
+                                 p->o.props.velocity[2]);
         }
     }
-    return g_num_explosions + g_num_projectiles - num_impacted;
+
+    // Damage the tanks in the order they were hit
+    apply_damage();
+
+    // Nothing points into the lists past here, so the projectiles that
+    // landed and the explosions that finished can go
+    sx3_destroy_deleted_weapons();
+
+    return g_num_explosions + g_num_projectiles;
 }
 
 // init_scene initializes the global variable g_projectiles immediately after
@@ -9,5 +9,6 @@
 #define SX3_ERROR_BAD_PARAMS 2
 #define SX3_ERROR_CANNOT_OPEN_FILE 3
 #define SX3_ERROR_BAD_FILE 4
+#define SX3_ERROR_CANNOT_START_THREAD 5
 
 #endif
@@ -8,6 +8,7 @@
 
 // FIX ME!! These should be static const variables.
 #define SX3_DEFAULT_TERRAIN			"data/terrain/default.ter"
+#define SX3_DEFAULT_GRADIENT		"data/terrain/default.grd"
 #define SX3_TITLE_SCREEN_BITMAP		"data/title/sx3title.pcx"
 #define SX3_DEFAULT_TANK			"data/tanks/dalek.tnk"
 #define SX3_AUDIO_SHOT				"data/audio/8cf15h.wav"
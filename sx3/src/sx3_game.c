@@ -14,6 +14,7 @@
 #include <GL/glu.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <matrix.h>
 #include <physics.h>
 #include <pglobal.h>
@@ -23,6 +24,8 @@
 #include "sx3_game.h"
 #include "sx3_global.h"
 #include "sx3_terrain.h"
+#include "sx3_terrain_raycast.h"
+#include "sx3_terrain_gen.h"
 #include "sx3_tanks.h"
 #include "sx3_files.h"
 #include "sx3_state.h"
@@ -30,6 +33,7 @@
 #include "sx3_engine.h"
 #include "sx3_audio.h"
 #include "sx3_gui.h"
+#include "sx3_sim.h"
 #include <sx3_utils.h>
 
 
@@ -95,6 +99,10 @@ int                 g_view_gravity              = 1;
 int                 g_fog_type                  = 4;
 int                 g_display_frame_rate        = 1;
 
+// Simulation variables -----------------------------------------------------
+int                 g_sim_tick_rate             = 60;
+int                 g_sim_max_ticks             = 5;
+
 // ===========================================================================
 // Functions definitions
 // ===========================================================================
@@ -158,6 +166,18 @@ void sx3_game_register_vars (void)
                         &g_display_frame_rate,
                         0,
                         NULL);
+    sx3_add_global_var ("sim.tick_rate",
+                        SX3_GLOBAL_INT,
+                        0,
+                        &g_sim_tick_rate,
+                        0,
+                        NULL);
+    sx3_add_global_var ("sim.max_ticks",
+                        SX3_GLOBAL_INT,
+                        0,
+                        &g_sim_max_ticks,
+                        0,
+                        NULL);
     return;
 }  // game_register_vars
 
@@ -171,12 +191,19 @@ void init_game()
     sx3_init_graphics();
     sx3_console_init(SX3_DEFAULT_FONT_FILE);
 
-    // Initialize terrain
-    if (sx3_load_terrain(SX3_DEFAULT_TERRAIN,
-                    g_terrain_vertex_height,
-                    &g_terrain_size,
-                    g_terrain_triag_normal,
-                    g_terrain_vertex_normal))
+    // Initialize terrain.  Every game gets a new map unless a seed was
+    // picked, or generating maps is turned off.
+    if (g_terrain_gen_size > 0)
+    {
+        if (sx3_generate_terrain(g_terrain_gen_size, g_terrain_gen_size,
+                g_terrain_gen_seed ? (unsigned int)g_terrain_gen_seed :
+                                     (unsigned int)time(NULL)))
+        {
+            fprintf(stderr, "Error generating terrain!\n");
+            exit (1);
+        }
+    }
+    else if (sx3_load_terrain(SX3_DEFAULT_TERRAIN))
     {
         fprintf(stderr, "Error loading terrain file %s!\n",
             SX3_DEFAULT_TERRAIN);
@@ -186,16 +213,26 @@ void init_game()
     // Initialize the physics engine
     // FIX ME!! These are not the right values, since we aren't doing
     // meter to GL conversions properly
-    world_data.gravity = -0.98;
-    world_data.air_density = 0.0;
-    world_data.air_viscosity = 0.0;
-    world_data.wind_x = 0.0;
-    world_data.wind_z = 0.0;
-    set_terrain_height_func(sx3_find_terrain_height);
+    init_physics_world(&g_physics_world);
+    g_physics_world.data.gravity = -0.98;
+    g_physics_world.data.air_density = 0.0;
+    g_physics_world.data.air_viscosity = 0.0;
+    g_physics_world.data.wind_x = 0.0;
+    g_physics_world.data.wind_z = 0.0;
+    g_physics_world.terrain_height = sx3_find_terrain_height;
+    g_physics_world.terrain_heights = sx3_find_terrain_heights;
+    g_physics_world.terrain_raycast = sx3_terrain_raycast;
 
     // Initialize the tanks
     // This MUST be done AFTER the terrain and physics initialization!
     sx3_init_tanks();
+
+    // Make room for the projectiles and explosions
+    if (sx3_init_weapons())
+    {
+        fprintf(stderr, "Error allocating the projectiles and explosions!\n");
+        exit (1);
+    }
 }
 
 // close_game is called when the game is over
@@ -206,6 +243,7 @@ void close_game()
     sx3_close_graphics();
     sx3_unload_terrain();
     sx3_cleanup_tanks();
+    sx3_close_weapons();
 }
 
 // init_gl does all the OpenGL intialization that needs to 
@@ -239,8 +277,10 @@ static void reset_view()
     // Set view point 3 meters off the ground, in the
     eye_point[0] = g_terrain_size.y/2 * METERS_PER_MAP_GRID;
     eye_point[2] = g_terrain_size.x/2 * METERS_PER_MAP_GRID;
+    sx3_lock_terrain();
     eye_point[1] = sx3_find_terrain_height(eye_point[0],eye_point[2]) +
         g_view_altitude;
+    sx3_unlock_terrain();
 
     view_dir[0] = 1.0F;
     view_dir[1] = 0.0F;
@@ -259,27 +299,25 @@ static void reset_view()
     return;
 }
 
-// This is where we update all the items in the scene
+// This is where we update all the items in the scene.  It runs on the
+// simulation thread, once a tick.
 void sx3_game_update(float dt)
 {
     if(get_game_mode() == SX3_GAME_ANIMATE && modify_scene(dt) == 0)
     {
         int i;
 
+        // The damage has already been done, as the tanks were hit
         for(i = 0; i < g_num_tanks; i++)
         {
             printf("Damage to tank %d: %f\n", i, g_tanks[i].s.temp_damage);
-            g_tanks[i].s.energy -= g_tanks[i].s.temp_damage;
             g_tanks[i].s.temp_damage = 0.0;
-            if(g_tanks[i].s.energy <= 0.0) {
-                // FIX ME!! We should now remove the tank from the scene
-                sx3_play_sound(SX3_AUDIO_BYEBYE);
-                printf("Tank %d has been eliminated.\n", i);
-            }
         }
 
+        // Unless the game was ended in the meantime
+        if(!change_game_mode(SX3_GAME_ANIMATE, SX3_GAME))
+            return;
         printf("Switching back to SX3_GAME mode\n");
-        set_game_mode(SX3_GAME);
         g_current_tank++;
         g_current_tank %= g_num_tanks;
         printf("g_current_tank = %d\n", g_current_tank);
@@ -294,13 +332,18 @@ void sx3_zoom(float increment)
 
     vv_add(eye_point, v);
     if(g_view_gravity > 0)
+    {
+        sx3_lock_terrain();
         eye_point[1] = sx3_find_terrain_height(eye_point[0],eye_point[2]) +
             g_view_altitude;
+        sx3_unlock_terrain();
+    }
     vv_cpy(view_point, eye_point);
     vv_add(view_point, view_dir);
 }
 
-// sx3_game_animate animates the scene before it is drawn.
+// sx3_game_animate moves the current tank's turret and gun.  It runs on the
+// simulation thread, once a tick.
 void sx3_game_animate(float dt)
 {
     if(g_current_tank >= 0)
@@ -313,8 +356,10 @@ void sx3_game_animate(float dt)
     
 }
 
-// sx3_game_key_hit processes all the keyboard commands.
-void sx3_game_key_hit(SDLKey key, SDLMod mod, Uint8 state)
+// sx3_game_sim_key processes the keyboard commands that change the game
+// (firing and aiming).  It runs on the simulation thread, at the start of a
+// tick; the main thread passes the keys on with sx3_post_sim_key.
+void sx3_game_sim_key(SDLKey key, Uint8 state)
 {
     if(state == SDL_RELEASED)
     {
@@ -329,15 +374,41 @@ void sx3_game_key_hit(SDLKey key, SDLMod mod, Uint8 state)
     switch (key)
     {
         case ' ':
-            if(get_game_mode() == SX3_GAME_ANIMATE) break;
+            if(get_game_mode() != SX3_GAME) break;
             // Fire!
             // Note: we assume that the tank is not moving.
             init_scene();
             sx3_play_sound(SX3_AUDIO_SHOT);
             printf("Switching to SX3_GAME_ANIMATE mode\n");
-            set_game_mode(SX3_GAME_ANIMATE);
+            change_game_mode(SX3_GAME, SX3_GAME_ANIMATE);
             break;
 
+        case '-':            tank_power_mod   = -TANK_POWER_DELTA;    break;
+        case '_':            tank_power_mod   = -TANK_POWER_DELTA*10; break;
+        case '=':            tank_power_mod   =  TANK_POWER_DELTA;    break;
+        case '+':            tank_power_mod   =  TANK_POWER_DELTA*10; break;
+        case SDLK_UP:        weapon_angle_mod =  WEAPON_ANGLE_DELTA;  break;
+        case SDLK_DOWN:      weapon_angle_mod = -WEAPON_ANGLE_DELTA;  break;
+        case SDLK_LEFT:      turret_angle_mod = -TURRET_ANGLE_DELTA;  break;
+        case SDLK_RIGHT:     turret_angle_mod =  TURRET_ANGLE_DELTA;  break;
+
+        default:
+            break;
+    }
+}
+
+// sx3_game_key_hit processes all the keyboard commands.  The ones that
+// change the game are passed on to the simulation thread.
+void sx3_game_key_hit(SDLKey key, SDLMod mod, Uint8 state)
+{
+    if(state == SDL_RELEASED)
+    {
+        sx3_post_sim_key(key, state);
+        return;
+    }
+
+    switch (key)
+    {
         case 'l':
             // Toggle lighting
             // TODO: This should be fixed
@@ -377,15 +448,6 @@ void sx3_game_key_hit(SDLKey key, SDLMod mod, Uint8 state)
             g_sat_view_on = !g_sat_view_on;
             break;
 
-        case '-':            tank_power_mod   = -TANK_POWER_DELTA;    break;
-        case '_':            tank_power_mod   = -TANK_POWER_DELTA*10; break;
-        case '=':            tank_power_mod   =  TANK_POWER_DELTA;    break;
-        case '+':            tank_power_mod   =  TANK_POWER_DELTA*10; break;
-        case SDLK_UP:        weapon_angle_mod =  WEAPON_ANGLE_DELTA;  break;
-        case SDLK_DOWN:      weapon_angle_mod = -WEAPON_ANGLE_DELTA;  break;
-        case SDLK_LEFT:      turret_angle_mod = -TURRET_ANGLE_DELTA;  break;
-        case SDLK_RIGHT:     turret_angle_mod =  TURRET_ANGLE_DELTA;  break;
-
         case 'x':
         case 'q':
         case 27:
@@ -393,6 +455,7 @@ void sx3_game_key_hit(SDLKey key, SDLMod mod, Uint8 state)
             set_game_mode(SX3_GAME_END);
             break;
         default:
+            sx3_post_sim_key(key, state);
             break;
     }
 }
@@ -421,7 +484,8 @@ void sx3_game_mouse_motion(Uint8 state, int x, int y, int xrel, int yrel)
 }
        
 // Here lies the guts of the program.  This is the main loop that polls for
-// SDL events, updates the scene, and refreshes the display.
+// SDL events and refreshes the display.  The scene is updated on the
+// simulation thread (see sx3_sim.c).
 void sx3_game()
 {
     SDL_Event event;
@@ -443,6 +507,12 @@ void sx3_game()
     sx3_console_print ("  quit");
     sx3_console_print ("");
 
+    if(sx3_start_sim())
+    {
+        fprintf(stderr, "Error starting the simulation thread!\n");
+        exit (1);
+    }
+
     while(get_game_mode() != SX3_GAME_END)
     {
         for(count = 0; count < MAX_EVENTS && SDL_PollEvent(&event); count++)
@@ -490,14 +560,12 @@ void sx3_game()
         time = SDL_GetTicks();
         dt = (float)(time - old_time) / 1000.0;
         old_time = time;
-        
-        sx3_game_animate(dt);
-        sx3_game_update(dt);
 
         sx3_update_screen(e.p, vp.p, vd.p, up.p, dt);
         SDL_GL_SwapBuffers();
     }
 
+    sx3_stop_sim();
     close_game();
     return;
 }
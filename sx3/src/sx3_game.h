@@ -7,7 +7,14 @@
 #ifndef SX3_GAME_H
 #define SX3_GAME_H
 
+#include <SDL/SDL.h>
+
 void sx3_game(void);
 void sx3_game_register_vars(void);
 
+// Run on the simulation thread (see sx3_sim.h)
+void sx3_game_animate(float dt);
+void sx3_game_update(float dt);
+void sx3_game_sim_key(SDLKey key, Uint8 state);
+
 #endif
@@ -33,10 +33,16 @@ int                 g_build_version             = SX3_BUILD_VERSION;
 // Terrain global variables --------------------------------------------------
 // These are also "declared" in sx3_terrain.h (instead of sx3_global.h)
 struct IPoint       g_terrain_size;
-float               g_terrain_vertex_height [MAX_MAP_X*MAX_MAP_Y];
-struct Point        g_terrain_vertex_normal [MAX_MAP_X*MAX_MAP_Y];
-struct Point        g_terrain_triag_normal  [MAX_MAP_X*MAX_MAP_Y*2];
-long int            g_terrain_square_tile   [MAX_MAP_X*MAX_MAP_Y];
+struct Terrain_Page *g_terrain_pages            = NULL;
+struct IPoint       g_terrain_num_pages;
+float               g_terrain_height_scale      = 1.0F;
+float               g_terrain_height_offset     = 0.0F;
+float               g_terrain_min_height        = 0.0F;
+float               g_terrain_max_height        = 0.0F;
+
+// Physics -------------------------------------------------------------------
+// The world the projectiles move in; set up by init_game
+struct Physics_World g_physics_world;
 
 // Projectiles ---------------------------------------------------------------
 int                 g_num_projectiles           = 0;
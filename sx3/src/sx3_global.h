@@ -25,11 +25,22 @@ extern float               g_sat_altitude;
 extern int                 g_view_radius;
 extern int                 g_view_gravity;
 
+// Physics -------------------------------------------------------------------
+extern struct Physics_World g_physics_world;
+
+// Simulation ----------------------------------------------------------------
+// The scene moves in ticks of 1/g_sim_tick_rate seconds on the simulation
+// thread, at most g_sim_max_ticks of them at once (see sx3_sim.h).
+extern int                 g_sim_tick_rate;
+extern int                 g_sim_max_ticks;
+
 // Projectiles ---------------------------------------------------------------
+// Room for MAX_PROJECTILES, set up by sx3_init_weapons
 extern int                 g_num_projectiles;
 extern struct Projectile  *g_projectiles;
 
 // Explosions ----------------------------------------------------------------
+// Room for MAX_EXPLOSIONS, set up by sx3_init_weapons
 extern int                 g_num_explosions;
 extern struct Explosion   *g_explosions;
 
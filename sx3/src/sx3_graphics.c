@@ -18,6 +18,7 @@
 #include "sx3_tanks.h"
 #include "sx3_weapons.h"
 #include "sx3_math.h"
+#include "sx3_sim.h"
 
 // FIX ME!! Is this the proper place for this?
 static int shield_list;
@@ -26,36 +27,42 @@ static int shield_list;
 // FUnction definitions
 // ===========================================================================
 
-void sx3_draw_projectiles()
+// The projectiles and explosions are drawn alpha of the way from where they
+// were at the start of the scene's last tick to where they were at the end.
+void sx3_draw_projectiles(const struct Scene_Snapshot *scene, float alpha)
 {
     int j;
-    struct Projectile *p;
+    Vector v;
 
     glColor3f(1.0, 0.0, 0.0);
     glPointSize(5.0);
 
     glBegin(GL_POINTS);
-    for(j = 0; j < g_num_projectiles; j++)
+    for(j = 0; j < scene->num_projectiles; j++)
     {
-        p = &g_projectiles[j];
-        glVertex3fv(p->o.props.position);
+        vv_cpy(v, scene->projectile_position[j]);
+        vv_sub(v, scene->projectile_last_position[j]);
+        vc_mul(v, alpha);
+        vv_add(v, scene->projectile_last_position[j]);
+        glVertex3fv(v);
     }
     glEnd();
         
 }
 
-void sx3_draw_explosions()
+void sx3_draw_explosions(const struct Scene_Snapshot *scene, float alpha)
 {
     int j, i;
-    struct Explosion *e;
     Vector v;
+    float radius;
 
     glPointSize(2.0);
 
     glBegin(GL_POINTS);
-    for(j = 0; j < g_num_explosions; j++)
+    for(j = 0; j < scene->num_explosions; j++)
     {
-        e = &g_explosions[j];
+        radius = scene->explosion_last_radius[j] + alpha *
+            (scene->explosion_radius[j] - scene->explosion_last_radius[j]);
         glColor3f((float)rand()/RAND_MAX,
                   (float)rand()/RAND_MAX,
                   (float)rand()/RAND_MAX);
@@ -66,67 +73,68 @@ void sx3_draw_explosions()
             v[2] = 2.0 * rand() / RAND_MAX - 1.0;
             v[3] = 0.0;
             v_norm(v);
-            vc_mul(v, e->props.radius);
-            vv_add(v, e->props.position);
+            vc_mul(v, radius);
+            vv_add(v, scene->explosion_position[j]);
             glVertex3fv(v);
         }
     }
     glEnd();
 }
 
-void sx3_draw_tanks ( void)
+// The tanks' models come from g_tanks, which the simulation doesn't change.
+void sx3_draw_tanks (const struct Scene_Snapshot *scene)
 {
-    int count = 0;
-    struct Tank *t;
+    int count;
+    const struct Tank_Snapshot *ts;
+    struct Tank_Model *m;
 
     glEnable(GL_TEXTURE_2D);
 
     // display each tank
-    while (g_tanks [count].id != -1)
+    for (count = 0; count < scene->num_tanks; count++)
     {
-        t = &g_tanks[count];
+        ts = &scene->tanks[count];
+        m = &g_tanks[count].m;
 
         glPushMatrix ();
 
         glColor3f (1.0, 1.0, 1.0); 
 
         // Draw the model
-        glTranslatef(t->o.props.position[0],
-                     t->o.props.position[1],
-                     t->o.props.position[2]);
-        glCallList(t->m.model.framestart);
+        glTranslatef(ts->position[0],
+                     ts->position[1],
+                     ts->position[2]);
+        glCallList(m->model.framestart);
 
         // Draw the shield
         glPushMatrix();
         glRotatef(180.0, (float)rand()/RAND_MAX, (float)rand()/RAND_MAX,
             (float)rand()/RAND_MAX);
-        glScalef(t->o.props.radius, t->o.props.radius, t->o.props.radius);
+        glScalef(ts->radius, ts->radius, ts->radius);
         glCallList(shield_list);
         glPopMatrix();
 
         // Draw the turret
-        glTranslatef(-t->m.turret_base[0],
-                     -t->m.turret_base[1],
-                     -t->m.turret_base[2]);
-        glRotatef(t->s.turret_angle, 0.0, 1.0, 0.0);
-        glTranslatef(t->m.turret_base[0],
-                     t->m.turret_base[1],
-                     t->m.turret_base[2]);
-        glCallList(t->m.turret.framestart);
+        glTranslatef(-m->turret_base[0],
+                     -m->turret_base[1],
+                     -m->turret_base[2]);
+        glRotatef(ts->turret_angle, 0.0, 1.0, 0.0);
+        glTranslatef(m->turret_base[0],
+                     m->turret_base[1],
+                     m->turret_base[2]);
+        glCallList(m->turret.framestart);
 
         // Draw the weapon
-        glTranslatef(-t->m.weapon_base[0],
-                     -t->m.weapon_base[1],
-                     -t->m.weapon_base[2]);
-        glRotatef(t->s.weapon_angle, -1.0, 0.0, 0.0);
-        glTranslatef(t->m.weapon_base[0],
-                     t->m.weapon_base[1],
-                     t->m.weapon_base[2]);
-        glCallList(t->m.weapon.framestart);
+        glTranslatef(-m->weapon_base[0],
+                     -m->weapon_base[1],
+                     -m->weapon_base[2]);
+        glRotatef(ts->weapon_angle, -1.0, 0.0, 0.0);
+        glTranslatef(m->weapon_base[0],
+                     m->weapon_base[1],
+                     m->weapon_base[2]);
+        glCallList(m->weapon.framestart);
 
         glPopMatrix ();
-
-        count++;
     }
 
 }
@@ -138,6 +146,10 @@ SX3_ERROR_CODE sx3_update_screen(
     struct Point up_vector,
     float dt)
 {
+    const struct Scene_Snapshot *scene = sx3_latest_scene();
+    float alpha = sx3_scene_alpha(scene);
+    float height;
+
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
     glLoadIdentity();
 
@@ -147,16 +159,20 @@ SX3_ERROR_CODE sx3_update_screen(
               view_point.x,view_point.y,view_point.z,
               up_vector.x,up_vector.y,up_vector.z);
     else
+    {
+        // The simulation may be digging a crater
+        sx3_lock_terrain();
+        height = sx3_interpolated_terrain_height (eye_point.x, eye_point.z, 1);
+        sx3_unlock_terrain();
         gluLookAt(
               eye_point.x,
-              sx3_interpolated_terrain_height (
-                  eye_point.x, eye_point.z, 1) + g_sat_altitude,
+              height + g_sat_altitude,
               eye_point.z,
               eye_point.x,
-              sx3_interpolated_terrain_height (
-                  eye_point.x, eye_point.z, 1),
+              height,
               eye_point.z,
               0.0, 0.0, -1.0 );
+    }
     
     // Draw the scene
     // TODO
@@ -169,10 +185,10 @@ SX3_ERROR_CODE sx3_update_screen(
     sx3_draw_terrain(eye_point, view_dir, up_vector);
 
     glDisable(GL_LIGHTING);                    // No lighting needed here
-    sx3_draw_tanks();                          // Draw the tanks
-    sx3_draw_projectiles();                    // Draw the projectiles
-    sx3_draw_explosions();                     // Draw the explosions
-    sx3_draw_hud(dt, 1);                       // Display the HUD (TODO)
+    sx3_draw_tanks(scene);                     // Draw the tanks
+    sx3_draw_projectiles(scene, alpha);        // Draw the projectiles
+    sx3_draw_explosions(scene, alpha);         // Draw the explosions
+    sx3_draw_hud(dt, 1, scene);                // Display the HUD (TODO)
     sx3_console_refresh_display ();            // Refresh the console
 
     return SX3_ERROR_SUCCESS;
@@ -227,7 +243,7 @@ void resize(int width, int height)
     glViewport(0,0,width,height);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    gluPerspective(g_fov/M_PI*180.0,(double)width/height,0.1,4096.0);
+    gluPerspective(g_fov/M_PI*180.0,(double)width/height,SX3_Z_NEAR,SX3_Z_FAR);
     glMatrixMode(GL_MODELVIEW);
 }
 
@@ -13,6 +13,15 @@ extern "C" {
 #include "sx3.h"
 
 
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// Near and far clipping planes of the projection set up by resize (meters)
+#define SX3_Z_NEAR                 0.1
+#define SX3_Z_FAR                  4096.0
+
+
 // ===========================================================================
 // Data types
 // ===========================================================================
@@ -88,12 +88,15 @@ SX3_ERROR_CODE sx3_display_text(char* s, enum sx3_font_types font)
 }
 
 // Warning!  This function not thread-safe!
-void sx3_draw_hud(float dt, int display_frame_rate)
+void sx3_draw_hud(
+    float dt,
+    int display_frame_rate,
+    const struct Scene_Snapshot *scene)
 {
     static char frame_text[32];
     static char s[32];
     static int frames = 0;
-    struct Tank *t = &g_tanks[g_current_tank];
+    const struct Tank_Snapshot *t;
 
     glDisable(GL_TEXTURE_2D);
     glDisable(GL_DEPTH_TEST);
@@ -122,35 +125,41 @@ void sx3_draw_hud(float dt, int display_frame_rate)
         sx3_draw_text(frame_text, SX3_DEFAULT_FONT);
     }
 
-    // Display the current tank numer
-    // FIX ME!! We aren't writing text in the correct y-position
-    sprintf(s, "Tank %d", g_current_tank+1);
-    sx3_move_text_cursor(5, 5);
-    sx3_draw_text(s, SX3_DEFAULT_FONT);
-
-    // Draw the tank's power
-    glColor3f(0.7, 0.0, 0.0);
-    glRectf(
-        g_window_size.x-25.0,
-        g_window_size.y - 30.0,
-        g_window_size.x- 5.0,
-        g_window_size.y - 30.0-t->s.power/t->s.max_power*100.0
-    );
-    sprintf(s, "%5.0f", t->s.power);
-    sx3_move_text_cursor(g_window_size.x - 55, g_window_size.y - 25);
-    sx3_draw_text(s, SX3_DEFAULT_FONT);
-
-    // And the tank's energy
-    glColor3f(0.0, 0.8, 0.0);
-    glRectf(
-        g_window_size.x-25.0,
-        g_window_size.y - 140.0,
-        g_window_size.x- 5.0,
-        g_window_size.y - 140.0-t->s.energy/t->s.max_energy*100.0
-    );
-    sprintf(s, "%5.0f", t->s.energy);
-    sx3_move_text_cursor(g_window_size.x - 55, g_window_size.y - 135);
-    sx3_draw_text(s, SX3_DEFAULT_FONT);
+    // The snapshot has no tanks if it ran out of memory
+    if(scene->current_tank >= 0 && scene->current_tank < scene->num_tanks)
+    {
+        t = &scene->tanks[scene->current_tank];
+
+        // Display the current tank numer
+        // FIX ME!! We aren't writing text in the correct y-position
+        sprintf(s, "Tank %d", scene->current_tank+1);
+        sx3_move_text_cursor(5, 5);
+        sx3_draw_text(s, SX3_DEFAULT_FONT);
+
+        // Draw the tank's power
+        glColor3f(0.7, 0.0, 0.0);
+        glRectf(
+            g_window_size.x-25.0,
+            g_window_size.y - 30.0,
+            g_window_size.x- 5.0,
+            g_window_size.y - 30.0-t->power/t->max_power*100.0
+        );
+        sprintf(s, "%5.0f", t->power);
+        sx3_move_text_cursor(g_window_size.x - 55, g_window_size.y - 25);
+        sx3_draw_text(s, SX3_DEFAULT_FONT);
+
+        // And the tank's energy
+        glColor3f(0.0, 0.8, 0.0);
+        glRectf(
+            g_window_size.x-25.0,
+            g_window_size.y - 140.0,
+            g_window_size.x- 5.0,
+            g_window_size.y - 140.0-t->energy/t->max_energy*100.0
+        );
+        sprintf(s, "%5.0f", t->energy);
+        sx3_move_text_cursor(g_window_size.x - 55, g_window_size.y - 135);
+        sx3_draw_text(s, SX3_DEFAULT_FONT);
+    }
 
     glPopMatrix();
     glMatrixMode(GL_PROJECTION);
@@ -11,6 +11,7 @@ extern "C" {
 #endif
 
 #include "sx3.h"
+#include "sx3_sim.h"
 
 // ===========================================================================
 // Data types
@@ -29,7 +30,10 @@ enum sx3_font_types {
 void sx3_move_text_cursor(int x, int y);
 SX3_ERROR_CODE sx3_display_text(char* s, enum sx3_font_types font);
 SX3_ERROR_CODE sx3_draw_text(char* s, enum sx3_font_types font);
-void sx3_draw_hud(float dt, int display_frame_rate);
+void sx3_draw_hud(
+    float dt,
+    int display_frame_rate,
+    const struct Scene_Snapshot *scene);
 void sx3_init_gui();
 void sx3_close_gui();
 
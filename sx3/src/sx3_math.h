@@ -23,6 +23,16 @@ extern "C" {
 #endif
 #endif
 
+// For pointers that don't overlap anything the function writes to, which
+// lets the compiler vectorise loops over many arrays
+#if !defined __cplusplus && defined __STDC_VERSION__ && __STDC_VERSION__ >= 199901L
+#define RESTRICT restrict
+#elif defined __GNUC__ || defined _MSC_VER
+#define RESTRICT __restrict
+#else
+#define RESTRICT
+#endif
+
 
 // ===========================================================================
 // Global macros
@@ -146,6 +156,51 @@ INLINE struct Point sx3_norm_cross_prod(struct Point v1, struct Point v2)
     return sx3_normalize(out);
 }
 
+// sx3_pack_normal packs a normal into 32 bits, using the octahedral
+// mapping: the normal is projected onto the octahedron |x|+|y|+|z| = 1,
+// the lower half (y < 0) is folded over the upper half, and the result is
+// flattened onto the x,z square and stored as two 16 bit values.  The +y
+// pole (straight up) is the most accurate direction.  v need not be of
+// unit length, but must not be zero.
+INLINE unsigned int sx3_pack_normal(struct Point v)
+{
+    float l1 = fabs(v.x) + fabs(v.y) + fabs(v.z);
+    float u = v.x / l1;
+    float w = v.z / l1;
+    float t;
+
+    if (v.y < 0.0F)
+    {
+        t = u;
+        u = (1.0F - fabs(w)) * ((t >= 0.0F) ? 1.0F : -1.0F);
+        w = (1.0F - fabs(t)) * ((w >= 0.0F) ? 1.0F : -1.0F);
+    }
+
+    return ((unsigned int)((u*0.5F + 0.5F)*65535.0F + 0.5F) << 16) |
+            (unsigned int)((w*0.5F + 0.5F)*65535.0F + 0.5F);
+}
+
+// sx3_unpack_normal unpacks a normal packed by sx3_pack_normal.  The
+// result is of unit length.
+INLINE struct Point sx3_unpack_normal(unsigned int packed)
+{
+    struct Point p;
+    float t;
+
+    p.x = (float)(packed >> 16) * (2.0F/65535.0F) - 1.0F;
+    p.z = (float)(packed & 0xFFFF) * (2.0F/65535.0F) - 1.0F;
+    p.y = 1.0F - fabs(p.x) - fabs(p.z);
+
+    if (p.y < 0.0F)
+    {
+        t = p.x;
+        p.x = (1.0F - fabs(p.z)) * ((t >= 0.0F) ? 1.0F : -1.0F);
+        p.z = (1.0F - fabs(t)) * ((p.z >= 0.0F) ? 1.0F : -1.0F);
+    }
+
+    return sx3_normalize(p);
+}
+
 
 #undef INLINE
 
@@ -0,0 +1,361 @@
+// File: sx3_sim.c
+// Author: Marc Bryant
+//
+// The simulation thread, and the scene snapshots it hands to the main
+// thread (see sx3_sim.h).
+//
+// The three snapshots are passed between the threads by index.  The
+// simulation fills in the back one and swaps it with the middle one,
+// marking it fresh; the main thread swaps its front one with the middle
+// one when the middle one is fresh.  Each swap is a single atomic exchange,
+// so the snapshots need no locks.  The terrain lock is the only thing the
+// threads share: the simulation takes it for one tick at a time, and the
+// main thread while it catches up with craters and builds chunk meshes.
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sx3_sim.h"
+#include "sx3_global.h"
+#include "sx3_game.h"
+#include "sx3_state.h"
+#include "sx3_tanks.h"
+#include "sx3_terrain.h"
+#include "sx3_weapons.h"
+#include "sx3_math.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// The most game keys that can wait for the next tick
+#define MAX_SIM_KEYS                64
+
+// The middle snapshot index has SNAPSHOT_FRESH set when the main thread
+// hasn't taken it yet
+#define SNAPSHOT_INDEX              3
+#define SNAPSHOT_FRESH              4
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+struct Sim_Key {
+    SDLKey                      key;
+    Uint8                       state;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+static struct Scene_Snapshot    snapshots[3];
+static int                      back_snapshot   = 0;  // Simulation's
+static volatile int             middle_snapshot = 1;  // Latest finished
+static int                      front_snapshot  = 2;  // Main thread's
+
+static struct Sim_Key           keys[MAX_SIM_KEYS];
+static int                      num_keys        = 0;
+static SDL_mutex               *key_lock        = NULL;
+
+static SDL_Thread              *sim_thread      = NULL;
+static volatile int             stop_sim        = 0;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// reserve
+//
+// Makes sure the array *a has room for n items of size bytes, where it
+// has room for max now.  Returns 0 if it runs out of memory.
+static int reserve(void **a, int max, int n, size_t size)
+{
+    void *bigger;
+
+    if (n <= max)
+        return 1;
+    bigger = realloc(*a, n * size);
+    if (!bigger)
+        return 0;
+    *a = bigger;
+    return 1;
+}  // reserve
+
+
+// take_snapshot
+//
+// Copies everything that is drawn into the snapshot s.  The tick ended at
+// time (SDL_GetTicks) and was tick seconds long.  If there isn't enough
+// memory for part of the scene, that part is left out.
+static void take_snapshot(struct Scene_Snapshot *s, Uint32 time, float tick)
+{
+    struct Tank_Snapshot *ts;
+    struct Tank *t;
+    int i;
+
+    s->tick_time = time;
+    s->tick = tick;
+    s->mode = get_game_mode();
+    s->current_tank = g_current_tank;
+
+    s->num_tanks = 0;
+    if (reserve((void**)&s->tanks, s->max_tanks, g_num_tanks,
+                sizeof(struct Tank_Snapshot)))
+    {
+        if (g_num_tanks > s->max_tanks)
+            s->max_tanks = g_num_tanks;
+        for (i=0; i<g_num_tanks; i++)
+        {
+            t = &g_tanks[i];
+            ts = &s->tanks[i];
+            vv_cpy(ts->position, t->o.props.position);
+            ts->radius = t->o.props.radius;
+            ts->turret_angle = t->s.turret_angle;
+            ts->weapon_angle = t->s.weapon_angle;
+            ts->power = t->s.power;
+            ts->max_power = t->s.max_power;
+            ts->energy = t->s.energy;
+            ts->max_energy = t->s.max_energy;
+        }
+        s->num_tanks = g_num_tanks;
+    }
+
+    s->num_projectiles = 0;
+    if (reserve((void**)&s->projectile_position, s->max_projectiles,
+                g_num_projectiles, sizeof(Vector)) &&
+        reserve((void**)&s->projectile_last_position, s->max_projectiles,
+                g_num_projectiles, sizeof(Vector)))
+    {
+        if (g_num_projectiles > s->max_projectiles)
+            s->max_projectiles = g_num_projectiles;
+        for (i=0; i<g_num_projectiles; i++)
+        {
+            vv_cpy(s->projectile_position[i], g_projectiles[i].o.props.position);
+            vv_cpy(s->projectile_last_position[i], g_projectiles[i].last_position);
+        }
+        s->num_projectiles = g_num_projectiles;
+    }
+
+    s->num_explosions = 0;
+    if (reserve((void**)&s->explosion_position, s->max_explosions,
+                g_num_explosions, sizeof(Vector)) &&
+        reserve((void**)&s->explosion_radius, s->max_explosions,
+                g_num_explosions, sizeof(float)) &&
+        reserve((void**)&s->explosion_last_radius, s->max_explosions,
+                g_num_explosions, sizeof(float)))
+    {
+        if (g_num_explosions > s->max_explosions)
+            s->max_explosions = g_num_explosions;
+        for (i=0; i<g_num_explosions; i++)
+        {
+            vv_cpy(s->explosion_position[i], g_explosions[i].props.position);
+            s->explosion_radius[i] = g_explosions[i].props.radius;
+            s->explosion_last_radius[i] = g_explosions[i].last_radius;
+        }
+        s->num_explosions = g_num_explosions;
+    }
+}  // take_snapshot
+
+
+// publish_snapshot
+//
+// Takes a snapshot of the scene and makes it the latest one.
+static void publish_snapshot(Uint32 time, float tick)
+{
+    take_snapshot(&snapshots[back_snapshot], time, tick);
+    back_snapshot = SX3_ATOMIC_EXCHANGE(&middle_snapshot,
+                        back_snapshot | SNAPSHOT_FRESH) & SNAPSHOT_INDEX;
+}  // publish_snapshot
+
+
+// free_snapshot
+//
+// Frees the arrays of a snapshot.
+static void free_snapshot(struct Scene_Snapshot *s)
+{
+    free(s->tanks);
+    free(s->projectile_position);
+    free(s->projectile_last_position);
+    free(s->explosion_position);
+    free(s->explosion_radius);
+    free(s->explosion_last_radius);
+    memset(s, 0, sizeof(struct Scene_Snapshot));
+}  // free_snapshot
+
+
+// handle_keys
+//
+// Hands the game keys posted since the last tick to the game.
+static void handle_keys(void)
+{
+    struct Sim_Key posted[MAX_SIM_KEYS];
+    int i, n;
+
+    SDL_mutexP(key_lock);
+    n = num_keys;
+    memcpy(posted, keys, n * sizeof(struct Sim_Key));
+    num_keys = 0;
+    SDL_mutexV(key_lock);
+
+    for (i=0; i<n; i++)
+        sx3_game_sim_key(posted[i].key, posted[i].state);
+}  // handle_keys
+
+
+// run_sim
+//
+// The simulation thread.  It runs as many ticks as have come due (but no
+// more than sim.max_ticks at once, so that the game slows down rather than
+// stalling when it can't keep up), publishes a snapshot, and sleeps until
+// the next tick is due.
+static int run_sim(void *data)
+{
+    Uint32 old_time = SDL_GetTicks(), time;
+    float tick, sim_time = 0.0F;
+    int ticks, wait;
+
+    while (!stop_sim)
+    {
+        RANGE_CHECK(g_sim_tick_rate, 1, 1000);
+        RANGE_CHECK(g_sim_max_ticks, 1, 100);
+        tick = 1.0F / g_sim_tick_rate;
+
+        time = SDL_GetTicks();
+        sim_time += (float)(time - old_time) / 1000.0F;
+        old_time = time;
+
+        if (sim_time >= tick)
+        {
+            // The terrain is let go of between ticks, so that the main
+            // thread never waits for a whole batch
+            for (ticks=0; sim_time >= tick && ticks < g_sim_max_ticks; ticks++)
+            {
+                sx3_lock_terrain();
+                handle_keys();
+                sx3_game_animate(tick);
+                sx3_game_update(tick);
+                sx3_unlock_terrain();
+                sim_time -= tick;
+            }
+
+            if (sim_time >= tick)
+                sim_time = (float)fmod(sim_time, tick);
+
+            // The last tick was due sim_time ago
+            publish_snapshot(time - (Uint32)(sim_time * 1000.0F), tick);
+        }
+
+        wait = (int)((tick - sim_time) * 1000.0F);
+        SDL_Delay(wait > 0 ? wait : 1);
+    }
+
+    return 0;
+}  // run_sim
+
+
+// sx3_start_sim
+//
+// Starts the simulation thread for a game.  The first snapshot is ready
+// when this returns.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+//         SX3_ERROR_CANNOT_START_THREAD
+SX3_ERROR_CODE sx3_start_sim(void)
+{
+    if (!key_lock)
+        key_lock = SDL_CreateMutex();
+    if (!key_lock)
+        return SX3_ERROR_MEM_ALLOC;
+    num_keys = 0;
+
+    RANGE_CHECK(g_sim_tick_rate, 1, 1000);
+    publish_snapshot(SDL_GetTicks(), 1.0F / g_sim_tick_rate);
+
+    stop_sim = 0;
+    sim_thread = SDL_CreateThread(run_sim, NULL);
+    if (!sim_thread)
+        return SX3_ERROR_CANNOT_START_THREAD;
+    return SX3_ERROR_SUCCESS;
+}  // sx3_start_sim
+
+
+// sx3_stop_sim
+//
+// Stops the simulation thread, after the tick it is on, and frees the
+// snapshots.
+void sx3_stop_sim(void)
+{
+    int i;
+
+    if (!sim_thread)
+        return;
+    stop_sim = 1;
+    SDL_WaitThread(sim_thread, NULL);
+    sim_thread = NULL;
+
+    for (i=0; i<3; i++)
+        free_snapshot(&snapshots[i]);
+}  // sx3_stop_sim
+
+
+// sx3_post_sim_key
+//
+// Passes a game key to the simulation, for the next tick.  Keys pressed
+// faster than the simulation can take them are dropped.
+void sx3_post_sim_key(SDLKey key, Uint8 state)
+{
+    if (!key_lock)
+        return;
+
+    SDL_mutexP(key_lock);
+    if (num_keys < MAX_SIM_KEYS)
+    {
+        keys[num_keys].key = key;
+        keys[num_keys].state = state;
+        num_keys++;
+    }
+    SDL_mutexV(key_lock);
+}  // sx3_post_sim_key
+
+
+// sx3_latest_scene
+//
+// Returns the latest snapshot of the scene.  It stays as it is until the
+// next call.  Only the main thread may call this.
+const struct Scene_Snapshot *sx3_latest_scene(void)
+{
+    if (middle_snapshot & SNAPSHOT_FRESH)
+        front_snapshot = SX3_ATOMIC_EXCHANGE(&middle_snapshot, front_snapshot) &
+                         SNAPSHOT_INDEX;
+    return &snapshots[front_snapshot];
+}  // sx3_latest_scene
+
+
+// sx3_scene_alpha
+//
+// Returns how far to draw the scene from the start of its last tick to
+// the end (0 to 1), going by how long ago the tick was.  Nothing moves
+// between ticks outside an attack.
+float sx3_scene_alpha(const struct Scene_Snapshot *scene)
+{
+    float alpha;
+
+    if (scene->mode != SX3_GAME_ANIMATE || scene->tick <= 0.0F)
+        return 1.0F;
+
+    alpha = (float)(SDL_GetTicks() - scene->tick_time) / 1000.0F / scene->tick;
+    RANGE_CHECK(alpha, 0.0F, 1.0F);
+    return alpha;
+}  // sx3_scene_alpha
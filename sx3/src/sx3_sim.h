@@ -0,0 +1,98 @@
+// File: sx3_sim.h
+// Author: Marc Bryant
+//
+// The simulation thread.  During a game the projectiles, explosions, tanks
+// and damage are moved on their own thread, in fixed ticks of
+// 1/sim.tick_rate seconds, so that a slow frame doesn't hold up the physics
+// and a big barrage doesn't hold up the drawing or the input.
+//
+// After each batch of ticks the simulation publishes a snapshot of
+// everything the main thread draws.  Snapshots are triple buffered: the
+// simulation writes one, the main thread reads another, and the third
+// holds the latest one finished, so neither thread waits for the other to
+// hand one over.  A snapshot doesn't change while the main thread is
+// reading it.
+//
+// The terrain is shared, and is guarded by sx3_lock_terrain.  The
+// simulation holds the lock for one tick at a time; the main thread holds
+// it only while it catches up with craters and builds the chunk meshes it
+// is about to draw, not while it draws them.  So either thread waits at
+// most that long for the other.
+//
+// The game keys are passed to the simulation with sx3_post_sim_key and are
+// handled at the start of the next tick.
+
+#ifndef SX3_SIM_H
+#define SX3_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <SDL/SDL.h>
+#include <matrix.h>
+#include "sx3.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// A tank as it is drawn.  The models are the ones in g_tanks, which don't
+// change during a game.
+struct Tank_Snapshot {
+    Vector                      position;
+    float                       radius;
+    float                       turret_angle;
+    float                       weapon_angle;
+    float                       power, max_power;
+    float                       energy, max_energy;
+};
+
+// Everything the main thread draws, as it was at the end of the last tick.
+// The projectiles and explosions also keep where they were at the start of
+// that tick (last_position, last_radius), so that the frames between ticks
+// can be drawn part of the way from one to the other.
+struct Scene_Snapshot {
+    Uint32                      tick_time;      // SDL_GetTicks of the tick
+    float                       tick;           // Length of a tick (s)
+    int                         mode;           // Game mode after the tick
+    int                         current_tank;
+
+    int                         num_tanks;
+    struct Tank_Snapshot       *tanks;
+
+    int                         num_projectiles;
+    Vector                     *projectile_position;
+    Vector                     *projectile_last_position;
+
+    int                         num_explosions;
+    Vector                     *explosion_position;
+    float                      *explosion_radius;
+    float                      *explosion_last_radius;
+
+    // Room in the arrays
+    int                         max_tanks;
+    int                         max_projectiles;
+    int                         max_explosions;
+};
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_start_sim(void);
+
+void sx3_stop_sim(void);
+
+void sx3_post_sim_key(SDLKey key, Uint8 state);
+
+const struct Scene_Snapshot *sx3_latest_scene(void);
+
+float sx3_scene_alpha(const struct Scene_Snapshot *scene);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
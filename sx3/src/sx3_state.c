@@ -3,9 +3,14 @@
 //
 // Keep track of the game's state between modules
 
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "sx3.h"
 #include "sx3_state.h"
 
-static int game_mode = SX3_TITLE_SCREEN_IN;
+static volatile int game_mode = SX3_TITLE_SCREEN_IN;
 
 int get_game_mode()
 {
@@ -16,3 +21,11 @@ void set_game_mode(int n)
 {
     game_mode = n;
 }
+
+// change_game_mode sets the game mode to n if it is still from, and returns
+// whether it did.  The simulation thread uses it so that it can't undo a
+// change made on the main thread at the same time, such as quitting.
+int change_game_mode(int from, int n)
+{
+    return SX3_ATOMIC_CAS(&game_mode, from, n);
+}
@@ -22,5 +22,6 @@ enum Game_Mode {
 
 int get_game_mode();
 void set_game_mode(int);
+int change_game_mode(int from, int n);
 
 #endif
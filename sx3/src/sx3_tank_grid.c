@@ -0,0 +1,209 @@
+// File: sx3_tank_grid.c
+// Author: Marc Bryant
+//
+// A uniform grid of tanks, in map coordinates.  Each tank is put in the cell
+// that its centre is in, and searches are widened by the radius of the
+// biggest tank to make up for it.  The cells are hashed into
+// TANK_GRID_BUCKETS buckets, so the grid doesn't depend on the size of the
+// map, and the tanks are sorted by bucket so that each bucket is one run
+// of an array.
+//
+// The grid is rebuilt at the start of every tick, which only takes time in
+// proportion to the number of tanks.
+
+#include <stdlib.h>
+#include <math.h>
+#include "sx3_global.h"
+#include "sx3_terrain.h"
+#include "sx3_tanks.h"
+#include "sx3_tank_grid.h"
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// The tanks in bucket b are entries bucket_start[b] to bucket_start[b+1]-1
+// of grid_tank, and are in cells (grid_x, grid_y) of those entries
+static int                      bucket_start[TANK_GRID_BUCKETS + 1];
+static int                     *grid_tank = NULL;
+static int                     *grid_x = NULL;
+static int                     *grid_y = NULL;
+static int                     *nearby = NULL;  // results of a search
+static int                      grid_size = 0;  // room in the arrays
+static int                      grid_count = 0;
+
+// Side of a cell (map squares), and the radius of the biggest tank (meters)
+static float                    cell_size = 1.0F;
+static float                    max_radius = 0.0F;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// hash_cell
+//
+// Returns the bucket of cell (x,y).
+static int hash_cell(int x, int y)
+{
+    return ((unsigned int)x * 73856093U ^ (unsigned int)y * 19349663U) &
+           (TANK_GRID_BUCKETS - 1);
+}  // hash_cell
+
+
+// tank_cell
+//
+// Finds the cell (x,y) that the centre of tank i is in.
+static void tank_cell(int i, int *x, int *y)
+{
+    const float *position = g_tanks[i].o.props.position;
+
+    *x = (int)floor(GL_Z_TO_MAP_X(position[2]) / cell_size);
+    *y = (int)floor(GL_X_TO_MAP_Y(position[0]) / cell_size);
+}  // tank_cell
+
+
+// sx3_build_tank_grid
+//
+// Puts every tank in g_tanks into the grid.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC (sx3_find_nearby_tanks then returns them all)
+SX3_ERROR_CODE sx3_build_tank_grid(void)
+{
+    int *tank, *cells_x, *cells_y, *found;
+    int i, b, n, x, y;
+
+    grid_count = 0;
+    if (grid_size < g_num_tanks)
+    {
+        tank = realloc(grid_tank, g_num_tanks * sizeof(int));
+        if (tank) grid_tank = tank;
+        cells_x = realloc(grid_x, g_num_tanks * sizeof(int));
+        if (cells_x) grid_x = cells_x;
+        cells_y = realloc(grid_y, g_num_tanks * sizeof(int));
+        if (cells_y) grid_y = cells_y;
+        found = realloc(nearby, g_num_tanks * sizeof(int));
+        if (found) nearby = found;
+        if (!tank || !cells_x || !cells_y || !found)
+            return SX3_ERROR_MEM_ALLOC;
+        grid_size = g_num_tanks;
+    }
+
+    // Cells as wide as the biggest tank keep the searches to a few cells
+    // with few tanks in each
+    max_radius = 0.0F;
+    for (i=0; i<g_num_tanks; i++)
+    {
+        if (g_tanks[i].o.props.radius > max_radius)
+            max_radius = g_tanks[i].o.props.radius;
+    }
+    cell_size = (float)ceil(2.0F * max_radius / METERS_PER_MAP_GRID);
+    if (cell_size < 1.0F)
+        cell_size = 1.0F;
+
+    // Count the tanks in each bucket, then sort them into place.  nearby
+    // isn't needed until the first search, so it holds the buckets.
+    for (b=0; b<=TANK_GRID_BUCKETS; b++)
+        bucket_start[b] = 0;
+    for (i=0; i<g_num_tanks; i++)
+    {
+        tank_cell(i, &x, &y);
+        nearby[i] = hash_cell(x, y);
+        bucket_start[nearby[i] + 1]++;
+    }
+    for (b=0; b<TANK_GRID_BUCKETS; b++)
+        bucket_start[b+1] += bucket_start[b];
+    for (i=0; i<g_num_tanks; i++)
+    {
+        tank_cell(i, &x, &y);
+        n = bucket_start[nearby[i]]++;
+        grid_tank[n] = i;
+        grid_x[n] = x;
+        grid_y[n] = y;
+    }
+
+    // Each bucket_start has moved up to the start of the next bucket
+    for (b=TANK_GRID_BUCKETS; b>0; b--)
+        bucket_start[b] = bucket_start[b-1];
+    bucket_start[0] = 0;
+
+    grid_count = g_num_tanks;
+    return SX3_ERROR_SUCCESS;
+}  // sx3_build_tank_grid
+
+
+// sx3_find_nearby_tanks
+//
+// Finds the tanks that might be within radius of the segment from GL
+// point p0 to p1 (which can be the same point), and sets *tanks to a list
+// of their indices in g_tanks.  The list is good until the next search.
+// When the segment covers more cells than there are tanks, or the grid
+// couldn't be built, it sets *tanks to NULL, which means all of them, in
+// order.
+//
+// RETURN: the number of tanks in the list
+int sx3_find_nearby_tanks(
+    const float *p0,
+    const float *p1,
+    float radius,
+    const int **tanks)
+{
+    float x0, x1, y0, y1, reach;
+    int cx0, cx1, cy0, cy1, cx, cy, i, b, n = 0;
+
+    if (grid_count != g_num_tanks)
+    {
+        *tanks = NULL;
+        return g_num_tanks;
+    }
+
+    // The box around the segment, in map squares
+    x0 = GL_Z_TO_MAP_X(p0[2]);
+    x1 = GL_Z_TO_MAP_X(p1[2]);
+    y0 = GL_X_TO_MAP_Y(p0[0]);
+    y1 = GL_X_TO_MAP_Y(p1[0]);
+    reach = (radius + max_radius) / METERS_PER_MAP_GRID;
+    cx0 = (int)floor(((x0 < x1 ? x0 : x1) - reach) / cell_size);
+    cx1 = (int)floor(((x0 < x1 ? x1 : x0) + reach) / cell_size);
+    cy0 = (int)floor(((y0 < y1 ? y0 : y1) - reach) / cell_size);
+    cy1 = (int)floor(((y0 < y1 ? y1 : y0) + reach) / cell_size);
+
+    if ((float)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > g_num_tanks)
+    {
+        *tanks = NULL;
+        return g_num_tanks;
+    }
+
+    for (cy=cy0; cy<=cy1; cy++)
+    {
+        for (cx=cx0; cx<=cx1; cx++)
+        {
+            // Other cells share the bucket
+            b = hash_cell(cx, cy);
+            for (i=bucket_start[b]; i<bucket_start[b+1]; i++)
+            {
+                if (grid_x[i] == cx && grid_y[i] == cy)
+                    nearby[n++] = grid_tank[i];
+            }
+        }
+    }
+
+    *tanks = nearby;
+    return n;
+}  // sx3_find_nearby_tanks
+
+
+// sx3_free_tank_grid
+//
+// Frees the grid.
+void sx3_free_tank_grid(void)
+{
+    free(grid_tank);
+    free(grid_x);
+    free(grid_y);
+    free(nearby);
+    grid_tank = grid_x = grid_y = nearby = NULL;
+    grid_size = grid_count = 0;
+}  // sx3_free_tank_grid
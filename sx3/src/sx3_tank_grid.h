@@ -0,0 +1,45 @@
+// File: sx3_tank_grid.h
+// Author: Marc Bryant
+//
+// A uniform grid over the map that the tanks are hashed into, so that the
+// projectiles and explosions only have to be checked against the tanks
+// near them, however many tanks there are in a game.
+
+#ifndef SX3_TANK_GRID_H
+#define SX3_TANK_GRID_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! These should be static const variables
+
+// Number of hash buckets the grid cells share (a power of 2)
+#define TANK_GRID_BUCKETS           256
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_build_tank_grid(void);
+
+int sx3_find_nearby_tanks(
+    const float *p0,
+    const float *p1,
+    float radius,
+    const int **tanks);
+
+void sx3_free_tank_grid(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
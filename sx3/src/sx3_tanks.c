@@ -9,6 +9,7 @@
 #include "sx3_tanks.h"
 #include "sx3_global.h"
 #include "sx3_terrain.h"
+#include "sx3_tank_grid.h"
 #include "sx3_files.h"
 
 // For the moment, the list of tanks is implemented as an
@@ -103,6 +104,7 @@ SX3_ERROR_CODE sx3_cleanup_tanks(void)
 {
     // FIX ME!! We need to delete the tank model first!
     free (g_tanks);
+    sx3_free_tank_grid();
 
     // FIX ME!! We should also free the shield list
 
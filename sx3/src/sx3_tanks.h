@@ -23,6 +23,10 @@ extern "C" {
 // FIX ME!! This should be a static const variable.
 #define MAX_TANKS 32
 
+#if MAX_TANKS > TANK_SET_WORDS * TANK_SET_WORD_BITS
+#error A Tank_Set (see sx3_weapons.h) is too small for MAX_TANKS
+#endif
+
 // ===========================================================================
 // Data types
 // ===========================================================================
@@ -100,7 +104,7 @@ struct Tank_Stats {
     float                        power;
     float                        energy;
     float                        max_energy;
-    float                        temp_damage;
+    float                        temp_damage;    // this attack
 };
 
 struct Tank {
@@ -7,6 +7,8 @@
 //   The first 2 words in the terrain file are the dimensions (X,Y) of the
 //   terrain matrix.  The rest of the file is composed of X*Y number of
 //   WORD integers.  Each word represents the height for that coordinate.
+//   Binary .ter2 files (see sx3_terrain_file.h) are loaded as well; they
+//   hold the normals and chunk bounds too, so they load much faster.
 
 #ifdef WIN32
 #include <windows.h>
@@ -16,36 +18,33 @@
 #include <GL/glu.h>
 #include <SDL/SDL.h>
 #include <SDL/SDL_endian.h>
+#include <SDL/SDL_thread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <memory.h>
 #include "sx3_terrain.h"
+#include "sx3_terrain_mesh.h"
+#include "sx3_terrain_cull.h"
+#include "sx3_terrain_color.h"
+#include "sx3_terrain_file.h"
+#include "sx3_terrain_gen.h"
+#include "sx3_terrain_normals.h"
+#include "sx3_terrain_pages.h"
+#include "sx3_terrain_raycast.h"
+#include "sx3_terrain_sample.h"
+#include "sx3_terrain_tiles.h"
 #include <sx3_registry.h>
 #include "sx3_math.h"
 #include "sx3_gui.h"
 #include "sx3_global.h"
+#include "sx3_graphics.h"
 
 
 // ===========================================================================
 // Function declarations
 // ===========================================================================
 
-struct Color
-calculate_vertex_color (
-    float height
-    );
-
-int is_point_in_fov (
-    struct Point *view_dir,
-    struct Point *eye_point,
-    struct Point *up_dir,
-    float test_x,
-    float test_y,
-    float test_z,
-    float fov
-    );
-
 SX3_ERROR_CODE
 sx3_generate_terrain_mm (
     int start_x,
@@ -61,17 +60,6 @@ calculate_terrain_mm_level (
     float y
     );
 
-SX3_ERROR_CODE
-map_pt_to_mesh_pt (
-    int           x,           // original map coords 
-    int           y,
-    int           level,       // 0=full detail, 1=half detail, 2=quarter det 
-    int           skip,        // 1<<level 
-    struct IPoint *new_p,      // Corrected point (in map coords) 
-    struct Point  *new_gl_p,   // Corrected gl position 
-    struct Point  *new_n       // Corrected gl normal 
-    );
-
 SX3_ERROR_CODE
 interpolate_height (
     struct Point nw,
@@ -81,15 +69,6 @@ interpolate_height (
     struct Point *pt
     );
 
-SX3_ERROR_CODE 
-sx3_interpolated_terrain_point (
-    float x,
-    float z,
-    int res,
-    struct Point *pt,
-    struct Point *norm
-    );
-
 
 // ===========================================================================
 // Constatnts
@@ -99,6 +78,20 @@ sx3_interpolated_terrain_point (
 #define MIN_TERRAIN_MM_LEVEL 0
 #define TILE_MOD(mac_x,mac_y) (((((mac_x))%((mac_y))) < 0) ?  (((mac_y))+(((mac_x))%((mac_y)))) : (((mac_x))%((mac_y))))
 #define SNAP_TO_LOW_RES(x,y) (int)(floor((float)((x))/(float)((y))) * ((y)))
+#define MAX_TERRAIN_DIRTY_RECTS 16
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// A rectangle of vertices, columns [x0,x1) of rows [y0,y1), that have to be
+// brought up to date after the terrain was deformed.  x0 and y0 always lie
+// within the map, but the rectangle may run past its far edges.
+struct Dirty_Rect {
+    int                         x0, y0;
+    int                         x1, y1;
+};
 
 
 // ===========================================================================
@@ -140,20 +133,26 @@ GLfloat terrain_diffuse[] =   {0.2F,1.0F,0.2F,0.5F};
 GLfloat terrain_specular[] =  {0.0F,0.0F,0.0F,0.5F};
 GLfloat terrain_shininess[] = {127.0};
 
-// Main terrain data structures -------------------------------------------
-struct IPoint       g_terrain_size;
-float               g_terrain_vertex_height [MAX_MAP_X*MAX_MAP_Y];
-struct Point        g_terrain_vertex_normal [MAX_MAP_X*MAX_MAP_Y];
-struct Point        g_terrain_triag_normal  [MAX_MAP_X*MAX_MAP_Y*2];
-long int            g_terrain_square_tile   [MAX_MAP_X*MAX_MAP_Y];
-
 // Terrain rendering options ----------------------------------------------
 int                 g_terrain_wire              = 0;
 int                 g_terrain_lights            = 1;
 int                 g_terrain_detail_levels     = 6;
 int                 g_terrain_detail_cutoff     = 4;
 int                 g_terrain_detail_skip       = 2;
-int                 g_terrain_detail_alg        = 0;
+int                 g_terrain_detail_alg        = Terrain_Detail_Cdlod;
+float               g_terrain_detail_tolerance  = 2.0F;
+int                 g_terrain_detail_range      = 48;
+float               g_terrain_detail_morph      = 0.3F;
+
+struct Terrain_Stats g_terrain_stats;
+
+// Deformations waiting for sx3_flush_terrain_deformations
+static struct Dirty_Rect dirty_rects[MAX_TERRAIN_DIRTY_RECTS];
+static int          num_dirty_rects             = 0;
+
+// Held by whichever thread is changing the terrain or reading it while
+// another might change it (see sx3_lock_terrain)
+static SDL_mutex   *terrain_lock                = NULL;
 
 
 // ===========================================================================
@@ -202,6 +201,120 @@ SX3_ERROR_CODE sx3_terrain_register_vars (void)
                         (void*)&g_terrain_detail_alg,
                         0,
                         NULL);
+    sx3_add_global_var ("terrain.detail.tolerance",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_detail_tolerance,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.detail.range",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_detail_range,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.detail.morph",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_detail_morph,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.horizon",
+                        SX3_GLOBAL_BOOL,
+                        0,
+                        (void*)&g_terrain_horizon,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.cache",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_cache_size,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.prefetch",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_prefetch,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.pages",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_page_budget,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.gradient",
+                        SX3_GLOBAL_STRING,
+                        0,
+                        (void*)g_terrain_gradient,
+                        sizeof(g_terrain_gradient),
+                        NULL);
+    sx3_add_global_var ("terrain.gen.size",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_gen_size,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.gen.seed",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_gen_seed,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.gen.height",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_gen_height,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.gen.roughness",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_gen_roughness,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.gen.thermal",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_gen_thermal,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.gen.hydraulic",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_gen_hydraulic,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.tile.snow",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_tile_snow,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.tile.pebbles",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_tile_pebbles,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.tile.rock",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_tile_rock,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.tile.dirt",
+                        SX3_GLOBAL_FLOAT,
+                        0,
+                        (void*)&g_terrain_tile_dirt,
+                        0,
+                        NULL);
+    sx3_add_global_var ("terrain.threads",
+                        SX3_GLOBAL_INT,
+                        0,
+                        (void*)&g_terrain_threads,
+                        0,
+                        NULL);
     sx3_add_global_var ("terrain.size.x",
                         SX3_GLOBAL_INT,
                         1,
@@ -219,29 +332,144 @@ SX3_ERROR_CODE sx3_terrain_register_vars (void)
 }  // sx3_terrain_register_vars 
 
 
+// find_terrain_height_range
+//
+// Works out g_terrain_min_height and g_terrain_max_height.
+static void find_terrain_height_range(void)
+{
+    short h, lo = 32767, hi = -32768;
+    int x, y;
+
+    for (y=0; y<g_terrain_size.y; y++)
+    {
+        for (x=0; x<g_terrain_size.x; x++)
+        {
+            h = TERRAIN_RAW_HEIGHT(x, y);
+            lo = (h < lo) ? h : lo;
+            hi = (h > hi) ? h : hi;
+        }
+    }
+    g_terrain_min_height = lo*g_terrain_height_scale + g_terrain_height_offset;
+    g_terrain_max_height = hi*g_terrain_height_scale + g_terrain_height_offset;
+}  // find_terrain_height_range
+
+
+// build_terrain
+//
+// Works out everything else the terrain needs once its heights are in
+// place: the height range, the normals, the square tiles, the ray cast
+// pyramid, the chunk meshes that the terrain is drawn from and the quadtree
+// used to cull them.  The terrain is unloaded if anything goes wrong.
+static SX3_ERROR_CODE build_terrain(void)
+{
+    SX3_ERROR_CODE retcode;
+
+    find_terrain_height_range();
+    retcode = sx3_compute_terrain_normals(0, 0, g_terrain_size.x, g_terrain_size.y);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+      sx3_unload_terrain();
+      return retcode;
+    }
+    sx3_classify_terrain_tiles(0, 0, g_terrain_size.x, g_terrain_size.y);
+
+    retcode = sx3_build_terrain_pyramid(NULL);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+      sx3_unload_terrain();
+      return retcode;
+    }
+
+    retcode = sx3_build_terrain_chunks(NULL);
+    if (retcode != SX3_ERROR_SUCCESS)
+        return retcode;
+    return sx3_build_terrain_quadtree();
+}  // build_terrain
+
+
+// load_terrain_file
+//
+// Loads a .ter2 file.  The pages and the top of the ray cast pyramid are
+// used straight out of the mapped file, and the height range comes from its
+// header, so nothing is done over the whole map unless the tiles were
+// worked out with other settings.  All that is left is to set up the
+// chunks.
+static SX3_ERROR_CODE load_terrain_file(char* terrainName)
+{
+    const struct Terrain_Chunk_Bounds *bounds;
+    short *pyramid;
+    int tiles_current;
+    SX3_ERROR_CODE retcode;
+
+    retcode = sx3_open_terrain_file(terrainName, &bounds, &pyramid,
+                                    &tiles_current);
+    if (retcode != SX3_ERROR_SUCCESS)
+        return retcode;
+
+    printf("Loading the terrain\n");
+
+    // The tiles are rewritten in the mapping, which is copy-on-write, so
+    // the pages can't be handed back after that
+    if (!tiles_current)
+    {
+        printf("The terrain tiles are out of date; the whole map is kept in memory\n");
+        sx3_pin_terrain_pages(0, 0, g_terrain_size.x, g_terrain_size.y);
+        retcode = sx3_classify_terrain_tiles(0, 0, g_terrain_size.x,
+                                             g_terrain_size.y);
+        if (retcode != SX3_ERROR_SUCCESS)
+        {
+            sx3_unload_terrain();
+            return retcode;
+        }
+    }
+
+    retcode = sx3_build_terrain_pyramid(pyramid);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+        sx3_unload_terrain();
+        return retcode;
+    }
+
+    // The stored bounds save us from measuring the mip errors again
+    retcode = sx3_build_terrain_chunks(bounds);
+    if (retcode != SX3_ERROR_SUCCESS)
+        return retcode;
+    return sx3_build_terrain_quadtree();
+}  // load_terrain_file
+
+
 // sx3_load_terrain
 //
-// Loads the desired terrain and returns 0 if successful.
+// Loads the desired terrain and returns 0 if successful.  The terrain
+// pages (see sx3_terrain_pages.h) are set up to fit the map, and any
+// previously loaded terrain is unloaded first.
 // 
 // INPUT:
 // OUTPUT:
 // RETURN: SX3_ERROR_SUCCESS
 //         SX3_ERROR_CANNOT_OPEN_FILE
-SX3_ERROR_CODE sx3_load_terrain(
-    char* terrainName, 
-    float* buffer, 
-    struct IPoint* terrainSize, 
-    struct Point* normalBuffer, 
-    struct Point* normalAvgBuffer)
+//         SX3_ERROR_BAD_FILE
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_load_terrain(char* terrainName)
 {
     FILE* inFile;   // File containing terrain data 
-    Sint16 *tmpbuf, *origbuf, dummy;
     Uint16 terrain_height, terrain_width;
-    int i,j;
-    struct Point v1,v2;
-    float* mapPtr;
-    struct Point* normalAvgPtr;
-    int avgCount;
+    short *row;
+    size_t values_read = 0;
+    int x, y, size_x, size_y;
+    SX3_ERROR_CODE retcode;
+
+    sx3_unload_terrain();
+    if (!terrain_lock)
+        terrain_lock = SDL_CreateMutex();
+
+    // The colors are baked into the chunk meshes, so they have to be ready
+    // before the meshes are built.  Without a gradient file the default
+    // colors are used.
+    sx3_load_terrain_gradient(g_terrain_gradient);
+
+    if (sx3_is_terrain_file(terrainName))
+        return load_terrain_file(terrainName);
 
     // For the moment, assume that terrain name is the name of 
     // the file containing the terrain data 
@@ -257,159 +485,325 @@ SX3_ERROR_CODE sx3_load_terrain(
     if (fread(&terrain_width,2,1,inFile) == 0)
     {
       printf ("Unable to read width from terrain file: %s\n", terrainName);
+      fclose(inFile);
       return SX3_ERROR_BAD_FILE;
     }
 
     if (fread(&terrain_height,2,1,inFile) == 0)
     {
       printf ("Unable to read height from terrain file: %s\n", terrainName);
+      fclose(inFile);
       return SX3_ERROR_BAD_FILE;
     }
 
     if(SDL_BYTEORDER == SDL_BIG_ENDIAN) {
-        terrainSize->x = SDL_Swap16(terrain_width);
-        terrainSize->y = SDL_Swap16(terrain_height);
+        size_x = SDL_Swap16(terrain_width);
+        size_y = SDL_Swap16(terrain_height);
     } else {
-        terrainSize->x = terrain_width;
-        terrainSize->y = terrain_height;
+        size_x = terrain_width;
+        size_y = terrain_height;
     }
 
-    printf("Loading the terrain\n");
-    tmpbuf = origbuf = malloc(terrainSize->x*terrainSize->y*2);
-
-    if (fread(tmpbuf, 2, terrainSize->x*terrainSize->y, inFile) == 0)
+    if (size_x < 2 || size_y < 2)
     {
-      printf ("Unable to read terrain data from file: %s\n", terrainName);
+      printf ("Bad terrain size in terrain file: %s\n", terrainName);
+      fclose(inFile);
       return SX3_ERROR_BAD_FILE;
     }
 
-    mapPtr = buffer;
-    for (j=0; j<terrainSize->y; j++) {
-        for (i=0; i<terrainSize->x; i++) {
-                if(SDL_BYTEORDER == SDL_BIG_ENDIAN)
-                    dummy = SDL_Swap16(*tmpbuf);
-                else
-                    dummy = *tmpbuf;
-                *mapPtr = (float)dummy/MAX_FILE_TERRAIN_HEIGHT*MAX_TERRAIN_HEIGHT;
-                mapPtr++;
-                tmpbuf++;
-        }
+    printf("Loading the terrain\n");
+
+    retcode = sx3_alloc_terrain_pages(size_x, size_y, NULL);
+    row = malloc(size_x*sizeof(short));
+    if (retcode != SX3_ERROR_SUCCESS || !row)
+    {
+      free(row);
+      sx3_unload_terrain();
+      fclose(inFile);
+      return SX3_ERROR_MEM_ALLOC;
     }
 
-    free(origbuf);
+    // The heights are read a row at a time into the pages.  Rows past the
+    // end of a short file are left at 0.
+    for (y=0; y<size_y; y++)
+    {
+        memset(row, 0, size_x*sizeof(short));
+        values_read += fread(row, 2, size_x, inFile);
+
+        if(SDL_BYTEORDER == SDL_BIG_ENDIAN)
+            for (x=0; x<size_x; x++)
+                row[x] = SDL_Swap16(row[x]);
+        sx3_set_terrain_row(Terrain_Heights, y, 0, size_x, row);
+    }
+    free(row);
     fclose(inFile);
 
-    // Calculate Terrain Normals (For each triangle) 
-    mapPtr = buffer;
-    for (j=0; j<terrainSize->y-1; j++)
+    if (values_read == 0)
     {
-        for (i=0; i<terrainSize->x-1; i++)
-        {
-            v1.x = -1.0F/MAX_MAP_Y*MAX_TERRAIN_DEPTH;
-            v1.y = *(mapPtr+terrainSize->x) - *(mapPtr);
-            v1.z = 0;
-            v2.x = 0;
-            v2.y = *(mapPtr+1) - *(mapPtr);
-            v2.z = 1.0F/MAX_MAP_X*MAX_TERRAIN_WIDTH;
-
-            *(normalBuffer + 2*i + (terrainSize->x-1)*2*j) = sx3_norm_cross_prod(v1, v2);
-
-            v1.x = 1.0F/MAX_MAP_Y*MAX_TERRAIN_DEPTH;
-            v1.y = *(mapPtr+1) - *(mapPtr+terrainSize->x+1);
-            v1.z = 0;
-            v2.x = 0;
-            v2.y = *(mapPtr+terrainSize->x) - *(mapPtr+terrainSize->x+1);
-            v2.z = -1.0F/MAX_MAP_X*MAX_TERRAIN_WIDTH;
-
-            *(normalBuffer + 1 + 2*i + (terrainSize->x-1)*2*j) = sx3_norm_cross_prod(v1, v2);
-            
-            mapPtr++;
-        }
-        mapPtr++;
+      printf ("Unable to read terrain data from file: %s\n", terrainName);
+      sx3_unload_terrain();
+      return SX3_ERROR_BAD_FILE;
     }
 
-    // Calculate Terrain Normals (for each vertex)
-    // these are calculated by averaging the normals for all 
-    // surrounding triangles
-    normalAvgPtr = normalAvgBuffer;
-    for (j=0; j<terrainSize->y; j++)
-        for (i=0; i<terrainSize->x; i++)
-        {
-            avgCount=0;
-            normalAvgPtr->x = 0;
-            normalAvgPtr->y = 0;
-            normalAvgPtr->z = 0;
-
-            // I know, I know: the following code is very ugly.  It is cut and
-            // paste from the old code just above (commented out) that did
-            // not tile the terrain map.  
-            // In the future, I will consider beautifying this code, but for 
-            // the moment it will suffice 
-            normalAvgPtr->x += (normalBuffer+TILE_MOD(i-1,terrainSize->x)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            normalAvgPtr->x += (normalBuffer+1+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+1+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+1+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            avgCount += 2;
-
-            normalAvgPtr->x += (normalBuffer+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            normalAvgPtr->x += (normalBuffer+1+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+1+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+1+TILE_MOD(i-1,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            avgCount += 2;
-
-            normalAvgPtr->x += (normalBuffer+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            normalAvgPtr->x += (normalBuffer+1+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+1+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+1+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j-1,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            avgCount += 2;
-
-            normalAvgPtr->x += (normalBuffer+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            normalAvgPtr->x += (normalBuffer+1+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->x;
-            normalAvgPtr->y += (normalBuffer+1+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->y;
-            normalAvgPtr->z += (normalBuffer+1+TILE_MOD(i,terrainSize->x-1)*2+TILE_MOD(j,terrainSize->x-1)*(terrainSize->x-1)*2)->z;
-            avgCount += 2;
-
-            normalAvgPtr->x /= avgCount;
-            normalAvgPtr->y /= avgCount;
-            normalAvgPtr->z /= avgCount;
-    
-            normalAvgPtr++;
-        }  // Calculating average normal for each vertex 
+    // The file heights are already quantized, so we keep them as they are
+    g_terrain_height_scale  = MAX_TERRAIN_HEIGHT/MAX_FILE_TERRAIN_HEIGHT;
+    g_terrain_height_offset = 0.0F;
 
-    return SX3_ERROR_SUCCESS;
+    return build_terrain();
 }  // sx3_load_terrain 
 
+
+// sx3_generate_terrain
+//
+// Makes a new size_x by size_y terrain from a seed (see sx3_terrain_gen.h)
+// in place of the current one.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_BAD_PARAMS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_generate_terrain(int size_x, int size_y, unsigned int seed)
+{
+    float *heights;
+    int x, y, n = size_x*size_y;
+    SX3_ERROR_CODE retcode;
+
+    sx3_unload_terrain();
+    if (!terrain_lock)
+        terrain_lock = SDL_CreateMutex();
+    sx3_load_terrain_gradient(g_terrain_gradient);
+
+    if (size_x < 2 || size_y < 2)
+        return SX3_ERROR_BAD_PARAMS;
+
+    printf("Generating a %dx%d terrain from seed %u\n", size_x, size_y, seed);
+
+    retcode = sx3_alloc_terrain_pages(size_x, size_y, NULL);
+    heights = malloc(n*sizeof(float));
+    if (retcode != SX3_ERROR_SUCCESS || !heights)
+    {
+        free(heights);
+        sx3_unload_terrain();
+        return SX3_ERROR_MEM_ALLOC;
+    }
+
+    retcode = sx3_generate_terrain_heights(heights, size_x, size_y, seed);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+        free(heights);
+        sx3_unload_terrain();
+        return retcode;
+    }
+
+    // The same steps as a .ter file, which leaves plenty of room for craters
+    g_terrain_height_scale  = MAX_TERRAIN_HEIGHT/MAX_FILE_TERRAIN_HEIGHT;
+    g_terrain_height_offset = 0.0F;
+    for (y=0; y<size_y; y++)
+        for (x=0; x<size_x; x++)
+            TERRAIN_RAW_HEIGHT(x, y) =
+                sx3_quantize_terrain_height(heights[x + y*size_x]);
+    free(heights);
+
+    return build_terrain();
+}  // sx3_generate_terrain
+
+
+
+// sx3_quantize_terrain_height
+//
+// Converts a height in meters to the value stored in the terrain pages,
+// clamping it to the range that can be stored.
+short sx3_quantize_terrain_height(float height)
+{
+    float q = (height - g_terrain_height_offset) / g_terrain_height_scale;
+
+    if (q >= 32767.0F)
+        return 32767;
+    if (q <= -32768.0F)
+        return -32768;
+    return (short)floor(q + 0.5F);
+}  // sx3_quantize_terrain_height
+
    
+// terrain_ring_level
+//
+// Returns the detail level of the ring that a point dist grid units away
+// from the viewer falls in, or -1 if it is outside the outermost ring.
+// Level 0 is full detail, and each ring is 1<<terrain.detail.skip times as
+// wide as the one inside it.
+static int terrain_ring_level(float dist)
+{
+    int detail_level, skip = g_terrain_detail_skip;
+
+    if (skip <= 0)
+        skip = 1;
+
+    for (detail_level=0; detail_level<g_terrain_detail_levels; detail_level+=skip)
+    {
+        if (dist < (float)(1<<(g_terrain_detail_cutoff+detail_level)))
+            return detail_level;
+    }
+
+    return -1;
+}  // terrain_ring_level
+
+
+// terrain_geomipmap_level
+//
+// Returns the coarsest mip level of a chunk whose geometric error, projected
+// onto the screen, stays within terrain.detail.tolerance pixels.  The error
+// is projected from the nearest point of the chunk's bounding sphere.
+// error_scale is the number of pixels that one meter covers one meter in
+// front of the viewer, given the projection set up by resize.
+static int terrain_geomipmap_level(
+    const struct Terrain_Chunk *chunk,
+    const struct Point *center,
+    const struct Point *eye_point,
+    float error_scale)
+{
+    float dx = center->x - eye_point->x;
+    float dy = center->y - eye_point->y;
+    float dz = center->z - eye_point->z;
+    float dist = fast_sqrt(dx*dx + dy*dy + dz*dz + 1.0F) - chunk->radius;
+    float max_error;
+    int level;
+
+    if (dist < METERS_PER_MAP_GRID)
+        dist = METERS_PER_MAP_GRID;
+    max_error = g_terrain_detail_tolerance * dist / error_scale;
+
+    for (level=TERRAIN_CHUNK_LEVELS-1; level>0; level--)
+    {
+        if (chunk->error[level] <= max_error)
+            break;
+    }
+
+    return level;
+}  // terrain_geomipmap_level
+
+
+// terrain_cdlod_level
+//
+// Returns the level of a chunk whose nearest point is dist grid units from
+// the viewer, along with the distances over which its vertices morph into
+// the next coarser level.  Level n is used out to terrain.detail.range<<n
+// grid units, and the vertices finish morphing right at that distance, so
+// a chunk always meets a coarser neighbour with the neighbour's surface.
+//
+// Each range is more than a chunk wider than the one before, so the
+// chunks next to a chunk are never more than one level coarser, and a
+// coarser neighbour does not start morphing before the finer chunk ends.
+static int terrain_cdlod_level(
+    float dist,
+    float *morph_start,
+    float *morph_end)
+{
+    int range = g_terrain_detail_range;
+    float morph = g_terrain_detail_morph;
+    float prev_end;
+    int level;
+
+    if (range <= TERRAIN_CHUNK_SIZE)
+        range = TERRAIN_CHUNK_SIZE + 1;
+    RANGE_CHECK(morph, 0.0F, 1.0F);
+
+    for (level=0; level<TERRAIN_CHUNK_LEVELS-1; level++)
+    {
+        if (dist < (float)(range<<level))
+            break;
+    }
+
+    *morph_end = (float)(range<<level);
+    *morph_start = *morph_end * (1.0F - morph);
+    if (level > 0)
+    {
+        prev_end = (float)(range<<(level-1));
+        if (*morph_start < prev_end + TERRAIN_CHUNK_SIZE)
+            *morph_start = prev_end + TERRAIN_CHUNK_SIZE;
+    }
+    if (*morph_start > *morph_end - 1.0F)
+        *morph_start = *morph_end - 1.0F;
+
+    return level;
+}  // terrain_cdlod_level
+
+
 // sx3_draw_terrain
 //
-// Draws the terrain in OpenGL.  At this point, the terrain is not
-// in a compiled list because we are only drawing the terrain right
-// around the viewer (and not the whole thing), so the terrain being
-// drawn will be constantly changing.
+// Draws the terrain in OpenGL.  The terrain is drawn from the cached chunk
+// meshes built in sx3_load_terrain.  The chunks are culled against the view
+// frustum with the terrain quadtree and, if terrain.horizon is set, against
+// the horizon seen from the viewer.  Each visible chunk within the
+// outermost detail ring is drawn, front to back, at a stride picked by
+// terrain.detail.alg: the stride of the ring it falls in, the coarsest mip
+// level whose error is not noticeable on screen, or a distance based level
+// that morphs smoothly into the next one.  Since the terrain map tiles, a
+// chunk may be drawn more than once, translated to each copy of the map
+// that is in view.
+//
+// The terrain is locked only while craters are caught up with and the
+// visible chunks are paged in, and again while chunks are built ahead of
+// the viewer; the chunks are drawn from their own vertex arrays, so the
+// simulation can go on changing the heights meanwhile.
 SX3_ERROR_CODE sx3_draw_terrain( 
     struct Point current_pos, 
     struct Point current_view_dir,
     struct Point current_up_vector)
 {
-    int x,y, startx, starty, nexty, endx, endy;
-    int cutoff_startx, cutoff_endx, cutoff_starty, cutoff_endy;
-    struct Color vColor = {0.0, 0.0, 0.0, 1.0};
-    struct Point temp_point;
     float current_map_x, current_map_y;  // Map coords of user pos 
-    struct IPoint map_pt;
-    struct Point gl_pt;
-    struct Point gl_norm;
-    float cosfov = cos(g_fov);
-    
-    int skip, radius, cutoff, detail_level;
+    float view_radius, eye_x, eye_y, morph_start, morph_end;
+    float error_scale = g_window_size.y / (2.0F*tan(g_fov*0.5F));
+    int detail_level, skip, level, stride, i, num_visible, kx, ky;
+    struct Terrain_Frustum frustum;
+    const struct Terrain_Visible *visible;
+    struct Terrain_Chunk *chunk;
+    struct Point offset, center;
+    static struct Point last_pos;
+    static Uint32 last_ticks = 0;
+    Uint32 ticks;
+    float dt;
+
+    memset(&g_terrain_stats, 0, sizeof(g_terrain_stats));
+    if (!g_terrain_chunks)
+        return SX3_ERROR_SUCCESS;
+
+    // Catch up with any craters made since the last frame.  The chunks
+    // paged in below are filled from the heights, so the simulation can't
+    // make more until they are all done.
+    sx3_lock_terrain();
+    sx3_flush_terrain_deformations();
+
+    current_map_x = GL_Z_TO_MAP_X(current_pos.z);
+    current_map_y = GL_X_TO_MAP_Y(current_pos.x);
+
+    // The outermost detail ring determines how much terrain we draw
+    skip = (g_terrain_detail_skip > 0) ? g_terrain_detail_skip : 1;
+    for (detail_level=0; detail_level+skip<g_terrain_detail_levels; detail_level+=skip)
+        ;
+    view_radius = (float)(1<<(g_terrain_detail_cutoff+detail_level));
+
+    // The frustum matches the projection set up by resize
+    sx3_build_terrain_frustum(&frustum, current_pos, current_view_dir,
+                              current_up_vector, g_fov,
+                              (float)g_window_size.x / g_window_size.y,
+                              SX3_Z_NEAR, SX3_Z_FAR);
+
+    num_visible = sx3_find_visible_terrain_chunks(&frustum,
+                      current_map_x, current_map_y, view_radius, &visible);
+    g_terrain_stats.chunks_in_frustum = num_visible;
+    if (g_terrain_horizon)
+        num_visible = sx3_cull_terrain_horizon(current_map_x, current_map_y,
+                                               current_pos.y);
+    g_terrain_stats.chunks_over_horizon = num_visible;
+
+    // Bring every chunk that will be drawn into the cache, then let the
+    // simulation have the terrain back
+    sx3_next_terrain_frame();
+    for (i=0; i<num_visible; i++)
+    {
+        if (terrain_ring_level(visible[i].dist) >= 0)
+            sx3_page_in_terrain_chunk(visible[i].chunk);
+    }
+    sx3_unlock_terrain();
 
     // Pick material 
     glMaterialfv(GL_FRONT,GL_AMBIENT,terrain_ambient);
@@ -418,229 +812,105 @@ SX3_ERROR_CODE sx3_draw_terrain(
     glMaterialfv(GL_FRONT,GL_SHININESS,terrain_shininess);
     glDisable(GL_TEXTURE_2D);
 
-    current_map_x = (int)GL_Z_TO_MAP_X(current_pos.z);
-    current_map_y = (int)GL_X_TO_MAP_Y(current_pos.x);
-
-    for (detail_level=0; detail_level<g_terrain_detail_levels; detail_level+=g_terrain_detail_skip)
-    {
-        skip   = 1<<detail_level;
-        radius = 1<<(g_terrain_detail_cutoff+detail_level);
-        cutoff = 1<<(g_terrain_detail_cutoff+detail_level-g_terrain_detail_skip);
-
-        // calculating start and cutoff_start values ends up being complicated.
-        // Keep in mind that we need to place the terrain exactly centered on
-        // our current eye_point 
-        startx = SNAP_TO_LOW_RES((int)current_map_x - radius + (skip<<(g_terrain_detail_skip-1)), (skip<<g_terrain_detail_skip));
-        starty = SNAP_TO_LOW_RES((int)current_map_y - radius + (skip<<(g_terrain_detail_skip-1)), (skip<<g_terrain_detail_skip));
-        endx   = SNAP_TO_LOW_RES((int)current_map_x + radius + (skip<<(g_terrain_detail_skip-1)), (skip<<g_terrain_detail_skip));
-        endy   = SNAP_TO_LOW_RES((int)current_map_y + radius + (skip<<(g_terrain_detail_skip-1)), (skip<<g_terrain_detail_skip));
-
-        cutoff_startx = SNAP_TO_LOW_RES (current_map_x-cutoff + (skip>>1), skip); 
-        cutoff_endx   = SNAP_TO_LOW_RES (current_map_x+cutoff + (skip>>1), skip);
-        cutoff_starty = SNAP_TO_LOW_RES (current_map_y-cutoff + (skip>>1), skip); 
-        cutoff_endy   = SNAP_TO_LOW_RES (current_map_y+cutoff + (skip>>1), skip);
-
-        // temp_point is the eye_point for the terrain visibility cone:
-        // ie:  what is in our fov?
-        temp_point = current_pos;
-        temp_point.x-=current_view_dir.x*6;
-        temp_point.y-=current_view_dir.y*6;
-        temp_point.z-=current_view_dir.z*6;
-        current_view_dir = sx3_normalize (current_view_dir);
-
-        // Begin terrain rendering, vertex by vertex ...
-        for (y=starty; y<endy; y=nexty)
+    sx3_begin_terrain_chunks();
+
+    kx = ky = 0;
+    glPushMatrix();
+    for (i=0; i<num_visible; i++)
+    {
+        chunk = visible[i].chunk;
+
+        level = terrain_ring_level(visible[i].dist);
+        if (level < 0)
+            continue;
+        g_terrain_stats.chunks_drawn++;
+
+        // Move to the copy of the map that the chunk is in
+        offset.x = -(float)(visible[i].ky*g_terrain_size.y)*METERS_PER_MAP_GRID;
+        offset.y = 0.0F;
+        offset.z =  (float)(visible[i].kx*g_terrain_size.x)*METERS_PER_MAP_GRID;
+        if (visible[i].kx != kx || visible[i].ky != ky)
         {
-            nexty = y + skip;
-
-            // Start the rendering 
-            glBegin(GL_TRIANGLE_STRIP);
-                for (x=startx; x<=endx; x+=skip)
-                {
-                    // Skip the "middle section" 
-                    if ( detail_level && // Detail level 0 will not have a hole in the middle 
-                         x > cutoff_startx &&
-                         x < cutoff_endx &&
-                         nexty > cutoff_starty && // Don't forget - triag strips run West to East 
-                         y < cutoff_endy )
-                    {
-                        glEnd ();
-                        glBegin (GL_TRIANGLE_STRIP);
-                        x+=((cutoff-skip)*2);
-                        continue;
-                    }
-
-                    // Calculate Height Field index for the vertices to render 
-                    // Interpolate the edges 
-                    if (y==starty || x==startx || x==endx)
-                    {
-                        sx3_interpolated_terrain_point (
-                            MAP_Y_TO_GL_X (y),
-                            MAP_X_TO_GL_Z (x),
-                            skip<<g_terrain_detail_skip,
-                            &gl_pt,
-                            &gl_norm);
-                    }
-                    else
-                        map_pt_to_mesh_pt (x,y,
-                            detail_level,skip,&map_pt,&gl_pt,&gl_norm);
-
-                    // Make sure that the vertex is within our fov 
-                    if (!is_point_in_fov(
-                        &current_view_dir, &temp_point, &current_up_vector,
-                        gl_pt.x, gl_pt.y, gl_pt.z, cosfov))
-                    {
-                        // FIX ME!! No need to call these functions so many times.
-                        glEnd ();
-                        glBegin (GL_TRIANGLE_STRIP);
-                        continue;
-                    }
-
-                    // Render this vertex 
-                    glNormal3f(gl_norm.x,
-                               gl_norm.y,
-                               gl_norm.z);
-                    vColor = calculate_vertex_color(gl_pt.y);
-                    glMaterialfv(GL_FRONT,GL_DIFFUSE, (GLfloat*)&(vColor.r));
-                    glVertex3f (gl_pt.x,
-                                gl_pt.y,
-                                gl_pt.z);
-        
-                    // Interpolate the edges 
-                    if (nexty==endy || x==startx || x==endx) 
-                    {
-                        sx3_interpolated_terrain_point (
-                            MAP_Y_TO_GL_X (nexty),
-                            MAP_X_TO_GL_Z (x),
-                            skip<<g_terrain_detail_skip,
-                            &gl_pt,
-                            &gl_norm);
-                    }
-                    else
-                        map_pt_to_mesh_pt (x,nexty,
-                            detail_level,skip,&map_pt,&gl_pt,&gl_norm);
-
-                    // Render the southern vertex 
-                    glNormal3f(gl_norm.x,
-                               gl_norm.y,
-                               gl_norm.z);
-                    vColor = calculate_vertex_color(gl_pt.y);
-                    glMaterialfv(GL_FRONT,GL_DIFFUSE, (GLfloat*)&(vColor.r));
-                    glVertex3f( gl_pt.x,
-                                gl_pt.y,
-                                gl_pt.z );
-                }  // for x ... 
-            glEnd();
-        }  // for y .... 
-    }  // for detail_level ... 
+            kx = visible[i].kx;
+            ky = visible[i].ky;
+            glPopMatrix();
+            glPushMatrix();
+            glTranslatef(offset.x, offset.y, offset.z);
+        }
 
-    return SX3_ERROR_SUCCESS;
-}  // sx3_draw_terrain 
+        if (g_terrain_detail_alg == Terrain_Detail_Cdlod)
+        {
+            // The viewer, relative to this copy of the map
+            eye_x = current_map_x - (float)(kx*g_terrain_size.x);
+            eye_y = current_map_y - (float)(ky*g_terrain_size.y);
+
+            level = terrain_cdlod_level(visible[i].dist,
+                        &morph_start, &morph_end);
+            sx3_draw_terrain_chunk_morphed(chunk, level, eye_x, eye_y,
+                                           morph_start, morph_end);
+            continue;
+        }
 
+        if (g_terrain_detail_alg == Terrain_Detail_Geomipmap)
+        {
+            center.x = chunk->center.x + offset.x;
+            center.y = chunk->center.y;
+            center.z = chunk->center.z + offset.z;
+            level = terrain_geomipmap_level(chunk, &center,
+                        &current_pos, error_scale);
+        }
 
-// calculate_vertex_color
-struct Color calculate_vertex_color(float height)
-{
-    struct Color c;
-    float heightRange = MAX_TERRAIN_HEIGHT;
-    float height_normalized = (height)/heightRange;
-    int selector = height_normalized * 10;
-
-    c.a = 1.0;
-
-    // The selector is ten times height_normalized, so a value of 0 means
-    // that height_normalized is between 0.0 and 0.1, a value of 1 means that
-    // height_normalized is between 0.1 and 0.2, etc.
-    switch(selector) {
-        case 0: // 0.0 to 0.1
-            c.r = 0.2F;
-            c.g = 0.6F;
-            c.b = 0.2F;
-            break;
-        case 1: // 0.1 to 0.2
-            c.r = 0.2F + (height_normalized - 0.1F)*10.0F*0.33F;
-            c.g = 0.6F - (height_normalized - 0.1F)*10.0F*0.53F;
-            c.b = 0.0F + (height_normalized - 0.1F)*10.0F*0.11F;
-            RANGE_CHECK(c.r, 0.0, 1.0);
-            RANGE_CHECK(c.g, 0.0, 1.0);
-            RANGE_CHECK(c.b, 0.0, 1.0);
-            break;
-        case 2: // 0.2 to 0.3
-            c.r = 0.53F;
-            c.g = 0.47F;
-            c.b = 0.31F;
-            break;
-        case 3: // 0.3 to 0.4
-            c.r = 0.53F + (height_normalized - 0.3F)*10.0F*0.47F;
-            c.g = 0.47F + (height_normalized - 0.3F)*10.0F*0.53F;
-            c.b = 0.31F + (height_normalized - 0.3F)*10.0F*0.69F;
-            RANGE_CHECK(c.r, 0.0, 1.0);
-            RANGE_CHECK(c.g, 0.0, 1.0);
-            RANGE_CHECK(c.b, 0.0, 1.0);
-            break;
-        default: // 0.4 and greater
-            c.r = 1.0F;
-            c.g = 1.0F;
-            c.b = 1.0F;
+        stride = 1<<level;
+        if (stride > TERRAIN_CHUNK_SIZE)
+            stride = TERRAIN_CHUNK_SIZE;
+        sx3_draw_terrain_chunk(chunk, stride);
     }
+    glPopMatrix();
 
-    return c;
-}  // calculate_vertex_color 
+    sx3_end_terrain_chunks();
 
+    // Get the terrain ready where the viewer is heading.  A jump of more
+    // than a second between frames is taken as a teleport.
+    ticks = SDL_GetTicks();
+    dt = (ticks - last_ticks) * 0.001F;
+    if (last_ticks && dt > 0.0F && dt < 1.0F)
+    {
+        sx3_lock_terrain();
+        sx3_prefetch_terrain_chunks(
+            current_map_x + GL_Z_TO_MAP_X(current_pos.z - last_pos.z) *
+                            TERRAIN_PREFETCH_TIME / dt,
+            current_map_y - (current_pos.x - last_pos.x) / METERS_PER_MAP_GRID *
+                            TERRAIN_PREFETCH_TIME / dt,
+            view_radius, 1);
+        sx3_unlock_terrain();
+    }
+    last_pos = current_pos;
+    last_ticks = ticks;
+
+    return SX3_ERROR_SUCCESS;
+}  // sx3_draw_terrain 
 
-// is_point_in_fov
-int is_point_in_fov(
-    struct Point *view_dir,
-    struct Point *eye_point,
-    struct Point *up_dir,
-    float test_x,
-    float test_y,
-    float test_z,
-    float cosfov)
-{
-    struct Point test_dir;
-    float dot;
-    float mag;
-
-    // Find the direction of the test point.
-    test_dir.x = test_x - eye_point->x;
-    test_dir.y = test_y - eye_point->y;
-    test_dir.z = test_z - eye_point->z;
-
-    // Find the dot product of the test vector and the view vector.
-    // This result is not normalized.
-    dot = view_dir->x * test_dir.x +
-          view_dir->y * test_dir.y +
-          view_dir->z * test_dir.z;
-
-    // Perform this test early to get better performance.
-    if(dot <= 0)
-        return 0;
-
-    // Find the magnitude of the test vector.
-    mag = test_dir.x*test_dir.x + test_dir.y*test_dir.y + test_dir.z*test_dir.z;
-    if(mag == 0.0)
-        return 0;
-    // mag = sqrt(mag);
-    mag = fast_sqrt(mag);
-
-    // Now, return the result of the fov test.
-    // Note that the dot product of two unit vectors is equal to the cosine
-    // of the included angle.  The point is outside our fov if this included
-    // angle is less than the value in fov.
-    // return (acos(dot/mag)<fov);
-    // return (fov_lookup[(int)(dot/mag*FOV_TABLE_SIZE)] < fov);
-    return (dot/mag) > cosfov;
-}  // is_point_in_fov 
 
 // This one is for the physics engine 
 float sx3_find_terrain_height(float x, float y) {
-    return sx3_interpolated_terrain_height(x, y, 1);
+    float height = 0.0F;
+
+    sx3_sample_terrain_heights(&x, &y, &height, NULL, 1);
+    return height;
+}
+
+// And this one is for stepping a batch of projectiles
+void sx3_find_terrain_heights(const float *x, const float *y, float *heights,
+                              int count) {
+    sx3_sample_terrain_heights(x, y, heights, NULL, count);
 }
 
 // sx3_interpolated_terrain_height
 //
 // Returns the interpolated height of any particular point on the terrain.
+// The heights are looked up in the pages they are in; a page of a mapped
+// file that has been handed back is read in again (see
+// sx3_terrain_pages.h).
 float sx3_interpolated_terrain_height(
     float x,    // GL x coord 
     float z,    // GL y coord 
@@ -665,12 +935,6 @@ float sx3_interpolated_terrain_height(
     int TMyy = TILE_MOD(int_y, g_terrain_size.y);
     int TMry = TILE_MOD(int_y + res, g_terrain_size.y);
 
-    // Calculate the index (into the heightfield) of the vertices 
-    int nw_hf_index = (TMxx) + (TMyy) * g_terrain_size.x;
-    int ne_hf_index = (TMrx) + (TMyy) * g_terrain_size.x;
-    int sw_hf_index = (TMxx) + (TMry) * g_terrain_size.x;
-    int se_hf_index = (TMrx) + (TMry) * g_terrain_size.x;
-
     // Do some more greedy calculations 
     float gl_x = MAP_Y_TO_GL_X(int_y);
     float gl_z = MAP_X_TO_GL_Z(int_x);
@@ -688,15 +952,15 @@ float sx3_interpolated_terrain_height(
         // Process northwest triangle 
         nw.x    = gl_x;
         nw.z    = gl_z;
-        nw.y    = g_terrain_vertex_height [nw_hf_index];
+        nw.y    = TERRAIN_HEIGHT (TMxx, TMyy);
 
         ne.x    = gl_x;
         ne.z    = gl_zr;
-        ne.y    = g_terrain_vertex_height [ne_hf_index];
+        ne.y    = TERRAIN_HEIGHT (TMrx, TMyy);
 
         sw.x    = gl_xr;
         sw.z    = gl_z;
-        sw.y    = g_terrain_vertex_height [sw_hf_index];
+        sw.y    = TERRAIN_HEIGHT (TMxx, TMry);
 
         // Calculate "left" vertex 
         alpha = (x-sw.x) / (nw.x-sw.x);
@@ -717,15 +981,15 @@ float sx3_interpolated_terrain_height(
         // Process southeast triangle 
         ne.x    = gl_x;
         ne.z    = gl_zr;
-        ne.y    = g_terrain_vertex_height [ne_hf_index];
+        ne.y    = TERRAIN_HEIGHT (TMrx, TMyy);
 
         sw.x    = gl_xr;
         sw.z    = gl_z;
-        sw.y    = g_terrain_vertex_height [sw_hf_index];
+        sw.y    = TERRAIN_HEIGHT (TMxx, TMry);
 
         se.x    = gl_xr;
         se.z    = gl_zr;
-        se.y    = g_terrain_vertex_height [se_hf_index];
+        se.y    = TERRAIN_HEIGHT (TMrx, TMry);
 
         // Calculate "left" vertex 
         alpha = (x-sw.x) / (ne.x-sw.x);
@@ -747,36 +1011,6 @@ float sx3_interpolated_terrain_height(
 }  // sx3_interpolated_terrain_height 
 
 
-// sx3_interpolated_terrain_point
-SX3_ERROR_CODE sx3_interpolated_terrain_point(
-    float x,
-    float z,
-    int res,
-    struct Point *pt,
-    struct Point *norm
-    )
-{
-    float grid_x = GL_Z_TO_MAP_X (z);
-    float grid_y = GL_X_TO_MAP_Y (x);
-
-    switch (g_terrain_detail_alg)
-    {
-    case 0:
-        pt->x = x;
-        pt->z = z;    
-        pt->y = sx3_interpolated_terrain_height (x, z, res);
-        *norm = g_terrain_vertex_normal [(TILE_MOD((int)grid_x,g_terrain_size.x)) +
-            ((TILE_MOD((int)grid_y,g_terrain_size.y)) * g_terrain_size.x)];    
-
-        return SX3_ERROR_SUCCESS;
-        break;
-    }  // end switch 
-
-    return SX3_ERROR_SUCCESS;
-}  // sx3_interpolated_terrain_point 
-    
-
-
 // interpolate_height
 //
 // This function bi-linearly interpolates a height given 4 other heights
@@ -840,6 +1074,14 @@ SX3_ERROR_CODE interpolate_height(
 
 SX3_ERROR_CODE sx3_unload_terrain(void)
 {
+    sx3_free_terrain_quadtree();
+    sx3_free_terrain_chunks();
+    sx3_free_terrain_pyramid();
+
+    // The pages of a .ter2 file belong to the mapped file
+    sx3_free_terrain_pages();
+    sx3_close_terrain_file();
+    num_dirty_rects = 0;
     return SX3_ERROR_SUCCESS;
 }  // sx3_unload_terrain 
 
@@ -866,57 +1108,352 @@ void sx3_draw_terrain_lights()
 }  // sx3_draw_terrain_lights  
 
 
-// map_pt_to_mesh_pt
+// merge_dirty_rects
 //
-// This function takes as input a terrain map coordinate.  From this, we
-// calculate the "corrected" coord and gl pos and gl norm.  The meaning
-// of corrected depends on what LOD algorithm we are using.
+// Returns the smallest rectangle that holds both a and b.
+static struct Dirty_Rect merge_dirty_rects(const struct Dirty_Rect *a,
+                                           const struct Dirty_Rect *b)
+{
+    struct Dirty_Rect m = *a;
+
+    if (b->x0 < m.x0) m.x0 = b->x0;
+    if (b->y0 < m.y0) m.y0 = b->y0;
+    if (b->x1 > m.x1) m.x1 = b->x1;
+    if (b->y1 > m.y1) m.y1 = b->y1;
+    return m;
+}  // merge_dirty_rects
+
+
+// add_dirty_rect
 //
-// IMPORTANT: x and y MUST be divisible by skip!!!!!!!
-// 
-// INPUT:    x,y = Original map coords          
-//            level = LOD (0=full, 1=half detail, 2=quarter detail
-//            skip = 1<<level
-// OUTPUT:    new_p = "corrected" point (in map coords)    
-//            new_gl_p = "corrected" gl position 
-//            new_n = "corrected" gl normal 
-// RETURN:    SX3_ERROR_SUCCESS
-SX3_ERROR_CODE map_pt_to_mesh_pt(
-    int           x,           // original map coords 
-    int           y,
-    int           level,       // 0=full detail, 1=half detail, 2=quarter det 
-    int           skip,        // 1<<level 
-    struct IPoint *new_p,      // Corrected point (in map coords) 
-    struct Point  *new_gl_p,   // Corrected gl position 
-    struct Point  *new_n       // Corrected gl normal 
-    )
+// Adds a rectangle to the deformations waiting to be flushed.  Rectangles
+// that touch are merged, so a volley of shells landing in the same place
+// is only dealt with once.
+static void add_dirty_rect(struct Dirty_Rect r)
 {
-    int v_index;
-
-    switch (g_terrain_detail_alg)
-    {
-        case 0:  // Simple "square" LOD 
-            // First, snap the coords to the correct level of detail 
-            new_p->x = x;//SNAP_TO_LOW_RES (x, skip);
-            new_p->y = y;//SNAP_TO_LOW_RES (y, skip);
-
-            // Nex, calculate the gl position and normal of this point 
-            v_index    = (TILE_MOD(new_p->x,g_terrain_size.x)) + 
-                ((TILE_MOD(new_p->y,g_terrain_size.y)) * g_terrain_size.x);   
-            new_gl_p->z = MAP_X_TO_GL_Z (new_p->x);
-            new_gl_p->x = MAP_Y_TO_GL_X (new_p->y);
-            new_gl_p->y = g_terrain_vertex_height [v_index];
-            *new_n      = g_terrain_vertex_normal [v_index];
-            
-            return SX3_ERROR_SUCCESS;
-            break;
-    }  // end switch 
-        
-    return SX3_ERROR_SUCCESS;
-}  // map_pt_to_mesh_pt 
+    struct Dirty_Rect m;
+    int i, shift, best, area, best_area;
+
+    // Move the rectangle onto the map
+    shift = TILE_MOD(r.x0, g_terrain_size.x) - r.x0;
+    r.x0 += shift;
+    r.x1 += shift;
+    shift = TILE_MOD(r.y0, g_terrain_size.y) - r.y0;
+    r.y0 += shift;
+    r.y1 += shift;
+
+    // Merging may make the rectangle touch ones that it missed before, so
+    // start over after each merge
+    for (i=0; i<num_dirty_rects; )
+    {
+        if (dirty_rects[i].x0 <= r.x1 && r.x0 <= dirty_rects[i].x1 &&
+            dirty_rects[i].y0 <= r.y1 && r.y0 <= dirty_rects[i].y1)
+        {
+            r = merge_dirty_rects(&dirty_rects[i], &r);
+            dirty_rects[i] = dirty_rects[--num_dirty_rects];
+            i = 0;
+        }
+        else
+            i++;
+    }
+
+    // If we're out of room, merge with the rectangle that grows the least.
+    // (Catching up here instead would rebuild chunk meshes on the
+    // simulation thread, while they are being drawn.)
+    if (num_dirty_rects == MAX_TERRAIN_DIRTY_RECTS)
+    {
+        best = 0;
+        best_area = -1;
+        for (i=0; i<num_dirty_rects; i++)
+        {
+            m = merge_dirty_rects(&dirty_rects[i], &r);
+            area = (m.x1 - m.x0)*(m.y1 - m.y0) -
+                   (dirty_rects[i].x1 - dirty_rects[i].x0)*
+                   (dirty_rects[i].y1 - dirty_rects[i].y0);
+            if (best_area < 0 || area < best_area)
+            {
+                best = i;
+                best_area = area;
+            }
+        }
+        r = merge_dirty_rects(&dirty_rects[best], &r);
+        dirty_rects[best] = dirty_rects[--num_dirty_rects];
+    }
+
+    // There is no point in updating more than the whole map
+    if (r.x1 - r.x0 > g_terrain_size.x)
+    {
+        r.x0 = 0;
+        r.x1 = g_terrain_size.x;
+    }
+    if (r.y1 - r.y0 > g_terrain_size.y)
+    {
+        r.y0 = 0;
+        r.y1 = g_terrain_size.y;
+    }
+
+    dirty_rects[num_dirty_rects++] = r;
+}  // add_dirty_rect
+
+
+// split_dirty_rect
+//
+// Splits a dirty rectangle into the (up to 4) pieces that lie within the
+// map.  Returns the number of pieces.
+static int split_dirty_rect(const struct Dirty_Rect *r, struct Dirty_Rect *pieces)
+{
+    int xs[2][2], ys[2][2];
+    int nx = 1, ny = 1, i, j, n = 0;
+
+    xs[0][0] = r->x0;
+    xs[0][1] = (r->x1 < g_terrain_size.x) ? r->x1 : g_terrain_size.x;
+    if (r->x1 > g_terrain_size.x)
+    {
+        xs[1][0] = 0;
+        xs[1][1] = r->x1 - g_terrain_size.x;
+        nx = 2;
+    }
+
+    ys[0][0] = r->y0;
+    ys[0][1] = (r->y1 < g_terrain_size.y) ? r->y1 : g_terrain_size.y;
+    if (r->y1 > g_terrain_size.y)
+    {
+        ys[1][0] = 0;
+        ys[1][1] = r->y1 - g_terrain_size.y;
+        ny = 2;
+    }
+
+    for (j=0; j<ny; j++)
+    {
+        for (i=0; i<nx; i++, n++)
+        {
+            pieces[n].x0 = xs[i][0];
+            pieces[n].x1 = xs[i][1];
+            pieces[n].y0 = ys[j][0];
+            pieces[n].y1 = ys[j][1];
+        }
+    }
+    return n;
+}  // split_dirty_rect
+
+
+// update_chunk_range
+//
+// Marks chunks cx0..cx1 of rows cy0..cy1 as dirty, or if rebuild is set,
+// rebuilds the ones that are marked.
+static void update_chunk_range(int cx0, int cy0, int cx1, int cy1, int rebuild)
+{
+    struct Terrain_Chunk *chunk;
+    int cx, cy;
+
+    for (cy=cy0; cy<=cy1; cy++)
+    {
+        for (cx=cx0; cx<=cx1; cx++)
+        {
+            chunk = &g_terrain_chunks[cx + cy*g_terrain_num_chunks.x];
+            if (!rebuild)
+            {
+                chunk->dirty = 1;
+            }
+            else if (chunk->dirty)
+            {
+                sx3_rebuild_terrain_chunk(chunk);
+                chunk->dirty = 0;
+            }
+        }
+    }
+}  // update_chunk_range
 
-// Deform the terrain by a sphere defined by a center (x,y,z) and radius r 
-void deform_terrain(float x, float y, float z, float r) {
-    // FIX ME!! I have no idea how to implement this function.  Marc??
-}
 
+// update_dirty_chunks
+//
+// Marks (or rebuilds, see update_chunk_range) every chunk that holds a
+// vertex of a rectangle that lies within the map.  Neighbouring chunks
+// share their edge vertices, and the first vertex of each row and column
+// is also the last vertex of the last chunk.
+static void update_dirty_chunks(const struct Dirty_Rect *r, int rebuild)
+{
+    int cx0 = (r->x0 > 0) ? (r->x0 - 1) / TERRAIN_CHUNK_SIZE : 0;
+    int cy0 = (r->y0 > 0) ? (r->y0 - 1) / TERRAIN_CHUNK_SIZE : 0;
+    int cx1 = (r->x1 - 1) / TERRAIN_CHUNK_SIZE;
+    int cy1 = (r->y1 - 1) / TERRAIN_CHUNK_SIZE;
+    int last_x = g_terrain_num_chunks.x - 1;
+    int last_y = g_terrain_num_chunks.y - 1;
+
+    update_chunk_range(cx0, cy0, cx1, cy1, rebuild);
+    if (r->x0 == 0)
+        update_chunk_range(last_x, cy0, last_x, cy1, rebuild);
+    if (r->y0 == 0)
+        update_chunk_range(cx0, last_y, cx1, last_y, rebuild);
+    if (r->x0 == 0 && r->y0 == 0)
+        update_chunk_range(last_x, last_y, last_x, last_y, rebuild);
+}  // update_dirty_chunks
+
+
+// sx3_flush_terrain_deformations
+//
+// Brings the normals, the square tiles, the ray cast pyramid, the chunk
+// meshes and the culling bounds up to date with the craters made since the last call.
+// Only the parts of the map under the craters are touched, so the cost
+// depends on the size of the craters rather than the size of the map.
+// sx3_draw_terrain calls this once a frame, so all the explosions of a
+// frame are handled together.  (Craters only lower the ground, so ray casts
+// made before the flush may do extra work but never miss.)
+SX3_ERROR_CODE sx3_flush_terrain_deformations(void)
+{
+    struct Dirty_Rect pieces[4];
+    int i, k, num_pieces;
+    SX3_ERROR_CODE retcode = SX3_ERROR_SUCCESS;
+
+    if (num_dirty_rects == 0 || !g_terrain_chunks)
+    {
+        num_dirty_rects = 0;
+        return SX3_ERROR_SUCCESS;
+    }
+
+    // Rectangles may overlap after being split, so the chunks are all
+    // marked before any are rebuilt
+    for (i=0; i<num_dirty_rects; i++)
+    {
+        num_pieces = split_dirty_rect(&dirty_rects[i], pieces);
+        for (k=0; k<num_pieces; k++)
+        {
+            if (sx3_compute_terrain_normals(pieces[k].x0, pieces[k].y0,
+                    pieces[k].x1, pieces[k].y1) != SX3_ERROR_SUCCESS)
+                retcode = SX3_ERROR_MEM_ALLOC;
+            sx3_classify_terrain_tiles(pieces[k].x0, pieces[k].y0,
+                                       pieces[k].x1, pieces[k].y1);
+            sx3_update_terrain_pyramid(pieces[k].x0, pieces[k].y0,
+                                       pieces[k].x1, pieces[k].y1);
+            update_dirty_chunks(&pieces[k], 0);
+        }
+    }
+    for (i=0; i<num_dirty_rects; i++)
+    {
+        num_pieces = split_dirty_rect(&dirty_rects[i], pieces);
+        for (k=0; k<num_pieces; k++)
+            update_dirty_chunks(&pieces[k], 1);
+    }
+    num_dirty_rects = 0;
+
+    sx3_update_terrain_quadtree();
+    return retcode;
+}  // sx3_flush_terrain_deformations
+
+
+// sx3_lock_terrain
+//
+// Craters are made on the simulation thread (see sx3_sim.h), which holds
+// the terrain lock for the whole of each tick.  Any other thread must hold
+// it while it looks at the heights, or brings the rest of the terrain up
+// to date with them.  The lock is made when the first terrain is loaded.
+void sx3_lock_terrain(void)
+{
+    if (terrain_lock)
+        SDL_mutexP(terrain_lock);
+}  // sx3_lock_terrain
+
+
+// sx3_unlock_terrain
+//
+// Lets go of the terrain lock.
+void sx3_unlock_terrain(void)
+{
+    if (terrain_lock)
+        SDL_mutexV(terrain_lock);
+}  // sx3_unlock_terrain
+
+
+// sx3_prefetch_terrain
+//
+// Starts reading in the terrain along the path of something at GL point
+// (x,z) moving at (vx,vz) meters per second, as far as it will get in
+// TERRAIN_PREFETCH_TIME seconds, so that it is in memory when it gets there.
+// The caller must hold the terrain lock.
+void sx3_prefetch_terrain(float x, float z, float vx, float vz)
+{
+    float dx = vx * TERRAIN_PREFETCH_TIME * 0.5F;
+    float dz = vz * TERRAIN_PREFETCH_TIME * 0.5F;
+
+    // A square around the middle of the path that holds all of it
+    sx3_prefetch_terrain_chunks(GL_Z_TO_MAP_X(z + dz), GL_X_TO_MAP_Y(x + dx),
+        (float)(sqrt(dx*dx + dz*dz) / METERS_PER_MAP_GRID + TERRAIN_CHUNK_SIZE),
+        0);
+}  // sx3_prefetch_terrain
+
+
+// deform_terrain
+//
+// Blows a crater in the terrain with a sphere of radius r (in meters)
+// centered on the GL point (x,y,z).  The ground inside the sphere is
+// removed, and any ground above it falls into the hole.  The heights and
+// the Blast tiles change right away; the rest of the terrain catches up the
+// next time sx3_flush_terrain_deformations is called.
+void deform_terrain(float x, float y, float z, float r)
+{
+    struct Dirty_Rect rect;
+    float center_x = GL_Z_TO_MAP_X(z);
+    float center_y = GL_X_TO_MAP_Y(x);
+    float grid_r = r / METERS_PER_MAP_GRID;
+    float dx, dy, s, h, top, bottom;
+    int i, j, mx, my, changed = 0;
+
+    if (!g_terrain_pages || r <= 0.0F)
+        return;
+
+    // The vertices under the sphere.  A crater wider than the map only
+    // needs to visit each vertex once.
+    rect.x0 = (int)ceil(center_x - grid_r);
+    rect.y0 = (int)ceil(center_y - grid_r);
+    rect.x1 = (int)floor(center_x + grid_r) + 1;
+    rect.y1 = (int)floor(center_y + grid_r) + 1;
+    if (rect.x1 - rect.x0 > g_terrain_size.x)
+        rect.x1 = rect.x0 + g_terrain_size.x;
+    if (rect.y1 - rect.y0 > g_terrain_size.y)
+        rect.y1 = rect.y0 + g_terrain_size.y;
+
+    for (j=rect.y0; j<rect.y1; j++)
+    {
+        dy = (j - center_y) * METERS_PER_MAP_GRID;
+        for (i=rect.x0; i<rect.x1; i++)
+        {
+            dx = (i - center_x) * METERS_PER_MAP_GRID;
+            s = r*r - dx*dx - dy*dy;
+            if (s <= 0.0F)
+                continue;
+            s = sqrt(s);
+
+            mx = TILE_MOD(i, g_terrain_size.x);
+            my = TILE_MOD(j, g_terrain_size.y);
+            h = TERRAIN_HEIGHT(mx, my);
+            bottom = y - s;
+            if (h <= bottom)
+                continue;
+
+            // Everything the crater changes, up to the tiles and pyramid
+            // entries of the squares next to the dirty rectangle, has to
+            // stay in memory from now on
+            if (!changed)
+                sx3_pin_terrain_pages(rect.x0 - 2, rect.y0 - 2,
+                                      rect.x1 + 2, rect.y1 + 2);
+
+            top = (h < y + s) ? h : y + s;
+            TERRAIN_RAW_HEIGHT(mx, my) =
+                sx3_quantize_terrain_height(h - (top - bottom));
+            if (TERRAIN_HEIGHT(mx, my) < g_terrain_min_height)
+                g_terrain_min_height = TERRAIN_HEIGHT(mx, my);
+            sx3_blast_terrain_tiles(i, j);
+            changed = 1;
+        }
+    }
+
+    // The normals one vertex beyond the crater change as well
+    if (changed)
+    {
+        rect.x0--;
+        rect.y0--;
+        rect.x1++;
+        rect.y1++;
+        add_dirty_rect(rect);
+    }
+}  // deform_terrain
@@ -21,22 +21,31 @@ extern "C" {
 
 // FIX ME!! These should be static const variables
 
-// Maximum x grid dimemsions for map: 
-#define MAX_MAP_X                  1024    
-// Maximum y grid dimensions for map: 
-#define MAX_MAP_Y                  1024    
 // Meters to grid side: 
 #define METERS_PER_MAP_GRID        3.0F    
-// Final width (z in gl) of terrain (meters): 
-#define MAX_TERRAIN_WIDTH          (METERS_PER_MAP_GRID*MAX_MAP_X)
-// Final depth (x in gl) of terrain (meters): 
-#define MAX_TERRAIN_DEPTH          (METERS_PER_MAP_GRID*MAX_MAP_Y)
 // Max height (y in gl) of terrain (meters): 
 #define MAX_TERRAIN_HEIGHT         500.0F
 // Maximum height allowed in input file 
 #define MAX_FILE_TERRAIN_HEIGHT    0x1FFF    
 // Maximum view diameter (in grid units) 
 #define MAX_VIEW_DIAMETER          1024
+// How far ahead (in seconds) terrain is read in for things on the move
+#define TERRAIN_PREFETCH_TIME      1.0F
+// The low bits of each square tile byte hold its Tile_Type, the top bit is
+// set once the square has been blasted
+#define TERRAIN_TILE_TYPE_MASK     0x7F
+#define TERRAIN_TILE_BLASTED       0x80
+// The terrain is stored in pages of TERRAIN_PAGE_SIZE x TERRAIN_PAGE_SIZE
+// vertices (see sx3_terrain_pages.h)
+#define TERRAIN_PAGE_BITS          6
+#define TERRAIN_PAGE_SIZE          (1<<TERRAIN_PAGE_BITS)
+#define TERRAIN_PAGE_VERTICES      (TERRAIN_PAGE_SIZE*TERRAIN_PAGE_SIZE)
+// Entries in the levels of the ray cast pyramid kept in each page, which
+// are the levels whose nodes are smaller than a page (see
+// sx3_terrain_raycast.h)
+#define TERRAIN_PAGE_PYRAMID       ((4*TERRAIN_PAGE_VERTICES - 4)/3)
+// Size of a page, rounded up to a whole number of 4K memory pages
+#define TERRAIN_PAGE_BYTES         40960
 
 
 // These macros convert from Map x and y coords to OpenGL x and z coords
@@ -65,19 +74,88 @@ enum Tile_Type {
     Num_Tile_Types
 };  // Tile_Type 
 
+// Values of terrain.detail.alg: how the detail level of each terrain chunk
+// is picked.
+enum Terrain_Detail_Alg {
+    Terrain_Detail_Rings,        // square rings centred on the viewer
+    Terrain_Detail_Geomipmap,    // screen-space error of each chunk
+    Terrain_Detail_Cdlod,        // distance, morphing between levels
+    Num_Terrain_Detail_Algs
+};  // Terrain_Detail_Alg 
+
+// What the last sx3_draw_terrain call did, for the benchmarks.  Chunks are
+// counted once for each copy of the map they are drawn in.
+struct Terrain_Stats {
+    int         chunks_in_range;      // in the copies of the map in range
+    int         chunks_in_frustum;    // left after frustum culling
+    int         chunks_over_horizon;  // left after horizon culling
+    int         chunks_drawn;         // left after the detail rings
+    int         strips;               // glDrawElements calls
+    long        vertices;             // indices sent in the strips
+};  // Terrain_Stats
+
+// One page of the terrain.  Vertex (x,y) of the page is entry
+// x + y*TERRAIN_PAGE_SIZE of the heights and normals, and the square whose
+// first corner it is is the same entry of the tiles.  The parts of the
+// pages on the last row and column that lie off the map are never used.
+struct Terrain_Page {
+    short               heights[TERRAIN_PAGE_VERTICES];
+    unsigned int        normals[TERRAIN_PAGE_VERTICES];
+    unsigned char       tiles[TERRAIN_PAGE_VERTICES];
+    short               pyramid[TERRAIN_PAGE_PYRAMID];
+    char                pad[TERRAIN_PAGE_BYTES - 7*TERRAIN_PAGE_VERTICES -
+                            2*TERRAIN_PAGE_PYRAMID];
+};  // Terrain_Page
+
 
 // ===========================================================================
 // Global variables
 // ===========================================================================
 
-// Note: these variables actually reside in sx3_global.h.  They are merely
+// Note: these variables actually reside in sx3_global.c.  They are merely
 // declared here because they depend on some of the sx3_terrain.h #defines,
-// and because they are terrain related. 
+// and because they are terrain related.  g_terrain_pages holds
+// g_terrain_num_pages.x*g_terrain_num_pages.y pages in row-major order, and
+// is set up by sx3_load_terrain (see sx3_terrain_pages.h).
+//
+// The TERRAIN_RAW_ macros look up the entries of map vertex (x,y), which
+// must lie within the map.  Heights are stored quantized; use
+// TERRAIN_HEIGHT to get the height in meters.  Vertex normals are packed
+// with sx3_pack_normal; use TERRAIN_NORMAL (which needs sx3_math.h) to
+// unpack them.  Square tiles are filled in by sx3_classify_terrain_tiles;
+// use TERRAIN_TILE to get the Tile_Type of a square.  g_terrain_min_height
+// and g_terrain_max_height are the lowest and highest the terrain gets, in
+// meters; craters only ever lower the first.
 extern struct IPoint        g_terrain_size;
-extern float                g_terrain_vertex_height [MAX_MAP_X*MAX_MAP_Y];
-extern struct Point            g_terrain_vertex_normal [MAX_MAP_X*MAX_MAP_Y];
-extern struct Point            g_terrain_triag_normal  [MAX_MAP_X*MAX_MAP_Y*2];
-extern long int                g_terrain_square_tile   [MAX_MAP_X*MAX_MAP_Y];
+extern struct Terrain_Page *g_terrain_pages;
+extern struct IPoint        g_terrain_num_pages;
+extern float                g_terrain_height_scale;
+extern float                g_terrain_height_offset;
+extern float                g_terrain_min_height;
+extern float                g_terrain_max_height;
+
+extern struct Terrain_Stats g_terrain_stats;
+
+#define TERRAIN_PAGE_OF(macx, macy) \
+    (&g_terrain_pages[((macx) >> TERRAIN_PAGE_BITS) + \
+                      ((macy) >> TERRAIN_PAGE_BITS)*g_terrain_num_pages.x])
+#define TERRAIN_IN_PAGE(macx, macy) \
+    (((macx) & (TERRAIN_PAGE_SIZE-1)) + \
+     ((macy) & (TERRAIN_PAGE_SIZE-1))*TERRAIN_PAGE_SIZE)
+#define TERRAIN_RAW_HEIGHT(macx, macy) \
+    (TERRAIN_PAGE_OF(macx, macy)->heights[TERRAIN_IN_PAGE(macx, macy)])
+#define TERRAIN_RAW_NORMAL(macx, macy) \
+    (TERRAIN_PAGE_OF(macx, macy)->normals[TERRAIN_IN_PAGE(macx, macy)])
+#define TERRAIN_RAW_TILE(macx, macy) \
+    (TERRAIN_PAGE_OF(macx, macy)->tiles[TERRAIN_IN_PAGE(macx, macy)])
+
+#define TERRAIN_HEIGHT(macx, macy) \
+    ((float)TERRAIN_RAW_HEIGHT(macx, macy)*g_terrain_height_scale + \
+     g_terrain_height_offset)
+#define TERRAIN_NORMAL(macx, macy) \
+    (sx3_unpack_normal(TERRAIN_RAW_NORMAL(macx, macy)))
+#define TERRAIN_TILE(macx, macy) \
+    (TERRAIN_RAW_TILE(macx, macy) & TERRAIN_TILE_TYPE_MASK)
 
 
 // ===========================================================================
@@ -86,12 +164,11 @@ extern long int                g_terrain_square_tile   [MAX_MAP_X*MAX_MAP_Y];
 
 void sx3_draw_terrain_lights (void); 
 
-SX3_ERROR_CODE sx3_load_terrain(
-    char* terrainName, 
-    float* buffer, 
-    struct IPoint* terrainSize, 
-    struct Point* normalBuffer, 
-    struct Point* normalAvgBuffer);
+SX3_ERROR_CODE sx3_load_terrain(char* terrainName);
+
+SX3_ERROR_CODE sx3_generate_terrain(int size_x, int size_y, unsigned int seed);
+
+short sx3_quantize_terrain_height(float height);
 
 SX3_ERROR_CODE sx3_draw_terrain( 
     struct Point current_pos, 
@@ -105,8 +182,21 @@ float sx3_interpolated_terrain_height(
 
 float sx3_find_terrain_height(float x, float y);
 
+void sx3_find_terrain_heights(const float *x, const float *y, float *heights,
+                              int count);
+
 SX3_ERROR_CODE sx3_unload_terrain(void);
 
+void sx3_lock_terrain(void);
+
+void sx3_unlock_terrain(void);
+
+void sx3_prefetch_terrain(float x, float z, float vx, float vz);
+
+void deform_terrain(float x, float y, float z, float r);
+
+SX3_ERROR_CODE sx3_flush_terrain_deformations(void);
+
 SX3_ERROR_CODE sx3_terrain_register_vars(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,166 @@
+// File: sx3_terrain_color.c
+// Author: Marc Bryant
+//
+// Colors the terrain by height.  A gradient file has a [Gradient] section
+// with keys Stop0, Stop1, ... each holding "height r g b", where the height
+// is in meters and the stops are in order of height.  The color between two
+// stops is blended linearly, and two stops at the same height make a hard
+// edge.  Below the first stop and above the last, the end colors are used.
+//
+// The gradient is baked into a table of TERRAIN_COLOR_TABLE_SIZE colors
+// spread evenly between the first and last stops.
+
+#include <stdio.h>
+#include <string.h>
+#include <ini.h>
+#include "sx3_terrain_color.h"
+#include "sx3_math.h"
+#include "sx3_files.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+struct Gradient_Stop {
+    float                       height;
+    struct Color                c;
+};  // Gradient_Stop
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+char                g_terrain_gradient[PATH_MAX] = SX3_DEFAULT_GRADIENT;
+
+// The colors used when there is no gradient file (the same as the default
+// one)
+static const struct Gradient_Stop default_stops[] = {
+    {   0.0F, { 0.2F,  0.6F,  0.2F,  1.0F } },
+    {  50.0F, { 0.2F,  0.6F,  0.2F,  1.0F } },
+    {  50.0F, { 0.2F,  0.6F,  0.0F,  1.0F } },
+    { 100.0F, { 0.53F, 0.07F, 0.11F, 1.0F } },
+    { 100.0F, { 0.53F, 0.47F, 0.31F, 1.0F } },
+    { 150.0F, { 0.53F, 0.47F, 0.31F, 1.0F } },
+    { 200.0F, { 1.0F,  1.0F,  1.0F,  1.0F } }
+};
+
+static struct Color     color_table[TERRAIN_COLOR_TABLE_SIZE];
+static float            color_base = 0.0F;
+static float            color_scale = 0.0F;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// bake_gradient
+//
+// Fills in the color table from a list of stops sorted by height.
+static void bake_gradient(const struct Gradient_Stop *stops, int num_stops)
+{
+    float range = stops[num_stops-1].height - stops[0].height;
+    float height, t;
+    int i, k = 0;
+
+    color_base  = stops[0].height;
+    color_scale = (range > 0.0F) ? TERRAIN_COLOR_TABLE_SIZE / range : 0.0F;
+
+    for (i=0; i<TERRAIN_COLOR_TABLE_SIZE; i++)
+    {
+        // Each entry gets the color at the middle of the heights it covers
+        height = color_base + (i + 0.5F) * range / TERRAIN_COLOR_TABLE_SIZE;
+
+        while (k < num_stops-1 && stops[k+1].height <= height)
+            k++;
+        if (k == num_stops-1)
+        {
+            color_table[i] = stops[k].c;
+            continue;
+        }
+
+        t = (height - stops[k].height) /
+            (stops[k+1].height - stops[k].height);
+        color_table[i].r = stops[k].c.r + t*(stops[k+1].c.r - stops[k].c.r);
+        color_table[i].g = stops[k].c.g + t*(stops[k+1].c.g - stops[k].c.g);
+        color_table[i].b = stops[k].c.b + t*(stops[k+1].c.b - stops[k].c.b);
+        color_table[i].a = 1.0F;
+    }
+}  // bake_gradient
+
+
+// sx3_load_terrain_gradient
+//
+// Reads a gradient file and bakes it into the color table.  If the file
+// can't be read, the default colors are used instead.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_CANNOT_OPEN_FILE
+//         SX3_ERROR_BAD_FILE
+SX3_ERROR_CODE sx3_load_terrain_gradient(const char *file_name)
+{
+    struct Gradient_Stop stops[MAX_TERRAIN_GRADIENT_STOPS];
+    struct Gradient_Stop *s;
+    int num_stops;
+    char key[16];
+    const char *val;
+    INI_Context *ini;
+
+    bake_gradient(default_stops,
+                  sizeof(default_stops) / sizeof(default_stops[0]));
+
+    ini = ini_new_context();
+    if (ini_load_config_file(ini, file_name) != INI_OK)
+    {
+        printf("Unable to open gradient file: %s\n", file_name);
+        ini_free_context(ini);
+        return SX3_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    for (num_stops=0; num_stops<MAX_TERRAIN_GRADIENT_STOPS; num_stops++)
+    {
+        sprintf(key, "Stop%d", num_stops);
+        if ((val = ini_get_value(ini, "Gradient", key)) == 0)
+            break;
+
+        s = &stops[num_stops];
+        s->c.a = 1.0F;
+        if (sscanf(val, "%f %f %f %f", &s->height,
+                   &s->c.r, &s->c.g, &s->c.b) != 4 ||
+            (num_stops > 0 && s->height < stops[num_stops-1].height))
+        {
+            printf("Bad %s in gradient file: %s\n", key, file_name);
+            ini_free_context(ini);
+            return SX3_ERROR_BAD_FILE;
+        }
+        RANGE_CHECK(s->c.r, 0.0, 1.0);
+        RANGE_CHECK(s->c.g, 0.0, 1.0);
+        RANGE_CHECK(s->c.b, 0.0, 1.0);
+    }
+    ini_free_context(ini);
+
+    if (num_stops == 0)
+    {
+        printf("No colors in gradient file: %s\n", file_name);
+        return SX3_ERROR_BAD_FILE;
+    }
+
+    bake_gradient(stops, num_stops);
+    return SX3_ERROR_SUCCESS;
+}  // sx3_load_terrain_gradient
+
+
+// sx3_terrain_color
+//
+// Returns the color of the terrain at the given height (in meters).
+struct Color sx3_terrain_color(float height)
+{
+    int i = (int)((height - color_base) * color_scale);
+
+    if (i < 0)
+        i = 0;
+    else if (i >= TERRAIN_COLOR_TABLE_SIZE)
+        i = TERRAIN_COLOR_TABLE_SIZE - 1;
+    return color_table[i];
+}  // sx3_terrain_color
@@ -0,0 +1,51 @@
+// File: sx3_terrain_color.h
+// Author: Marc Bryant
+//
+// The colors of the terrain.  A gradient of colors against height is read
+// from a gradient file (see data/terrain/default.grd), and baked into a
+// table so that coloring a vertex takes a single lookup.
+
+#ifndef SX3_TERRAIN_COLOR_H
+#define SX3_TERRAIN_COLOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+#include "sx3_misc.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! These should be static const variables
+
+// Number of entries in the baked color table
+#define TERRAIN_COLOR_TABLE_SIZE    1024
+// Maximum number of color stops in a gradient file
+#define MAX_TERRAIN_GRADIENT_STOPS  32
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// The gradient file that sx3_load_terrain colors the terrain with
+// (terrain.gradient)
+extern char                 g_terrain_gradient[PATH_MAX];
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_load_terrain_gradient(const char *file_name);
+
+struct Color sx3_terrain_color(float height);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,707 @@
+// File: sx3_terrain_cull.c
+// Author: Marc Bryant
+//
+// Terrain visibility.  The terrain chunks are the leaves of a quadtree, and
+// each node of the tree keeps a bounding box that covers the lowest and
+// highest points of the chunks below it.  Each frame the tree is walked
+// against the six planes of the view frustum: a node that is completely
+// outside a plane is dropped along with all of its chunks, and a node that
+// is completely inside a plane does not test that plane again below it.
+// The cost of culling thus grows with the number of visible chunks instead
+// of with the size of the terrain.
+//
+// The chunks that are left can then be culled against the horizon.  They
+// are walked front to back, keeping the steepest slope (height over
+// distance) up from the eye that the ground blocks in each direction
+// around the viewer.  A chunk whose highest point lies below that slope in
+// every direction it covers can't be seen.  The lowest point of a chunk is
+// a floor under its whole area, and raises the horizon for the chunks
+// beyond it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_mesh.h"
+#include "sx3_terrain_cull.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// A quadtree node covers a rectangle of chunks.  box_min and box_max bound
+// the chunks (skirts included) in GL coords for the copy of the map at the
+// origin.  Leaves point at their chunk, and unused child slots are -1.
+struct Terrain_Node {
+    struct IPoint               origin;        // map coords of first vertex
+    struct IPoint               cells;         // cells in x and y
+    struct Point                box_min;
+    struct Point                box_max;
+    int                         child[4];
+    struct Terrain_Chunk       *chunk;
+};
+
+
+// A visible chunk as the horizon sees it.  The distances (in meters) are
+// from the eye to the nearest and furthest points of the chunk, and the
+// slopes are the steepest one at which any of the chunk can be seen and the
+// one under which the chunk's ground blocks the view.  The chunk covers
+// the horizon bins first_bin to last_bin (which may wrap around), and
+// covers first_full to last_full completely.  first_bin is -1 if the eye is
+// over the chunk, in which case it is never culled.
+struct Horizon_Chunk {
+    struct Terrain_Visible      v;
+    float                       near_dist;
+    float                       far_dist;
+    float                       top_slope;
+    float                       ground_slope;
+    int                         first_bin;
+    int                         last_bin;
+    int                         first_full;
+    int                         last_full;
+};
+
+
+// ===========================================================================
+// Constants
+// ===========================================================================
+
+#define NUM_FRUSTUM_PLANES   6
+#define ALL_FRUSTUM_PLANES   ((1<<NUM_FRUSTUM_PLANES) - 1)
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+static struct Terrain_Node     *terrain_nodes = NULL;
+static int                      num_terrain_nodes = 0;
+
+int                             g_terrain_horizon = 1;
+
+// Results of sx3_find_visible_terrain_chunks
+static struct Terrain_Visible  *terrain_visible = NULL;
+static int                      num_terrain_visible = 0;
+static int                      max_terrain_visible = 0;
+
+// Working space for sx3_cull_terrain_horizon
+static struct Horizon_Chunk    *horizon_chunks = NULL;
+static int                      max_horizon_chunks = 0;
+static float                    horizon[TERRAIN_HORIZON_BINS];
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// set_frustum_plane
+//
+// Stores the plane with normal n that passes through the point p.
+static void set_frustum_plane(float *plane, struct Point n, struct Point p)
+{
+    plane[0] = n.x;
+    plane[1] = n.y;
+    plane[2] = n.z;
+    plane[3] = -(n.x*p.x + n.y*p.y + n.z*p.z);
+}  // set_frustum_plane
+
+
+// sx3_build_terrain_frustum
+//
+// Builds the planes of the view frustum from the camera.  fov is the
+// vertical field of view (in radians) and aspect is width over height,
+// just like gluPerspective.  The plane normals point into the frustum.
+void sx3_build_terrain_frustum(
+    struct Terrain_Frustum *frustum,
+    struct Point eye_point,
+    struct Point view_dir,
+    struct Point up_vector,
+    float fov,
+    float aspect,
+    float z_near,
+    float z_far)
+{
+    struct Point f, r, u, n, p;
+    float tan_v = tan(fov*0.5F);
+    float tan_h = tan_v*aspect;
+    float mag;
+
+    mag = sqrt(view_dir.x*view_dir.x + view_dir.y*view_dir.y +
+               view_dir.z*view_dir.z);
+    f.x = view_dir.x/mag;
+    f.y = view_dir.y/mag;
+    f.z = view_dir.z/mag;
+
+    // r = f x up.  If we are looking straight along the up vector, any
+    // vector perpendicular to f will do.
+    r.x = f.y*up_vector.z - f.z*up_vector.y;
+    r.y = f.z*up_vector.x - f.x*up_vector.z;
+    r.z = f.x*up_vector.y - f.y*up_vector.x;
+    mag = sqrt(r.x*r.x + r.y*r.y + r.z*r.z);
+    if (mag < 1.0e-6F)
+    {
+        r.x = f.z;
+        r.y = 0.0F;
+        r.z = -f.x;
+        mag = sqrt(r.x*r.x + r.z*r.z);
+        if (mag < 1.0e-6F)
+        {
+            r.x = 1.0F;
+            mag = 1.0F;
+        }
+    }
+    r.x /= mag;
+    r.y /= mag;
+    r.z /= mag;
+
+    // u = r x f
+    u.x = r.y*f.z - r.z*f.y;
+    u.y = r.z*f.x - r.x*f.z;
+    u.z = r.x*f.y - r.y*f.x;
+
+    // Left and right
+    n.x = r.x + f.x*tan_h;  n.y = r.y + f.y*tan_h;  n.z = r.z + f.z*tan_h;
+    set_frustum_plane(frustum->planes[0], n, eye_point);
+    n.x = f.x*tan_h - r.x;  n.y = f.y*tan_h - r.y;  n.z = f.z*tan_h - r.z;
+    set_frustum_plane(frustum->planes[1], n, eye_point);
+
+    // Bottom and top
+    n.x = u.x + f.x*tan_v;  n.y = u.y + f.y*tan_v;  n.z = u.z + f.z*tan_v;
+    set_frustum_plane(frustum->planes[2], n, eye_point);
+    n.x = f.x*tan_v - u.x;  n.y = f.y*tan_v - u.y;  n.z = f.z*tan_v - u.z;
+    set_frustum_plane(frustum->planes[3], n, eye_point);
+
+    // Near and far
+    p.x = eye_point.x + f.x*z_near;
+    p.y = eye_point.y + f.y*z_near;
+    p.z = eye_point.z + f.z*z_near;
+    set_frustum_plane(frustum->planes[4], f, p);
+    n.x = -f.x;  n.y = -f.y;  n.z = -f.z;
+    p.x = eye_point.x + f.x*z_far;
+    p.y = eye_point.y + f.y*z_far;
+    p.z = eye_point.z + f.z*z_far;
+    set_frustum_plane(frustum->planes[5], n, p);
+}  // sx3_build_terrain_frustum
+
+
+// fit_terrain_node
+//
+// Recomputes the bounding box of a node from its chunk or its children.
+// The children must already be up to date.
+static void fit_terrain_node(struct Terrain_Node *node)
+{
+    struct Terrain_Node *c;
+    int i;
+
+    if (node->chunk)
+    {
+        node->box_min.y = node->chunk->min_height - TERRAIN_SKIRT_DEPTH;
+        node->box_max.y = node->chunk->max_height;
+        return;
+    }
+
+    for (i=0; i<4; i++)
+    {
+        if (node->child[i] < 0)
+            continue;
+        c = &terrain_nodes[node->child[i]];
+        if (i == 0 || c->box_min.y < node->box_min.y)
+            node->box_min.y = c->box_min.y;
+        if (i == 0 || c->box_max.y > node->box_max.y)
+            node->box_max.y = c->box_max.y;
+    }
+}  // fit_terrain_node
+
+
+// build_terrain_node
+//
+// Adds the node covering the chunks [x0,x1) x [y0,y1), and the subtree
+// below it, and returns its index.  Children always come after their
+// parent in terrain_nodes.
+static int build_terrain_node(int x0, int y0, int x1, int y1)
+{
+    struct Terrain_Node *node;
+    struct Terrain_Chunk *first, *last;
+    int index = num_terrain_nodes++;
+    int mx = (x0 + x1 + 1) / 2, my = (y0 + y1 + 1) / 2;
+    int child;
+
+    // terrain_nodes is sized for the whole tree up front, so node stays
+    // valid while the children are added.
+    node = &terrain_nodes[index];
+    node->child[0] = node->child[1] = node->child[2] = node->child[3] = -1;
+    node->chunk = NULL;
+
+    first = &g_terrain_chunks[x0 + y0*g_terrain_num_chunks.x];
+    last  = &g_terrain_chunks[(x1-1) + (y1-1)*g_terrain_num_chunks.x];
+    node->origin = first->origin;
+    node->cells.x = last->origin.x + last->cells.x - first->origin.x;
+    node->cells.y = last->origin.y + last->cells.y - first->origin.y;
+    node->cells.z = 0;
+
+    // Map y runs along -x in GL
+    node->box_min.x = MAP_Y_TO_GL_X (node->origin.y + node->cells.y);
+    node->box_max.x = MAP_Y_TO_GL_X (node->origin.y);
+    node->box_min.z = MAP_X_TO_GL_Z (node->origin.x);
+    node->box_max.z = MAP_X_TO_GL_Z (node->origin.x + node->cells.x);
+
+    if (x1 - x0 == 1 && y1 - y0 == 1)
+    {
+        node->chunk = first;
+    }
+    else
+    {
+        child = 0;
+        node->child[child++] = build_terrain_node(x0, y0, mx, my);
+        if (mx < x1)
+            node->child[child++] = build_terrain_node(mx, y0, x1, my);
+        if (my < y1)
+            node->child[child++] = build_terrain_node(x0, my, mx, y1);
+        if (mx < x1 && my < y1)
+            node->child[child++] = build_terrain_node(mx, my, x1, y1);
+    }
+
+    fit_terrain_node(node);
+    return index;
+}  // build_terrain_node
+
+
+// sx3_build_terrain_quadtree
+//
+// Builds the quadtree over the current terrain chunks.  Must be called
+// whenever the chunks are rebuilt.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_build_terrain_quadtree(void)
+{
+    int num_chunks = g_terrain_num_chunks.x * g_terrain_num_chunks.y;
+
+    sx3_free_terrain_quadtree();
+    if (!g_terrain_chunks || num_chunks == 0)
+        return SX3_ERROR_SUCCESS;
+
+    // Every interior node has at least two children, so a tree with
+    // num_chunks leaves has fewer than 2*num_chunks nodes.
+    terrain_nodes = malloc(2 * num_chunks * sizeof(struct Terrain_Node));
+    if (!terrain_nodes)
+    {
+        sx3_free_terrain_quadtree();
+        return SX3_ERROR_MEM_ALLOC;
+    }
+
+    build_terrain_node(0, 0, g_terrain_num_chunks.x, g_terrain_num_chunks.y);
+
+    return SX3_ERROR_SUCCESS;
+}  // sx3_build_terrain_quadtree
+
+
+// sx3_update_terrain_quadtree
+//
+// Refits the node bounding boxes after the heights of some chunks have
+// changed (sx3_rebuild_terrain_chunk).  The shape of the tree stays the same.
+void sx3_update_terrain_quadtree(void)
+{
+    int i;
+
+    // Children come after their parents, so walking backwards refits the
+    // tree bottom up.
+    for (i=num_terrain_nodes-1; i>=0; i--)
+        fit_terrain_node(&terrain_nodes[i]);
+}  // sx3_update_terrain_quadtree
+
+
+// sx3_free_terrain_quadtree
+void sx3_free_terrain_quadtree(void)
+{
+    free(terrain_nodes);
+    terrain_nodes = NULL;
+    num_terrain_nodes = 0;
+
+    free(terrain_visible);
+    terrain_visible = NULL;
+    num_terrain_visible = 0;
+    max_terrain_visible = 0;
+
+    free(horizon_chunks);
+    horizon_chunks = NULL;
+    max_horizon_chunks = 0;
+}  // sx3_free_terrain_quadtree
+
+
+// rect_distance
+//
+// Returns how far (in grid units) p is from the span [start, start+len), or
+// 0 if it is inside it.
+static float rect_distance(float p, float start, float len)
+{
+    if (p < start)
+        return start - p;
+    if (p > start + len)
+        return p - (start + len);
+    return 0.0F;
+}  // rect_distance
+
+
+// cull_terrain_node
+//
+// Adds the visible chunks below a node to terrain_visible.  planes holds
+// the frustum planes moved to the copy of the map being drawn, and mask
+// has a bit set for each plane that the node may still cross.
+static void cull_terrain_node(
+    const struct Terrain_Node *node,
+    float planes[NUM_FRUSTUM_PLANES][4],
+    int mask,
+    float map_x,
+    float map_y,
+    float view_radius)
+{
+    const float *plane;
+    float dx, dy, dist, near_d, far_d;
+    int i;
+
+    // Anything outside the view radius is not drawn at all.  The rings are
+    // square, so we use the larger of the two axis distances.
+    dx = rect_distance(map_x, (float)node->origin.x, (float)node->cells.x);
+    dy = rect_distance(map_y, (float)node->origin.y, (float)node->cells.y);
+    dist = (dx > dy) ? dx : dy;
+    if (dist >= view_radius)
+        return;
+
+    // For each plane, test the corners of the box that are furthest along
+    // (far_d) and against (near_d) the plane normal.
+    for (i=0; i<NUM_FRUSTUM_PLANES; i++)
+    {
+        if (!(mask & (1<<i)))
+            continue;
+        plane = planes[i];
+
+        near_d = far_d = plane[3];
+        if (plane[0] > 0.0F)
+        {
+            far_d  += plane[0]*node->box_max.x;
+            near_d += plane[0]*node->box_min.x;
+        }
+        else
+        {
+            far_d  += plane[0]*node->box_min.x;
+            near_d += plane[0]*node->box_max.x;
+        }
+        if (plane[1] > 0.0F)
+        {
+            far_d  += plane[1]*node->box_max.y;
+            near_d += plane[1]*node->box_min.y;
+        }
+        else
+        {
+            far_d  += plane[1]*node->box_min.y;
+            near_d += plane[1]*node->box_max.y;
+        }
+        if (plane[2] > 0.0F)
+        {
+            far_d  += plane[2]*node->box_max.z;
+            near_d += plane[2]*node->box_min.z;
+        }
+        else
+        {
+            far_d  += plane[2]*node->box_min.z;
+            near_d += plane[2]*node->box_max.z;
+        }
+
+        if (far_d < 0.0F)
+            return;                     // completely outside
+        if (near_d >= 0.0F)
+            mask &= ~(1<<i);            // completely inside
+    }
+
+    if (node->chunk)
+    {
+        terrain_visible[num_terrain_visible].chunk = node->chunk;
+        terrain_visible[num_terrain_visible].dist  = dist;
+        num_terrain_visible++;
+        return;
+    }
+
+    for (i=0; i<4; i++)
+    {
+        if (node->child[i] >= 0)
+            cull_terrain_node(&terrain_nodes[node->child[i]], planes, mask,
+                              map_x, map_y, view_radius);
+    }
+}  // cull_terrain_node
+
+
+// sx3_find_visible_terrain_chunks
+//
+// Finds the chunks that are at least partly inside the frustum and within
+// view_radius grid units of the viewer, in every copy of the (tiled) map
+// that the view radius reaches.  map_x and map_y are the map coords of the
+// viewer, and the frustum is in world coords.
+//
+// The chunks are returned through visible, which stays valid until the next
+// call.  RETURN: the number of visible chunks.
+int sx3_find_visible_terrain_chunks(
+    const struct Terrain_Frustum *frustum,
+    float map_x,
+    float map_y,
+    float view_radius,
+    const struct Terrain_Visible **visible)
+{
+    float planes[NUM_FRUSTUM_PLANES][4];
+    float offset_x, offset_z;
+    int i, kx, ky, kx_start, kx_end, ky_start, ky_end, first, max_visible;
+    struct Terrain_Visible *v;
+
+    num_terrain_visible = 0;
+    *visible = terrain_visible;
+    if (!num_terrain_nodes)
+        return 0;
+
+    // Find the copies of the map that overlap the view radius
+    kx_start = (int)floor((map_x - view_radius) / g_terrain_size.x);
+    kx_end   = (int)floor((map_x + view_radius) / g_terrain_size.x);
+    ky_start = (int)floor((map_y - view_radius) / g_terrain_size.y);
+    ky_end   = (int)floor((map_y + view_radius) / g_terrain_size.y);
+
+    // Each copy can see every chunk
+    max_visible = (kx_end - kx_start + 1) * (ky_end - ky_start + 1) *
+                  g_terrain_num_chunks.x * g_terrain_num_chunks.y;
+    g_terrain_stats.chunks_in_range = max_visible;
+    if (max_visible > max_terrain_visible)
+    {
+        v = realloc(terrain_visible, max_visible * sizeof(struct Terrain_Visible));
+        if (!v)
+            return 0;
+        terrain_visible = v;
+        max_terrain_visible = max_visible;
+        *visible = terrain_visible;
+    }
+
+    for (ky=ky_start; ky<=ky_end; ky++)
+    {
+        for (kx=kx_start; kx<=kx_end; kx++)
+        {
+            // Rather than moving every node to the copy of the map, move
+            // the frustum (and the viewer) the other way.
+            offset_x = -(float)(ky*g_terrain_size.y)*METERS_PER_MAP_GRID;
+            offset_z =  (float)(kx*g_terrain_size.x)*METERS_PER_MAP_GRID;
+            for (i=0; i<NUM_FRUSTUM_PLANES; i++)
+            {
+                planes[i][0] = frustum->planes[i][0];
+                planes[i][1] = frustum->planes[i][1];
+                planes[i][2] = frustum->planes[i][2];
+                planes[i][3] = frustum->planes[i][3] +
+                               planes[i][0]*offset_x + planes[i][2]*offset_z;
+            }
+
+            first = num_terrain_visible;
+            cull_terrain_node(&terrain_nodes[0], planes, ALL_FRUSTUM_PLANES,
+                              map_x - kx*g_terrain_size.x,
+                              map_y - ky*g_terrain_size.y, view_radius);
+            for (i=first; i<num_terrain_visible; i++)
+            {
+                terrain_visible[i].kx = kx;
+                terrain_visible[i].ky = ky;
+            }
+        }
+    }
+
+    return num_terrain_visible;
+}  // sx3_find_visible_terrain_chunks
+
+
+// horizon_bin
+//
+// Returns the position of a direction (in radians, from atan2) in units of
+// horizon bins.
+static float horizon_bin(float angle)
+{
+    return (angle + (float)M_PI) * (TERRAIN_HORIZON_BINS / (2.0F*(float)M_PI));
+}  // horizon_bin
+
+
+// wrap_bin
+static int wrap_bin(int bin)
+{
+    bin %= TERRAIN_HORIZON_BINS;
+    return (bin < 0) ? bin + TERRAIN_HORIZON_BINS : bin;
+}  // wrap_bin
+
+
+// measure_horizon_chunk
+//
+// Fills in everything but v of a Horizon_Chunk.  (eye_x, eye_y) is the
+// viewer in map coords of the chunk's copy of the map.
+static void measure_horizon_chunk(
+    struct Horizon_Chunk *h,
+    float eye_x,
+    float eye_y,
+    float eye_height)
+{
+    const struct Terrain_Chunk *chunk = h->v.chunk;
+    float x0 = (float)chunk->origin.x - eye_x;
+    float y0 = (float)chunk->origin.y - eye_y;
+    float x1 = x0 + chunk->cells.x;
+    float y1 = y0 + chunk->cells.y;
+    float dx, dy, center, angle, delta, min_delta, max_delta, rise;
+    float cx[4], cy[4];
+    int i;
+
+    // Nearest and furthest points of the chunk from the eye
+    dx = (x0 > 0.0F) ? x0 : (x1 < 0.0F) ? -x1 : 0.0F;
+    dy = (y0 > 0.0F) ? y0 : (y1 < 0.0F) ? -y1 : 0.0F;
+    h->near_dist = sqrt(dx*dx + dy*dy) * METERS_PER_MAP_GRID;
+    dx = (-x0 > x1) ? -x0 : x1;
+    dy = (-y0 > y1) ? -y0 : y1;
+    h->far_dist = sqrt(dx*dx + dy*dy) * METERS_PER_MAP_GRID;
+
+    // The chunk under the viewer (or right next to it) is always drawn
+    if (h->near_dist < METERS_PER_MAP_GRID)
+    {
+        h->first_bin = -1;
+        return;
+    }
+
+    // The directions the chunk covers, measured from the one to its center
+    cx[0] = x0;  cy[0] = y0;
+    cx[1] = x1;  cy[1] = y0;
+    cx[2] = x0;  cy[2] = y1;
+    cx[3] = x1;  cy[3] = y1;
+    center = atan2(y0 + y1, x0 + x1);
+    min_delta = max_delta = 0.0F;
+    for (i=0; i<4; i++)
+    {
+        angle = atan2(cy[i], cx[i]);
+        delta = angle - center;
+        if (delta > (float)M_PI)
+            delta -= 2.0F*(float)M_PI;
+        else if (delta < -(float)M_PI)
+            delta += 2.0F*(float)M_PI;
+        if (delta < min_delta)
+            min_delta = delta;
+        if (delta > max_delta)
+            max_delta = delta;
+    }
+    h->first_bin  = (int)floor(horizon_bin(center + min_delta));
+    h->last_bin   = (int)floor(horizon_bin(center + max_delta));
+    h->first_full = (int)ceil(horizon_bin(center + min_delta));
+    h->last_full  = (int)floor(horizon_bin(center + max_delta)) - 1;
+
+    // Rising ground is steepest at its nearest point, and falling ground at
+    // its furthest.
+    rise = chunk->max_height - eye_height;
+    h->top_slope = rise / ((rise > 0.0F) ? h->near_dist : h->far_dist);
+
+    // Every line of sight across the chunk passes over ground at least as
+    // high as its lowest point, somewhere between its near and far points.
+    rise = chunk->min_height - eye_height;
+    h->ground_slope = rise / ((rise > 0.0F) ? h->far_dist : h->near_dist);
+}  // measure_horizon_chunk
+
+
+// compare_horizon_chunks
+//
+// qsort callback that puts the nearest chunks first.
+static int compare_horizon_chunks(const void *a, const void *b)
+{
+    float da = ((const struct Horizon_Chunk *)a)->near_dist;
+    float db = ((const struct Horizon_Chunk *)b)->near_dist;
+
+    return (da < db) ? -1 : (da > db) ? 1 : 0;
+}  // compare_horizon_chunks
+
+
+// sx3_cull_terrain_horizon
+//
+// Drops the chunks found by the last sx3_find_visible_terrain_chunks that
+// are hidden behind nearer ground, and sorts the rest front to back.
+// (map_x, map_y) is the viewer in map coords and eye_height its GL y.
+//
+// A chunk only raises the horizon once every chunk still to be tested is
+// further away than all of it, so that nothing is hidden behind ground
+// that is actually behind it.
+//
+// RETURN: the number of visible chunks left.
+int sx3_cull_terrain_horizon(
+    float map_x,
+    float map_y,
+    float eye_height)
+{
+    struct Horizon_Chunk *h, *occluder, *hc;
+    float max_width;
+    int i, b, end, num_visible, next_occluder;
+
+    if (num_terrain_visible == 0)
+        return 0;
+
+    if (num_terrain_visible > max_horizon_chunks)
+    {
+        hc = realloc(horizon_chunks,
+                     num_terrain_visible * sizeof(struct Horizon_Chunk));
+        if (!hc)
+            return num_terrain_visible;
+        horizon_chunks = hc;
+        max_horizon_chunks = num_terrain_visible;
+    }
+
+    for (i=0; i<num_terrain_visible; i++)
+    {
+        h = &horizon_chunks[i];
+        h->v = terrain_visible[i];
+        measure_horizon_chunk(h,
+                              map_x - (float)(h->v.kx*g_terrain_size.x),
+                              map_y - (float)(h->v.ky*g_terrain_size.y),
+                              eye_height);
+    }
+    qsort(horizon_chunks, num_terrain_visible, sizeof(struct Horizon_Chunk),
+          compare_horizon_chunks);
+
+    for (b=0; b<TERRAIN_HORIZON_BINS; b++)
+        horizon[b] = -HUGE_VAL;
+
+    // No chunk is further across than its diagonal, so a chunk is behind
+    // another once it is that much further away.
+    max_width = TERRAIN_CHUNK_SIZE * METERS_PER_MAP_GRID * (float)sqrt(2.0);
+
+    num_visible = 0;
+    next_occluder = 0;
+    for (i=0; i<num_terrain_visible; i++)
+    {
+        h = &horizon_chunks[i];
+
+        // Raise the horizon by the chunks that are all in front of this one
+        for (; next_occluder < i; next_occluder++)
+        {
+            occluder = &horizon_chunks[next_occluder];
+            if (occluder->near_dist + max_width > h->near_dist)
+                break;
+            if (occluder->first_bin < 0)
+                continue;
+            end = occluder->last_full;
+            if (end < occluder->first_full)
+                continue;
+            for (b=occluder->first_full; b<=end; b++)
+            {
+                if (horizon[wrap_bin(b)] < occluder->ground_slope)
+                    horizon[wrap_bin(b)] = occluder->ground_slope;
+            }
+        }
+
+        // Keep the chunk if it shows above the horizon anywhere
+        if (h->first_bin >= 0)
+        {
+            for (b=h->first_bin; b<=h->last_bin; b++)
+            {
+                if (h->top_slope >= horizon[wrap_bin(b)])
+                    break;
+            }
+            if (b > h->last_bin)
+                continue;
+        }
+        terrain_visible[num_visible++] = h->v;
+    }
+
+    num_terrain_visible = num_visible;
+    return num_visible;
+}  // sx3_cull_terrain_horizon
@@ -0,0 +1,95 @@
+// File: sx3_terrain_cull.h
+// Author: Marc Bryant
+//
+// Terrain visibility: a min/max height quadtree over the terrain chunks,
+// tested against the view frustum, and a horizon that drops the chunks
+// hidden behind nearer hills.
+
+#ifndef SX3_TERRAIN_CULL_H
+#define SX3_TERRAIN_CULL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+#include "sx3_terrain_mesh.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! This should be a static const variable
+
+// Number of directions the horizon is kept for
+#define TERRAIN_HORIZON_BINS        1024
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// The six planes of the view frustum (left, right, bottom, top, near, far).
+// A point p is inside plane i if
+//   planes[i][0]*p.x + planes[i][1]*p.y + planes[i][2]*p.z + planes[i][3] >= 0
+struct Terrain_Frustum {
+    float                       planes[6][4];
+};
+
+// A chunk that survived culling, along with its distance (in grid units,
+// measured along the larger of the two map axes) from the viewer.  kx and
+// ky give the copy of the (tiled) map that it is drawn in: kx maps along
+// the map x axis and ky maps along the map y axis from the original.
+struct Terrain_Visible {
+    struct Terrain_Chunk       *chunk;
+    float                       dist;
+    int                         kx;
+    int                         ky;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// Whether chunks hidden behind hills are culled (terrain.horizon)
+extern int                      g_terrain_horizon;
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+void sx3_build_terrain_frustum(
+    struct Terrain_Frustum *frustum,
+    struct Point eye_point,
+    struct Point view_dir,
+    struct Point up_vector,
+    float fov,
+    float aspect,
+    float z_near,
+    float z_far);
+
+SX3_ERROR_CODE sx3_build_terrain_quadtree(void);
+
+void sx3_update_terrain_quadtree(void);
+
+void sx3_free_terrain_quadtree(void);
+
+int sx3_find_visible_terrain_chunks(
+    const struct Terrain_Frustum *frustum,
+    float map_x,
+    float map_y,
+    float view_radius,
+    const struct Terrain_Visible **visible);
+
+int sx3_cull_terrain_horizon(
+    float map_x,
+    float map_y,
+    float eye_height);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,528 @@
+// File: sx3_terrain_file.c
+// Author: Marc Bryant
+//
+// Binary terrain files (.ter2).  See sx3_terrain_file.h for the layout.
+// The file is mapped copy-on-write, so the terrain can still be deformed
+// in memory without touching the file, and the pages and the top of the
+// ray cast pyramid are used straight out of the mapping.
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_mesh.h"
+#include "sx3_terrain_pages.h"
+#include "sx3_terrain_raycast.h"
+#include "sx3_terrain_tiles.h"
+#include "sx3_terrain_file.h"
+
+
+// ===========================================================================
+// Constants
+// ===========================================================================
+
+#define ALIGN_16(mac_x) (((mac_x) + 15) & ~15)
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// The mapped file, if the current terrain was loaded from one
+static char                    *terrain_file_data = NULL;
+static size_t                   terrain_file_size = 0;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// map_file
+//
+// Maps a whole file into memory, copy-on-write.  Returns NULL on failure.
+static char *map_file(const char *name, size_t *size)
+{
+#ifdef WIN32
+    HANDLE file, mapping;
+    DWORD low, high;
+    void *data;
+
+    file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    // Files over 4GB can only be mapped by 64 bit builds
+    low = GetFileSize(file, &high);
+    if ((low == INVALID_FILE_SIZE && GetLastError() != NO_ERROR) ||
+        (high && sizeof(size_t) <= 4))
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    *size = (size_t)low | ((size_t)high << 16 << 16);
+    mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return NULL;
+
+    // The view keeps the mapping alive
+    data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    return data;
+#else
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+
+    data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return (data == MAP_FAILED) ? NULL : data;
+#endif
+}  // map_file
+
+
+// unmap_file
+static void unmap_file(char *data, size_t size)
+{
+#ifdef WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}  // unmap_file
+
+
+// swap_values
+//
+// Converts count little endian values, each width (2 or 4) bytes long, to
+// the byte order of this machine, in place.
+static void swap_values(void *values, int count, int width)
+{
+    Uint16 *v16 = values;
+    Uint32 *v32 = values;
+    int i;
+
+    if (SDL_BYTEORDER == SDL_LIL_ENDIAN)
+        return;
+
+    for (i=0; i<count; i++)
+    {
+        if (width == 2)
+            v16[i] = SDL_Swap16(v16[i]);
+        else
+            v32[i] = SDL_Swap32(v32[i]);
+    }
+}  // swap_values
+
+
+// write_values
+//
+// Writes count values, each width (2 or 4) bytes long, in little endian
+// order.  Returns 1 if successful.
+static int write_values(FILE *out, const void *values, int count, int width)
+{
+    const char *p = values;
+    Uint16 v16;
+    Uint32 v32;
+    int i;
+
+    if (SDL_BYTEORDER == SDL_LIL_ENDIAN)
+        return fwrite(values, width, count, out) == (size_t)count;
+
+    for (i=0; i<count; i++, p+=width)
+    {
+        if (width == 2)
+        {
+            memcpy(&v16, p, 2);
+            v16 = SDL_Swap16(v16);
+            if (fwrite(&v16, 2, 1, out) != 1)
+                return 0;
+        }
+        else
+        {
+            memcpy(&v32, p, 4);
+            v32 = SDL_Swap32(v32);
+            if (fwrite(&v32, 4, 1, out) != 1)
+                return 0;
+        }
+    }
+    return 1;
+}  // write_values
+
+
+// pad_file
+//
+// Pads the file with count zeros.  Returns 1 if successful.
+static int pad_file(FILE *out, size_t count)
+{
+    for (; count > 0; count--)
+    {
+        if (fputc(0, out) == EOF)
+            return 0;
+    }
+    return 1;
+}  // pad_file
+
+
+// swap_page
+//
+// Converts a little endian page to the byte order of this machine, in
+// place.
+static void swap_page(struct Terrain_Page *page)
+{
+    swap_values(page->heights, TERRAIN_PAGE_VERTICES, 2);
+    swap_values(page->normals, TERRAIN_PAGE_VERTICES, 4);
+    swap_values(page->pyramid, TERRAIN_PAGE_PYRAMID, 2);
+}  // swap_page
+
+
+// write_page
+//
+// Writes a page in little endian order.  Returns 1 if successful.
+static int write_page(FILE *out, const struct Terrain_Page *page)
+{
+    return write_values(out, page->heights, TERRAIN_PAGE_VERTICES, 2) &&
+           write_values(out, page->normals, TERRAIN_PAGE_VERTICES, 4) &&
+           fwrite(page->tiles, 1, TERRAIN_PAGE_VERTICES, out) ==
+               TERRAIN_PAGE_VERTICES &&
+           write_values(out, page->pyramid, TERRAIN_PAGE_PYRAMID, 2) &&
+           pad_file(out, sizeof(page->pad));
+}  // write_page
+
+
+// lay_out_file
+//
+// Works out where the top of the pyramid and the chunk bounds start in the
+// .ter2 file of a size_x by size_y map with the given number of chunks,
+// and how long the file is.
+static void lay_out_file(
+    unsigned int size_x,
+    unsigned int size_y,
+    unsigned int num_chunks,
+    size_t *pyramid_offset,
+    size_t *chunks_offset,
+    size_t *file_size)
+{
+    size_t num_pages = (size_t)((size_x + TERRAIN_PAGE_SIZE - 1) >> TERRAIN_PAGE_BITS) *
+                       ((size_y + TERRAIN_PAGE_SIZE - 1) >> TERRAIN_PAGE_BITS);
+
+    *pyramid_offset = TERRAIN_FILE_PAGES + num_pages*TERRAIN_PAGE_BYTES;
+    *chunks_offset = ALIGN_16(*pyramid_offset +
+                              sx3_terrain_pyramid_size(size_x, size_y)*sizeof(short));
+    *file_size = *chunks_offset + num_chunks*sizeof(struct Terrain_Chunk_Bounds);
+}  // lay_out_file
+
+
+// sx3_is_terrain_file
+//
+// Returns whether a file is a .ter2 file (as opposed to an old .ter file).
+int sx3_is_terrain_file(const char *name)
+{
+    FILE *in;
+    char magic[4];
+    int is_ter2;
+
+    if (!(in = fopen(name, "rb")))
+        return 0;
+    is_ter2 = fread(magic, 4, 1, in) == 1 &&
+              !memcmp(magic, TERRAIN_FILE_MAGIC, 4);
+    fclose(in);
+
+    return is_ter2;
+}  // sx3_is_terrain_file
+
+
+// sx3_open_terrain_file
+//
+// Maps a .ter2 file, and sets the terrain globals (g_terrain_size, the
+// pages, the height scale and offset and the height range) from it.
+// bounds is set to the stored chunk bounds, or to NULL if they were built
+// for a different chunk layout, and pyramid to the stored top of the ray
+// cast pyramid.  tiles_current is cleared if the tiles were worked out with
+// different terrain.tile settings, in which case they must be worked out
+// again.  Any file that is already open is closed first.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_CANNOT_OPEN_FILE
+//         SX3_ERROR_BAD_FILE
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_open_terrain_file(
+    const char *name,
+    const struct Terrain_Chunk_Bounds **bounds,
+    short **pyramid,
+    int *tiles_current)
+{
+    struct Terrain_File_Header header;
+    struct Terrain_Page *pages;
+    unsigned int num_chunks, num_pages, i;
+    size_t pyramid_offset, chunks_offset, file_size;
+    SX3_ERROR_CODE retcode;
+    char *data;
+    size_t size;
+
+    sx3_close_terrain_file();
+    *bounds = NULL;
+    *pyramid = NULL;
+    *tiles_current = 0;
+
+    if (!(data = map_file(name, &size)))
+    {
+        printf ("Unable to open file: %s!\n", name);
+        return SX3_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    // Every field after the magic number is 4 bytes long
+    if (size < sizeof(header))
+    {
+        printf ("Truncated terrain file: %s\n", name);
+        unmap_file(data, size);
+        return SX3_ERROR_BAD_FILE;
+    }
+    memcpy(&header, data, sizeof(header));
+    swap_values(&header.version, (sizeof(header) - 4) / 4, 4);
+
+    if (memcmp(header.magic, TERRAIN_FILE_MAGIC, 4) ||
+        header.version != TERRAIN_FILE_VERSION ||
+        header.page_size != TERRAIN_PAGE_SIZE ||
+        header.page_bytes != TERRAIN_PAGE_BYTES)
+    {
+        printf ("Unknown terrain file version: %s\n", name);
+        unmap_file(data, size);
+        return SX3_ERROR_BAD_FILE;
+    }
+
+    num_chunks = header.num_chunks_x * header.num_chunks_y;
+    if (header.size_x < 2 || header.size_y < 2 ||
+        header.size_x > 0xFFFF || header.size_y > 0xFFFF ||
+        header.num_chunks_x > header.size_x ||
+        header.num_chunks_y > header.size_y ||
+        header.num_pages_x != (header.size_x + TERRAIN_PAGE_SIZE - 1) >> TERRAIN_PAGE_BITS ||
+        header.num_pages_y != (header.size_y + TERRAIN_PAGE_SIZE - 1) >> TERRAIN_PAGE_BITS)
+    {
+        printf ("Bad terrain file: %s\n", name);
+        unmap_file(data, size);
+        return SX3_ERROR_BAD_FILE;
+    }
+
+    lay_out_file(header.size_x, header.size_y, num_chunks,
+                 &pyramid_offset, &chunks_offset, &file_size);
+    if (file_size != size)
+    {
+        printf ("Bad terrain file: %s\n", name);
+        unmap_file(data, size);
+        return SX3_ERROR_BAD_FILE;
+    }
+
+    pages = (struct Terrain_Page*)(data + TERRAIN_FILE_PAGES);
+    retcode = sx3_alloc_terrain_pages(header.size_x, header.size_y, pages);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+        unmap_file(data, size);
+        return retcode;
+    }
+    terrain_file_data = data;
+    terrain_file_size = size;
+
+    // The data is only converted on big endian machines, where every page
+    // has to be read in and kept
+    if (SDL_BYTEORDER != SDL_LIL_ENDIAN)
+    {
+        num_pages = header.num_pages_x * header.num_pages_y;
+        sx3_pin_terrain_pages(0, 0, header.size_x, header.size_y);
+        for (i=0; i<num_pages; i++)
+            swap_page(&pages[i]);
+    }
+    swap_values(data + pyramid_offset,
+                sx3_terrain_pyramid_size(header.size_x, header.size_y), 2);
+    swap_values(data + chunks_offset,
+                num_chunks*sizeof(struct Terrain_Chunk_Bounds)/4, 4);
+
+    g_terrain_height_scale  = header.height_scale;
+    g_terrain_height_offset = header.height_offset;
+    g_terrain_min_height    = header.min_height;
+    g_terrain_max_height    = header.max_height;
+    *pyramid = (short*)(data + pyramid_offset);
+
+    *tiles_current = header.tile_snow == g_terrain_tile_snow &&
+                     header.tile_pebbles == g_terrain_tile_pebbles &&
+                     header.tile_rock == g_terrain_tile_rock &&
+                     header.tile_dirt == g_terrain_tile_dirt;
+
+    if (header.chunk_size == TERRAIN_CHUNK_SIZE &&
+        header.chunk_levels == TERRAIN_CHUNK_LEVELS &&
+        header.num_chunks_x == (header.size_x + TERRAIN_CHUNK_SIZE - 1) / TERRAIN_CHUNK_SIZE &&
+        header.num_chunks_y == (header.size_y + TERRAIN_CHUNK_SIZE - 1) / TERRAIN_CHUNK_SIZE)
+        *bounds = (const struct Terrain_Chunk_Bounds*)(data + chunks_offset);
+
+    return SX3_ERROR_SUCCESS;
+}  // sx3_open_terrain_file
+
+
+// sx3_close_terrain_file
+//
+// Unmaps the current .ter2 file, if any, along with the pages in it.
+void sx3_close_terrain_file(void)
+{
+    if (!terrain_file_data)
+        return;
+
+    sx3_free_terrain_pages();
+    unmap_file(terrain_file_data, terrain_file_size);
+    terrain_file_data = NULL;
+    terrain_file_size = 0;
+}  // sx3_close_terrain_file
+
+
+// sx3_is_terrain_file_open
+//
+// Returns whether the current terrain pages belong to a mapped .ter2 file.
+int sx3_is_terrain_file_open(void)
+{
+    return terrain_file_data != NULL;
+}  // sx3_is_terrain_file_open
+
+
+// sx3_write_terrain_file
+//
+// Writes the current terrain, along with its tiles, ray cast pyramid and
+// chunk bounds, to a .ter2 file.  The pages are written one at a time, so
+// if the terrain came from a file, they are read in one at a time.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_BAD_PARAMS (no terrain is loaded)
+//         SX3_ERROR_CANNOT_OPEN_FILE
+//         SX3_ERROR_BAD_FILE (the file could not be written)
+SX3_ERROR_CODE sx3_write_terrain_file(const char *name)
+{
+    struct Terrain_File_Header header;
+    struct Terrain_Chunk_Bounds b;
+    struct Terrain_Chunk *chunk;
+    const short *pyramid = sx3_get_terrain_pyramid();
+    unsigned int num_chunks, num_pyramid, i, px, py;
+    size_t pyramid_offset, chunks_offset, file_size;
+    FILE *out;
+    int ok;
+
+    num_pyramid = sx3_terrain_pyramid_size(g_terrain_size.x, g_terrain_size.y);
+    if (!g_terrain_pages || !g_terrain_chunks || (num_pyramid && !pyramid))
+        return SX3_ERROR_BAD_PARAMS;
+
+    num_chunks = g_terrain_num_chunks.x * g_terrain_num_chunks.y;
+    lay_out_file(g_terrain_size.x, g_terrain_size.y, num_chunks,
+                 &pyramid_offset, &chunks_offset, &file_size);
+
+    memcpy(header.magic, TERRAIN_FILE_MAGIC, 4);
+    header.version        = TERRAIN_FILE_VERSION;
+    header.size_x         = g_terrain_size.x;
+    header.size_y         = g_terrain_size.y;
+    header.height_scale   = g_terrain_height_scale;
+    header.height_offset  = g_terrain_height_offset;
+    header.min_height     = g_terrain_min_height;
+    header.max_height     = g_terrain_max_height;
+    header.tile_snow      = g_terrain_tile_snow;
+    header.tile_pebbles   = g_terrain_tile_pebbles;
+    header.tile_rock      = g_terrain_tile_rock;
+    header.tile_dirt      = g_terrain_tile_dirt;
+    header.chunk_size     = TERRAIN_CHUNK_SIZE;
+    header.chunk_levels   = TERRAIN_CHUNK_LEVELS;
+    header.num_chunks_x   = g_terrain_num_chunks.x;
+    header.num_chunks_y   = g_terrain_num_chunks.y;
+    header.page_size      = TERRAIN_PAGE_SIZE;
+    header.page_bytes     = TERRAIN_PAGE_BYTES;
+    header.num_pages_x    = g_terrain_num_pages.x;
+    header.num_pages_y    = g_terrain_num_pages.y;
+
+    if (!(out = fopen(name, "wb")))
+    {
+        printf ("Unable to open file: %s!\n", name);
+        return SX3_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    ok = fwrite(header.magic, 4, 1, out) == 1 &&
+         write_values(out, &header.version, (sizeof(header) - 4) / 4, 4) &&
+         pad_file(out, TERRAIN_FILE_PAGES - sizeof(header));
+
+    for (py=0; ok && py<header.num_pages_y; py++)
+    {
+        for (px=0; ok && px<header.num_pages_x; px++)
+        {
+            sx3_use_terrain_pages(px << TERRAIN_PAGE_BITS, py << TERRAIN_PAGE_BITS,
+                                  (px + 1) << TERRAIN_PAGE_BITS,
+                                  (py + 1) << TERRAIN_PAGE_BITS);
+            ok = write_page(out, &g_terrain_pages[px + py*header.num_pages_x]);
+        }
+    }
+
+    ok = ok &&
+         write_values(out, pyramid, num_pyramid, 2) &&
+         pad_file(out, chunks_offset - pyramid_offset - num_pyramid*sizeof(short));
+
+    for (i=0; ok && i<num_chunks; i++)
+    {
+        chunk = &g_terrain_chunks[i];
+        b.min_height = chunk->min_height;
+        b.max_height = chunk->max_height;
+        memcpy(b.error, chunk->error, sizeof(b.error));
+        ok = write_values(out, &b, sizeof(b) / 4, 4);
+    }
+
+    if (fclose(out) != 0 || !ok)
+    {
+        printf ("Unable to write terrain file: %s\n", name);
+        return SX3_ERROR_BAD_FILE;
+    }
+
+    return SX3_ERROR_SUCCESS;
+}  // sx3_write_terrain_file
+
+
+// sx3_convert_terrain_file
+//
+// Loads a terrain file (.ter or .ter2) and writes it out as a .ter2 file.
+// This is what "sx3 -convert in.ter out.ter2" runs.  Returns the exit code
+// for main.
+int sx3_convert_terrain_file(const char *in_name, const char *out_name)
+{
+    SX3_ERROR_CODE retcode;
+
+    retcode = sx3_load_terrain((char*)in_name);
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+        fprintf (stderr, "Error loading terrain file %s!\n", in_name);
+        return 1;
+    }
+
+    retcode = sx3_write_terrain_file(out_name);
+    sx3_unload_terrain();
+    if (retcode != SX3_ERROR_SUCCESS)
+    {
+        fprintf (stderr, "Error writing terrain file %s!\n", out_name);
+        return 1;
+    }
+
+    printf ("Wrote %s\n", out_name);
+    return 0;
+}  // sx3_convert_terrain_file
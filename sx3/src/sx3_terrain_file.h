@@ -0,0 +1,109 @@
+// File: sx3_terrain_file.h
+// Author: Marc Bryant
+//
+// Binary terrain files (.ter2).  Unlike the old .ter files, which hold
+// nothing but the raw heights, a .ter2 file holds everything that is costly
+// to work out when a map is loaded, laid out the way the terrain module
+// keeps it in memory.  The file is mapped into memory and its pages are
+// used in place (see sx3_terrain_pages.h): a page is read in when the
+// viewer or a projectile comes near it, and handed back to the system once
+// the pages in use go over terrain.pages kilobytes.  The pages under
+// craters are changed in memory, and those are kept for the rest of the
+// game.
+//
+// Loading a .ter2 file reads nothing but the header: the height range is
+// stored in it, and the square tiles and the ray cast pyramid are stored
+// alongside the heights.  The tiles are only worked out again if the
+// terrain.tile settings have changed since the file was written, and then
+// the whole map is read in and kept, as it is on big endian machines,
+// where the pages have to be converted.
+//
+// File layout (all values little endian):
+//   struct Terrain_File_Header
+//   struct Terrain_Page         pages[num_pages_x*num_pages_y]
+//                                   (from TERRAIN_FILE_PAGES, 4K aligned)
+//   short                       pyramid[sx3_terrain_pyramid_size()]
+//   struct Terrain_Chunk_Bounds chunks[num_chunks_x*num_chunks_y]
+//                                   (16 byte aligned)
+
+#ifndef SX3_TERRAIN_FILE_H
+#define SX3_TERRAIN_FILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+#include "sx3_terrain_mesh.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! These should be static const variables
+
+#define TERRAIN_FILE_MAGIC         "SX3T"
+// Bump this whenever the layout of the file changes
+#define TERRAIN_FILE_VERSION       3
+// Where the pages start, so that each lies on whole 4K memory pages
+#define TERRAIN_FILE_PAGES         4096
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// The chunk bounds are only used if the file was written with the same
+// chunk size and number of levels that we draw with.  Otherwise they are
+// worked out from the heights.  The tile settings are the terrain.tile
+// values the tiles were worked out with.  The page size and number of bytes
+// must match TERRAIN_PAGE_SIZE and TERRAIN_PAGE_BYTES.
+struct Terrain_File_Header {
+    char                        magic[4];
+    unsigned int                version;
+    unsigned int                size_x;
+    unsigned int                size_y;
+    float                       height_scale;
+    float                       height_offset;
+    float                       min_height;
+    float                       max_height;
+    float                       tile_snow;
+    float                       tile_pebbles;
+    float                       tile_rock;
+    float                       tile_dirt;
+    unsigned int                chunk_size;
+    unsigned int                chunk_levels;
+    unsigned int                num_chunks_x;
+    unsigned int                num_chunks_y;
+    unsigned int                page_size;
+    unsigned int                page_bytes;
+    unsigned int                num_pages_x;
+    unsigned int                num_pages_y;
+};
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+int sx3_is_terrain_file(const char *name);
+
+SX3_ERROR_CODE sx3_open_terrain_file(
+    const char *name,
+    const struct Terrain_Chunk_Bounds **bounds,
+    short **pyramid,
+    int *tiles_current);
+
+void sx3_close_terrain_file(void);
+
+int sx3_is_terrain_file_open(void);
+
+SX3_ERROR_CODE sx3_write_terrain_file(const char *name);
+
+int sx3_convert_terrain_file(const char *in_name, const char *out_name);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
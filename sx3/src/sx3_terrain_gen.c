@@ -0,0 +1,727 @@
+// File: sx3_terrain_gen.c
+// Author: Marc Bryant
+//
+// Makes terrain heights from a seed.
+//
+// The heights start out as value noise: random values at the corners of a
+// lattice, blended smoothly in between, added up over octaves that each
+// have twice as many lattice cells across the map as the last.  Every
+// octave has a whole number of lattice cells across the map and the lattice
+// wraps, so the map joins up at its edges the same way the terrain mesh
+// does.  The random values come from hashing the lattice coordinates with
+// the seed, so any row of the map can be made without the others.
+//
+// Erosion then wears the noise down.  Thermal erosion slides ground down
+// any slope steeper than it can stand at.  Hydraulic erosion rains on the
+// map, runs the water downhill with the sediment it has picked up, and
+// drops the sediment again where the water slows down.
+//
+// Every pass works a row at a time and only reads what the pass before it
+// wrote, so the rows can be split into bands and done on separate threads
+// without changing the result by a single bit.  The rows are straight runs
+// over memory that the compiler can vectorise; the cells at either end of a
+// row, whose neighbours wrap around to the other end, are done on their own.
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_gen.h"
+#include "sx3_terrain_normals.h"
+#include "sx3_math.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// One octave of noise.  Column x of the map lies in lattice cell
+// lattice_x[x] (so lattice cell i starts at the first column x with
+// lattice_x[x] == i, which is start_x[i]), and fade_x[x] is how far across
+// the cell it is, eased in and out.
+struct Gen_Octave {
+    int                         count_x;
+    int                         count_y;
+    float                       amplitude;
+    int                        *start_x;
+    float                      *fade_x;
+};
+
+// A band of rows [y0,y1) that one thread works on, and its scratch space
+struct Gen_Band {
+    int                         y0, y1;
+    void                      (*row)(int y, float *scratch);
+    float                      *scratch;
+};
+
+
+// ===========================================================================
+// Constants
+// ===========================================================================
+
+// Lattice cells across the map in the first octave of noise
+#define GEN_FEATURES            4
+
+// Thermal erosion: the height difference (in meters) between neighbours
+// that ground starts to slide at, and how much of the excess slides each
+// pass.  With four neighbours the rate must stay below 1/4.
+#define GEN_TALUS               2.0F
+#define GEN_SLIDE_RATE          0.1F
+
+// Hydraulic erosion, all per pass: the water that falls on each cell (in
+// meters), the fraction of the water that evaporates, the sediment that
+// each meter of running water can carry, and how quickly the ground is
+// dissolved into water that can carry more or sediment is dropped from
+// water that is carrying too much.
+#define GEN_RAIN                0.01F
+#define GEN_EVAPORATION         0.05F
+#define GEN_CAPACITY            0.5F
+#define GEN_DISSOLVE            0.05F
+#define GEN_DEPOSIT             0.2F
+
+// Keeps divisions by amounts of water that may be zero finite
+#define GEN_TINY                1.0e-6F
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+int                 g_terrain_gen_size          = 1024;
+int                 g_terrain_gen_seed          = 0;
+float               g_terrain_gen_height        = 200.0F;
+float               g_terrain_gen_roughness     = 0.5F;
+int                 g_terrain_gen_thermal       = 50;
+int                 g_terrain_gen_hydraulic     = 50;
+
+// The map being made
+static int                      gen_size_x;
+static int                      gen_size_y;
+static unsigned int             gen_seed;
+static struct Gen_Octave        octaves[MAX_TERRAIN_GEN_OCTAVES];
+static int                      num_octaves;
+
+// The heights, and the buffer the next pass writes them to
+static float                   *heights;
+static float                   *next_heights;
+
+// Hydraulic erosion.  level is the height of the top of the water, and
+// concentration the sediment in each meter of water.  to_west etc. are the
+// amounts of water that leave each cell for each of its neighbours.
+static float                   *water;
+static float                   *sediment;
+static float                   *next_water;
+static float                   *next_sediment;
+static float                   *level;
+static float                   *concentration;
+static float                   *to_west;
+static float                   *to_east;
+static float                   *to_north;
+static float                   *to_south;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// lattice_value
+//
+// Returns the random value (between -1 and 1) at corner (x,y) of the
+// lattice of an octave.
+static float lattice_value(unsigned int x, unsigned int y, unsigned int octave)
+{
+    unsigned int h = gen_seed ^ (x * 0x8da6b343U) ^ (y * 0xd8163841U) ^
+                     (octave * 0xcb1ab31fU);
+
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return (float)(h >> 8) * (2.0F / 16777216.0F) - 1.0F;
+}  // lattice_value
+
+
+// fade
+//
+// Eases t (between 0 and 1) in and out, so that the noise is smooth across
+// the lattice cell edges.
+static float fade(float t)
+{
+    return t*t*t*(t*(t*6.0F - 15.0F) + 10.0F);
+}  // fade
+
+
+// noise_row
+//
+// Fills in row y of the heights with the sum of the octaves of noise.
+// scratch holds one row of blended lattice values.
+static void noise_row(int y, float *scratch)
+{
+    float *out = heights + y*gen_size_x;
+    const struct Gen_Octave *o;
+    unsigned long t;
+    float fy, v0, v1, b0, d, amplitude;
+    int k, i, j, j1, x;
+
+    for (x=0; x<gen_size_x; x++)
+        out[x] = 0.0F;
+
+    for (k=0; k<num_octaves; k++)
+    {
+        o = &octaves[k];
+        amplitude = o->amplitude;
+
+        // The lattice rows either side of the row, blended together
+        t  = (unsigned long)y * o->count_y;
+        j  = (int)(t / gen_size_y);
+        fy = fade((float)(t - (unsigned long)j*gen_size_y) / gen_size_y);
+        j1 = (j + 1 < o->count_y) ? j + 1 : 0;
+        for (i=0; i<o->count_x; i++)
+        {
+            v0 = lattice_value(i, j, k);
+            v1 = lattice_value(i, j1, k);
+            scratch[i] = v0 + fy*(v1 - v0);
+        }
+        scratch[o->count_x] = scratch[0];
+
+        // Then blended across each lattice cell
+        for (i=0; i<o->count_x; i++)
+        {
+            b0 = amplitude * scratch[i];
+            d  = amplitude * (scratch[i+1] - scratch[i]);
+            for (x=o->start_x[i]; x<o->start_x[i+1]; x++)
+                out[x] += b0 + o->fade_x[x]*d;
+        }
+    }
+}  // noise_row
+
+
+// slide_cells
+//
+// One pass of thermal erosion over n cells, from the heights h of the
+// cells and of their neighbours into out.  Whatever slides off one cell
+// lands on its neighbour, so no ground is lost.
+static void slide_cells(
+    const float *RESTRICT h,
+    const float *RESTRICT west,
+    const float *RESTRICT east,
+    const float *RESTRICT north,
+    const float *RESTRICT south,
+    float *RESTRICT out,
+    int n)
+{
+    float c, d, up, down, move;
+    int i;
+
+    // Ground slides in from a neighbour that is more than GEN_TALUS higher
+    // (up), or out to one that is more than GEN_TALUS lower (down)
+    for (i=0; i<n; i++)
+    {
+        c = h[i];
+        move = 0.0F;
+
+        d = west[i] - c;
+        up = d - GEN_TALUS;
+        down = d + GEN_TALUS;
+        move += (up > 0.0F) ? up : 0.0F;
+        move += (down < 0.0F) ? down : 0.0F;
+
+        d = east[i] - c;
+        up = d - GEN_TALUS;
+        down = d + GEN_TALUS;
+        move += (up > 0.0F) ? up : 0.0F;
+        move += (down < 0.0F) ? down : 0.0F;
+
+        d = north[i] - c;
+        up = d - GEN_TALUS;
+        down = d + GEN_TALUS;
+        move += (up > 0.0F) ? up : 0.0F;
+        move += (down < 0.0F) ? down : 0.0F;
+
+        d = south[i] - c;
+        up = d - GEN_TALUS;
+        down = d + GEN_TALUS;
+        move += (up > 0.0F) ? up : 0.0F;
+        move += (down < 0.0F) ? down : 0.0F;
+
+        out[i] = c + GEN_SLIDE_RATE*move;
+    }
+}  // slide_cells
+
+
+// slide_row
+static void slide_row(int y, float *scratch)
+{
+    int n = gen_size_x;
+    const float *h = heights + y*n;
+    const float *north = heights + ((y > 0) ? y - 1 : gen_size_y - 1)*n;
+    const float *south = heights + ((y < gen_size_y - 1) ? y + 1 : 0)*n;
+    float *out = next_heights + y*n;
+
+    slide_cells(h + 1, h, h + 2, north + 1, south + 1, out + 1, n - 2);
+    slide_cells(h, h + n - 1, h + 1, north, south, out, 1);
+    slide_cells(h + n - 1, h + n - 2, h, north + n - 1, south + n - 1,
+                out + n - 1, 1);
+}  // slide_row
+
+
+// flow_cells
+//
+// Works out how much of the water on each of n cells runs off to each of
+// its neighbours, from the water levels of the cells and their neighbours.
+// The water is shared out by how far each neighbour is below the cell, and
+// no more leaves than would bring the cell level with its lowest neighbour.
+static void flow_cells(
+    const float *RESTRICT lv,
+    const float *RESTRICT west,
+    const float *RESTRICT east,
+    const float *RESTRICT north,
+    const float *RESTRICT south,
+    const float *RESTRICT w,
+    const float *RESTRICT s,
+    float *RESTRICT out_west,
+    float *RESTRICT out_east,
+    float *RESTRICT out_north,
+    float *RESTRICT out_south,
+    float *RESTRICT c,
+    int n)
+{
+    float dw, de, dn, ds, most, total, out, k;
+    int i;
+
+    for (i=0; i<n; i++)
+    {
+        dw = lv[i] - west[i];
+        de = lv[i] - east[i];
+        dn = lv[i] - north[i];
+        ds = lv[i] - south[i];
+        dw = (dw > 0.0F) ? dw : 0.0F;
+        de = (de > 0.0F) ? de : 0.0F;
+        dn = (dn > 0.0F) ? dn : 0.0F;
+        ds = (ds > 0.0F) ? ds : 0.0F;
+
+        most = (dw > de) ? dw : de;
+        most = (dn > most) ? dn : most;
+        most = (ds > most) ? ds : most;
+        total = dw + de + dn + ds;
+        out = (w[i] < 0.5F*most) ? w[i] : 0.5F*most;
+
+        k = out / (total + GEN_TINY);
+        out_west[i]  = dw*k;
+        out_east[i]  = de*k;
+        out_north[i] = dn*k;
+        out_south[i] = ds*k;
+        c[i] = s[i] / (w[i] + GEN_TINY);
+    }
+}  // flow_cells
+
+
+// flow_row
+static void flow_row(int y, float *scratch)
+{
+    int n = gen_size_x, row = y*n;
+    const float *lv = level + row;
+    const float *north = level + ((y > 0) ? y - 1 : gen_size_y - 1)*n;
+    const float *south = level + ((y < gen_size_y - 1) ? y + 1 : 0)*n;
+    const float *w = water + row;
+    const float *s = sediment + row;
+    float *tw = to_west + row, *te = to_east + row;
+    float *tn = to_north + row, *ts = to_south + row;
+    float *c = concentration + row;
+
+    flow_cells(lv + 1, lv, lv + 2, north + 1, south + 1, w + 1, s + 1,
+               tw + 1, te + 1, tn + 1, ts + 1, c + 1, n - 2);
+    flow_cells(lv, lv + n - 1, lv + 1, north, south, w, s,
+               tw, te, tn, ts, c, 1);
+    flow_cells(lv + n - 1, lv + n - 2, lv, north + n - 1, south + n - 1,
+               w + n - 1, s + n - 1,
+               tw + n - 1, te + n - 1, tn + n - 1, ts + n - 1, c + n - 1, 1);
+}  // flow_row
+
+
+// settle_cells
+//
+// Moves the water worked out by flow_cells, along with the sediment in it,
+// then lets the water on each of n cells dissolve ground or drop sediment
+// until it is carrying what it can, and finally evaporates some of it and
+// rains on the cell again.  The from_* arrays hold what the neighbours send
+// to these cells, and the *_c arrays how much sediment is in it.
+static void settle_cells(
+    float *RESTRICT h,
+    const float *RESTRICT w,
+    const float *RESTRICT s,
+    const float *RESTRICT out_west,
+    const float *RESTRICT out_east,
+    const float *RESTRICT out_north,
+    const float *RESTRICT out_south,
+    const float *RESTRICT c,
+    const float *RESTRICT from_west,
+    const float *RESTRICT west_c,
+    const float *RESTRICT from_east,
+    const float *RESTRICT east_c,
+    const float *RESTRICT from_north,
+    const float *RESTRICT north_c,
+    const float *RESTRICT from_south,
+    const float *RESTRICT south_c,
+    float *RESTRICT new_w,
+    float *RESTRICT new_s,
+    float *RESTRICT lv,
+    int n)
+{
+    float out, ww, ss, d;
+    int i;
+
+    for (i=0; i<n; i++)
+    {
+        out = out_west[i] + out_east[i] + out_north[i] + out_south[i];
+        ww = w[i] - out + from_west[i] + from_east[i] + from_north[i] +
+             from_south[i];
+        ss = s[i] - out*c[i] + from_west[i]*west_c[i] +
+             from_east[i]*east_c[i] + from_north[i]*north_c[i] +
+             from_south[i]*south_c[i];
+
+        // Over capacity drops sediment, under capacity picks up ground
+        d = ss - GEN_CAPACITY*out;
+        d = (d > 0.0F) ? GEN_DEPOSIT*d : GEN_DISSOLVE*d;
+        h[i] += d;
+        ss   -= d;
+
+        ww = ww*(1.0F - GEN_EVAPORATION) + GEN_RAIN;
+        new_w[i] = ww;
+        new_s[i] = ss;
+        lv[i]    = h[i] + ww;
+    }
+}  // settle_cells
+
+
+// settle_row
+static void settle_row(int y, float *scratch)
+{
+    int n = gen_size_x, row = y*n, e = n - 1;
+    int up = ((y > 0) ? y - 1 : gen_size_y - 1)*n;
+    int down = ((y < gen_size_y - 1) ? y + 1 : 0)*n;
+    float *h = heights + row;
+    const float *w = water + row, *s = sediment + row;
+    const float *tw = to_west + row, *te = to_east + row;
+    const float *tn = to_north + row, *ts = to_south + row;
+    const float *c = concentration + row;
+    const float *from_north = to_south + up, *north_c = concentration + up;
+    const float *from_south = to_north + down, *south_c = concentration + down;
+    float *nw = next_water + row, *ns = next_sediment + row;
+    float *lv = level + row;
+
+    // The west neighbour of cell i sends its east flow, and so on
+    settle_cells(h + 1, w + 1, s + 1, tw + 1, te + 1, tn + 1, ts + 1, c + 1,
+                 te, c, tw + 2, c + 2,
+                 from_north + 1, north_c + 1, from_south + 1, south_c + 1,
+                 nw + 1, ns + 1, lv + 1, n - 2);
+    settle_cells(h, w, s, tw, te, tn, ts, c,
+                 te + e, c + e, tw + 1, c + 1,
+                 from_north, north_c, from_south, south_c,
+                 nw, ns, lv, 1);
+    settle_cells(h + e, w + e, s + e, tw + e, te + e, tn + e, ts + e, c + e,
+                 te + e - 1, c + e - 1, tw, c,
+                 from_north + e, north_c + e, from_south + e, south_c + e,
+                 nw + e, ns + e, lv + e, 1);
+}  // settle_row
+
+
+// gen_band
+//
+// Works through the rows of one band.  This is the thread function.
+static int gen_band(void *data)
+{
+    struct Gen_Band *band = data;
+    int y;
+
+    for (y=band->y0; y<band->y1; y++)
+        band->row(y, band->scratch);
+    return 0;
+}  // gen_band
+
+
+// run_rows
+//
+// Runs row on every row of the map, spread over g_terrain_threads threads,
+// and waits for them all.  Each thread gets scratch_floats floats of
+// scratch space.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+static SX3_ERROR_CODE run_rows(
+    void (*row)(int y, float *scratch),
+    int scratch_floats)
+{
+    struct Gen_Band bands[MAX_TERRAIN_THREADS];
+    SDL_Thread *threads[MAX_TERRAIN_THREADS];
+    float *scratch = NULL;
+    int num_bands, k;
+
+    num_bands = g_terrain_threads;
+    RANGE_CHECK(num_bands, 1, MAX_TERRAIN_THREADS);
+    if (num_bands > gen_size_y / MIN_TERRAIN_THREAD_ROWS)
+        num_bands = (gen_size_y / MIN_TERRAIN_THREAD_ROWS > 0) ?
+                    gen_size_y / MIN_TERRAIN_THREAD_ROWS : 1;
+
+    if (scratch_floats > 0 &&
+        !(scratch = malloc(num_bands * scratch_floats * sizeof(float))))
+        return SX3_ERROR_MEM_ALLOC;
+
+    for (k=0; k<num_bands; k++)
+    {
+        bands[k].y0 = gen_size_y*k/num_bands;
+        bands[k].y1 = gen_size_y*(k+1)/num_bands;
+        bands[k].row = row;
+        bands[k].scratch = scratch ? scratch + k*scratch_floats : NULL;
+    }
+
+    // The calling thread does the first band itself.  If a thread can't be
+    // started, its band is done here as well.
+    for (k=1; k<num_bands; k++)
+        threads[k] = SDL_CreateThread(gen_band, &bands[k]);
+    gen_band(&bands[0]);
+    for (k=1; k<num_bands; k++)
+    {
+        if (threads[k])
+            SDL_WaitThread(threads[k], NULL);
+        else
+            gen_band(&bands[k]);
+    }
+
+    free(scratch);
+    return SX3_ERROR_SUCCESS;
+}  // run_rows
+
+
+// setup_octaves
+//
+// Works out the lattice of each octave of noise for the map.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+static SX3_ERROR_CODE setup_octaves(void)
+{
+    struct Gen_Octave *o;
+    int base_x, base_y, i, k, x;
+    unsigned long t;
+
+    // The first octave has about GEN_FEATURES lattice cells across the
+    // longer side of the map, and square cells
+    base_x = GEN_FEATURES;
+    base_y = GEN_FEATURES;
+    if (gen_size_x > gen_size_y)
+        base_y = (GEN_FEATURES*gen_size_y + gen_size_x/2) / gen_size_x;
+    else
+        base_x = (GEN_FEATURES*gen_size_x + gen_size_y/2) / gen_size_y;
+    RANGE_CHECK(base_x, 1, gen_size_x);
+    RANGE_CHECK(base_y, 1, gen_size_y);
+
+    // Each octave halves the lattice cells, down to two map cells across
+    num_octaves = 0;
+    for (k=0; k<MAX_TERRAIN_GEN_OCTAVES; k++)
+    {
+        if (k > 0 && ((base_x<<k) > gen_size_x/2 || (base_y<<k) > gen_size_y/2))
+            break;
+
+        o = &octaves[k];
+        o->count_x = base_x<<k;
+        o->count_y = base_y<<k;
+        o->amplitude = (k > 0) ? octaves[k-1].amplitude*g_terrain_gen_roughness :
+                                 1.0F;
+        o->start_x = malloc((o->count_x + 1) * sizeof(int));
+        o->fade_x  = malloc(gen_size_x * sizeof(float));
+        num_octaves++;
+        if (!o->start_x || !o->fade_x)
+            return SX3_ERROR_MEM_ALLOC;
+
+        // Column x is (x*count_x)/size_x of the way across the lattice
+        for (i=0; i<=o->count_x; i++)
+            o->start_x[i] = (int)(((unsigned long)i*gen_size_x + o->count_x - 1) /
+                                  o->count_x);
+        for (x=0; x<gen_size_x; x++)
+        {
+            t = (unsigned long)x * o->count_x;
+            o->fade_x[x] = fade((float)(t % gen_size_x) / gen_size_x);
+        }
+    }
+
+    return SX3_ERROR_SUCCESS;
+}  // setup_octaves
+
+
+// free_octaves
+static void free_octaves(void)
+{
+    int k;
+
+    for (k=0; k<num_octaves; k++)
+    {
+        free(octaves[k].start_x);
+        free(octaves[k].fade_x);
+    }
+    num_octaves = 0;
+}  // free_octaves
+
+
+// shape_heights
+//
+// Scales the noise to run from 0 to g_terrain_gen_height.  The heights are
+// squared on the way, which flattens the valleys and sharpens the peaks.
+static void shape_heights(void)
+{
+    int i, n = gen_size_x*gen_size_y;
+    float lo = heights[0], hi = heights[0], scale, v;
+
+    for (i=1; i<n; i++)
+    {
+        if (heights[i] < lo)
+            lo = heights[i];
+        if (heights[i] > hi)
+            hi = heights[i];
+    }
+    scale = (hi > lo) ? 1.0F / (hi - lo) : 0.0F;
+
+    for (i=0; i<n; i++)
+    {
+        v = (heights[i] - lo) * scale;
+        heights[i] = g_terrain_gen_height * v * v;
+    }
+}  // shape_heights
+
+
+// erode_thermal
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+static SX3_ERROR_CODE erode_thermal(float *out)
+{
+    float *t;
+    int pass;
+    SX3_ERROR_CODE retcode = SX3_ERROR_SUCCESS;
+
+    if (g_terrain_gen_thermal <= 0)
+        return SX3_ERROR_SUCCESS;
+    if (!(next_heights = malloc(gen_size_x*gen_size_y*sizeof(float))))
+        return SX3_ERROR_MEM_ALLOC;
+
+    for (pass=0; pass<g_terrain_gen_thermal && retcode == SX3_ERROR_SUCCESS; pass++)
+    {
+        retcode = run_rows(slide_row, 0);
+        t = heights;
+        heights = next_heights;
+        next_heights = t;
+    }
+
+    // Make sure the heights end up where they were asked for
+    if (heights != out)
+    {
+        memcpy(out, heights, gen_size_x*gen_size_y*sizeof(float));
+        next_heights = heights;
+        heights = out;
+    }
+    free(next_heights);
+    next_heights = NULL;
+    return retcode;
+}  // erode_thermal
+
+
+// erode_hydraulic
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+static SX3_ERROR_CODE erode_hydraulic(void)
+{
+    int i, pass, n = gen_size_x*gen_size_y;
+    float *buffer, *t;
+    SX3_ERROR_CODE retcode = SX3_ERROR_SUCCESS;
+
+    if (g_terrain_gen_hydraulic <= 0)
+        return SX3_ERROR_SUCCESS;
+    if (!(buffer = malloc(10*n*sizeof(float))))
+        return SX3_ERROR_MEM_ALLOC;
+    water         = buffer;
+    sediment      = buffer + n;
+    next_water    = buffer + 2*n;
+    next_sediment = buffer + 3*n;
+    level         = buffer + 4*n;
+    concentration = buffer + 5*n;
+    to_west       = buffer + 6*n;
+    to_east       = buffer + 7*n;
+    to_north      = buffer + 8*n;
+    to_south      = buffer + 9*n;
+
+    // It has just rained everywhere
+    for (i=0; i<n; i++)
+    {
+        water[i] = GEN_RAIN;
+        sediment[i] = 0.0F;
+        level[i] = heights[i] + GEN_RAIN;
+    }
+
+    for (pass=0; pass<g_terrain_gen_hydraulic && retcode == SX3_ERROR_SUCCESS; pass++)
+    {
+        retcode = run_rows(flow_row, 0);
+        if (retcode == SX3_ERROR_SUCCESS)
+            retcode = run_rows(settle_row, 0);
+        t = water;
+        water = next_water;
+        next_water = t;
+        t = sediment;
+        sediment = next_sediment;
+        next_sediment = t;
+    }
+
+    // What the water is still carrying is left where it is
+    for (i=0; i<n; i++)
+        heights[i] += sediment[i];
+
+    free(buffer);
+    water = sediment = next_water = next_sediment = NULL;
+    level = concentration = NULL;
+    to_west = to_east = to_north = to_south = NULL;
+    return retcode;
+}  // erode_hydraulic
+
+
+// sx3_generate_terrain_heights
+//
+// Makes a size_x by size_y map from a seed, and stores its heights (in
+// meters, row by row) in heights.  The rest of the terrain.gen.* settings
+// shape the map.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_BAD_PARAMS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_generate_terrain_heights(
+    float *heights_out,
+    int size_x,
+    int size_y,
+    unsigned int seed)
+{
+    SX3_ERROR_CODE retcode;
+
+    if (!heights_out || size_x < 2 || size_y < 2)
+        return SX3_ERROR_BAD_PARAMS;
+
+    gen_size_x = size_x;
+    gen_size_y = size_y;
+    gen_seed = seed;
+    heights = heights_out;
+
+    retcode = setup_octaves();
+    if (retcode == SX3_ERROR_SUCCESS)
+        retcode = run_rows(noise_row, octaves[num_octaves-1].count_x + 1);
+    free_octaves();
+    if (retcode != SX3_ERROR_SUCCESS)
+        return retcode;
+
+    shape_heights();
+
+    retcode = erode_thermal(heights_out);
+    if (retcode != SX3_ERROR_SUCCESS)
+        return retcode;
+    return erode_hydraulic();
+}  // sx3_generate_terrain_heights
@@ -0,0 +1,62 @@
+// File: sx3_terrain_gen.h
+// Author: Marc Bryant
+//
+// Procedural terrain.  A map is made from a seed: fractal noise that wraps
+// around the edges of the map, worn down by thermal and hydraulic erosion.
+// The same seed and settings always give the same map, however many
+// threads (terrain.threads) it is made on.
+
+#ifndef SX3_TERRAIN_GEN_H
+#define SX3_TERRAIN_GEN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! These should be static const variables
+
+// Most octaves of noise that are added up
+#define MAX_TERRAIN_GEN_OCTAVES     12
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// Size of the map made for each game (terrain.gen.size); 0 loads
+// SX3_DEFAULT_TERRAIN instead
+extern int                      g_terrain_gen_size;
+// Seed of the map (terrain.gen.seed); 0 picks a new one every time
+extern int                      g_terrain_gen_seed;
+// Height of the highest peaks, in meters (terrain.gen.height)
+extern float                    g_terrain_gen_height;
+// How much each octave of noise is scaled by relative to the last one
+// (terrain.gen.roughness)
+extern float                    g_terrain_gen_roughness;
+// Number of thermal and hydraulic erosion passes (terrain.gen.thermal,
+// terrain.gen.hydraulic)
+extern int                      g_terrain_gen_thermal;
+extern int                      g_terrain_gen_hydraulic;
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_generate_terrain_heights(
+    float *heights,
+    int size_x,
+    int size_y,
+    unsigned int seed);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
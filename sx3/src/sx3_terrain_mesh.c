@@ -0,0 +1,1000 @@
+// File: sx3_terrain_mesh.c
+// Author: Marc Bryant
+//
+// Cached terrain meshes.  Instead of walking the heightfield and sending
+// every vertex to OpenGL in immediate mode, we split the terrain into
+// TERRAIN_CHUNK_SIZE x TERRAIN_CHUNK_SIZE chunks when the terrain is loaded.
+// Each chunk keeps its positions, normals and colors in one interleaved
+// array, and is drawn with a single glDrawElements call.  The index lists
+// only depend on the size of the chunk and the stride it is drawn at, so
+// they are shared by all the chunks.  A chunk can also be drawn with its
+// heights blended towards the next coarser stride, which hides the jump
+// when it changes detail level.
+//
+// The vertex arrays are only built for chunks that are drawn (or are about
+// to be, see sx3_prefetch_terrain_chunks), and are kept on a list in the
+// order they were last drawn in.  When the arrays take up more than
+// terrain.cache kilobytes, the ones at the end of the list are freed.
+// The heights and normals they are built from are paged the same way, but
+// separately (see sx3_terrain_pages.h): building a chunk marks the pages
+// under it as used.
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include <GL/gl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <memory.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_mesh.h"
+#include "sx3_terrain_color.h"
+#include "sx3_terrain_pages.h"
+#include "sx3_math.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// A triangle strip index list for chunks of a given size and stride.  The
+// rows of the chunk and its four skirts are joined into one strip with
+// degenerate triangles.
+struct Terrain_Strip {
+    int                         cells_x;
+    int                         cells_y;
+    int                         stride;
+    int                         num_indices;
+    GLushort                   *indices;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+struct IPoint                   g_terrain_num_chunks;
+struct Terrain_Chunk           *g_terrain_chunks = NULL;
+
+int                             g_terrain_cache_size = 65536;
+int                             g_terrain_prefetch = 4;
+
+// Chunks whose vertex arrays are built, most recently drawn first, and the
+// memory the arrays take up
+static struct Terrain_Chunk    *lru_head = NULL;
+static struct Terrain_Chunk    *lru_tail = NULL;
+static long                     cache_bytes = 0;
+
+// Counts the frames drawn (see sx3_begin_terrain_chunks)
+static int                      terrain_frame = 0;
+
+static struct Terrain_Strip    *terrain_strips = NULL;
+static int                      num_terrain_strips = 0;
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+static void fill_chunk_vertices(struct Terrain_Chunk *chunk);
+
+static void set_chunk_bounding_volume(struct Terrain_Chunk *chunk);
+
+static void chunk_morph_deltas(struct Terrain_Chunk *chunk);
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// sx3_build_terrain_chunks
+//
+// Splits the heightfield into chunks.  Any chunks
+// from a previous terrain are freed first.  If bounds is not NULL, it holds
+// the height ranges and mip level errors of every chunk (in row-major
+// order), and the vertex arrays are left to be built as the chunks are
+// drawn.  Otherwise every chunk is built once to measure them.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_build_terrain_chunks(
+    const struct Terrain_Chunk_Bounds *bounds)
+{
+    struct IPoint size = g_terrain_size;
+    int cx, cy;
+    struct Terrain_Chunk *chunk;
+    const struct Terrain_Chunk_Bounds *b;
+    SX3_ERROR_CODE retcode;
+
+    sx3_free_terrain_chunks();
+
+    g_terrain_num_chunks.x = (size.x + TERRAIN_CHUNK_SIZE - 1) / TERRAIN_CHUNK_SIZE;
+    g_terrain_num_chunks.y = (size.y + TERRAIN_CHUNK_SIZE - 1) / TERRAIN_CHUNK_SIZE;
+    g_terrain_num_chunks.z = 0;
+
+    g_terrain_chunks = calloc(g_terrain_num_chunks.x * g_terrain_num_chunks.y,
+                              sizeof(struct Terrain_Chunk));
+    if (!g_terrain_chunks)
+        return SX3_ERROR_MEM_ALLOC;
+
+    chunk = g_terrain_chunks;
+    for (cy=0; cy<g_terrain_num_chunks.y; cy++)
+    {
+        for (cx=0; cx<g_terrain_num_chunks.x; cx++)
+        {
+            // Note that the last row and column of chunks may be smaller
+            // than the rest, since the map size need not be a multiple of
+            // the chunk size.  The last cell wraps around to the first
+            // vertex, just like sx3_interpolated_terrain_height does.
+            chunk->origin.x = cx * TERRAIN_CHUNK_SIZE;
+            chunk->origin.y = cy * TERRAIN_CHUNK_SIZE;
+            chunk->origin.z = 0;
+            chunk->cells.x  = size.x - chunk->origin.x;
+            chunk->cells.y  = size.y - chunk->origin.y;
+            chunk->cells.z  = 0;
+            if (chunk->cells.x > TERRAIN_CHUNK_SIZE)
+                chunk->cells.x = TERRAIN_CHUNK_SIZE;
+            if (chunk->cells.y > TERRAIN_CHUNK_SIZE)
+                chunk->cells.y = TERRAIN_CHUNK_SIZE;
+
+            chunk->num_vertices = (chunk->cells.x+1)*(chunk->cells.y+1) +
+                                  2*(chunk->cells.x+1) + 2*(chunk->cells.y+1);
+
+            if (bounds)
+            {
+                b = &bounds[cx + cy*g_terrain_num_chunks.x];
+                chunk->min_height = b->min_height;
+                chunk->max_height = b->max_height;
+                memcpy(chunk->error, b->error, sizeof(chunk->error));
+                set_chunk_bounding_volume(chunk);
+                retcode = SX3_ERROR_SUCCESS;
+            }
+            else
+                retcode = sx3_rebuild_terrain_chunk(chunk);
+            if (retcode != SX3_ERROR_SUCCESS)
+            {
+                sx3_free_terrain_chunks();
+                return retcode;
+            }
+
+            chunk++;
+        }
+    }
+
+    return SX3_ERROR_SUCCESS;
+}  // sx3_build_terrain_chunks
+
+
+// next_sample
+//
+// Steps to the next vertex along a chunk edge that is drawn at the given
+// stride.  The last vertex of the edge is always drawn, so that chunks whose
+// size is not a multiple of the stride still close up.
+static int next_sample(int i, int stride, int cells)
+{
+    i += stride;
+    return (i > cells) ? cells : i;
+}  // next_sample
+
+
+// is_sampled
+//
+// Returns whether a vertex along a chunk edge is drawn at the given stride.
+static int is_sampled(int i, int stride, int cells)
+{
+    return (i % stride) == 0 || i == cells;
+}  // is_sampled
+
+
+// cell_height
+//
+// Returns the height at grid vertex (i,j) of the cell with corners
+// (i0,j0) and (i1,j1), which is split into a northwest and a southeast
+// triangle.  The cell may be flat along either axis (i0 == i1 or
+// j0 == j1), in which case it is a line.
+static float cell_height(
+    const struct Terrain_Vertex *grid,
+    int w,
+    int i0, int j0,
+    int i1, int j1,
+    int i, int j)
+{
+    float fu = (i1 > i0) ? (float)(i - i0) / (i1 - i0) : 0.0F;
+    float fv = (j1 > j0) ? (float)(j - j0) / (j1 - j0) : 0.0F;
+    float h00 = grid[i0 + j0*w].p.y;
+    float h10 = grid[i1 + j0*w].p.y;
+    float h01 = grid[i0 + j1*w].p.y;
+    float h11 = grid[i1 + j1*w].p.y;
+
+    // Northwest or southeast triangle of the cell
+    if (fu + fv <= 1.0F)
+        return h00 + fu*(h10 - h00) + fv*(h01 - h00);
+    return h11 + (1.0F-fu)*(h01 - h11) + (1.0F-fv)*(h10 - h11);
+}  // cell_height
+
+
+// chunk_level_error
+//
+// Finds how far the chunk's grid vertices are from the surface that is
+// drawn at the given stride.  The surface is triangulated the same way as
+// the strips built by find_terrain_strip (and the same way that
+// sx3_interpolated_terrain_height splits a cell), so this is exactly the
+// error seen on screen.
+static float chunk_level_error(const struct Terrain_Chunk *chunk, int stride)
+{
+    const struct Terrain_Vertex *grid = chunk->vertices;
+    int w = chunk->cells.x + 1;
+    int i, j, i0, i1, j0, j1;
+    float e, max_error = 0.0F;
+
+    for (j0=0; j0<chunk->cells.y; j0=j1)
+    {
+        j1 = next_sample(j0, stride, chunk->cells.y);
+        for (i0=0; i0<chunk->cells.x; i0=i1)
+        {
+            i1 = next_sample(i0, stride, chunk->cells.x);
+
+            for (j=j0; j<=j1; j++)
+            {
+                for (i=i0; i<=i1; i++)
+                {
+                    e = fabs(grid[i + j*w].p.y -
+                             cell_height(grid, w, i0, j0, i1, j1, i, j));
+                    if (e > max_error)
+                        max_error = e;
+                }
+            }
+        }
+    }
+
+    return max_error;
+}  // chunk_level_error
+
+
+// chunk_morph_deltas
+//
+// Fills in chunk->morph from the unmorphed vertices.  A vertex that is drawn at stride s but not
+// at stride 2s lies inside a cell of the coarser level, and moves onto the
+// plane of that cell as the chunk morphs.  Vertices that are drawn at every
+// level never move.
+static void chunk_morph_deltas(struct Terrain_Chunk *chunk)
+{
+    const struct Terrain_Vertex *grid = chunk->vertices;
+    int w = chunk->cells.x + 1;
+    int i, j, i0, i1, j0, j1, s, level;
+
+    for (j=0; j<=chunk->cells.y; j++)
+    {
+        for (i=0; i<=chunk->cells.x; i++)
+        {
+            // Find the level at which the vertex is dropped
+            for (level=0; level<TERRAIN_CHUNK_LEVELS-1; level++)
+            {
+                s = 2<<level;
+                if (!is_sampled(i, s, chunk->cells.x) ||
+                    !is_sampled(j, s, chunk->cells.y))
+                    break;
+            }
+            chunk->morph[i + j*w].height = grid[i + j*w].p.y;
+            if (level == TERRAIN_CHUNK_LEVELS-1)
+            {
+                chunk->morph[i + j*w].delta = 0.0F;
+                continue;
+            }
+
+            // The corners of the coarser cell around the vertex
+            s = 1<<level;
+            i0 = i1 = i;
+            if (!is_sampled(i, 2*s, chunk->cells.x))
+            {
+                i0 = i - s;
+                i1 = next_sample(i, s, chunk->cells.x);
+            }
+            j0 = j1 = j;
+            if (!is_sampled(j, 2*s, chunk->cells.y))
+            {
+                j0 = j - s;
+                j1 = next_sample(j, s, chunk->cells.y);
+            }
+
+            chunk->morph[i + j*w].delta =
+                cell_height(grid, w, i0, j0, i1, j1, i, j) - grid[i + j*w].p.y;
+        }
+    }
+    chunk->morph_level = -1;
+}  // chunk_morph_deltas
+
+
+// fill_chunk_vertices
+//
+// Refills the vertex array of a chunk from the heightfield, and updates the
+// chunk's height range and bounding volume.
+static void fill_chunk_vertices(struct Terrain_Chunk *chunk)
+{
+    struct IPoint size = g_terrain_size;
+    int i, j, mx, my;
+    struct Terrain_Vertex *v = chunk->vertices;
+    struct Terrain_Vertex *grid = chunk->vertices;
+    float skirt_height;
+
+    sx3_use_terrain_pages(chunk->origin.x, chunk->origin.y,
+                          chunk->origin.x + chunk->cells.x + 1,
+                          chunk->origin.y + chunk->cells.y + 1);
+    chunk->min_height = chunk->max_height =
+        TERRAIN_HEIGHT (chunk->origin.x, chunk->origin.y);
+
+    // The grid vertices
+    for (j=0; j<=chunk->cells.y; j++)
+    {
+        my = chunk->origin.y + j;
+        if (my >= size.y)
+            my -= size.y;
+
+        for (i=0; i<=chunk->cells.x; i++)
+        {
+            mx = chunk->origin.x + i;
+            if (mx >= size.x)
+                mx -= size.x;
+
+            v->p.x = MAP_Y_TO_GL_X (chunk->origin.y + j);
+            v->p.y = TERRAIN_HEIGHT (mx, my);
+            v->p.z = MAP_X_TO_GL_Z (chunk->origin.x + i);
+            v->n   = TERRAIN_NORMAL (mx, my);
+            v->c   = sx3_terrain_color(v->p.y);
+
+            if (v->p.y < chunk->min_height)
+                chunk->min_height = v->p.y;
+            if (v->p.y > chunk->max_height)
+                chunk->max_height = v->p.y;
+
+            v++;
+        }
+    }
+
+    // The skirts are copies of the edge vertices that have been pulled down
+    // below the lowest point of the chunk.
+    skirt_height = chunk->min_height - TERRAIN_SKIRT_DEPTH;
+    for (i=0; i<=chunk->cells.x; i++, v++)              // North
+    {
+        *v = grid[i];
+        v->p.y = skirt_height;
+    }
+    for (i=0; i<=chunk->cells.x; i++, v++)              // South
+    {
+        *v = grid[i + chunk->cells.y*(chunk->cells.x+1)];
+        v->p.y = skirt_height;
+    }
+    for (j=0; j<=chunk->cells.y; j++, v++)              // West
+    {
+        *v = grid[j*(chunk->cells.x+1)];
+        v->p.y = skirt_height;
+    }
+    for (j=0; j<=chunk->cells.y; j++, v++)              // East
+    {
+        *v = grid[chunk->cells.x + j*(chunk->cells.x+1)];
+        v->p.y = skirt_height;
+    }
+
+    set_chunk_bounding_volume(chunk);
+}  // fill_chunk_vertices
+
+
+// set_chunk_bounding_volume
+//
+// Works out the bounding sphere of a chunk from its height range.
+static void set_chunk_bounding_volume(struct Terrain_Chunk *chunk)
+{
+    struct Point corner;
+
+    chunk->center.x = MAP_Y_TO_GL_X (chunk->origin.y + chunk->cells.y*0.5F);
+    chunk->center.y = (chunk->min_height + chunk->max_height) * 0.5F;
+    chunk->center.z = MAP_X_TO_GL_Z (chunk->origin.x + chunk->cells.x*0.5F);
+    corner.x = chunk->cells.y * METERS_PER_MAP_GRID * 0.5F;
+    corner.y = (chunk->max_height - chunk->min_height) * 0.5F +
+               TERRAIN_SKIRT_DEPTH;
+    corner.z = chunk->cells.x * METERS_PER_MAP_GRID * 0.5F;
+    chunk->radius = sqrt(corner.x*corner.x + corner.y*corner.y +
+                         corner.z*corner.z);
+}  // set_chunk_bounding_volume
+
+
+// chunk_bytes
+//
+// Returns the memory taken up by a chunk's vertex array and morph deltas.
+static long chunk_bytes(const struct Terrain_Chunk *chunk)
+{
+    return chunk->num_vertices * sizeof(struct Terrain_Vertex) +
+           (chunk->cells.x+1) * (chunk->cells.y+1) * sizeof(struct Terrain_Morph);
+}  // chunk_bytes
+
+
+// unlink_chunk
+//
+// Takes a chunk off the cache list.
+static void unlink_chunk(struct Terrain_Chunk *chunk)
+{
+    if (chunk->lru_prev)
+        chunk->lru_prev->lru_next = chunk->lru_next;
+    else
+        lru_head = chunk->lru_next;
+    if (chunk->lru_next)
+        chunk->lru_next->lru_prev = chunk->lru_prev;
+    else
+        lru_tail = chunk->lru_prev;
+    chunk->lru_prev = chunk->lru_next = NULL;
+}  // unlink_chunk
+
+
+// link_chunk
+//
+// Puts a chunk at the front of the cache list.
+static void link_chunk(struct Terrain_Chunk *chunk)
+{
+    chunk->lru_prev = NULL;
+    chunk->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = chunk;
+    else
+        lru_tail = chunk;
+    lru_head = chunk;
+}  // link_chunk
+
+
+// page_out_chunk
+//
+// Frees the vertex array of a chunk.  Its bounds are kept.
+static void page_out_chunk(struct Terrain_Chunk *chunk)
+{
+    unlink_chunk(chunk);
+    cache_bytes -= chunk_bytes(chunk);
+    free(chunk->vertices);
+    free(chunk->morph);
+    chunk->vertices = NULL;
+    chunk->morph = NULL;
+}  // page_out_chunk
+
+
+// make_room
+//
+// Frees the least recently drawn chunks until bytes more will fit in the
+// cache.  If keep_current is set, chunks drawn this frame are left alone,
+// and 0 is returned if that means there is no room.  Otherwise there is
+// always room; if a single chunk is over the budget, the budget gives.
+static int make_room(long bytes, int keep_current)
+{
+    long budget = (long)g_terrain_cache_size * 1024;
+
+    while (lru_tail && cache_bytes + bytes > budget)
+    {
+        if (keep_current && lru_tail->last_used == terrain_frame)
+            return 0;
+        page_out_chunk(lru_tail);
+    }
+    return !keep_current || cache_bytes + bytes <= budget;
+}  // make_room
+
+
+// alloc_chunk
+//
+// Allocates the vertex array of a chunk that is out of the cache, and puts
+// it in the cache.  The caller must make room first.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+static SX3_ERROR_CODE alloc_chunk(struct Terrain_Chunk *chunk)
+{
+    chunk->vertices = malloc(chunk->num_vertices *
+                             sizeof(struct Terrain_Vertex));
+    chunk->morph = malloc((chunk->cells.x+1) * (chunk->cells.y+1) *
+                          sizeof(struct Terrain_Morph));
+    if (!chunk->vertices || !chunk->morph)
+    {
+        free(chunk->vertices);
+        free(chunk->morph);
+        chunk->vertices = NULL;
+        chunk->morph = NULL;
+        return SX3_ERROR_MEM_ALLOC;
+    }
+
+    cache_bytes += chunk_bytes(chunk);
+    link_chunk(chunk);
+    return SX3_ERROR_SUCCESS;
+}  // alloc_chunk
+
+
+// sx3_page_in_terrain_chunk
+//
+// Makes sure a chunk's vertex array is built, and moves it to the front of
+// the cache.  This is done for every chunk of a frame before any of them
+// are drawn, with the terrain locked, since the vertices are filled from
+// the heights.  Chunks paged in for the same frame are never freed to make
+// room, so that they are all still there to be drawn; if they don't fit,
+// the budget gives.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_page_in_terrain_chunk(struct Terrain_Chunk *chunk)
+{
+    chunk->last_used = terrain_frame;
+
+    if (chunk->vertices)
+    {
+        unlink_chunk(chunk);
+        link_chunk(chunk);
+        return SX3_ERROR_SUCCESS;
+    }
+
+    make_room(chunk_bytes(chunk), 1);
+    if (alloc_chunk(chunk) != SX3_ERROR_SUCCESS)
+        return SX3_ERROR_MEM_ALLOC;
+    fill_chunk_vertices(chunk);
+    chunk_morph_deltas(chunk);
+    return SX3_ERROR_SUCCESS;
+}  // sx3_page_in_terrain_chunk
+
+
+// sx3_prefetch_terrain_chunks
+//
+// Gets the chunks within radius grid units of map point (map_x, map_y)
+// ready ahead of time.  The pages under the square are marked as used (see
+// sx3_use_terrain_pages), so that if the terrain came from a file they are
+// read in in the background.  If build is set, up to
+// terrain.prefetch of the chunks that aren't in the cache are built, as long
+// as no chunk drawn this frame has to be freed to make room for them.
+void sx3_prefetch_terrain_chunks(
+    float map_x,
+    float map_y,
+    float radius,
+    int build)
+{
+    struct Terrain_Chunk *chunk;
+    int x, y, x_start, x_end, y_start, y_end, next_x, next_y;
+    int local_x, local_y, cx, cy, built = 0;
+
+    if (!g_terrain_chunks)
+        return;
+
+    x_start = (int)floor(map_x - radius);
+    x_end   = (int)floor(map_x + radius);
+    y_start = (int)floor(map_y - radius);
+    y_end   = (int)floor(map_y + radius);
+    if (x_end - x_start >= g_terrain_size.x)
+        x_end = x_start + g_terrain_size.x - 1;
+    if (y_end - y_start >= g_terrain_size.y)
+        y_end = y_start + g_terrain_size.y - 1;
+
+    sx3_use_terrain_pages(x_start, y_start, x_end + 2, y_end + 2);
+    if (!build)
+        return;
+
+    // Step through the chunks under the square, wrapping around the map
+    for (y=y_start; y<=y_end; y=next_y)
+    {
+        local_y = y % g_terrain_size.y;
+        if (local_y < 0)
+            local_y += g_terrain_size.y;
+        cy = local_y / TERRAIN_CHUNK_SIZE;
+
+        for (x=x_start; x<=x_end; x=next_x)
+        {
+            local_x = x % g_terrain_size.x;
+            if (local_x < 0)
+                local_x += g_terrain_size.x;
+            cx = local_x / TERRAIN_CHUNK_SIZE;
+
+            chunk = &g_terrain_chunks[cx + cy*g_terrain_num_chunks.x];
+            next_x = x + chunk->origin.x + chunk->cells.x - local_x;
+
+            if (build && !chunk->vertices && built < g_terrain_prefetch)
+            {
+                // Stop as soon as the cache is full of chunks in view
+                if (make_room(chunk_bytes(chunk), 1) &&
+                    alloc_chunk(chunk) == SX3_ERROR_SUCCESS)
+                {
+                    fill_chunk_vertices(chunk);
+                    chunk_morph_deltas(chunk);
+                    chunk->last_used = terrain_frame - 1;
+                    built++;
+                }
+                else
+                    build = 0;
+            }
+        }
+
+        next_y = y + g_terrain_chunks[cy*g_terrain_num_chunks.x].origin.y +
+                 g_terrain_chunks[cy*g_terrain_num_chunks.x].cells.y - local_y;
+    }
+}  // sx3_prefetch_terrain_chunks
+
+
+// sx3_rebuild_terrain_chunk
+//
+// Refills the vertex array of a chunk from the heightfield, and updates the
+// chunk's bounding volume and mip level errors.  The chunk is brought into
+// the cache if it isn't there already.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_rebuild_terrain_chunk(struct Terrain_Chunk *chunk)
+{
+    int level;
+
+    if (!chunk->vertices)
+    {
+        make_room(chunk_bytes(chunk), 0);
+        if (alloc_chunk(chunk) != SX3_ERROR_SUCCESS)
+            return SX3_ERROR_MEM_ALLOC;
+    }
+    fill_chunk_vertices(chunk);
+
+    // Geometric error of each mip level
+    chunk->error[0] = 0.0F;
+    for (level=1; level<TERRAIN_CHUNK_LEVELS; level++)
+    {
+        chunk->error[level] = chunk_level_error(chunk, 1<<level);
+        if (chunk->error[level] < chunk->error[level-1])
+            chunk->error[level] = chunk->error[level-1];
+    }
+
+    chunk_morph_deltas(chunk);
+
+    return SX3_ERROR_SUCCESS;
+}  // sx3_rebuild_terrain_chunk
+
+
+// sx3_free_terrain_chunks
+//
+// Frees the chunks and the shared index lists.
+void sx3_free_terrain_chunks(void)
+{
+    int i;
+
+    if (g_terrain_chunks)
+    {
+        for (i=0; i<g_terrain_num_chunks.x*g_terrain_num_chunks.y; i++)
+        {
+            free(g_terrain_chunks[i].vertices);
+            free(g_terrain_chunks[i].morph);
+        }
+        free(g_terrain_chunks);
+        g_terrain_chunks = NULL;
+    }
+    lru_head = lru_tail = NULL;
+    cache_bytes = 0;
+    g_terrain_num_chunks.x = g_terrain_num_chunks.y = 0;
+
+    for (i=0; i<num_terrain_strips; i++)
+        free(terrain_strips[i].indices);
+    free(terrain_strips);
+    terrain_strips = NULL;
+    num_terrain_strips = 0;
+}  // sx3_free_terrain_chunks
+
+
+// add_strip_index
+//
+// Appends a vertex to a strip.  If start is set, the vertex begins a new
+// strip, and is joined to the previous one with degenerate triangles.
+// Every strip we build has an even number of vertices, so the winding of
+// the next strip is not affected by the join.
+static void add_strip_index(struct Terrain_Strip *s, int index, int start)
+{
+    if (start && s->num_indices)
+    {
+        s->indices[s->num_indices] = s->indices[s->num_indices-1];
+        s->num_indices++;
+        s->indices[s->num_indices++] = index;
+    }
+    s->indices[s->num_indices++] = index;
+}  // add_strip_index
+
+
+// find_terrain_strip
+//
+// Returns the strip for chunks of the given size drawn at the given stride,
+// building it the first time it is asked for.
+static const struct Terrain_Strip *find_terrain_strip(
+    int cells_x,
+    int cells_y,
+    int stride)
+{
+    struct Terrain_Strip *s, *tmp;
+    int i, j, nj, w, max_indices, first;
+    int grid_size, north, south, west, east;
+
+    for (i=0; i<num_terrain_strips; i++)
+    {
+        s = &terrain_strips[i];
+        if (s->cells_x == cells_x && s->cells_y == cells_y &&
+            s->stride == stride)
+            return s;
+    }
+
+    tmp = realloc(terrain_strips,
+                  (num_terrain_strips+1) * sizeof(struct Terrain_Strip));
+    if (!tmp)
+        return NULL;
+    terrain_strips = tmp;
+
+    // The worst case is stride 1: two indices per vertex for every row and
+    // every skirt, plus two for each join.
+    w = cells_x + 1;
+    max_indices = 2*w*cells_y + 4*(cells_y + cells_x + 2) + 2*(cells_y + 4);
+
+    s = &terrain_strips[num_terrain_strips];
+    s->cells_x = cells_x;
+    s->cells_y = cells_y;
+    s->stride = stride;
+    s->num_indices = 0;
+    s->indices = malloc(max_indices * sizeof(GLushort));
+    if (!s->indices)
+        return NULL;
+    num_terrain_strips++;
+
+    grid_size = w*(cells_y + 1);
+    north = grid_size;
+    south = north + w;
+    west  = south + w;
+    east  = west + cells_y + 1;
+
+    // The grid.  Triangle strips run West to East, one row at a time.
+    for (j=0; j<cells_y; j=nj)
+    {
+        nj = next_sample(j, stride, cells_y);
+        for (i=0, first=1; ; i=next_sample(i, stride, cells_x), first=0)
+        {
+            add_strip_index(s, i + j*w, first);
+            add_strip_index(s, i + nj*w, 0);
+            if (i == cells_x)
+                break;
+        }
+    }
+
+    // The skirts.  The order of the top and bottom vertices is picked so
+    // that each skirt faces away from the chunk.
+    for (i=0, first=1; ; i=next_sample(i, stride, cells_x), first=0)
+    {
+        add_strip_index(s, north + i, first);
+        add_strip_index(s, i, 0);
+        if (i == cells_x)
+            break;
+    }
+    for (i=0, first=1; ; i=next_sample(i, stride, cells_x), first=0)
+    {
+        add_strip_index(s, i + cells_y*w, first);
+        add_strip_index(s, south + i, 0);
+        if (i == cells_x)
+            break;
+    }
+    for (j=0, first=1; ; j=next_sample(j, stride, cells_y), first=0)
+    {
+        add_strip_index(s, j*w, first);
+        add_strip_index(s, west + j, 0);
+        if (j == cells_y)
+            break;
+    }
+    for (j=0, first=1; ; j=next_sample(j, stride, cells_y), first=0)
+    {
+        add_strip_index(s, east + j, first);
+        add_strip_index(s, cells_x + j*w, 0);
+        if (j == cells_y)
+            break;
+    }
+
+    return s;
+}  // find_terrain_strip
+
+
+// sx3_next_terrain_frame
+//
+// Starts a new frame as far as the cache is concerned.  The chunks paged in
+// from now on are the ones drawn in the new frame.
+void sx3_next_terrain_frame(void)
+{
+    terrain_frame++;
+}  // sx3_next_terrain_frame
+
+
+// sx3_begin_terrain_chunks
+//
+// Sets up the GL state for drawing chunks.  The vertex colors drive the
+// diffuse material through GL_COLOR_MATERIAL.
+void sx3_begin_terrain_chunks(void)
+{
+    glColorMaterial(GL_FRONT, GL_DIFFUSE);
+    glEnable(GL_COLOR_MATERIAL);
+}  // sx3_begin_terrain_chunks
+
+
+// draw_chunk_vertices
+//
+// Draws a chunk from its vertex array, as it stands.  The chunk must be in
+// the cache.
+static void draw_chunk_vertices(
+    const struct Terrain_Chunk *chunk,
+    int stride)
+{
+    const struct Terrain_Strip *s;
+
+    s = find_terrain_strip(chunk->cells.x, chunk->cells.y, stride);
+    if (!s)
+        return;
+
+    glInterleavedArrays(GL_C4F_N3F_V3F, 0, chunk->vertices);
+    glDrawElements(GL_TRIANGLE_STRIP, s->num_indices, GL_UNSIGNED_SHORT,
+                   s->indices);
+
+    g_terrain_stats.strips++;
+    g_terrain_stats.vertices += s->num_indices;
+}  // draw_chunk_vertices
+
+
+// morph_vertex
+//
+// Moves grid vertex (i,j) of a chunk, which is dy grid units from the viewer
+// along the map's y axis, by its morph delta times its morph weight (see
+// move_morphed_vertices).
+static void morph_vertex(
+    struct Terrain_Chunk *chunk,
+    int i,
+    int j,
+    float dy,
+    float eye_x,
+    float morph_start,
+    float scale)
+{
+    int k = i + j*(chunk->cells.x+1);
+    float dx = fabs(chunk->origin.x + i - eye_x);
+    float m = (((dx > dy) ? dx : dy) - morph_start) * scale;
+
+    RANGE_CHECK(m, 0.0F, 1.0F);
+    chunk->vertices[k].p.y = chunk->morph[k].height + m * chunk->morph[k].delta;
+}  // morph_vertex
+
+
+// move_morphed_vertices
+//
+// Moves the vertices of a chunk that are drawn at stride 1<<level but not at
+// the next coarser one, in place.  Each moves by (d - morph_start) * scale of
+// its morph delta (no less than none and no more than all of it), where d is
+// its distance from the viewer.  A scale of 0 puts them back where they
+// started.  No other vertex is touched.
+static void move_morphed_vertices(
+    struct Terrain_Chunk *chunk,
+    int level,
+    float eye_x,
+    float eye_y,
+    float morph_start,
+    float scale)
+{
+    int stride = 1<<level;
+    int i, j;
+    float dy;
+
+    for (j=0; ; j=next_sample(j, stride, chunk->cells.y))
+    {
+        dy = fabs(chunk->origin.y + j - eye_y);
+
+        if (is_sampled(j, 2*stride, chunk->cells.y))
+        {
+            // The coarser level keeps the row, but drops every other vertex
+            for (i=stride; i<chunk->cells.x; i+=2*stride)
+                morph_vertex(chunk, i, j, dy, eye_x, morph_start, scale);
+        }
+        else
+        {
+            for (i=0; ; i=next_sample(i, stride, chunk->cells.x))
+            {
+                morph_vertex(chunk, i, j, dy, eye_x, morph_start, scale);
+                if (i == chunk->cells.x)
+                    break;
+            }
+        }
+
+        if (j == chunk->cells.y)
+            break;
+    }
+}  // move_morphed_vertices
+
+
+// unmorph_chunk
+//
+// Puts back any vertices of a chunk that were morphed the last time it was
+// drawn.
+static void unmorph_chunk(struct Terrain_Chunk *chunk)
+{
+    if (chunk->morph_level < 0)
+        return;
+    move_morphed_vertices(chunk, chunk->morph_level, 0.0F, 0.0F, 0.0F, 0.0F);
+    chunk->morph_level = -1;
+}  // unmorph_chunk
+
+
+// sx3_draw_terrain_chunk
+//
+// Draws a chunk, using every stride'th vertex.  The chunk must have been
+// paged in this frame (see sx3_page_in_terrain_chunk); the terrain need not
+// be locked.  The caller is responsible for translating the chunk to the
+// copy of the (tiled) map being drawn.
+void sx3_draw_terrain_chunk(
+    struct Terrain_Chunk *chunk,
+    int stride)
+{
+    if (!chunk->vertices)
+        return;
+    unmorph_chunk(chunk);
+    draw_chunk_vertices(chunk, stride);
+}  // sx3_draw_terrain_chunk
+
+
+// sx3_draw_terrain_chunk_morphed
+//
+// Draws a chunk at stride 1<<level, with the vertices that the next coarser
+// level drops blended towards the coarser surface.  A vertex starts to move
+// morph_start grid units from the viewer, and lies on the coarser surface
+// at morph_end and beyond.  Distances are measured along the larger of the
+// two map axes, and eye_x and eye_y are the map coords of the viewer
+// relative to the copy of the map being drawn.  As with
+// sx3_draw_terrain_chunk, the chunk must have been paged in this frame.
+void sx3_draw_terrain_chunk_morphed(
+    struct Terrain_Chunk *chunk,
+    int level,
+    float eye_x,
+    float eye_y,
+    float morph_start,
+    float morph_end)
+{
+    int stride = 1<<level;
+    float dx, dy, far_x, far_y;
+
+    if (!chunk->vertices)
+        return;
+
+    if (level >= TERRAIN_CHUNK_LEVELS-1 || morph_end <= morph_start)
+    {
+        unmorph_chunk(chunk);
+        draw_chunk_vertices(chunk, stride);
+        return;
+    }
+
+    // Leave the vertices alone if none of them is far enough away to move
+    far_x = fabs(chunk->origin.x - eye_x);
+    dx = fabs(chunk->origin.x + chunk->cells.x - eye_x);
+    if (dx > far_x)
+        far_x = dx;
+    far_y = fabs(chunk->origin.y - eye_y);
+    dy = fabs(chunk->origin.y + chunk->cells.y - eye_y);
+    if (dy > far_y)
+        far_y = dy;
+    if (far_x <= morph_start && far_y <= morph_start)
+    {
+        unmorph_chunk(chunk);
+        draw_chunk_vertices(chunk, stride);
+        return;
+    }
+
+    // The skirts hang from the unmorphed minimum height, which is never
+    // above the morphed surface.
+    if (chunk->morph_level != level)
+        unmorph_chunk(chunk);
+    move_morphed_vertices(chunk, level, eye_x, eye_y, morph_start,
+                          1.0F / (morph_end - morph_start));
+    chunk->morph_level = level;
+
+    draw_chunk_vertices(chunk, stride);
+}  // sx3_draw_terrain_chunk_morphed
+
+
+// sx3_end_terrain_chunks
+//
+// Restores the GL state changed by sx3_begin_terrain_chunks and
+// sx3_draw_terrain_chunk.
+void sx3_end_terrain_chunks(void)
+{
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisable(GL_COLOR_MATERIAL);
+}  // sx3_end_terrain_chunks
@@ -0,0 +1,161 @@
+// File: sx3_terrain_mesh.h
+// Author: Marc Bryant
+//
+// Cached terrain meshes.  The heightfield is split into fixed-size chunks,
+// and each chunk has an interleaved vertex array that is built the first
+// time the chunk is drawn.  The vertex arrays are kept in a cache with a
+// fixed memory budget (terrain.cache), and the ones that haven't been drawn
+// for the longest are freed to make room.  Every chunk keeps its record
+// (origin, height range and mip level errors) for as long as the terrain
+// is loaded, so that it can be culled without building it; those records
+// are small, but there is one for each chunk of the map.
+
+#ifndef SX3_TERRAIN_MESH_H
+#define SX3_TERRAIN_MESH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! These should be static const variables
+
+// Number of grid cells along each side of a terrain chunk.  This must be a
+// power of two, and (TERRAIN_CHUNK_SIZE+1)^2 plus the skirt vertices must
+// fit in an unsigned short index.
+#define TERRAIN_CHUNK_SIZE         32
+// Number of strides a chunk can be drawn at: 1, 2, 4, ... TERRAIN_CHUNK_SIZE
+#define TERRAIN_CHUNK_LEVELS       6
+// How far (in meters) the chunk skirts hang below the lowest chunk vertex
+#define TERRAIN_SKIRT_DEPTH        1.0F
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// One terrain vertex.  The layout matches GL_C4F_N3F_V3F, so a chunk can be
+// handed to glInterleavedArrays as is.
+struct Terrain_Vertex {
+    struct Color                c;
+    struct Point                n;
+    struct Point                p;
+};
+
+// The unmorphed height of a grid vertex, and how far it moves when its
+// level is fully morphed (see struct Terrain_Chunk)
+struct Terrain_Morph {
+    float                       height;
+    float                       delta;
+};
+
+// A terrain chunk covers cells [origin, origin+cells) of the heightfield.
+// The vertex array holds the (cells.x+1)*(cells.y+1) grid vertices in
+// row-major order, followed by the skirt vertices for the north, south,
+// west and east edges (in that order).  The skirts hide the cracks between
+// neighbouring chunks that are drawn at different strides.
+//
+// error[level] is the largest vertical distance (in meters) between a grid
+// vertex and the surface drawn when the chunk is drawn at stride 1<<level.
+// It never decreases as the level goes up.
+//
+// Each grid vertex is dropped at exactly one level: the first level whose
+// stride skips it.  morph holds, for every grid vertex, how far its height
+// must move to lie on the surface drawn at that level, so that a chunk can
+// be blended smoothly into the next coarser level.  The vertices dropped at
+// morph_level are moved in place in the vertex array (morph_level is -1
+// when none are), and are put back from morph[].height before the chunk is
+// drawn any other way.
+//
+// dirty is set while the chunk is waiting to be rebuilt after the terrain
+// under it has been deformed.
+//
+// The bounds, errors and bounding volume are always kept.  vertices and
+// morph are NULL while the chunk is out of the cache.
+struct Terrain_Chunk {
+    struct IPoint               origin;        // map coords of first vertex
+    struct IPoint               cells;         // cells in x and y
+    struct Point                center;        // gl center of bounding box
+    float                       radius;        // bounding sphere radius
+    float                       min_height;
+    float                       max_height;
+    float                       error[TERRAIN_CHUNK_LEVELS];
+    int                         num_vertices;
+    struct Terrain_Vertex      *vertices;
+    struct Terrain_Morph       *morph;
+    int                         morph_level;
+    int                         dirty;
+    int                         last_used;     // frame last drawn in
+    struct Terrain_Chunk       *lru_prev;      // cache order, newest first
+    struct Terrain_Chunk       *lru_next;
+};
+
+// The parts of a chunk that are costly to work out from the heightfield,
+// as stored in terrain files (see sx3_terrain_file.h).
+struct Terrain_Chunk_Bounds {
+    float                       min_height;
+    float                       max_height;
+    float                       error[TERRAIN_CHUNK_LEVELS];
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+extern struct IPoint            g_terrain_num_chunks;
+extern struct Terrain_Chunk    *g_terrain_chunks;
+
+// Memory budget (in kilobytes) of the chunk vertex arrays (terrain.cache)
+extern int                      g_terrain_cache_size;
+// Chunks that may be built ahead of the viewer each frame (terrain.prefetch)
+extern int                      g_terrain_prefetch;
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_build_terrain_chunks(
+    const struct Terrain_Chunk_Bounds *bounds);
+
+SX3_ERROR_CODE sx3_rebuild_terrain_chunk(struct Terrain_Chunk *chunk);
+
+SX3_ERROR_CODE sx3_page_in_terrain_chunk(struct Terrain_Chunk *chunk);
+
+void sx3_prefetch_terrain_chunks(
+    float map_x,
+    float map_y,
+    float radius,
+    int build);
+
+void sx3_free_terrain_chunks(void);
+
+void sx3_next_terrain_frame(void);
+
+void sx3_begin_terrain_chunks(void);
+
+void sx3_draw_terrain_chunk(
+    struct Terrain_Chunk *chunk,
+    int stride);
+
+void sx3_draw_terrain_chunk_morphed(
+    struct Terrain_Chunk *chunk,
+    int level,
+    float eye_x,
+    float eye_y,
+    float morph_start,
+    float morph_end);
+
+void sx3_end_terrain_chunks(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
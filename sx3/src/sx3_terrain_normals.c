@@ -0,0 +1,234 @@
+// File: sx3_terrain_normals.c
+// Author: Marc Bryant
+//
+// Works out the terrain vertex normals from the heights, for the whole map
+// when it is loaded or for part of it after the terrain changes.  Big jobs
+// are split into bands of rows, each worked on by its own thread.
+//
+// Each band copies the rows of heights it needs out of the pages, and
+// keeps two rows of cell normals (the sum of the two triangle normals of
+// each cell) as separate x, y and z arrays.  The rows are laid out with the
+// wrapped cells already in place, so the inner loops are straight runs
+// over memory that the compiler can vectorise.  The finished normals are
+// copied back into the pages a row at a time.
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_normals.h"
+#include "sx3_terrain_pages.h"
+#include "sx3_math.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// A band of vertex rows [y0,y1), columns [x0,x1), and the scratch space for
+// its two rows of cell normals, two rows of heights and a row of normals.
+struct Normal_Band {
+    int                         x0, y0;
+    int                         x1, y1;
+    float                      *cells;
+    short                      *heights;
+    unsigned int               *normals;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+int                             g_terrain_threads = 4;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// cell_normals
+//
+// Works out the normals of n cells between the vertex rows h0 and h1 (the
+// cell i lies between vertices i and i+1 of each row) into nx, ny and nz.
+// Each is the sum of the unit normals of the cell's two triangles.
+static void cell_normals(
+    const short *h0,
+    const short *h1,
+    int n,
+    float *nx,
+    float *ny,
+    float *nz)
+{
+    const float scale = g_terrain_height_scale;
+    const float d = METERS_PER_MAP_GRID;
+    const float d2 = METERS_PER_MAP_GRID * METERS_PER_MAP_GRID;
+    float h00, h10, h01, h11;
+    float ax, az, bx, bz, la, lb;
+    int i;
+
+    // The height offset cancels out, so only the scale is applied
+    for (i=0; i<n; i++)
+    {
+        h00 = h0[i] * scale;
+        h10 = h0[i+1] * scale;
+        h01 = h1[i] * scale;
+        h11 = h1[i+1] * scale;
+
+        // Triangle (i,r) (i,r+1) (i+1,r), then (i+1,r+1) (i+1,r) (i,r+1).
+        // Both have a y component of d2.
+        ax = (h01 - h00) * d;
+        az = (h00 - h10) * d;
+        bx = (h11 - h10) * d;
+        bz = (h01 - h11) * d;
+        la = 1.0F / sqrtf(ax*ax + d2*d2 + az*az);
+        lb = 1.0F / sqrtf(bx*bx + d2*d2 + bz*bz);
+
+        nx[i] = ax*la + bx*lb;
+        ny[i] = d2*(la + lb);
+        nz[i] = az*la + bz*lb;
+    }
+}  // cell_normals
+
+
+// cell_row
+//
+// Works out the normals of the cells on either side of vertex columns
+// x0..x1-1 in cell row r, so that entry k holds cell x0-1+k.  h0 and h1
+// are scratch space for the two rows of heights (vertex columns x0-1..x1)
+// that the cells lie between.  The map wraps the same way the mesh does: the last cell of each row joins the last vertex to the
+// first, and the last row of cells joins the last row of vertices to the
+// first.
+static void cell_row(
+    int r,
+    int x0,
+    int x1,
+    short *h0,
+    short *h1,
+    float *nx,
+    float *ny,
+    float *nz)
+{
+    sx3_get_terrain_row(Terrain_Heights, r, x0 - 1, x1 + 1, h0);
+    sx3_get_terrain_row(Terrain_Heights, r + 1, x0 - 1, x1 + 1, h1);
+    cell_normals(h0, h1, x1 - x0 + 1, nx, ny, nz);
+}  // cell_row
+
+
+// normal_band
+//
+// Works out the vertex normals of one band.  This is the thread function.
+static int normal_band(void *data)
+{
+    struct Normal_Band *band = data;
+    int n = band->x1 - band->x0 + 1;
+    float *prev = band->cells;
+    float *next = band->cells + 3*n;
+    float *t;
+    short *h0 = band->heights;
+    short *h1 = band->heights + n + 1;
+    unsigned int *out = band->normals;
+    struct Point avg;
+    int i, j;
+
+    // The cells above the first row of the band
+    cell_row((band->y0 > 0) ? band->y0 - 1 : g_terrain_size.y - 1,
+             band->x0, band->x1, h0, h1, prev, prev + n, prev + 2*n);
+
+    for (j=band->y0; j<band->y1; j++)
+    {
+        cell_row(j, band->x0, band->x1, h0, h1, next, next + n, next + 2*n);
+
+        // The averages are left unscaled; sx3_pack_normal doesn't care
+        for (i=0; i<n-1; i++)
+        {
+            avg.x = prev[i]       + prev[i+1]       + next[i]       + next[i+1];
+            avg.y = prev[n+i]     + prev[n+i+1]     + next[n+i]     + next[n+i+1];
+            avg.z = prev[2*n+i]   + prev[2*n+i+1]   + next[2*n+i]   + next[2*n+i+1];
+            out[i] = sx3_pack_normal(avg);
+        }
+        sx3_set_terrain_row(Terrain_Normals, j, band->x0, band->x1, out);
+
+        t = prev;
+        prev = next;
+        next = t;
+    }
+
+    return 0;
+}  // normal_band
+
+
+// sx3_compute_terrain_normals
+//
+// Works out the vertex normals of columns x0..x1-1 of rows y0..y1-1 from
+// the heights.  The rectangle must lie within the map; callers split
+// rectangles that wrap.  The work is spread over g_terrain_threads threads
+// if there is enough of it.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_BAD_PARAMS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_compute_terrain_normals(int x0, int y0, int x1, int y1)
+{
+    struct Normal_Band bands[MAX_TERRAIN_THREADS];
+    SDL_Thread *threads[MAX_TERRAIN_THREADS];
+    int num_bands, rows = y1 - y0;
+    int row_floats = 6 * (x1 - x0 + 1);  // Two rows of x, y and z
+    int row_shorts = 2 * (x1 - x0 + 2);  // Two rows of heights
+    float *cells;
+    short *heights;
+    unsigned int *normals;
+    int k;
+
+    if (!g_terrain_pages || x0 < 0 || y0 < 0 || x1 > g_terrain_size.x || y1 > g_terrain_size.y ||
+        x0 >= x1 || y0 >= y1)
+        return SX3_ERROR_BAD_PARAMS;
+
+    num_bands = g_terrain_threads;
+    RANGE_CHECK(num_bands, 1, MAX_TERRAIN_THREADS);
+    if (num_bands > rows / MIN_TERRAIN_THREAD_ROWS)
+        num_bands = (rows / MIN_TERRAIN_THREAD_ROWS > 0) ?
+                    rows / MIN_TERRAIN_THREAD_ROWS : 1;
+
+    cells = malloc(num_bands * row_floats * sizeof(float));
+    heights = malloc(num_bands * row_shorts * sizeof(short));
+    normals = malloc(num_bands * (x1 - x0) * sizeof(unsigned int));
+    if (!cells || !heights || !normals)
+    {
+        free(cells);
+        free(heights);
+        free(normals);
+        return SX3_ERROR_MEM_ALLOC;
+    }
+
+    for (k=0; k<num_bands; k++)
+    {
+        bands[k].x0 = x0;
+        bands[k].x1 = x1;
+        bands[k].y0 = y0 + rows*k/num_bands;
+        bands[k].y1 = y0 + rows*(k+1)/num_bands;
+        bands[k].cells = cells + k*row_floats;
+        bands[k].heights = heights + k*row_shorts;
+        bands[k].normals = normals + k*(x1 - x0);
+    }
+
+    // The calling thread does the first band itself.  If a thread can't be
+    // started, its band is done here as well.
+    for (k=1; k<num_bands; k++)
+        threads[k] = SDL_CreateThread(normal_band, &bands[k]);
+    normal_band(&bands[0]);
+    for (k=1; k<num_bands; k++)
+    {
+        if (threads[k])
+            SDL_WaitThread(threads[k], NULL);
+        else
+            normal_band(&bands[k]);
+    }
+
+    free(cells);
+    free(heights);
+    free(normals);
+    return SX3_ERROR_SUCCESS;
+}  // sx3_compute_terrain_normals
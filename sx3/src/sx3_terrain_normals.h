@@ -0,0 +1,47 @@
+// File: sx3_terrain_normals.h
+// Author: Marc Bryant
+//
+// Terrain vertex normals.  Each vertex normal is the average of the normals
+// of the eight triangles in the four cells around it.  The map wraps, so the
+// cells along the edges join the last row and column of vertices to the
+// first, the same as in the terrain mesh.
+
+#ifndef SX3_TERRAIN_NORMALS_H
+#define SX3_TERRAIN_NORMALS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! These should be static const variables
+
+#define MAX_TERRAIN_THREADS         64
+// Bands with fewer rows than this are not worth starting a thread for
+#define MIN_TERRAIN_THREAD_ROWS     32
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// Number of threads the normals are worked out on (terrain.threads)
+extern int                      g_terrain_threads;
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_compute_terrain_normals(int x0, int y0, int x1, int y1);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
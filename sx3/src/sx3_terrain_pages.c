@@ -0,0 +1,461 @@
+// File: sx3_terrain_pages.c
+// Author: Marc Bryant
+//
+// The paged terrain store (see sx3_terrain_pages.h).  The pages of a mapped
+// file that are in use are kept on a list, most recently used first, the
+// same way as the chunk meshes (see sx3_terrain_mesh.c).  Pinned pages are
+// taken off the list for good.  Pages are read in and handed back with
+// madvise, or on Windows with PrefetchVirtualMemory and VirtualUnlock.
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_pages.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+#ifdef WIN32
+// PrefetchVirtualMemory and its WIN32_MEMORY_RANGE_ENTRY only exist on
+// Windows 8 and later, so they are declared here and looked up at run time
+struct Memory_Range {
+    void                       *start;
+    SIZE_T                      length;
+};
+
+typedef BOOL (WINAPI *Prefetch_Memory)(HANDLE, ULONG_PTR, struct Memory_Range*,
+                                       ULONG);
+#endif
+
+// Where a page of a mapped file stands.  prev and next link the pages in
+// use, and are -1 at the ends of the list.  last_used counts the calls to
+// sx3_use_terrain_pages.
+struct Page_Entry {
+    int                         prev;
+    int                         next;
+    int                         last_used;
+    char                        in_use;
+    char                        pinned;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+int                             g_terrain_page_budget = 32768;
+
+// One entry for each page, if the pages belong to a mapped file
+static struct Page_Entry       *page_entries = NULL;
+
+// The pages in use, most recently used first
+static int                      lru_head = -1;
+static int                      lru_tail = -1;
+static int                      pages_in_use = 0;
+static int                      pages_pinned = 0;
+static int                      use_count = 0;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// sx3_alloc_terrain_pages
+//
+// Sets up the pages of a size_x by size_y map, and sets g_terrain_size,
+// g_terrain_num_pages and g_terrain_pages.  Any pages from a previous
+// terrain are freed first.  If stored is not NULL, it holds all the pages
+// (in a mapped .ter2 file), which are used in place and handed back to the
+// system as they go out of use.  Otherwise the pages are allocated, zeroed.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_alloc_terrain_pages(
+    int size_x,
+    int size_y,
+    struct Terrain_Page *stored)
+{
+    int num_pages;
+
+    sx3_free_terrain_pages();
+
+    g_terrain_size.x = size_x;
+    g_terrain_size.y = size_y;
+    g_terrain_size.z = 0;
+    g_terrain_num_pages.x = (size_x + TERRAIN_PAGE_SIZE - 1) >> TERRAIN_PAGE_BITS;
+    g_terrain_num_pages.y = (size_y + TERRAIN_PAGE_SIZE - 1) >> TERRAIN_PAGE_BITS;
+    g_terrain_num_pages.z = 0;
+    num_pages = g_terrain_num_pages.x * g_terrain_num_pages.y;
+
+    if (!stored)
+    {
+        g_terrain_pages = calloc(num_pages, sizeof(struct Terrain_Page));
+        return g_terrain_pages ? SX3_ERROR_SUCCESS : SX3_ERROR_MEM_ALLOC;
+    }
+
+    page_entries = calloc(num_pages, sizeof(struct Page_Entry));
+    if (!page_entries)
+        return SX3_ERROR_MEM_ALLOC;
+    g_terrain_pages = stored;
+    return SX3_ERROR_SUCCESS;
+}  // sx3_alloc_terrain_pages
+
+
+// sx3_free_terrain_pages
+//
+// Frees the pages, unless they belong to a mapped file.
+void sx3_free_terrain_pages(void)
+{
+    if (!page_entries)
+        free(g_terrain_pages);
+    free(page_entries);
+
+    g_terrain_pages = NULL;
+    g_terrain_num_pages.x = g_terrain_num_pages.y = 0;
+    page_entries = NULL;
+    lru_head = lru_tail = -1;
+    pages_in_use = 0;
+    pages_pinned = 0;
+}  // sx3_free_terrain_pages
+
+
+// unlink_page
+//
+// Takes page i off the list of pages in use.
+static void unlink_page(int i)
+{
+    struct Page_Entry *e = &page_entries[i];
+
+    if (e->prev >= 0)
+        page_entries[e->prev].next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next >= 0)
+        page_entries[e->next].prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->in_use = 0;
+    pages_in_use--;
+}  // unlink_page
+
+
+// link_page
+//
+// Puts page i at the front of the list of pages in use.
+static void link_page(int i)
+{
+    struct Page_Entry *e = &page_entries[i];
+
+    e->prev = -1;
+    e->next = lru_head;
+    if (lru_head >= 0)
+        page_entries[lru_head].prev = i;
+    else
+        lru_tail = i;
+    lru_head = i;
+    e->in_use = 1;
+    pages_in_use++;
+}  // link_page
+
+
+// advise_page
+//
+// Tells the system that page i of the mapped file will be needed soon, so
+// that it can start reading it in, or if needed is 0, that it won't be, so
+// that it can have the memory back.  Memory handed back is read in from
+// the file again the next time it is looked at, so anything changed in it
+// is lost.  Only the memory pages that lie wholly within the page are
+// handed back, in case the system's pages are bigger than 4K.
+static void advise_page(int i, int needed)
+{
+    char *start = (char*)&g_terrain_pages[i];
+#ifdef WIN32
+    static Prefetch_Memory prefetch = NULL;
+    static int looked_up = 0;
+    struct Memory_Range range;
+
+    // Unlocking memory that isn't locked takes it out of the working set
+    if (!needed)
+    {
+        VirtualUnlock(start, sizeof(struct Terrain_Page));
+        return;
+    }
+
+    if (!looked_up)
+    {
+        prefetch = (Prefetch_Memory)GetProcAddress(
+            GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+        looked_up = 1;
+    }
+
+    // Older versions of Windows read the pages in when they are first used
+    if (!prefetch)
+        return;
+    range.start = start;
+    range.length = sizeof(struct Terrain_Page);
+    prefetch(GetCurrentProcess(), 1, &range, 0);
+#else
+    static size_t page_size = 0;
+    size_t first = (size_t)start;
+    size_t last = first + sizeof(struct Terrain_Page);
+
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    // madvise wants the start to be page aligned.  Reading in is rounded
+    // out to whole pages, handing back is rounded in.
+    if (needed)
+    {
+        first -= first % page_size;
+        madvise((void*)first, last - first, MADV_WILLNEED);
+    }
+    else
+    {
+        first = (first + page_size - 1) / page_size * page_size;
+        last -= last % page_size;
+        if (last > first)
+            madvise((void*)first, last - first, MADV_DONTNEED);
+    }
+#endif
+}  // advise_page
+
+
+// page_span
+//
+// Works out which pages along one axis of the map hold the vertices
+// [a0,a1), which may run off either end of the map and wrap around.
+// size is the size of the map along the axis and num the number of pages.
+// Returns the number of pages, and sets *first to the first of them; the
+// rest follow it, wrapping around after the last page.
+static int page_span(int a0, int a1, int size, int num, int *first)
+{
+    int length = a1 - a0, start, end, count;
+
+    *first = 0;
+    if (length <= 0)
+        return 0;
+    if (length >= size)
+        return num;
+
+    start = a0 % size;
+    if (start < 0)
+        start += size;
+    end = start + length - 1;
+
+    *first = start >> TERRAIN_PAGE_BITS;
+    if (end < size)
+        return (end >> TERRAIN_PAGE_BITS) - *first + 1;
+
+    count = num - *first + ((end - size) >> TERRAIN_PAGE_BITS) + 1;
+    return (count < num) ? count : num;
+}  // page_span
+
+
+// sx3_use_terrain_pages
+//
+// Marks the pages that hold the vertices [x0,x1) x [y0,y1) as used.  The
+// rectangle may run off the map, and wraps around.  Pages that weren't in
+// use are read in in the background.  If the pages in use then take up
+// more than terrain.pages kilobytes, the ones that have gone unused the
+// longest (but not the ones marked by this call) are handed back to the
+// system.  Does nothing unless the pages belong to a mapped file.
+void sx3_use_terrain_pages(int x0, int y0, int x1, int y1)
+{
+    struct Page_Entry *e;
+    int first_x, first_y, count_x, count_y, i, j, k;
+    int budget = (int)((long)g_terrain_page_budget * 1024 / TERRAIN_PAGE_BYTES);
+
+    if (!page_entries)
+        return;
+
+    use_count++;
+    count_x = page_span(x0, x1, g_terrain_size.x, g_terrain_num_pages.x, &first_x);
+    count_y = page_span(y0, y1, g_terrain_size.y, g_terrain_num_pages.y, &first_y);
+    for (j=0; j<count_y; j++)
+    {
+        for (i=0; i<count_x; i++)
+        {
+            k = (first_x + i) % g_terrain_num_pages.x +
+                (first_y + j) % g_terrain_num_pages.y * g_terrain_num_pages.x;
+            e = &page_entries[k];
+            if (e->pinned)
+                continue;
+
+            if (e->in_use)
+                unlink_page(k);
+            else
+                advise_page(k, 1);
+            link_page(k);
+            e->last_used = use_count;
+        }
+    }
+
+    while (pages_in_use > budget && lru_tail >= 0 &&
+           page_entries[lru_tail].last_used != use_count)
+    {
+        k = lru_tail;
+        unlink_page(k);
+        advise_page(k, 0);
+    }
+}  // sx3_use_terrain_pages
+
+
+// sx3_pin_terrain_pages
+//
+// Keeps the pages that hold the vertices [x0,x1) x [y0,y1) (which may run
+// off the map, as for sx3_use_terrain_pages) in memory for good.  This must
+// be done before anything in the pages is changed, since a page that is
+// handed back to the system is read in again from the file.
+void sx3_pin_terrain_pages(int x0, int y0, int x1, int y1)
+{
+    struct Page_Entry *e;
+    int first_x, first_y, count_x, count_y, i, j, k;
+
+    if (!page_entries)
+        return;
+
+    count_x = page_span(x0, x1, g_terrain_size.x, g_terrain_num_pages.x, &first_x);
+    count_y = page_span(y0, y1, g_terrain_size.y, g_terrain_num_pages.y, &first_y);
+    for (j=0; j<count_y; j++)
+    {
+        for (i=0; i<count_x; i++)
+        {
+            k = (first_x + i) % g_terrain_num_pages.x +
+                (first_y + j) % g_terrain_num_pages.y * g_terrain_num_pages.x;
+            e = &page_entries[k];
+            if (e->pinned)
+                continue;
+
+            if (e->in_use)
+                unlink_page(k);
+            e->pinned = 1;
+            pages_pinned++;
+        }
+    }
+}  // sx3_pin_terrain_pages
+
+
+// sx3_terrain_page_bytes
+//
+// Returns the memory taken up by the pages that are kept in memory: the
+// pages in use and the pinned ones for a mapped file, otherwise all of
+// them.
+long sx3_terrain_page_bytes(void)
+{
+    if (!g_terrain_pages)
+        return 0;
+    if (!page_entries)
+        return (long)g_terrain_num_pages.x * g_terrain_num_pages.y *
+               sizeof(struct Terrain_Page);
+    return (long)(pages_in_use + pages_pinned) * sizeof(struct Terrain_Page);
+}  // sx3_terrain_page_bytes
+
+
+// row_run
+//
+// Returns the entry of vertex (x,y) (which may lie off the map) in one of
+// the per vertex arrays of its page.  Sets *width to the size of the
+// entries, and *run to the number of entries from there to the end of the
+// row, the page or [x,x1), whichever comes first.
+static char *row_run(
+    enum Terrain_Page_Array array,
+    int x,
+    int y,
+    int x1,
+    int *width,
+    int *run)
+{
+    struct Terrain_Page *page;
+    int i, end;
+
+    x1 -= x;
+    x %= g_terrain_size.x;
+    if (x < 0)
+        x += g_terrain_size.x;
+    y %= g_terrain_size.y;
+    if (y < 0)
+        y += g_terrain_size.y;
+
+    end = (x | (TERRAIN_PAGE_SIZE-1)) + 1;
+    if (end > g_terrain_size.x)
+        end = g_terrain_size.x;
+    *run = (end - x < x1) ? end - x : x1;
+
+    page = TERRAIN_PAGE_OF(x, y);
+    i = TERRAIN_IN_PAGE(x, y);
+
+    switch (array)
+    {
+    case Terrain_Heights:
+        *width = sizeof(short);
+        return (char*)&page->heights[i];
+    case Terrain_Normals:
+        *width = sizeof(unsigned int);
+        return (char*)&page->normals[i];
+    default:
+        *width = sizeof(unsigned char);
+        return (char*)&page->tiles[i];
+    }
+}  // row_run
+
+
+// sx3_get_terrain_row
+//
+// Copies the entries of vertices [x0,x1) of row y out of one of the per
+// vertex arrays into values.  The row and columns may lie off the map, and
+// wrap around.
+void sx3_get_terrain_row(
+    enum Terrain_Page_Array array,
+    int y,
+    int x0,
+    int x1,
+    void *values)
+{
+    char *out = values;
+    const char *src;
+    int x, n, width;
+
+    // A run at a time, up to the end of each page
+    for (x=x0; x<x1; x+=n)
+    {
+        src = row_run(array, x, y, x1, &width, &n);
+        memcpy(out, src, n*width);
+        out += n*width;
+    }
+}  // sx3_get_terrain_row
+
+
+// sx3_set_terrain_row
+//
+// Copies values into the entries of vertices [x0,x1) of row y in one of
+// the per vertex arrays.  The row and columns may lie off the map, and
+// wrap around.
+void sx3_set_terrain_row(
+    enum Terrain_Page_Array array,
+    int y,
+    int x0,
+    int x1,
+    const void *values)
+{
+    const char *in = values;
+    char *dst;
+    int x, n, width;
+
+    for (x=x0; x<x1; x+=n)
+    {
+        dst = row_run(array, x, y, x1, &width, &n);
+        memcpy(dst, in, n*width);
+        in += n*width;
+    }
+}  // sx3_set_terrain_row
@@ -0,0 +1,93 @@
+// File: sx3_terrain_pages.h
+// Author: Marc Bryant
+//
+// Paged terrain store.  The heights, normals and tiles of the map, along
+// with the bottom levels of the ray cast pyramid, are kept in pages of
+// TERRAIN_PAGE_SIZE x TERRAIN_PAGE_SIZE vertices (struct Terrain_Page in
+// sx3_terrain.h), and every lookup goes through the page the vertex is in.
+//
+// The pages of a .ter2 file are used straight out of the mapped file.  The
+// pages around the viewer and along the path of every projectile in flight
+// are marked as used when they are prefetched, and so are the pages under
+// each chunk mesh as it is built.  Once the pages in use take up more than
+// terrain.pages kilobytes, the ones that have gone unused the longest are
+// handed back to the system, which reads them in from the file again if
+// they are ever looked at.  So the memory the map takes up depends on how
+// far the viewer can see, not on the size of the map.  Pages that have
+// been changed in memory (under craters) can't be read in again, and are
+// kept for the rest of the game.
+//
+// Maps loaded from .ter files or generated have no file to read the pages
+// back from, and are wholly in memory; terrain.pages does nothing for them.
+//
+// Looking up a vertex never marks its page: anything else that reads the
+// terrain (a tank, a long ray cast) has its pages read in by the system as
+// usual.  All of these functions must be called with the terrain locked.
+
+#ifndef SX3_TERRAIN_PAGES_H
+#define SX3_TERRAIN_PAGES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// The per vertex arrays of a page, for sx3_get_terrain_row and
+// sx3_set_terrain_row
+enum Terrain_Page_Array {
+    Terrain_Heights,
+    Terrain_Normals,
+    Terrain_Tiles
+};  // Terrain_Page_Array
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// Memory budget (in kilobytes) of the pages of a mapped terrain file that
+// are kept in memory (terrain.pages)
+extern int                      g_terrain_page_budget;
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_alloc_terrain_pages(
+    int size_x,
+    int size_y,
+    struct Terrain_Page *stored);
+
+void sx3_free_terrain_pages(void);
+
+void sx3_use_terrain_pages(int x0, int y0, int x1, int y1);
+
+void sx3_pin_terrain_pages(int x0, int y0, int x1, int y1);
+
+long sx3_terrain_page_bytes(void);
+
+void sx3_get_terrain_row(
+    enum Terrain_Page_Array array,
+    int y,
+    int x0,
+    int x1,
+    void *values);
+
+void sx3_set_terrain_row(
+    enum Terrain_Page_Array array,
+    int y,
+    int x0,
+    int x1,
+    const void *values);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,487 @@
+// File: sx3_terrain_raycast.c
+// Author: Marc Bryant
+//
+// Ray casts against the terrain, using a pyramid of maximum heights to skip
+// the ground that a ray passes over.
+//
+// A ray is walked through the pyramid a node at a time.  If the ray stays
+// above the highest point of a node while it is inside it, it moves on to
+// where it leaves the node and tries the next level up.  Otherwise it tries
+// the next level down, until it reaches a single cell, where it is tested
+// against the two triangles the cell is drawn with.  The map wraps, so a
+// ray that leaves one side of the map comes back in on the other.
+//
+// The heights in the pyramid are stored the same way as the terrain
+// heights (the height scale is always positive).  The levels whose nodes
+// are smaller than a page are kept in the pages themselves, so that they
+// are read in and handed back along with the heights they are made from
+// (see sx3_terrain_pages.h); only the levels above them, a single entry
+// per page at the bottom, are kept here.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_raycast.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// The levels of the pyramid that are kept in the pages
+#define PAGE_LEVELS                 TERRAIN_PAGE_BITS
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// The levels above the pages.  level_offset is the start of each level,
+// within the page for the levels kept in the pages, otherwise within
+// upper_levels.
+static short                   *upper_levels = NULL;
+static int                      upper_stored = 0;
+static int                      num_levels = 0;
+static int                      level_offset[MAX_TERRAIN_PYRAMID_LEVELS];
+static struct IPoint            level_size[MAX_TERRAIN_PYRAMID_LEVELS];
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// node_ptr
+//
+// Returns the entry of node (nx,ny) of a level of the pyramid.
+static short *node_ptr(int level, int nx, int ny)
+{
+    struct Terrain_Page *page;
+    int shift, mask;
+
+    if (level >= PAGE_LEVELS)
+        return upper_levels + level_offset[level] + nx + ny*level_size[level].x;
+
+    // A page holds 64 >> level nodes across of each of these levels
+    shift = TERRAIN_PAGE_BITS - level;
+    mask = (1 << shift) - 1;
+    page = &g_terrain_pages[(nx >> shift) + (ny >> shift)*g_terrain_num_pages.x];
+    return &page->pyramid[level_offset[level] + (nx & mask) +
+                          ((ny & mask) << shift)];
+}  // node_ptr
+
+
+// cell_max
+//
+// Returns the highest corner of map cell (x,y).
+static short cell_max(int x, int y)
+{
+    int x1 = (x + 1 < g_terrain_size.x) ? x + 1 : 0;
+    int y1 = (y + 1 < g_terrain_size.y) ? y + 1 : 0;
+    short h = TERRAIN_RAW_HEIGHT(x, y);
+
+    if (TERRAIN_RAW_HEIGHT(x1, y)  > h) h = TERRAIN_RAW_HEIGHT(x1, y);
+    if (TERRAIN_RAW_HEIGHT(x, y1)  > h) h = TERRAIN_RAW_HEIGHT(x, y1);
+    if (TERRAIN_RAW_HEIGHT(x1, y1) > h) h = TERRAIN_RAW_HEIGHT(x1, y1);
+    return h;
+}  // cell_max
+
+
+// fill_pyramid
+//
+// Works out the entries [x0,x1) x [y0,y1) of level 0, and everything above
+// them.
+static void fill_pyramid(int x0, int y0, int x1, int y1)
+{
+    short h, c;
+    int level, x, y, sx, sy;
+
+    for (y=y0; y<y1; y++)
+        for (x=x0; x<x1; x++)
+            *node_ptr(0, x, y) = cell_max(x, y);
+
+    for (level=1; level<num_levels; level++)
+    {
+        x0 >>= 1;
+        y0 >>= 1;
+        x1 = (x1 + 1) >> 1;
+        y1 = (y1 + 1) >> 1;
+        sx = level_size[level-1].x;
+        sy = level_size[level-1].y;
+
+        for (y=y0; y<y1; y++)
+        {
+            for (x=x0; x<x1; x++)
+            {
+                // The last row and column of odd sized levels only have
+                // one child across
+                h = *node_ptr(level-1, 2*x, 2*y);
+                if (2*x + 1 < sx && (c = *node_ptr(level-1, 2*x + 1, 2*y)) > h)
+                    h = c;
+                if (2*y + 1 < sy)
+                {
+                    if ((c = *node_ptr(level-1, 2*x, 2*y + 1)) > h)
+                        h = c;
+                    if (2*x + 1 < sx &&
+                        (c = *node_ptr(level-1, 2*x + 1, 2*y + 1)) > h)
+                        h = c;
+                }
+                *node_ptr(level, x, y) = h;
+            }
+        }
+    }
+}  // fill_pyramid
+
+
+// lay_out_pyramid
+//
+// Works out where each level of the pyramid of a size_x by size_y map
+// starts and how big it is.  Returns the number of levels, and sets *total
+// to the number of entries in the levels above the pages.
+static int lay_out_pyramid(
+    int size_x,
+    int size_y,
+    int *offsets,
+    struct IPoint *sizes,
+    int *total)
+{
+    struct IPoint size;
+    int levels = 0;
+
+    size.x = size_x;
+    size.y = size_y;
+    size.z = 0;
+    *total = 0;
+
+    // Each level is half the size of the one below, rounded up, until a
+    // single entry covers the whole map
+    for (;;)
+    {
+        sizes[levels] = size;
+        if (levels < PAGE_LEVELS)
+        {
+            offsets[levels] = levels ? offsets[levels-1] +
+                (TERRAIN_PAGE_VERTICES >> (2*(levels-1))) : 0;
+        }
+        else
+        {
+            offsets[levels] = *total;
+            *total += size.x * size.y;
+        }
+        levels++;
+        if ((size.x == 1 && size.y == 1) ||
+            levels == MAX_TERRAIN_PYRAMID_LEVELS)
+            break;
+        size.x = (size.x + 1) / 2;
+        size.y = (size.y + 1) / 2;
+    }
+    return levels;
+}  // lay_out_pyramid
+
+
+// sx3_terrain_pyramid_size
+//
+// Returns the number of entries in the levels of the pyramid of a size_x by
+// size_y map that are kept above the pages (which may be none).
+int sx3_terrain_pyramid_size(int size_x, int size_y)
+{
+    int offsets[MAX_TERRAIN_PYRAMID_LEVELS];
+    struct IPoint sizes[MAX_TERRAIN_PYRAMID_LEVELS];
+    int total;
+
+    lay_out_pyramid(size_x, size_y, offsets, sizes, &total);
+    return total;
+}  // sx3_terrain_pyramid_size
+
+
+// sx3_build_terrain_pyramid
+//
+// Builds the pyramid for the current terrain.  Must be called whenever a
+// terrain is loaded.  If stored is not NULL, the pages already hold their
+// levels of the pyramid and stored holds the levels above them (as
+// returned by sx3_get_terrain_pyramid when the terrain was saved), which
+// are used in place rather than built; stored must stay put until the
+// pyramid is freed, and is kept up to date as the terrain changes.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_build_terrain_pyramid(short *stored)
+{
+    int total;
+
+    sx3_free_terrain_pyramid();
+    if (!g_terrain_pages)
+        return SX3_ERROR_SUCCESS;
+
+    num_levels = lay_out_pyramid(g_terrain_size.x, g_terrain_size.y,
+                                 level_offset, level_size, &total);
+    if (stored)
+    {
+        upper_levels = stored;
+        upper_stored = 1;
+        return SX3_ERROR_SUCCESS;
+    }
+
+    if (total > 0)
+    {
+        upper_levels = malloc(total * sizeof(short));
+        if (!upper_levels)
+        {
+            sx3_free_terrain_pyramid();
+            return SX3_ERROR_MEM_ALLOC;
+        }
+    }
+
+    fill_pyramid(0, 0, g_terrain_size.x, g_terrain_size.y);
+    return SX3_ERROR_SUCCESS;
+}  // sx3_build_terrain_pyramid
+
+
+// sx3_update_terrain_pyramid
+//
+// Brings the pyramid up to date after the heights of the vertices
+// [x0,x1) x [y0,y1) have changed.  The rectangle must lie within the map.
+// The cells that share those vertices include the ones to the west and
+// north of the rectangle, which wrap around to the far side of the map.
+void sx3_update_terrain_pyramid(int x0, int y0, int x1, int y1)
+{
+    int last_x = g_terrain_size.x - 1;
+    int last_y = g_terrain_size.y - 1;
+    int cx0 = (x0 > 0) ? x0 - 1 : 0;
+    int cy0 = (y0 > 0) ? y0 - 1 : 0;
+
+    if (!num_levels)
+        return;
+
+    fill_pyramid(cx0, cy0, x1, y1);
+    if (x0 == 0)
+        fill_pyramid(last_x, cy0, last_x + 1, y1);
+    if (y0 == 0)
+        fill_pyramid(cx0, last_y, x1, last_y + 1);
+    if (x0 == 0 && y0 == 0)
+        fill_pyramid(last_x, last_y, last_x + 1, last_y + 1);
+}  // sx3_update_terrain_pyramid
+
+
+// sx3_get_terrain_pyramid
+//
+// Returns the levels of the pyramid of the current terrain that are kept
+// above the pages, sx3_terrain_pyramid_size entries long, or NULL if there
+// aren't any.
+const short *sx3_get_terrain_pyramid(void)
+{
+    return upper_levels;
+}  // sx3_get_terrain_pyramid
+
+
+// sx3_free_terrain_pyramid
+//
+// Frees the pyramid, unless it was stored elsewhere.
+void sx3_free_terrain_pyramid(void)
+{
+    if (!upper_stored)
+        free(upper_levels);
+    upper_levels = NULL;
+    upper_stored = 0;
+    num_levels = 0;
+}  // sx3_free_terrain_pyramid
+
+
+// cell_height
+//
+// Returns the height at (fx,fy) of the plane of one of the two triangles a
+// cell is drawn with: the northwest one if nw_triangle is set, otherwise
+// the southeast one.  The two planes agree along the diagonal.
+static double cell_height(
+    double fx,
+    double fy,
+    int nw_triangle,
+    double nw,
+    double ne,
+    double sw,
+    double se)
+{
+    if (nw_triangle)
+        return nw + fx*(ne - nw) + fy*(sw - nw);
+    return se + (1.0 - fx)*(sw - se) + (1.0 - fy)*(ne - se);
+}  // cell_height
+
+
+// hit_cell
+//
+// Tests the part [t0,t1] of a ray that lies over cell (cx,cy) against the
+// terrain.  (ox,oy,oh) and (dx,dy,dh) are the ray origin and direction in
+// map coords, with cx and cy unwrapped.  The height of the ray above the
+// terrain is linear over each of the triangles, so at most one split (where
+// the ray crosses the diagonal) is needed to find where it first drops to
+// zero.  Returns 1 and sets *t if the ray hits.
+static int hit_cell(
+    int cx,
+    int cy,
+    double ox, double oy, double oh,
+    double dx, double dy, double dh,
+    double t0,
+    double t1,
+    double *t)
+{
+    int x = cx % g_terrain_size.x, y = cy % g_terrain_size.y;
+    int x1, y1, i, n = 2, nw_triangle;
+    double nw, ne, sw, se, s0, s1, ts[3], mid, g0, g1;
+
+    if (x < 0) x += g_terrain_size.x;
+    if (y < 0) y += g_terrain_size.y;
+    x1 = (x + 1 < g_terrain_size.x) ? x + 1 : 0;
+    y1 = (y + 1 < g_terrain_size.y) ? y + 1 : 0;
+    nw = TERRAIN_HEIGHT(x,  y);
+    ne = TERRAIN_HEIGHT(x1, y);
+    sw = TERRAIN_HEIGHT(x,  y1);
+    se = TERRAIN_HEIGHT(x1, y1);
+
+    // Split where the ray crosses the diagonal (fx + fy = 1)
+    ts[0] = t0;
+    ts[1] = t1;
+    s0 = (ox + dx*t0 - cx) + (oy + dy*t0 - cy) - 1.0;
+    s1 = (ox + dx*t1 - cx) + (oy + dy*t1 - cy) - 1.0;
+    if ((s0 < 0.0) != (s1 < 0.0))
+    {
+        ts[1] = t0 + (t1 - t0) * s0 / (s0 - s1);
+        ts[2] = t1;
+        n = 3;
+    }
+
+    for (i=0; i+1<n; i++)
+    {
+        // Both ends are measured against the triangle the middle is over
+        mid = 0.5 * (ts[i] + ts[i+1]);
+        nw_triangle = (ox + dx*mid - cx) + (oy + dy*mid - cy) < 1.0;
+
+        g0 = oh + dh*ts[i] - cell_height(ox + dx*ts[i] - cx,
+                oy + dy*ts[i] - cy, nw_triangle, nw, ne, sw, se);
+        g1 = oh + dh*ts[i+1] - cell_height(ox + dx*ts[i+1] - cx,
+                oy + dy*ts[i+1] - cy, nw_triangle, nw, ne, sw, se);
+        if (g0 <= 0.0)
+        {
+            *t = ts[i];
+            return 1;
+        }
+        if (g1 <= 0.0)
+        {
+            *t = ts[i] + (ts[i+1] - ts[i]) * g0 / (g0 - g1);
+            return 1;
+        }
+    }
+    return 0;
+}  // hit_cell
+
+
+// floor_div
+//
+// a/b rounded down (b > 0).
+static int floor_div(int a, int b)
+{
+    return (a >= 0) ? a / b : -((b - 1 - a) / b);
+}  // floor_div
+
+
+// sx3_terrain_raycast
+//
+// Casts the ray origin + t*dir (GL coords, 0 <= t <= tmax) against the
+// terrain.  Returns 1 and sets *t to where the ray first meets the ground,
+// or returns 0 if it doesn't.  A ray that starts underground hits at t = 0.
+// dir need not be a unit vector.
+int sx3_terrain_raycast(
+    const float *origin,
+    const float *dir,
+    float tmax,
+    float *t)
+{
+    double ox, oy, oh, dx, dy, dh;
+    double s, s_exit, bias, h0, h1, top, hit;
+    int level, cx, cy, tile_x, tile_y, nx, ny;
+    int x0, y0, x1, y1;
+
+    if (!num_levels || tmax < 0.0F)
+        return 0;
+
+    // Map coords (see GL_Z_TO_MAP_X and GL_X_TO_MAP_Y)
+    ox = origin[2] / METERS_PER_MAP_GRID;
+    oy = g_terrain_size.y - origin[0] / METERS_PER_MAP_GRID;
+    oh = origin[1];
+    dx = dir[2] / METERS_PER_MAP_GRID;
+    dy = -dir[0] / METERS_PER_MAP_GRID;
+    dh = dir[1];
+
+    // Rays that stay above the highest point of the map can't hit anything
+    top = *node_ptr(num_levels-1, 0, 0) * (double)g_terrain_height_scale +
+          g_terrain_height_offset;
+    if (oh > top && oh + dh*tmax > top)
+        return 0;
+
+    // Positions are nudged this far along the ray when working out which
+    // node they are in, so that a point on the edge of a node counts as
+    // being in the node the ray is heading into
+    bias = fabs(dx) > fabs(dy) ? fabs(dx) : fabs(dy);
+    bias = (bias > 0.0) ? 1e-6 / bias : 0.0;
+
+    level = num_levels - 1;
+    s = 0.0;
+    while (s <= tmax)
+    {
+        cx = (int)floor(ox + dx*(s + bias));
+        cy = (int)floor(oy + dy*(s + bias));
+
+        // The node's cells, [x0,x1) x [y0,y1), in unwrapped map coords
+        tile_x = floor_div(cx, g_terrain_size.x) * g_terrain_size.x;
+        tile_y = floor_div(cy, g_terrain_size.y) * g_terrain_size.y;
+        nx = (cx - tile_x) >> level;
+        ny = (cy - tile_y) >> level;
+        x0 = tile_x + (nx << level);
+        y0 = tile_y + (ny << level);
+        x1 = tile_x + ((nx + 1) << level);
+        y1 = tile_y + ((ny + 1) << level);
+        if (x1 > tile_x + g_terrain_size.x) x1 = tile_x + g_terrain_size.x;
+        if (y1 > tile_y + g_terrain_size.y) y1 = tile_y + g_terrain_size.y;
+
+        // Where the ray leaves the node
+        s_exit = tmax;
+        if (dx > 0.0 && (x1 - ox) / dx < s_exit) s_exit = (x1 - ox) / dx;
+        if (dx < 0.0 && (x0 - ox) / dx < s_exit) s_exit = (x0 - ox) / dx;
+        if (dy > 0.0 && (y1 - oy) / dy < s_exit) s_exit = (y1 - oy) / dy;
+        if (dy < 0.0 && (y0 - oy) / dy < s_exit) s_exit = (y0 - oy) / dy;
+        if (s_exit < s)
+            s_exit = s;
+
+        // Pass over the node if the ray stays above it
+        h0 = oh + dh*s;
+        h1 = oh + dh*s_exit;
+        if ((h0 < h1 ? h0 : h1) >
+            *node_ptr(level, nx, ny) * (double)g_terrain_height_scale +
+            g_terrain_height_offset)
+        {
+            if (s_exit >= tmax)
+                return 0;
+            s = (s_exit > s + bias) ? s_exit : s + bias;
+            if (level < num_levels - 1)
+                level++;
+            continue;
+        }
+
+        if (level > 0)
+        {
+            level--;
+            continue;
+        }
+
+        if (hit_cell(cx, cy, ox, oy, oh, dx, dy, dh, s, s_exit, &hit))
+        {
+            *t = (float)hit;
+            return 1;
+        }
+        if (s_exit >= tmax)
+            return 0;
+        s = (s_exit > s + bias) ? s_exit : s + bias;
+        if (level < num_levels - 1)
+            level++;
+    }
+    return 0;
+}  // sx3_terrain_raycast
@@ -0,0 +1,53 @@
+// File: sx3_terrain_raycast.h
+// Author: Marc Bryant
+//
+// Ray casts against the terrain.  A pyramid of maximum heights is kept next
+// to the terrain heights: level 0 holds the highest corner of each map
+// cell, and each level above holds the highest of 2x2 entries of the level
+// below.  A ray skips any part of the pyramid that it passes over, so long
+// rays over open ground cost a handful of steps.
+
+#ifndef SX3_TERRAIN_RAYCAST_H
+#define SX3_TERRAIN_RAYCAST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// FIX ME!! These should be static const variables
+
+// Enough levels for a 65536 x 65536 map
+#define MAX_TERRAIN_PYRAMID_LEVELS  17
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+int sx3_terrain_pyramid_size(int size_x, int size_y);
+
+SX3_ERROR_CODE sx3_build_terrain_pyramid(short *stored);
+
+const short *sx3_get_terrain_pyramid(void);
+
+void sx3_update_terrain_pyramid(int x0, int y0, int x1, int y1);
+
+void sx3_free_terrain_pyramid(void);
+
+int sx3_terrain_raycast(
+    const float *origin,
+    const float *dir,
+    float tmax,
+    float *t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
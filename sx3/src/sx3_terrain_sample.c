@@ -0,0 +1,248 @@
+// File: sx3_terrain_sample.c
+// Author: Marc Bryant
+//
+// Batch terrain height sampling.  A point is dropped onto one of the two
+// triangles of its map cell (split along the same diagonal the terrain is
+// drawn with), and its height is that of the plane of the triangle.
+//
+// The SSE version does four points at a time.  The heights themselves
+// are still fetched one at a time from their pages (SSE2 has no gather), but the rest of the
+// work (finding the cell, wrapping it onto the map, picking the triangle,
+// interpolating and the normals) is done four wide.  Both versions do the
+// same arithmetic in the same order, so they give the same results.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_sample.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define SX3_TERRAIN_SAMPLE_SSE
+#endif
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// sx3_sample_terrain_heights_scalar
+//
+// Fills in heights[i] with the terrain height at GL point (x[i], z[i]), for
+// each of count points.  If normals is not NULL, it is filled in with the
+// unit normal of the terrain at each point.
+void sx3_sample_terrain_heights_scalar(
+    const float *x,
+    const float *z,
+    float *heights,
+    struct Point *normals,
+    int count)
+{
+    const int size_x = g_terrain_size.x;
+    const int size_y = g_terrain_size.y;
+    const float slope = g_terrain_height_scale / METERS_PER_MAP_GRID;
+    float grid_x, grid_y, cell_x, cell_y, frac_x, frac_y;
+    float nw, ne, sw, se, height, dx, dy, l;
+    int i, ix, iy, ix1, iy1;
+
+    if (!g_terrain_pages)
+        return;
+
+    for (i=0; i<count; i++)
+    {
+        // Map coordinates (see GL_Z_TO_MAP_X and GL_X_TO_MAP_Y)
+        grid_x = z[i] / METERS_PER_MAP_GRID;
+        grid_y = (float)size_y - x[i] / METERS_PER_MAP_GRID;
+        cell_x = (float)floor(grid_x);
+        cell_y = (float)floor(grid_y);
+        frac_x = grid_x - cell_x;
+        frac_y = grid_y - cell_y;
+
+        ix = (int)cell_x % size_x;
+        iy = (int)cell_y % size_y;
+        if (ix < 0) ix += size_x;
+        if (iy < 0) iy += size_y;
+        ix1 = (ix + 1 < size_x) ? ix + 1 : 0;
+        iy1 = (iy + 1 < size_y) ? iy + 1 : 0;
+
+        nw = TERRAIN_RAW_HEIGHT(ix,  iy);
+        ne = TERRAIN_RAW_HEIGHT(ix1, iy);
+        sw = TERRAIN_RAW_HEIGHT(ix,  iy1);
+        se = TERRAIN_RAW_HEIGHT(ix1, iy1);
+
+        // The cells are split from the northeast to the southwest corner
+        if (1.0F - frac_y > frac_x)
+        {
+            height = nw + frac_x*(ne - nw) + frac_y*(sw - nw);
+            dx = ne - nw;
+            dy = sw - nw;
+        }
+        else
+        {
+            height = se + (1.0F - frac_x)*(sw - se) + (1.0F - frac_y)*(ne - se);
+            dx = se - sw;
+            dy = se - ne;
+        }
+        heights[i] = height*g_terrain_height_scale + g_terrain_height_offset;
+
+        // Map x runs along GL z, and map y runs against GL x
+        if (normals)
+        {
+            dx *= slope;
+            dy *= slope;
+            l = 1.0F / sqrtf(dx*dx + dy*dy + 1.0F);
+            normals[i].x = dy * l;
+            normals[i].y = l;
+            normals[i].z = -dx * l;
+        }
+    }
+}  // sx3_sample_terrain_heights_scalar
+
+
+#ifdef SX3_TERRAIN_SAMPLE_SSE
+
+// floor_ps
+static __m128 floor_ps(__m128 v)
+{
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.0F)));
+}  // floor_ps
+
+
+// wrap_ps
+//
+// Wraps whole numbers onto [0, size).
+static __m128 wrap_ps(__m128 v, __m128 size)
+{
+    v = _mm_sub_ps(v, _mm_mul_ps(floor_ps(_mm_div_ps(v, size)), size));
+
+    // In case the division rounded the wrong way
+    v = _mm_add_ps(v, _mm_and_ps(_mm_cmplt_ps(v, _mm_setzero_ps()), size));
+    v = _mm_sub_ps(v, _mm_and_ps(_mm_cmpge_ps(v, size), size));
+    return v;
+}  // wrap_ps
+
+
+// sample_heights_sse
+//
+// sx3_sample_terrain_heights for four points at a time.  count must be a
+// multiple of 4.
+static void sample_heights_sse(
+    const float *x,
+    const float *z,
+    float *heights,
+    struct Point *normals,
+    int count)
+{
+    const __m128 one = _mm_set1_ps(1.0F);
+    const __m128 meters = _mm_set1_ps(METERS_PER_MAP_GRID);
+    const __m128 width = _mm_set1_ps((float)g_terrain_size.x);
+    const __m128 depth = _mm_set1_ps((float)g_terrain_size.y);
+    const __m128 scale = _mm_set1_ps(g_terrain_height_scale);
+    const __m128 offset = _mm_set1_ps(g_terrain_height_offset);
+    const __m128 slope = _mm_set1_ps(g_terrain_height_scale / METERS_PER_MAP_GRID);
+    __m128 grid_x, grid_y, cell_x, cell_y, frac_x, frac_y, cell_x1, cell_y1;
+    __m128 nw, ne, sw, se, in_nw, height_nw, height_se, dx, dy, l;
+    int ix[4], iy[4], ix1[4], iy1[4];
+    float fnw[4], fne[4], fsw[4], fse[4], nx[4], ny[4], nz[4];
+    int i, k;
+
+    for (i=0; i<count; i+=4)
+    {
+        grid_x = _mm_div_ps(_mm_loadu_ps(z + i), meters);
+        grid_y = _mm_sub_ps(depth, _mm_div_ps(_mm_loadu_ps(x + i), meters));
+        cell_x = floor_ps(grid_x);
+        cell_y = floor_ps(grid_y);
+        frac_x = _mm_sub_ps(grid_x, cell_x);
+        frac_y = _mm_sub_ps(grid_y, cell_y);
+
+        cell_x = wrap_ps(cell_x, width);
+        cell_y = wrap_ps(cell_y, depth);
+        cell_x1 = _mm_add_ps(cell_x, one);
+        cell_y1 = _mm_add_ps(cell_y, one);
+        cell_x1 = _mm_andnot_ps(_mm_cmpge_ps(cell_x1, width), cell_x1);
+        cell_y1 = _mm_andnot_ps(_mm_cmpge_ps(cell_y1, depth), cell_y1);
+
+        _mm_storeu_si128((__m128i*)ix,  _mm_cvttps_epi32(cell_x));
+        _mm_storeu_si128((__m128i*)iy,  _mm_cvttps_epi32(cell_y));
+        _mm_storeu_si128((__m128i*)ix1, _mm_cvttps_epi32(cell_x1));
+        _mm_storeu_si128((__m128i*)iy1, _mm_cvttps_epi32(cell_y1));
+        for (k=0; k<4; k++)
+        {
+            fnw[k] = TERRAIN_RAW_HEIGHT(ix[k],  iy[k]);
+            fne[k] = TERRAIN_RAW_HEIGHT(ix1[k], iy[k]);
+            fsw[k] = TERRAIN_RAW_HEIGHT(ix[k],  iy1[k]);
+            fse[k] = TERRAIN_RAW_HEIGHT(ix1[k], iy1[k]);
+        }
+        nw = _mm_loadu_ps(fnw);
+        ne = _mm_loadu_ps(fne);
+        sw = _mm_loadu_ps(fsw);
+        se = _mm_loadu_ps(fse);
+
+        // Work out both triangles, then pick
+        in_nw = _mm_cmpgt_ps(_mm_sub_ps(one, frac_y), frac_x);
+        height_nw = _mm_add_ps(_mm_add_ps(nw,
+                        _mm_mul_ps(frac_x, _mm_sub_ps(ne, nw))),
+                        _mm_mul_ps(frac_y, _mm_sub_ps(sw, nw)));
+        height_se = _mm_add_ps(_mm_add_ps(se,
+                        _mm_mul_ps(_mm_sub_ps(one, frac_x), _mm_sub_ps(sw, se))),
+                        _mm_mul_ps(_mm_sub_ps(one, frac_y), _mm_sub_ps(ne, se)));
+        height_nw = _mm_or_ps(_mm_and_ps(in_nw, height_nw),
+                              _mm_andnot_ps(in_nw, height_se));
+        _mm_storeu_ps(heights + i,
+                      _mm_add_ps(_mm_mul_ps(height_nw, scale), offset));
+
+        if (normals)
+        {
+            dx = _mm_or_ps(_mm_and_ps(in_nw, _mm_sub_ps(ne, nw)),
+                           _mm_andnot_ps(in_nw, _mm_sub_ps(se, sw)));
+            dy = _mm_or_ps(_mm_and_ps(in_nw, _mm_sub_ps(sw, nw)),
+                           _mm_andnot_ps(in_nw, _mm_sub_ps(se, ne)));
+            dx = _mm_mul_ps(dx, slope);
+            dy = _mm_mul_ps(dy, slope);
+            l = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), one)));
+            _mm_storeu_ps(nx, _mm_mul_ps(dy, l));
+            _mm_storeu_ps(ny, l);
+            _mm_storeu_ps(nz, _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), dx), l));
+            for (k=0; k<4; k++)
+            {
+                normals[i+k].x = nx[k];
+                normals[i+k].y = ny[k];
+                normals[i+k].z = nz[k];
+            }
+        }
+    }
+}  // sample_heights_sse
+
+#endif
+
+
+// sx3_sample_terrain_heights
+//
+// Fills in heights[i] with the terrain height at GL point (x[i], z[i]), for
+// each of count points.  If normals is not NULL, it is filled in with the
+// unit normal of the terrain at each point.  Uses SSE where the compiler
+// supports it.
+void sx3_sample_terrain_heights(
+    const float *x,
+    const float *z,
+    float *heights,
+    struct Point *normals,
+    int count)
+{
+    int done = 0;
+
+#ifdef SX3_TERRAIN_SAMPLE_SSE
+    if (g_terrain_pages)
+    {
+        done = count & ~3;
+        sample_heights_sse(x, z, heights, normals, done);
+    }
+#endif
+
+    sx3_sample_terrain_heights_scalar(x + done, z + done, heights + done,
+                                      normals ? normals + done : NULL,
+                                      count - done);
+}  // sx3_sample_terrain_heights
@@ -0,0 +1,40 @@
+// File: sx3_terrain_sample.h
+// Author: Marc Bryant
+//
+// Batch terrain height sampling.  These take arrays of GL x,z coordinates
+// and fill in the terrain height (and, optionally, the surface normal) at
+// each of them, for code that needs many points at once: projectiles,
+// tanks and impact searches.  The results match sx3_find_terrain_height.
+
+#ifndef SX3_TERRAIN_SAMPLE_H
+#define SX3_TERRAIN_SAMPLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+void sx3_sample_terrain_heights(
+    const float *x,
+    const float *z,
+    float *heights,
+    struct Point *normals,
+    int count);
+
+void sx3_sample_terrain_heights_scalar(
+    const float *x,
+    const float *z,
+    float *heights,
+    struct Point *normals,
+    int count);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,296 @@
+// File: sx3_terrain_tiles.c
+// Author: Marc Bryant
+//
+// Works out the tile type of each terrain square from the heights and
+// normals, for the whole map when it is loaded or for the squares around a
+// crater after the terrain changes.  Big jobs are split into bands of rows,
+// each worked on by its own thread, the same as the normals.  Each band
+// copies the rows it needs out of the pages, and the tiles back in.
+//
+// The rules are applied to a whole row of squares at a time as a series of
+// selects rather than an if/else chain, so that the compiler can vectorise
+// the loop.  From the lowest priority to the highest:
+//
+//   Grass    everything else
+//   Pebbles  lower than terrain.tile.pebbles
+//   Dirt     steeper than terrain.tile.dirt
+//   Snow     higher than terrain.tile.snow
+//   Rock     steeper than terrain.tile.rock
+//   Blast    hit by an explosion
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sx3_terrain.h"
+#include "sx3_terrain_normals.h"
+#include "sx3_terrain_pages.h"
+#include "sx3_terrain_tiles.h"
+#include "sx3_math.h"
+
+
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+#define WRAP(a,n) ((((a) % (n)) + (n)) % (n))
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// A band of square rows.  Rows first..first+count-1 are done, wrapped onto
+// the map, for the squares around vertex columns [x0,x1).  heights and
+// normals are scratch space for two rows of each, and tiles for one.
+struct Tile_Band {
+    int                         x0, x1;
+    int                         first, count;
+    short                      *heights;
+    unsigned int               *normals;
+    unsigned char              *tiles;
+};
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+float                           g_terrain_tile_snow = 150.0F;
+float                           g_terrain_tile_pebbles = 3.0F;
+float                           g_terrain_tile_rock = 0.7F;
+float                           g_terrain_tile_dirt = 0.9F;
+
+
+// ===========================================================================
+// Function definitions
+// ===========================================================================
+
+// normal_up
+//
+// Returns the y component of a normal packed by sx3_pack_normal without
+// unpacking all of it.  Normals that point below the horizon come out
+// negative (though not of the right size), which is all the rules need.
+static float normal_up(unsigned int packed)
+{
+    float u = (float)(packed >> 16) * (2.0F/65535.0F) - 1.0F;
+    float w = (float)(packed & 0xFFFF) * (2.0F/65535.0F) - 1.0F;
+    float y = 1.0F - fabsf(u) - fabsf(w);
+
+    return y / sqrtf(u*u + y*y + w*w);
+}  // normal_up
+
+
+// classify_cells
+//
+// Works out the tile types of n squares whose corners are h00[i], h10[i],
+// h01[i] and h11[i] (with normals n00[i] and so on) into tiles.  Squares
+// that have been blasted are left Blast.
+static void classify_cells(
+    const short *RESTRICT h00,
+    const short *RESTRICT h10,
+    const short *RESTRICT h01,
+    const short *RESTRICT h11,
+    const unsigned int *RESTRICT n00,
+    const unsigned int *RESTRICT n10,
+    const unsigned int *RESTRICT n01,
+    const unsigned int *RESTRICT n11,
+    unsigned char *RESTRICT tiles,
+    int n)
+{
+    const float scale = 0.25F * g_terrain_height_scale;
+    const float offset = g_terrain_height_offset;
+    const float snow = g_terrain_tile_snow;
+    const float pebbles = g_terrain_tile_pebbles;
+    const float rock = g_terrain_tile_rock;
+    const float dirt = g_terrain_tile_dirt;
+    float h, up, t;
+    unsigned char type;
+    int i;
+
+    for (i=0; i<n; i++)
+    {
+        h = (float)(h00[i] + h10[i] + h01[i] + h11[i]) * scale + offset;
+
+        // The steepest corner decides how steep the square is
+        up = normal_up(n00[i]);
+        t = normal_up(n10[i]);
+        up = (t < up) ? t : up;
+        t = normal_up(n01[i]);
+        up = (t < up) ? t : up;
+        t = normal_up(n11[i]);
+        up = (t < up) ? t : up;
+
+        type = Grass;
+        type = (h < pebbles) ? Pebbles : type;
+        type = (up < dirt) ? Dirt : type;
+        type = (h > snow) ? Snow : type;
+        type = (up < rock) ? Rock : type;
+        tiles[i] = (tiles[i] & TERRAIN_TILE_BLASTED) ?
+                   (TERRAIN_TILE_BLASTED | Blast) : type;
+    }
+}  // classify_cells
+
+
+// tile_row
+//
+// Works out the tile types of the squares in row r that have a corner in
+// vertex columns x0..x1-1, which are squares x0-1..x1-1.  The map wraps the
+// same way the mesh does: the last square of each row joins the last
+// vertex to the first, and the last row of squares joins the last row of
+// vertices to the first.  When the columns take in the whole row, the
+// last square is worked out twice, the same both times.
+static void tile_row(const struct Tile_Band *band, int r)
+{
+    int n = band->x1 - band->x0 + 1;  // Squares
+    const short *h0 = band->heights;
+    const short *h1 = band->heights + n + 1;
+    const unsigned int *n0 = band->normals;
+    const unsigned int *n1 = band->normals + n + 1;
+
+    sx3_get_terrain_row(Terrain_Heights, r, band->x0 - 1, band->x1 + 1,
+                        band->heights);
+    sx3_get_terrain_row(Terrain_Heights, r + 1, band->x0 - 1, band->x1 + 1,
+                        band->heights + n + 1);
+    sx3_get_terrain_row(Terrain_Normals, r, band->x0 - 1, band->x1 + 1,
+                        band->normals);
+    sx3_get_terrain_row(Terrain_Normals, r + 1, band->x0 - 1, band->x1 + 1,
+                        band->normals + n + 1);
+    sx3_get_terrain_row(Terrain_Tiles, r, band->x0 - 1, band->x1, band->tiles);
+
+    classify_cells(h0, h0 + 1, h1, h1 + 1, n0, n0 + 1, n1, n1 + 1,
+                   band->tiles, n);
+    sx3_set_terrain_row(Terrain_Tiles, r, band->x0 - 1, band->x1, band->tiles);
+}  // tile_row
+
+
+// tile_band
+//
+// Works out the tile types of one band.  This is the thread function.
+static int tile_band(void *data)
+{
+    struct Tile_Band *band = data;
+    int k;
+
+    for (k=0; k<band->count; k++)
+        tile_row(band, WRAP(band->first + k, g_terrain_size.y));
+
+    return 0;
+}  // tile_band
+
+
+// sx3_classify_terrain_tiles
+//
+// Works out the tile types of every square with a corner in columns
+// x0..x1-1 of rows y0..y1-1, which is every square whose tile may change
+// when the heights and normals of those vertices do.  The rectangle must
+// lie within the map; callers split rectangles that wrap.  The work is
+// spread over g_terrain_threads threads if there is enough of it.
+//
+// RETURN: SX3_ERROR_SUCCESS
+//         SX3_ERROR_BAD_PARAMS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_classify_terrain_tiles(int x0, int y0, int x1, int y1)
+{
+    struct Tile_Band bands[MAX_TERRAIN_THREADS];
+    SDL_Thread *threads[MAX_TERRAIN_THREADS];
+    int num_bands, rows = y1 - y0 + 1;
+    int row_entries = 2 * (x1 - x0 + 2);  // Two rows of heights or normals
+    short *heights;
+    unsigned int *normals;
+    unsigned char *tiles;
+    int k;
+
+    if (!g_terrain_pages || x0 < 0 || y0 < 0 || x1 > g_terrain_size.x || y1 > g_terrain_size.y ||
+        x0 >= x1 || y0 >= y1)
+        return SX3_ERROR_BAD_PARAMS;
+
+    // The row of squares before y0 is the last one when y0 is 0, so the
+    // whole map is only done once
+    if (rows > g_terrain_size.y)
+        rows = g_terrain_size.y;
+
+    num_bands = g_terrain_threads;
+    RANGE_CHECK(num_bands, 1, MAX_TERRAIN_THREADS);
+    if (num_bands > rows / MIN_TERRAIN_THREAD_ROWS)
+        num_bands = (rows / MIN_TERRAIN_THREAD_ROWS > 0) ?
+                    rows / MIN_TERRAIN_THREAD_ROWS : 1;
+
+    heights = malloc(num_bands * row_entries * sizeof(short));
+    normals = malloc(num_bands * row_entries * sizeof(unsigned int));
+    tiles = malloc(num_bands * (x1 - x0 + 1));
+    if (!heights || !normals || !tiles)
+    {
+        free(heights);
+        free(normals);
+        free(tiles);
+        return SX3_ERROR_MEM_ALLOC;
+    }
+
+    for (k=0; k<num_bands; k++)
+    {
+        bands[k].x0 = x0;
+        bands[k].x1 = x1;
+        bands[k].first = y0 - 1 + rows*k/num_bands;
+        bands[k].count = rows*(k+1)/num_bands - rows*k/num_bands;
+        bands[k].heights = heights + k*row_entries;
+        bands[k].normals = normals + k*row_entries;
+        bands[k].tiles = tiles + k*(x1 - x0 + 1);
+    }
+
+    // The calling thread does the first band itself.  If a thread can't be
+    // started, its band is done here as well.
+    for (k=1; k<num_bands; k++)
+        threads[k] = SDL_CreateThread(tile_band, &bands[k]);
+    tile_band(&bands[0]);
+    for (k=1; k<num_bands; k++)
+    {
+        if (threads[k])
+            SDL_WaitThread(threads[k], NULL);
+        else
+            tile_band(&bands[k]);
+    }
+
+    free(heights);
+    free(normals);
+    free(tiles);
+    return SX3_ERROR_SUCCESS;
+}  // sx3_classify_terrain_tiles
+
+
+// sx3_blast_terrain_tiles
+//
+// Marks the four squares around vertex (x,y) as blasted.  The vertex may
+// lie off the map.  They are Blast from now on, even before the next
+// sx3_classify_terrain_tiles.
+void sx3_blast_terrain_tiles(int x, int y)
+{
+    int i, j;
+
+    if (!g_terrain_pages)
+        return;
+
+    for (j=y-1; j<=y; j++)
+        for (i=x-1; i<=x; i++)
+            TERRAIN_RAW_TILE(WRAP(i, g_terrain_size.x),
+                             WRAP(j, g_terrain_size.y)) =
+                TERRAIN_TILE_BLASTED | Blast;
+}  // sx3_blast_terrain_tiles
+
+
+// sx3_find_terrain_tile
+//
+// Returns the tile type of the square under the GL point (x,z).
+enum Tile_Type sx3_find_terrain_tile(float x, float z)
+{
+    int i, j;
+
+    if (!g_terrain_pages)
+        return Grass;
+
+    i = (int)floor(GL_Z_TO_MAP_X(z));
+    j = (int)floor(GL_X_TO_MAP_Y(x));
+    return (enum Tile_Type)(TERRAIN_TILE(WRAP(i, g_terrain_size.x),
+                                         WRAP(j, g_terrain_size.y)));
+}  // sx3_find_terrain_tile
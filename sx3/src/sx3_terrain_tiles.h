@@ -0,0 +1,49 @@
+// File: sx3_terrain_tiles.h
+// Author: Marc Bryant
+//
+// Terrain tiles.  Each square of the map (the square whose first corner is
+// vertex (x,y)) has a tile type (enum Tile_Type), worked out from the
+// height and steepness of its corners, and kept in a byte of the tiles of
+// the page the vertex is in.
+// Squares that have been hit by an explosion stay Blast for the rest of the
+// game.  Use TERRAIN_TILE (in sx3_terrain.h) to read the type of a square.
+
+#ifndef SX3_TERRAIN_TILES_H
+#define SX3_TERRAIN_TILES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sx3.h"
+#include "sx3_terrain.h"
+
+
+// ===========================================================================
+// Global variables
+// ===========================================================================
+
+// Flat ground above this height (meters) is Snow (terrain.tile.snow)
+extern float                    g_terrain_tile_snow;
+// Ground below this height (meters) is Pebbles (terrain.tile.pebbles)
+extern float                    g_terrain_tile_pebbles;
+// Squares with a corner normal whose y is below these are Rock and Dirt
+// (terrain.tile.rock, terrain.tile.dirt)
+extern float                    g_terrain_tile_rock;
+extern float                    g_terrain_tile_dirt;
+
+
+// ===========================================================================
+// Function declarations
+// ===========================================================================
+
+SX3_ERROR_CODE sx3_classify_terrain_tiles(int x0, int y0, int x1, int y1);
+
+void sx3_blast_terrain_tiles(int x, int y);
+
+enum Tile_Type sx3_find_terrain_tile(float x, float z);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -62,17 +62,201 @@ const float explosion_radii[Num_Explosion_Types] = {
     25.0,                             // Satellite_Beam
 };
 
+// A fixed-size pool of projectiles or explosions.  The items are kept
+// packed at the start of the array (g_projectiles or g_explosions), in any
+// order, and each is named by a handle to a slot that knows where it is.
+// Deleting an item moves the last one into its place.
+struct Weapon_Pool {
+    char                          *items;
+    size_t                         item_size;
+    int                           *count;        // g_num_...
+    int                            capacity;
+    int                           *item_of;      // item in each slot, or -1
+    int                           *slot_of;      // slot of each item
+    unsigned int                  *generation;   // of each slot
+    char                          *deleted;      // of each slot
+    int                           *free_slots;
+    int                            num_free;
+    Weapon_Handle                 *deleted_handles;
+    int                            num_deleted;
+};
+
+static struct Weapon_Pool projectile_pool;
+static struct Weapon_Pool explosion_pool;
+
+// free_pool frees the arrays of a pool.
+static void free_pool(struct Weapon_Pool *pool)
+{
+    free(pool->items);
+    free(pool->item_of);
+    free(pool->slot_of);
+    free(pool->generation);
+    free(pool->deleted);
+    free(pool->free_slots);
+    free(pool->deleted_handles);
+    memset(pool, 0, sizeof(struct Weapon_Pool));
+}
+
+// init_pool sets up an empty pool with room for capacity items of
+// item_size bytes, kept in *items and counted in *count.
+// Return: 1 on success, or 0 if there isn't enough memory.
+static int init_pool(struct Weapon_Pool *pool, void **items, size_t item_size,
+                     int *count, int capacity)
+{
+    int s;
+
+    memset(pool, 0, sizeof(struct Weapon_Pool));
+    pool->items = malloc(capacity * item_size);
+    pool->item_of = malloc(capacity * sizeof(int));
+    pool->slot_of = malloc(capacity * sizeof(int));
+    pool->generation = malloc(capacity * sizeof(unsigned int));
+    pool->deleted = malloc(capacity);
+    pool->free_slots = malloc(capacity * sizeof(int));
+    pool->deleted_handles = malloc(capacity * sizeof(Weapon_Handle));
+    if(!pool->items || !pool->item_of || !pool->slot_of || !pool->generation ||
+       !pool->deleted || !pool->free_slots || !pool->deleted_handles)
+    {
+        free_pool(pool);
+        return 0;
+    }
+
+    pool->item_size = item_size;
+    pool->count = count;
+    pool->capacity = capacity;
+    for(s = 0; s < capacity; s++)
+    {
+        pool->item_of[s] = -1;
+        pool->generation[s] = 1;
+        pool->deleted[s] = 0;
+        // Hand out the low slots first
+        pool->free_slots[s] = capacity - 1 - s;
+    }
+    pool->num_free = capacity;
+
+    *items = pool->items;
+    *count = 0;
+    return 1;
+}
+
+// pool_add takes a free slot and puts a new item at the end of the items,
+// and stores its handle in h.
+// Return: the new item, or NULL if the pool is full.
+static void* pool_add(struct Weapon_Pool *pool, Weapon_Handle *h)
+{
+    int s, i;
+
+    if(pool->num_free == 0) return NULL;
+    s = pool->free_slots[--pool->num_free];
+    i = (*pool->count)++;
+    pool->item_of[s] = i;
+    pool->slot_of[i] = s;
+    *h = (pool->generation[s] << 16) | s;
+    return pool->items + i * pool->item_size;
+}
+
+// pool_find finds the item that handle h names.
+// Return: its place in the items, or -1 if it is gone.
+static int pool_find(const struct Weapon_Pool *pool, Weapon_Handle h)
+{
+    int s = h & 0xFFFF;
+
+    if(s >= pool->capacity || pool->generation[s] != h >> 16) return -1;
+    return pool->item_of[s];
+}
+
+// pool_delete marks the item that handle h names to be removed by
+// pool_flush.
+static void pool_delete(struct Weapon_Pool *pool, Weapon_Handle h)
+{
+    int s = h & 0xFFFF;
+
+    if(pool_find(pool, h) < 0 || pool->deleted[s]) return;
+    pool->deleted[s] = 1;
+    pool->deleted_handles[pool->num_deleted++] = h;
+}
+
+// pool_flush removes the items marked by pool_delete.  Each one's place is
+// taken by the last item, and its slot gets a new generation so that the
+// old handle no longer names anything.
+static void pool_flush(struct Weapon_Pool *pool)
+{
+    int j, s, i, last;
+
+    for(j = 0; j < pool->num_deleted; j++)
+    {
+        s = pool->deleted_handles[j] & 0xFFFF;
+        i = pool->item_of[s];
+        last = --(*pool->count);
+        if(i != last)
+        {
+            memcpy(pool->items + i * pool->item_size,
+                   pool->items + last * pool->item_size, pool->item_size);
+            pool->slot_of[i] = pool->slot_of[last];
+            pool->item_of[pool->slot_of[i]] = i;
+        }
+
+        pool->item_of[s] = -1;
+        pool->deleted[s] = 0;
+        pool->generation[s] = (pool->generation[s] + 1) & 0xFFFF;
+        if(pool->generation[s] == 0) pool->generation[s] = 1;
+        pool->free_slots[pool->num_free++] = s;
+    }
+    pool->num_deleted = 0;
+}
+
+// sx3_init_weapons makes room for MAX_PROJECTILES projectiles and
+// MAX_EXPLOSIONS explosions.  Nothing is allocated after this.
+// Return: SX3_ERROR_SUCCESS
+//         SX3_ERROR_MEM_ALLOC
+SX3_ERROR_CODE sx3_init_weapons(void)
+{
+    if(!init_pool(&projectile_pool, (void**)&g_projectiles,
+                  sizeof(struct Projectile), &g_num_projectiles,
+                  MAX_PROJECTILES))
+        return SX3_ERROR_MEM_ALLOC;
+    if(!init_pool(&explosion_pool, (void**)&g_explosions,
+                  sizeof(struct Explosion), &g_num_explosions,
+                  MAX_EXPLOSIONS))
+    {
+        free_pool(&projectile_pool);
+        return SX3_ERROR_MEM_ALLOC;
+    }
+    return SX3_ERROR_SUCCESS;
+}
+
+// sx3_close_weapons frees the projectiles and explosions.
+void sx3_close_weapons(void)
+{
+    free_pool(&projectile_pool);
+    free_pool(&explosion_pool);
+    g_projectiles = NULL;
+    g_explosions = NULL;
+    g_num_projectiles = 0;
+    g_num_explosions = 0;
+}
+
+// sx3_destroy_deleted_weapons removes the projectiles and explosions that
+// have been deleted since it was last called.  It is called at the end of
+// every tick.
+void sx3_destroy_deleted_weapons(void)
+{
+    pool_flush(&projectile_pool);
+    pool_flush(&explosion_pool);
+}
+
 // Creates a new explosion and adds it to the global explosion list which
 // takes on the properties of projectile P.
-struct Explosion* new_explosion(struct Projectile *p)
+// Return: its handle, or NO_WEAPON_HANDLE if there are already
+//         MAX_EXPLOSIONS explosions.
+Weapon_Handle new_explosion(const struct Projectile *p)
 {
     struct Explosion *e;
+    Weapon_Handle h;
 
-    // Create a new explosion.  Note that realloc is really expensive, and so this
-    // should probably be changed later.
-    g_num_explosions++;
-    g_explosions = realloc(g_explosions, sizeof(*g_explosions) * g_num_explosions);
-    e = &g_explosions[g_num_explosions-1];
+    // Create a new explosion
+    e = pool_add(&explosion_pool, &h);
+    if(!e) return NO_WEAPON_HANDLE;
+    e->handle = h;
 
     // Set the explosion's physical properties
     e->props.mass = 0.0;
@@ -86,6 +270,8 @@ struct Explosion* new_explosion(struct Projectile *p)
     e->props.bounce_coefficient = 0.0;
     e->props.can_roll = 0;
     e->props.growth_direction = 1;
+    e->last_radius = 0.0;
+    TANK_SET_CLEAR(e->hit);
 
     // Now set the elapsed time
     e->elapsed_time = 0;
@@ -93,25 +279,29 @@ struct Explosion* new_explosion(struct Projectile *p)
     // Finally, set the explosion type
     e->type = weapon_explosions[p->type];
 
-    return e;
+    return h;
 }
 
-// delete explosion deletes an explosion from the global explosion list.
-void delete_explosion(struct Explosion *e)
+// delete explosion deletes an explosion from the global explosion list, at
+// the end of the tick (see sx3_destroy_deleted_weapons).
+void delete_explosion(Weapon_Handle h)
 {
-    int j;
+    pool_delete(&explosion_pool, h);
+}
 
-    // Find the number of the explosion
-    // FIX ME!! This is a linear search and could definitely be optimized better.
-    for(j = 0; j < g_num_explosions; j++) if(&g_explosions[j] == e) break;
-    if(j == g_num_explosions) return; // not found in the list
+// sx3_get_explosion finds the explosion that handle h names.
+// Return: the explosion, or NULL if it has been destroyed.
+struct Explosion* sx3_get_explosion(Weapon_Handle h)
+{
+    int i = pool_find(&explosion_pool, h);
 
-    // Delete the value but don't reallocate memory
-    g_num_explosions--;
-    memmove(e, e+1, (g_num_explosions - j)*sizeof(struct Explosion));
+    return (i < 0) ? NULL : &g_explosions[i];
 }
 
-struct Projectile* new_projectile(
+// Creates a new projectile and adds it to the global projectile list.
+// Return: its handle, or NO_WEAPON_HANDLE if there are already
+//         MAX_PROJECTILES projectiles.
+Weapon_Handle new_projectile(
     pVector direction,
     float magnitude,
     pVector position,
@@ -119,12 +309,12 @@ struct Projectile* new_projectile(
 {
     struct Projectile *p;
     struct Physical_Properties *props;
+    Weapon_Handle h;
 
-    // Create a new projectile.  Note that realloc is really expensive, and so this
-    // should probably be changed later.
-    g_num_projectiles++;
-    g_projectiles = realloc(g_projectiles, sizeof(*g_projectiles) * g_num_projectiles);
-    p = &g_projectiles[g_num_projectiles-1];
+    // Create a new projectile
+    p = pool_add(&projectile_pool, &h);
+    if(!p) return NO_WEAPON_HANDLE;
+    p->handle = h;
 
     // FIX ME!!
     // Set the projectile's physical properties -- this should DEFINITELY be based
@@ -134,6 +324,8 @@ struct Projectile* new_projectile(
     props->radius = 1.0;
     props->surface_area = 1.0;
     vv_cpy(props->position, position);
+    vv_cpy(p->last_position, position);
+    TANK_SET_CLEAR(p->hit);
     vv_cpy(props->velocity, direction);
     vc_mul(props->velocity, magnitude);
     v_zero(props->angular_position);
@@ -155,6 +347,21 @@ struct Projectile* new_projectile(
     // Finally, set the explosion type
     p->type = type;
 
-    return p;
+    return h;
 }
 
+// delete_projectile deletes a projectile from the global projectile list,
+// at the end of the tick (see sx3_destroy_deleted_weapons).
+void delete_projectile(Weapon_Handle h)
+{
+    pool_delete(&projectile_pool, h);
+}
+
+// sx3_get_projectile finds the projectile that handle h names.
+// Return: the projectile, or NULL if it has been destroyed.
+struct Projectile* sx3_get_projectile(Weapon_Handle h)
+{
+    int i = pool_find(&projectile_pool, h);
+
+    return (i < 0) ? NULL : &g_projectiles[i];
+}
@@ -10,10 +10,54 @@
 extern "C" {
 #endif
 
+#include <SDL/SDL.h>
 #include <physics.h>
 #include "sx3_graphics.h"
 
 
+// ===========================================================================
+// Global macros
+// ===========================================================================
+
+// A Tank_Set has a bit for each place in g_tanks.  sx3_tanks.h checks that
+// there are enough for MAX_TANKS.
+#define TANK_SET_WORDS 1
+#define TANK_SET_WORD_BITS 32
+
+#define TANK_SET_HAS(s,i)   (((s).bits[(i)/TANK_SET_WORD_BITS] >> \
+                              ((i)%TANK_SET_WORD_BITS)) & 1)
+#define TANK_SET_ADD(s,i)   ((s).bits[(i)/TANK_SET_WORD_BITS] |= \
+                             (Uint32)1 << ((i)%TANK_SET_WORD_BITS))
+#define TANK_SET_CLEAR(s)   memset(&(s), 0, sizeof(s))
+
+// FIX ME!! These should be static const variables
+
+// The most projectiles and explosions there can be at once (no more than
+// 65536 each, the number of slots a Weapon_Handle can name)
+#define MAX_PROJECTILES     1024
+#define MAX_EXPLOSIONS      1024
+
+// A handle that never names anything
+#define NO_WEAPON_HANDLE    0
+
+
+// ===========================================================================
+// Data types
+// ===========================================================================
+
+// Names a projectile or explosion however it moves about in g_projectiles
+// or g_explosions.  The low 16 bits are its slot and the high 16 bits the
+// generation of the slot, which changes when the slot is reused, so a
+// handle to something that is gone never names what comes after it.
+typedef unsigned int Weapon_Handle;
+
+// The tanks that a projectile or explosion has hit, so that it hits each
+// of them only once however many ticks it spends touching them
+struct Tank_Set {
+    Uint32                         bits[TANK_SET_WORDS];
+};
+
+
 enum Explosion_Type {
     No_Explosion,
     Boom_Expl_I,                 // standard round "scorch-like" expls
@@ -80,12 +124,18 @@ struct Explosion {
     enum Explosion_Type            type;
     float                          elapsed_time;  // in seconds
     struct Physical_Properties     props;
+    float                          last_radius;   // at the last tick
+    struct Tank_Set                hit;
+    Weapon_Handle                  handle;
 };
 
 struct Projectile {
     enum Projectile_Type           type;
     float                          elapsed_time;  // in seconds
      struct Object                 o;
+    Vector                         last_position; // at the last tick
+    struct Tank_Set                hit;
+    Weapon_Handle                  handle;
 };
 
 // weapon_explosions maps weapon types onto explosion types -- this represents
@@ -96,14 +146,24 @@ extern const enum Explosion_Type weapon_explosions[Num_Projectile_Types];
 // the radius of a given explosion type.
 extern const float explosion_radii[Num_Explosion_Types];
 
-// These functions operate on the global explosion and projectile lists
-struct Explosion* new_explosion(struct Projectile *p);
-void delete_explosion(struct Explosion *e);
-struct Projectile* new_projectile(
+// These functions operate on the global explosion and projectile lists.
+// Deleted projectiles and explosions stay where they are until
+// sx3_destroy_deleted_weapons, so the lists can be looped over while
+// things are deleted.  The pointers sx3_get_explosion and
+// sx3_get_projectile return are good until then too.
+SX3_ERROR_CODE sx3_init_weapons(void);
+void sx3_close_weapons(void);
+Weapon_Handle new_explosion(const struct Projectile *p);
+void delete_explosion(Weapon_Handle h);
+struct Explosion* sx3_get_explosion(Weapon_Handle h);
+Weapon_Handle new_projectile(
     pVector direction,
     float magnitude,
     pVector position,
     enum Projectile_Type type);
+void delete_projectile(Weapon_Handle h);
+struct Projectile* sx3_get_projectile(Weapon_Handle h);
+void sx3_destroy_deleted_weapons(void);
 
 #ifdef __cplusplus
 }